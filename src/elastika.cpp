@@ -1,12 +1,14 @@
 #include "plugin.hpp"
+#ifndef NO_RACK_DEPENDENCY
 #include "reloadable_widget.hpp"
+#endif
 #include "elastika_engine.hpp"
 
 // Sapphire Elastika for VCV Rack 2, by Don Cross <cosinekitty@gmail.com>
 // https://github.com/cosinekitty/sapphire
 
 
-struct ElastikaModule : Module
+struct ElastikaModule : Module, Sapphire::CaptureTarget
 {
     Sapphire::ElastikaEngine engine;
     DcRejectQuantity *dcRejectQuantity = nullptr;
@@ -14,7 +16,12 @@ struct ElastikaModule : Module
     Sapphire::Slewer slewer;
     bool isPowerGateActive = true;
     bool isQuiet = false;
-    bool enableLimiterWarning = true;
+    Sapphire::SettingSlot<bool> enableLimiterWarning {true};
+    uint32_t dcRejectVersion = 0;       // versions of the menu settings most recently applied to the engine
+    uint32_t agcLevelVersion = 0;
+    int settingsCountdown = 0;
+    TelemetryPublisher telemetry;       // read by the warning light on the UI thread
+    Sapphire::ProfileSnapshot profileBaseline;      // "Reset profile" remembers the counters at that moment
 
     enum ParamId
     {
@@ -73,6 +80,12 @@ struct ElastikaModule : Module
         LIGHTS_LEN
     };
 
+    enum CaptureSettingId       // menu settings, as recorded in session captures
+    {
+        CAPTURE_DC_REJECT,
+        CAPTURE_AGC_LEVEL,
+    };
+
     ElastikaModule()
     {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -99,7 +112,7 @@ struct ElastikaModule : Module
             "DC reject cutoff",
             " Hz"
         );
-        dcRejectQuantity->value = DC_REJECT_DEFAULT_FREQ;
+        dcRejectQuantity->setting.set(DC_REJECT_DEFAULT_FREQ);
 
         agcLevelQuantity = configParam<AgcLevelQuantity>(
             AGC_LEVEL_PARAM,
@@ -108,7 +121,7 @@ struct ElastikaModule : Module
             AGC_LEVEL_DEFAULT,
             "Output limiter"
         );
-        agcLevelQuantity->value = AGC_LEVEL_DEFAULT;
+        agcLevelQuantity->setting.set(AGC_LEVEL_DEFAULT);
 
         auto driveKnob = configParam(DRIVE_KNOB_PARAM, 0, 2, 1, "Input drive", " dB", -10, 80);
         auto levelKnob = configParam(LEVEL_KNOB_PARAM, 0, 2, 1, "Output level", " dB", -10, 80);
@@ -146,18 +159,20 @@ struct ElastikaModule : Module
     void initialize()
     {
         engine.initialize();
-        engine.setDcRejectFrequency(dcRejectQuantity->value);
-        dcRejectQuantity->changed = false;
-        reflectAgcSlider();
+        // Make the next call to process() apply every menu setting to the freshly initialized engine.
+        dcRejectVersion = 0;
+        agcLevelVersion = 0;
+        settingsCountdown = 0;
         isPowerGateActive = true;
         isQuiet = false;
         slewer.enable(true);
         params[POWER_TOGGLE_PARAM].setValue(1.0f);
-        enableLimiterWarning = true;
+        enableLimiterWarning.set(true);
     }
 
     void onReset(const ResetEvent& e) override
     {
+        capture.reset();
         Module::onReset(e);
         initialize();
     }
@@ -165,7 +180,7 @@ struct ElastikaModule : Module
     json_t* dataToJson() override
     {
         json_t* root = json_object();
-        json_object_set_new(root, "limiterWarningLight", json_boolean(enableLimiterWarning));
+        json_object_set_new(root, "limiterWarningLight", json_boolean(enableLimiterWarning.get()));
         return root;
     }
 
@@ -173,7 +188,7 @@ struct ElastikaModule : Module
     {
         // If the JSON is damaged, default to enabling the warning light.
         json_t *warningFlag = json_object_get(root, "limiterWarningLight");
-        enableLimiterWarning = !json_is_false(warningFlag);
+        enableLimiterWarning.set(!json_is_false(warningFlag));
     }
 
     void onSampleRateChange(const SampleRateChangeEvent& e) override
@@ -206,23 +221,81 @@ struct ElastikaModule : Module
         return slider;
     }
 
-    void reflectAgcSlider()
+    void applySettings()
     {
+        // Pick up any menu setting changes the UI thread made since the last block.
+        // Checking once per block keeps atomic loads out of the per-sample path.
+        if (--settingsCountdown > 0)
+            return;
+        settingsCountdown = SETTINGS_POLL_SAMPLES;
+
+        float value;
+
+        // If the user has changed the DC cutoff via the right-click menu,
+        // update the output filter corner frequencies.
+        if (dcRejectQuantity->setting.poll(dcRejectVersion, value))
+        {
+            engine.setDcRejectFrequency(value);
+            capture.setting(CAPTURE_DC_REJECT, value);
+        }
+
         // Check for changes to the automatic gain control: its level, and whether enabled/disabled.
-        if (agcLevelQuantity && agcLevelQuantity->changed)
+        if (agcLevelQuantity->setting.poll(agcLevelVersion, value))
         {
-            bool enabled = agcLevelQuantity->isAgcEnabled();
+            bool enabled = AgcLevelQuantity::IsAgcEnabled(value);
             if (enabled)
-                engine.setAgcLevel(agcLevelQuantity->clampedAgc());
+                engine.setAgcLevel(AgcLevelQuantity::ClampedAgc(value));
             engine.setAgcEnabled(enabled);
-            agcLevelQuantity->changed = false;
+            capture.setting(CAPTURE_AGC_LEVEL, value);
         }
     }
 
+    void startCapture()
+    {
+        // Record every menu setting at the start of the capture, by re-applying them all now.
+        // Everything else the replay needs to start from goes into the snapshot.
+        dcRejectVersion = 0;
+        agcLevelVersion = 0;
+        settingsCountdown = 0;
+        capture.snapshot(*this);
+    }
+
+    void saveCaptureState(Sapphire::StateWriter& writer, std::vector<uint8_t>& scratch) const override
+    {
+        writer.write(isPowerGateActive);
+        writer.write(isQuiet);
+        slewer.saveState(writer);
+        engine.saveState(scratch);
+        Sapphire::WriteStateBlob(writer, scratch);
+    }
+
+    void loadCaptureState(Sapphire::StateReader& reader) override
+    {
+        reader.read(isPowerGateActive);
+        reader.read(isQuiet);
+        slewer.loadState(reader);
+        engine.loadState(Sapphire::ReadStateBlob(reader));
+    }
+
+    void replaySetting(int id, float value) override
+    {
+        if (id == CAPTURE_DC_REJECT)
+            dcRejectQuantity->setting.set(value);
+        else if (id == CAPTURE_AGC_LEVEL)
+            agcLevelQuantity->setting.set(value);
+    }
+
     void process(const ProcessArgs& args) override
     {
         using namespace Sapphire;
 
+        SAPPHIRE_REALTIME_SCOPE();
+
+        telemetry.begin();
+        if (capture.begin(args.sampleRate))
+            startCapture();
+        applySettings();
+
         // The user is allowed to turn off Elastika to reduce CPU usage.
         // Check the gate input voltage first, and debounce it.
         // If the gate is not connected, fall back to the pushbutton state.
@@ -269,21 +342,12 @@ struct ElastikaModule : Module
                 isQuiet = true;
                 engine.quiet();
             }
+            endSample(args);
             return;
         }
 
         isQuiet = false;
 
-        // If the user has changed the DC cutoff via the right-click menu,
-        // update the output filter corner frequencies.
-        if (dcRejectQuantity->changed)
-        {
-            engine.setDcRejectFrequency(dcRejectQuantity->value);
-            dcRejectQuantity->changed = false;
-        }
-
-        reflectAgcSlider();
-
         // Update the mesh parameters from sliders and control voltages.
 
         float fric = getControlValue(FRICTION_SLIDER_PARAM, FRICTION_ATTEN_PARAM, FRICTION_CV_INPUT);
@@ -320,10 +384,29 @@ struct ElastikaModule : Module
 
         outputs[AUDIO_LEFT_OUTPUT].setVoltage(sample[0]);
         outputs[AUDIO_RIGHT_OUTPUT].setVoltage(sample[1]);
+
+        endSample(args);
+    }
+
+    void endSample(const ProcessArgs& args)
+    {
+        capture.frame(params, inputs, outputs);
+        publishTelemetry(args);
+    }
+
+    void publishTelemetry(const ProcessArgs& args)
+    {
+        Sapphire::EngineTelemetry* frame = telemetry.end(args.sampleRate);
+        if (frame != nullptr)
+        {
+            engine.readTelemetry(*frame);
+            telemetry.publish();
+        }
     }
 };
 
 
+#ifndef NO_RACK_DEPENDENCY
 class ElastikaWarningLightWidget : public LightWidget
 {
 private:
@@ -336,7 +419,7 @@ private:
 
     NVGcolor warningColor(double distortion)
     {
-        bool enableWarning = elastikaModule && elastikaModule->enableLimiterWarning;
+        bool enableWarning = elastikaModule && elastikaModule->enableLimiterWarning.get();
 
         if (!enableWarning || distortion <= 0.0)
             return nvgRGBA(0, 0, 0, 0);     // no warning light
@@ -366,7 +449,7 @@ public:
         {
             // Update the warning light state dynamically.
             // Turn on the warning when the AGC is limiting the output.
-            double distortion = elastikaModule ? elastikaModule->engine.getAgcDistortion() : 0.0;
+            double distortion = elastikaModule ? elastikaModule->telemetry.read().agcDistortion() : 0.0;
             color = warningColor(distortion);
         }
         LightWidget::drawLayer(args, layer);
@@ -481,11 +564,41 @@ struct ElastikaWidget : ReloadableModuleWidget
                 menu->addChild(new AgcLevelSlider(elastikaModule->agcLevelQuantity));
 
                 // Add an option to enable/disable the warning slider.
-                menu->addChild(createBoolPtrMenuItem<bool>("Limiter warning light", "", &elastikaModule->enableLimiterWarning));
+                ElastikaModule* m = elastikaModule;
+                menu->addChild(createBoolMenuItem(
+                    "Limiter warning light",
+                    "",
+                    [m]{ return m->enableLimiterWarning.get(); },
+                    [m](bool state){ m->enableLimiterWarning.set(state); }
+                ));
             }
+
+            menu->addChild(new MenuSeparator);
+            AddSessionCaptureMenuItem(
+                menu,
+                &elastikaModule->capture,
+                "Elastika",
+                ElastikaModule::PARAMS_LEN,
+                ElastikaModule::INPUTS_LEN,
+                ElastikaModule::OUTPUTS_LEN
+            );
+
+#if SAPPHIRE_ENABLE_PROFILING
+            // Show where the engine has spent its time since the module started or the profile was last reset.
+            ElastikaModule* m = elastikaModule;
+            Sapphire::ProfileSnapshot profile = m->engine.getProfile().since(m->profileBaseline);
+            menu->addChild(new MenuSeparator);
+            menu->addChild(createMenuLabel("Engine profile"));
+            for (size_t i = 0; i < profile.stages.size(); ++i)
+                menu->addChild(createMenuLabel(profile.format(i)));
+            menu->addChild(createMenuItem("Reset profile", "", [=]{ m->profileBaseline = m->engine.getProfile(); }));
+#endif
         }
     }
 };
+#else
+struct ElastikaWidget;      // headless builds have no user interface
+#endif
 
 
 Model* modelElastika = createModel<ElastikaModule, ElastikaWidget>("Elastika");
@@ -4,7 +4,11 @@
 // Sapphire mesh physics engine, by Don Cross <cosinekitty@gmail.com>
 // https://github.com/cosinekitty/sapphire
 
+#include <array>
+#include <limits>
+#include <type_traits>
 #include "sapphire_engine.hpp"
+#include "sapphire_profile.hpp"
 
 namespace Sapphire
 {
@@ -13,7 +17,7 @@ namespace Sapphire
         int ballIndex1;         // 0-based index into Mesh::ballList
         int ballIndex2;         // 0-based index into Mesh::ballList
 
-        Spring(int _ballIndex1, int _ballIndex2)
+        constexpr Spring(int _ballIndex1, int _ballIndex2)
             : ballIndex1(_ballIndex1)
             , ballIndex2(_ballIndex2)
             {}
@@ -25,6 +29,12 @@ namespace Sapphire
         PhysicsVector vel;      // the ball's velocity [m/s]
         float mass;            // the ball's [kg]
 
+        Ball()      // an anchor at the origin, until something better is assigned
+            : pos()
+            , vel()
+            , mass(0.0f)
+            {}
+
         Ball(float _mass, float _x, float _y, float _z)
             : pos(_x, _y, _z, 0.0f)
             , vel()
@@ -58,22 +68,143 @@ namespace Sapphire
     const float MESH_DEFAULT_REST_LENGTH = 1.0e-3;
     const float MESH_DEFAULT_SPEED_LIMIT = 2.0;
 
-    class PhysicsMesh
+    // The arithmetic of one simulation step, shared by every kind of mesh,
+    // so that they all calculate exactly the same results.
+
+    inline float MeshDampingFactor(float dt, float halflife)
+    {
+        // damp^(frictionHalfLife/dt) = 0.5.
+        return std::pow(0.5, dt/halflife);
+    }
+
+    inline PhysicsVector SpringForce(const PhysicsVector& pos1, const PhysicsVector& pos2, float stiffness, float restLength)
+    {
+        // Returns the force the spring exerts on the ball at pos1. The spring pulls the ball at pos2 the opposite way.
+        // dr = vector from ball 1 toward ball 2.
+        PhysicsVector dr = pos2 - pos1;
+        float dist = Magnitude(dr);   // length of the spring
+        float attractiveForce = stiffness * (dist - restLength);
+        if (dist < 1.0e-9)
+        {
+            // Think of this like two bullets hitting each other in a gunfight:
+            // it should almost never happen.
+            // The balls are so close together, it's hard to tell which direction the force should go.
+            // We also risk dividing by zero.
+            // It's a little weird/chaotic, but pick an arbitrary tension direction.
+            return PhysicsVector(0.f, 0.f, -attractiveForce, 0.f);
+        }
+        return (attractiveForce / dist) * dr;
+    }
+
+    inline void ExtrapolateBall(
+        float dt,
+        float speedLimit,
+        const PhysicsVector& force,
+        const Ball& curr,
+        Ball& next)
+    {
+        if (curr.IsAnchor())
+        {
+            // This is an "anchor" that never moves, not a normal ball.
+            next = curr;
+        }
+        else
+        {
+            // It is possible for the caller to modify a ball's mass.
+            // Make sure we keep masses in sync.
+            next.mass = curr.mass;
+
+            // Update the velocity vector from `curr` into `next`.
+            next.vel = curr.vel + ((dt / curr.mass) * force);
+
+            if (speedLimit > 0.0)
+            {
+                float speedSquared = Dot(next.vel, next.vel);
+                if (speedSquared > speedLimit * speedLimit)
+                    next.vel *= speedLimit / std::sqrt(speedSquared);
+            }
+
+            // Estimate the next position based on the average speed over the time increment.
+            next.pos = curr.pos + ((dt / 2.0) * (curr.vel + next.vel));
+        }
+    }
+
+    inline void CheckMeshState(StateReader& reader, int nballs)
+    {
+        // Every mesh saves the same format: a ball count, then each ball's position and velocity.
+        // Reads past it without changing anything, and throws if LoadState would reject it.
+        uint32_t count;
+        reader.read(count);
+        if (count != static_cast<uint32_t>(nballs))
+            throw std::runtime_error("Mesh state has the wrong number of balls.");
+        reader.skip(count * 2 * sizeof(PhysicsVector));
+    }
+
+    // The structure of a mesh: its springs, and where each ball starts out and how heavy it is.
+    // A topology is built once and then never changes, so any number of PhysicsMesh
+    // objects can share it. Each mesh keeps only the state that evolves over time.
+    class alignas(64) MeshTopology
     {
     private:
         SpringList springList;
-        std::vector<PhysicsVector> originalPositions;
-        BallList currBallList;
+        BallList initialBallList;
+        std::vector<int> drivenList;
+
+    public:
+        int Add(Ball);      // returns ball index, for linking with springs
+        bool Add(Spring);   // returns false if either ball index is bad, true if spring added
+
+        // Anchors never move by themselves, but the caller may move a "driven" anchor
+        // by hand, for example to inject audio. All other anchors stay put forever,
+        // which lets PhysicsMesh and FixedPhysicsMesh leave them out of their simulation state.
+        bool MarkDriven(int ballIndex);     // returns false if the ball index is bad
+        bool IsDriven(int ballIndex) const;
+        const SpringList& GetSprings() const { return springList; }
+        const BallList& GetInitialBalls() const { return initialBallList; }
+        int NumBalls() const { return static_cast<int>(initialBallList.size()); }
+        int NumSprings() const { return static_cast<int>(springList.size()); }
+        const Ball& GetInitialBallAt(int index) const { return initialBallList.at(index); }
+        PhysicsVector GetBallOrigin(int index) const { return initialBallList.at(index).pos; }
+    };
+
+    // A mesh simulates only its "live" balls: the mobile balls and the driven anchors.
+    // Anchors that are not driven are folded into the springs attached to them,
+    // as constant positions, when the mesh is attached to a topology.
+    // Ball indexes in the public interface are always topology indexes.
+    class PhysicsMesh
+    {
+    private:
+        struct MeshLink     // a spring, with any fixed anchor at its end folded in as a constant
+        {
+            int slot1;                  // the live ball at one end
+            int slot2;                  // the live ball at the other end, or -1 for a fixed anchor
+            PhysicsVector anchorPos;    // where the fixed anchor is, when slot2 < 0
+        };
+
+        const MeshTopology *topology;
+        std::vector<int> slotList;                  // topology ball index => live ball slot, or -1 for a fixed anchor
+        std::vector<int> liveList;                  // live ball slot => topology ball index
+        std::vector<MeshLink> linkList;
+        BallList currBallList;                      // live balls only
         BallList nextBallList;
-        PhysicsVectorList forceList;                // holds calculated net force on each ball
+        PhysicsVectorList forceList;                // holds calculated net force on each live ball
         PhysicsVector gravity;
         PhysicsVector magnet;
         float stiffness  = MESH_DEFAULT_STIFFNESS;     // the linear spring constant [N/m]
         float restLength = MESH_DEFAULT_REST_LENGTH;   // spring length [m] that results in zero force
         float speedLimit = MESH_DEFAULT_SPEED_LIMIT;
 
+        static const MeshTopology& EmptyTopology();
+
     public:
-        void Clear();   // empty out the mesh and start over
+        PhysicsMesh()
+            : topology(&EmptyTopology())
+            {}
+
+        // Start over using the given topology, with every ball at rest in its original location
+        // and all settings at their defaults. The topology must outlive this mesh.
+        // Attaching another topology of the same size does not allocate any memory.
+        void Attach(const MeshTopology& _topology);
         void Quiet();    // put all balls back to their original locations and zero their velocities
         float GetStiffness() const { return stiffness; }
         void SetStiffness(float _stiffness);
@@ -84,20 +215,24 @@ namespace Sapphire
         void SetMagneticField(PhysicsVector _magnet) { magnet = _magnet; }
         PhysicsVector GetGravity() const { return gravity; }
         void SetGravity(PhysicsVector _gravity) { gravity = _gravity; }
-        int Add(Ball);      // returns ball index, for linking with springs
-        bool Add(Spring);   // returns false if either ball index is bad, true if spring added
-        const SpringList& GetSprings() const { return springList; }
-        BallList& GetBalls() { return currBallList; }
+        const MeshTopology& GetTopology() const { return *topology; }
+        const SpringList& GetSprings() const { return topology->GetSprings(); }
         void Update(float dt, float halflife);
-        int NumBalls() const { return static_cast<int>(currBallList.size()); }
-        int NumSprings() const { return static_cast<int>(springList.size()); }
-        Ball& GetBallAt(int index) { return currBallList.at(index); }
-        const Ball& GetBallAt(int index) const { return currBallList.at(index); }
+        int NumBalls() const { return topology->NumBalls(); }
+        int NumLiveBalls() const { return static_cast<int>(currBallList.size()); }
+        int NumSprings() const { return topology->NumSprings(); }
+        Ball& GetBallAt(int index) { return currBallList.at(slotList.at(index)); }    // throws for a fixed anchor
+        const Ball& GetBallAt(int index) const;
+        void SetBallPosition(int index, PhysicsVector pos) { GetBallAt(index).pos = pos; }
+        void SetBallMass(int index, float mass) { GetBallAt(index).mass = mass; }
         bool IsAnchor(int ballIndex) const { return GetBallAt(ballIndex).IsAnchor(); }
         bool IsMobile(int ballIndex) const { return GetBallAt(ballIndex).IsMobile(); }
-        PhysicsVector GetBallOrigin(int index) const { return originalPositions.at(index); }
-        PhysicsVector GetBallDisplacement(int index) const { return currBallList.at(index).pos - originalPositions.at(index); }
-        Spring& GetSpringAt(int index) { return springList.at(index); }
+        PhysicsVector GetBallOrigin(int index) const { return topology->GetBallOrigin(index); }
+        PhysicsVector GetBallDisplacement(int index) const { return GetBallAt(index).pos - topology->GetBallOrigin(index); }
+        float KineticEnergy() const;    // total kinetic energy of the mobile balls [J]
+        const Spring& GetSpringAt(int index) const { return topology->GetSprings().at(index); }
+        void SaveState(StateWriter& writer) const;     // ball positions and velocities
+        void LoadState(StateReader& reader);
 
     private:
         void CalcForces(
@@ -116,6 +251,519 @@ namespace Sapphire
         );
     };
 
+    // A spring in a mesh layout that is compiled into constants: see HexLayout.
+    // Its ends are live ball slots, or a live ball and a fixed anchor
+    // whose position is folded in, the same way PhysicsMesh::Attach folds them.
+    struct FixedLink
+    {
+        int slot1;          // the live ball at one end
+        int slot2;          // the live ball at the other end, or -1 for a fixed anchor
+        float x, y, z;      // where the fixed anchor is, when slot2 < 0
+
+        constexpr FixedLink(int _slot1, int _slot2)
+            : slot1(_slot1)
+            , slot2(_slot2)
+            , x(0.0f)
+            , y(0.0f)
+            , z(0.0f)
+            {}
+
+        constexpr FixedLink(int _slot1, float _x, float _y, float _z)
+            : slot1(_slot1)
+            , slot2(-1)
+            , x(_x)
+            , y(_y)
+            , z(_z)
+            {}
+    };
+
+    // The Elastika hexagon mesh, compiled into constants so the compiler knows its shape.
+    // HexBuilder creates balls 0..21 as mobile balls and balls 22..33 as the anchors around the edge.
+    // Anchors 23 and 32 are the left and right inputs: the audio moves them,
+    // so mesh_hex.cpp marks them with MeshTopology::MarkDriven. The other anchors never move.
+    // These tables are what PhysicsMesh::Attach makes of HexTopology() at run time:
+    // the 24 live balls (the mobile balls and the two driven anchors), and the 39 springs
+    // in HexBuilder's order, with the positions of the 10 fixed anchors folded in.
+    // The unit tests verify they still match HexTopology().
+    struct HexLayout
+    {
+        static constexpr int NumBalls = 34;
+        static constexpr int NumLiveBalls = 24;
+        static constexpr int NumLinks = 39;
+
+        // live ball slot => topology ball index
+        static constexpr int LiveBalls[NumLiveBalls] =
+        {
+             0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+            23, 32,
+        };
+
+        // topology ball index => live ball slot, or -1 for a fixed anchor
+        static constexpr int Slots[NumBalls] =
+        {
+             0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+            -1, 22, -1, -1, -1, -1, -1, -1, -1, -1, 23, -1,
+        };
+
+        static constexpr FixedLink Links[NumLinks] =
+        {
+            { 3,  2}, { 3, -0.00200000009f,  0.0f,           0.0f}, { 3,  4}, { 2,  1}, { 2, 22},
+            {15,  4}, {15, -0.00200000009f, -0.00173205091f, 0.0f}, {15, 16}, { 4,  5}, { 1,  8}, { 1,  0},
+            { 8,  7}, { 8,  0.000500000024f, 0.00259807636f, 0.0f}, {16, 17},
+            {16, -0.00100000005f, -0.00346410181f, 0.0f}, { 5,  0}, { 5, 14}, { 0,  9}, { 7, 12}, { 7,  6},
+            {12, 11}, {12,  0.00200000009f,  0.00346410181f, 0.0f}, {17, 14},
+            {17,  0.00100000005f, -0.00346410181f, 0.0f}, {14, 19}, { 9,  6}, { 9, 18}, { 6, 13},
+            {11,  0.00400000019f,  0.00346410181f, 0.0f}, {11, 10}, {19, 18},
+            {19,  0.00250000018f, -0.00259807636f, 0.0f}, {18, 21}, {13, 10}, {13, 20},
+            {10,  0.00500000035f,  0.00173205091f, 0.0f}, {21, 20}, {21, 23},
+            {20,  0.00500000035f,  0.0f,           0.0f},
+        };
+    };
+
+    // A mesh whose live balls and springs are fixed at compile time by `layout_t`.
+    // Like PhysicsMesh, it simulates only the live balls, and the fixed anchors
+    // are constants in the springs attached to them. Its output is identical to PhysicsMesh,
+    // because every force is rounded the same way and each ball adds up its forces
+    // in the same order. But the balls live in fixed-size arrays, the spring loops are
+    // unrolled with every ball slot and anchor position a constant, the spring forces
+    // are calculated 4 at a time, and each ball's magnetic force is calculated once
+    // instead of once for every spring attached to it.
+    template <typename layout_t>
+    class FixedPhysicsMesh
+    {
+    private:
+        static const int NBALLS = layout_t::NumBalls;
+        static const int NLIVE = layout_t::NumLiveBalls;
+        static const int NLINKS = layout_t::NumLinks;
+        static const int NGROUPED = 4 * ((NLINKS + 3) / 4);     // spring forces are calculated 4 at a time
+
+        using BallArray = std::array<Ball, NLIVE>;
+        using ForceArray = std::array<PhysicsVector, NLIVE>;
+
+        template <int index> struct LinkTag {};
+
+        const MeshTopology *topology = nullptr;
+        BallArray currBallList;         // live balls only
+        BallArray nextBallList;
+        ForceArray forceList;
+        ForceArray curlList;                                // each live ball's magnetic force
+        std::array<PhysicsVector, NGROUPED> springList;     // the force each spring exerts on its first ball
+        std::array<PhysicsVector, NLIVE> origin;
+        PhysicsVector gravity;
+        PhysicsVector magnet;
+        float stiffness  = MESH_DEFAULT_STIFFNESS;
+        float restLength = MESH_DEFAULT_REST_LENGTH;
+        float speedLimit = MESH_DEFAULT_SPEED_LIMIT;
+        float dampDt = std::numeric_limits<float>::quiet_NaN();    // the time step and half-life `damp` was calculated for
+        float dampHalflife = std::numeric_limits<float>::quiet_NaN();
+        float damp = 1.0f;
+
+        static int SlotOf(int index)
+        {
+            assert(index >= 0 && index < NBALLS);
+            return layout_t::Slots[index];
+        }
+
+    public:
+        static bool Matches(const MeshTopology& topology)
+        {
+            // Compile the topology the way PhysicsMesh::Attach does, and compare the result with the layout.
+            if (topology.NumBalls() != NBALLS)
+                return false;
+
+            for (int i = 0; i < NBALLS; ++i)
+            {
+                const int slot = layout_t::Slots[i];
+                const bool live = topology.GetInitialBallAt(i).IsMobile() || topology.IsDriven(i);
+                if (live != (slot >= 0))
+                    return false;
+                if (live && (slot >= NLIVE || layout_t::LiveBalls[slot] != i))
+                    return false;
+            }
+
+            int n = 0;
+            for (const Spring& spring : topology.GetSprings())
+            {
+                int slot1 = layout_t::Slots[spring.ballIndex1];
+                int slot2 = layout_t::Slots[spring.ballIndex2];
+                int anchor = -1;
+                if (slot1 < 0)
+                {
+                    if (slot2 < 0)
+                        continue;
+                    slot1 = slot2;
+                    slot2 = -1;
+                    anchor = spring.ballIndex1;
+                }
+                else if (slot2 < 0)
+                {
+                    anchor = spring.ballIndex2;
+                }
+
+                if (n == NLINKS)
+                    return false;
+
+                const FixedLink& link = layout_t::Links[n++];
+                if (link.slot1 != slot1 || link.slot2 != slot2)
+                    return false;
+
+                if (anchor >= 0)
+                {
+                    const PhysicsVector pos = topology.GetBallOrigin(anchor);
+                    if (pos[0] != link.x || pos[1] != link.y || pos[2] != link.z)
+                        return false;
+                }
+            }
+            return n == NLINKS;
+        }
+
+        // Start over with every ball at rest where `topology` puts it, and all settings at their defaults.
+        // The topology must compile to exactly the tables in `layout_t`, and must outlive this mesh.
+        void Attach(const MeshTopology& _topology)
+        {
+            if (!Matches(_topology))
+                throw std::runtime_error("Mesh topology does not match the fixed mesh layout.");
+
+            topology = &_topology;
+            for (int slot = 0; slot < NLIVE; ++slot)
+            {
+                currBallList[slot] = nextBallList[slot] = topology->GetInitialBallAt(layout_t::LiveBalls[slot]);
+                origin[slot] = currBallList[slot].pos;
+                forceList[slot] = PhysicsVector::zero();
+            }
+
+            gravity = PhysicsVector::zero();
+            magnet = PhysicsVector::zero();
+            stiffness  = MESH_DEFAULT_STIFFNESS;
+            restLength = MESH_DEFAULT_REST_LENGTH;
+            speedLimit = MESH_DEFAULT_SPEED_LIMIT;
+        }
+
+        void Quiet()
+        {
+            for (int slot = 0; slot < NLIVE; ++slot)
+            {
+                currBallList[slot].pos = origin[slot];
+                currBallList[slot].vel = PhysicsVector::zero();
+            }
+        }
+
+        float GetStiffness() const { return stiffness; }
+        void SetStiffness(float _stiffness) { stiffness = std::max(0.0f, _stiffness); }
+        float GetRestLength() const { return restLength; }
+        void SetRestLength(float _restLength) { restLength = std::max(0.0f, _restLength); }
+        float GetSpeedLimit() const { return speedLimit; }
+        void SetSpeedLimit(float _speedLimit) { speedLimit = _speedLimit; }
+        void SetMagneticField(PhysicsVector _magnet) { magnet = _magnet; }
+        PhysicsVector GetGravity() const { return gravity; }
+        void SetGravity(PhysicsVector _gravity) { gravity = _gravity; }
+        static int NumBalls() { return NBALLS; }
+        static int NumLiveBalls() { return NLIVE; }
+        Ball& GetBallAt(int index) { assert(SlotOf(index) >= 0); return currBallList[SlotOf(index)]; }    // fixed anchors cannot be changed
+        const Ball& GetBallAt(int index) const { const int slot = SlotOf(index); return (slot < 0) ? topology->GetInitialBallAt(index) : currBallList[slot]; }
+        void SetBallPosition(int index, PhysicsVector pos) { GetBallAt(index).pos = pos; }
+        void SetBallMass(int index, float mass) { GetBallAt(index).mass = mass; }
+        bool IsAnchor(int ballIndex) const { return GetBallAt(ballIndex).IsAnchor(); }
+        bool IsMobile(int ballIndex) const { return GetBallAt(ballIndex).IsMobile(); }
+        PhysicsVector GetBallOrigin(int index) const { const int slot = SlotOf(index); return (slot < 0) ? topology->GetBallOrigin(index) : origin[slot]; }
+        PhysicsVector GetBallDisplacement(int index) const { return GetBallAt(index).pos - GetBallOrigin(index); }
+
+        float KineticEnergy() const
+        {
+            float energy = 0.0f;
+            for (const Ball& b : currBallList)
+                if (b.IsMobile())
+                    energy += 0.5f * b.mass * Dot(b.vel, b.vel);
+            return energy;
+        }
+
+        void SaveState(StateWriter& writer) const
+        {
+            // Same format as PhysicsMesh, fixed anchors included, so either kind of mesh can load the other's state.
+            writer.write(static_cast<uint32_t>(NBALLS));
+            for (int i = 0; i < NBALLS; ++i)
+            {
+                const Ball& b = GetBallAt(i);
+                writer.write(b.pos);
+                writer.write(b.vel);
+            }
+        }
+
+        void LoadState(StateReader& reader)
+        {
+            uint32_t nballs;
+            reader.read(nballs);
+            if (nballs != NBALLS)
+                throw std::runtime_error("Mesh state has the wrong number of balls.");
+
+            for (int i = 0; i < NBALLS; ++i)
+            {
+                PhysicsVector pos, vel;
+                reader.read(pos);
+                reader.read(vel);
+                const int slot = layout_t::Slots[i];
+                if (slot >= 0)
+                {
+                    currBallList[slot].pos = pos;
+                    currBallList[slot].vel = vel;
+                }
+            }
+        }
+
+        void Update(float dt, float halflife)
+        {
+            if (dt != dampDt || halflife != dampHalflife)
+            {
+                // MeshDampingFactor calls std::pow, so only call it when its inputs change.
+                dampDt = dt;
+                dampHalflife = halflife;
+                damp = MeshDampingFactor(dt, halflife);
+            }
+
+            for (Ball& b : currBallList)
+                b.vel *= damp;
+
+            CalcForces(currBallList);
+            for (int i = 0; i < NLIVE; ++i)
+                ExtrapolateBall(dt / 2.0, speedLimit, forceList[i], currBallList[i], nextBallList[i]);
+
+            // The second step lands each ball straight back in currBallList,
+            // so there is no array to copy at the end.
+            CalcForces(nextBallList);
+            for (int i = 0; i < NLIVE; ++i)
+            {
+                Ball next;
+                ExtrapolateBall(dt, speedLimit, forceList[i], currBallList[i], next);
+                currBallList[i] = next;
+            }
+        }
+
+    private:
+        void CalcForces(const BallArray& blist)
+        {
+            // The spring forces depend only on the ball positions, so calculate them all first,
+            // 4 springs at a time. Then add them to the balls in the same order PhysicsMesh does.
+            AddSpringGroups(blist, LinkTag<0>());
+
+            for (int i = 0; i < NLIVE; ++i)
+            {
+                // A ball's velocity does not change while its forces are added up,
+                // so it feels the same magnetic force from every spring attached to it.
+                curlList[i] = Cross(blist[i].vel, magnet);
+                if (blist[i].IsMobile())
+                    forceList[i] = blist[i].mass * gravity;
+            }
+
+            AddSpringForces(blist, LinkTag<0>());
+        }
+
+        // Which of these a link is decides how its spring force is calculated.
+        enum LinkKind { PaddingLink, AnchorLink, BallLink };
+
+        template <int index>
+        struct LinkKindOf : std::integral_constant<LinkKind,
+            (index >= NLINKS) ? PaddingLink :
+            (layout_t::Links[index].slot2 < 0) ? AnchorLink : BallLink> {};
+
+        template <int index>
+        PhysicsVector LinkVector(const BallArray&, std::integral_constant<LinkKind, PaddingLink>) const
+        {
+            // Past the last link, fill out the group with a spring whose force nothing uses.
+            // Any length will do, as long as it is not short enough to need SpringForce's special case.
+            return PhysicsVector(1.0f, 0.0f, 0.0f, 0.0f);
+        }
+
+        template <int index>
+        PhysicsVector LinkVector(const BallArray& blist, std::integral_constant<LinkKind, AnchorLink>) const
+        {
+            const PhysicsVector anchorPos(layout_t::Links[index].x, layout_t::Links[index].y, layout_t::Links[index].z, 0.0f);
+            return anchorPos - blist[layout_t::Links[index].slot1].pos;
+        }
+
+        template <int index>
+        PhysicsVector LinkVector(const BallArray& blist, std::integral_constant<LinkKind, BallLink>) const
+        {
+            return blist[layout_t::Links[index].slot2].pos - blist[layout_t::Links[index].slot1].pos;
+        }
+
+        template <int index>
+        void AddSpringGroups(const BallArray& blist, LinkTag<index>)
+        {
+            // The same arithmetic as SpringForce, in the same order, for the 4 links starting at `index`.
+            // Each lane rounds exactly as the scalar code does, so the forces are identical.
+            const __m128 d0 = LinkVector<index+0>(blist, LinkKindOf<index+0>()).v;
+            const __m128 d1 = LinkVector<index+1>(blist, LinkKindOf<index+1>()).v;
+            const __m128 d2 = LinkVector<index+2>(blist, LinkKindOf<index+2>()).v;
+            const __m128 d3 = LinkVector<index+3>(blist, LinkKindOf<index+3>()).v;
+
+            // Transpose, so each register holds one coordinate of all 4 vectors.
+            const __m128 t0 = _mm_unpacklo_ps(d0, d1);
+            const __m128 t1 = _mm_unpacklo_ps(d2, d3);
+            const __m128 t2 = _mm_unpackhi_ps(d0, d1);
+            const __m128 t3 = _mm_unpackhi_ps(d2, d3);
+            const __m128 x = _mm_movelh_ps(t0, t1);
+            const __m128 y = _mm_movehl_ps(t1, t0);
+            const __m128 z = _mm_movelh_ps(t2, t3);
+            const __m128 w = _mm_movehl_ps(t3, t2);
+
+            // Dot adds the products in the order x, y, z, w.
+            __m128 sum = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+            sum = _mm_add_ps(sum, _mm_mul_ps(z, z));
+            sum = _mm_add_ps(sum, _mm_mul_ps(w, w));
+            const __m128 dist = _mm_sqrt_ps(sum);
+            const __m128 attractiveForce = _mm_mul_ps(_mm_set1_ps(stiffness), _mm_sub_ps(dist, _mm_set1_ps(restLength)));
+            const __m128 scale = _mm_div_ps(attractiveForce, dist);
+
+            springList[index+0] = PhysicsVector(_mm_mul_ps(_mm_shuffle_ps(scale, scale, _MM_SHUFFLE(0,0,0,0)), d0));
+            springList[index+1] = PhysicsVector(_mm_mul_ps(_mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1,1,1,1)), d1));
+            springList[index+2] = PhysicsVector(_mm_mul_ps(_mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2,2,2,2)), d2));
+            springList[index+3] = PhysicsVector(_mm_mul_ps(_mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3,3,3,3)), d3));
+
+            // Balls almost on top of each other need SpringForce's special case.
+            // The threshold is a little larger than SpringForce's, so no such spring is missed;
+            // SpringForce itself decides what each one gets.
+            if (_mm_movemask_ps(_mm_cmplt_ps(dist, _mm_set1_ps(2.0e-9f))))
+            {
+                const PhysicsVector delta[4] = { PhysicsVector(d0), PhysicsVector(d1), PhysicsVector(d2), PhysicsVector(d3) };
+                for (int k = 0; k < 4; ++k)
+                    springList[index+k] = SpringForce(PhysicsVector::zero(), delta[k], stiffness, restLength);
+            }
+
+            AddSpringGroups(blist, LinkTag<index + 4>());
+        }
+
+        void AddSpringGroups(const BallArray&, LinkTag<NGROUPED>)
+        {
+        }
+
+        template <int index>
+        void AddSpringForces(const BallArray& blist, LinkTag<index>)
+        {
+            // Each link gets its own copy of this function, with constant ball slots.
+            AddLinkForces<index>(blist, LinkKindOf<index>());
+            AddSpringForces(blist, LinkTag<index + 1>());
+        }
+
+        void AddSpringForces(const BallArray&, LinkTag<NLINKS>)
+        {
+        }
+
+        template <int index>
+        void AddLinkForces(const BallArray& blist, std::integral_constant<LinkKind, AnchorLink>)
+        {
+            // A fixed anchor feels no force, so only the live ball needs updating.
+            constexpr int s1 = layout_t::Links[index].slot1;
+            if (blist[s1].IsMobile())
+            {
+                forceList[s1] += springList[index];
+                forceList[s1] += curlList[s1];
+            }
+        }
+
+        template <int index>
+        void AddLinkForces(const BallArray& blist, std::integral_constant<LinkKind, BallLink>)
+        {
+            constexpr int s1 = layout_t::Links[index].slot1;
+            constexpr int s2 = layout_t::Links[index].slot2;
+
+            if (blist[s1].IsMobile())
+            {
+                forceList[s1] += springList[index];
+                forceList[s1] += curlList[s1];
+            }
+
+            if (blist[s2].IsMobile())
+            {
+                forceList[s2] -= springList[index];
+                forceList[s2] += curlList[s2];
+            }
+        }
+    };
+
+    using FixedHexMesh = FixedPhysicsMesh<HexLayout>;
+
+    // A mesh whose balls sit on the regular triangular lattice that HexBuilder uses,
+    // so every spring joins two neighboring grid sites and no spring list is needed.
+    // Ball state is kept in a 2D grid, one array per coordinate, one row per lattice row.
+    // Each row stores only the span of sites it uses, padded to a multiple of 4.
+    // Each site remembers which of its 3 forward neighbors (east, north, northwest)
+    // it has springs to, and the forces are calculated 4 sites at a time
+    // as a stencil sweeping along the rows. Within a row, each neighbor is
+    // a constant distance away in memory, so there is no index indirection,
+    // and memory is read and written in order. Plates can be any size.
+    // The results match PhysicsMesh closely, but not bit for bit,
+    // because the forces on each ball are added up in a different order.
+    class LatticeMesh
+    {
+    private:
+        struct LatticeState
+        {
+            std::vector<float> px, py, pz;      // positions
+            std::vector<float> vx, vy, vz;      // velocities
+        };
+
+        struct LatticeRow
+        {
+            int base;           // the row's first site
+            int width;          // number of sites in the row: a multiple of 4
+            int north;          // distance from a site to its north neighbor; northwest is 1 less
+            int umin;           // the lattice u coordinate of the row's first site
+        };
+
+        const MeshTopology *topology = nullptr;
+        int firstSite = 0;                      // sites before this are padding, so the stencil never leaves the arrays
+        int endSite = 0;                        // sites from here on are padding
+        std::vector<LatticeRow> rowList;
+        std::vector<int> siteList;              // topology ball index => grid site
+        std::vector<int> ballList;              // grid site => topology ball index, or -1 for an empty site
+        LatticeState curr;
+        LatticeState next;
+        std::vector<float> ox, oy, oz;          // each site's original position
+        std::vector<float> mass;
+        std::vector<float> mobileMask;          // all bits set for sites holding a mobile ball
+        std::vector<float> springMask[3];       // all bits set for a spring toward east, north, northwest
+        std::vector<float> springCount;         // how many springs are attached to each site
+        std::vector<float> fx, fy, fz;          // net force on each site
+        PhysicsVector gravity;
+        PhysicsVector magnet;
+        float stiffness  = MESH_DEFAULT_STIFFNESS;
+        float restLength = MESH_DEFAULT_REST_LENGTH;
+        float speedLimit = MESH_DEFAULT_SPEED_LIMIT;
+
+    public:
+        // Start over with every ball at rest where `topology` puts it, and all settings at their defaults.
+        // Throws an exception if the balls do not sit on a triangular lattice
+        // or any spring joins balls that are not lattice neighbors.
+        // The topology must outlive this mesh.
+        void Attach(const MeshTopology& _topology);
+        void Quiet();
+        float GetStiffness() const { return stiffness; }
+        void SetStiffness(float _stiffness) { stiffness = std::max(0.0f, _stiffness); }
+        float GetRestLength() const { return restLength; }
+        void SetRestLength(float _restLength) { restLength = std::max(0.0f, _restLength); }
+        float GetSpeedLimit() const { return speedLimit; }
+        void SetSpeedLimit(float _speedLimit) { speedLimit = _speedLimit; }
+        void SetMagneticField(PhysicsVector _magnet) { magnet = _magnet; }
+        PhysicsVector GetGravity() const { return gravity; }
+        void SetGravity(PhysicsVector _gravity) { gravity = _gravity; }
+        int NumBalls() const { return static_cast<int>(siteList.size()); }
+        int NumSprings() const { return topology ? topology->NumSprings() : 0; }
+        int GridSites() const { return endSite - firstSite; }    // includes the padding at the end of each row
+        Ball GetBallAt(int index) const;
+        void SetBallPosition(int index, PhysicsVector pos);
+        void SetBallMass(int index, float _mass);
+        PhysicsVector GetBallOrigin(int index) const { return topology->GetBallOrigin(index); }
+        PhysicsVector GetBallDisplacement(int index) const { return GetBallAt(index).pos - GetBallOrigin(index); }
+        float KineticEnergy() const;
+        void SaveState(StateWriter& writer) const;     // same format as PhysicsMesh
+        void LoadState(StateReader& reader);
+        void Update(float dt, float halflife);
+
+    private:
+        void CalcForces(const LatticeState& state);
+        void Extrapolate(float dt, const LatticeState& source, LatticeState& target) const;
+    };
+
     struct MeshAudioParameters
     {
         int leftInputBallIndex        {-1};
@@ -166,7 +814,14 @@ namespace Sapphire
         }
     };
 
-    MeshAudioParameters CreateHex(PhysicsMesh& mesh);
+    // The Elastika hexagonal mesh is built the first time it is needed, then shared by every caller.
+    const MeshTopology& HexTopology();
+    MeshAudioParameters CreateHex(PhysicsMesh& mesh);     // attaches `mesh` to HexTopology()
+    MeshAudioParameters CreateHex(FixedHexMesh& mesh);
+    MeshAudioParameters CreateHex(LatticeMesh& mesh);
+
+    // A plate of hexagons like Elastika's, but any size: hexWide by hexFar hexagons.
+    void CreateHexPlate(MeshTopology& topology, int hexWide, int hexFar);
 
     const int ELASTIKA_FILTER_LAYERS = 3;
 
@@ -185,10 +840,10 @@ namespace Sapphire
             {}
 
         // Inject audio into the mesh
-        void Inject(Sapphire::PhysicsMesh& mesh, const Sapphire::PhysicsVector& direction, float sample)
+        template <typename mesh_t>
+        void Inject(mesh_t& mesh, const Sapphire::PhysicsVector& direction, float sample)
         {
-            Sapphire::Ball& ball = mesh.GetBallAt(ballIndex);
-            ball.pos = mesh.GetBallOrigin(ballIndex) + (sample * direction);
+            mesh.SetBallPosition(ballIndex, mesh.GetBallOrigin(ballIndex) + (sample * direction));
         }
     };
 
@@ -208,7 +863,8 @@ namespace Sapphire
             {}
 
         // Extract audio from the mesh
-        float Extract(const Sapphire::PhysicsMesh& mesh, const Sapphire::PhysicsVector& direction)
+        template <typename mesh_t>
+        float Extract(const mesh_t& mesh, const Sapphire::PhysicsVector& direction)
         {
             using namespace Sapphire;
 
@@ -218,11 +874,40 @@ namespace Sapphire
     };
 
 
-    class ElastikaEngine
+    // The Elastika engine can run on any kind of mesh.
+    // PhysicsMesh follows whatever topology it is attached to at run time.
+    // FixedHexMesh knows the hexagon layout at compile time, and produces identical output.
+    // LatticeMesh solves the mesh as a stencil over a grid, and its output is very close.
+    template <typename mesh_t>
+    class BasicElastikaEngine
     {
+    public:
+        enum Stage      // sections of process() measured when SAPPHIRE_ENABLE_PROFILING is enabled
+        {
+            STAGE_INJECT,
+            STAGE_MESH_UPDATE,
+            STAGE_EXTRACT,
+            STAGE_FILTER,
+            STAGE_AGC,
+            STAGE_COUNT
+        };
+
+        static const char * const *StageNames()
+        {
+            static const char * const names[STAGE_COUNT] =
+            {
+                "inject",
+                "mesh update",
+                "extract",
+                "DC reject",
+                "limiter",
+            };
+            return names;
+        }
+
     private:
         int outputVerifyCounter;
-        PhysicsMesh mesh;
+        mesh_t mesh;
         MeshAudioParameters mp;
         SliderMapping frictionMap;
         SliderMapping stiffnessMap;
@@ -234,8 +919,7 @@ namespace Sapphire
         MeshInput rightInput;
         MeshOutput leftOutput;
         MeshOutput rightOutput;
-        StagedFilter<float, ELASTIKA_FILTER_LAYERS> leftLoCut;
-        StagedFilter<float, ELASTIKA_FILTER_LAYERS> rightLoCut;
+        StagedFilterBank<ELASTIKA_FILTER_LAYERS> loCut;    // DC reject: left in lane 0, right in lane 1
         float halfLife;
         float drive;
         float gain;
@@ -243,23 +927,28 @@ namespace Sapphire
         float outTilt;
         AutomaticGainLimiter agc;
         bool enableAgc = false;
+        float peakLeft = 0.0f;      // largest output magnitudes since the last call to readTelemetry()
+        float peakRight = 0.0f;
+        StageProfiler<STAGE_COUNT> profiler {StageNames()};
 
     public:
-        ElastikaEngine()
+        BasicElastikaEngine()
+            : frictionMap(SliderScale::Exponential, {1.3f, -4.5f})
+            , stiffnessMap(SliderScale::Exponential, {-0.1f, 3.4f})
+            , spanMap(SliderScale::Linear, {0.0008, 0.0003})
+            , curlMap(SliderScale::Linear, {0.0f, 1.0f})
+            , massMap(SliderScale::Exponential, {0.0f, 1.0f})
+            , tiltMap(SliderScale::Linear, {0.0f, 1.0f})
         {
             initialize();
         }
 
         void initialize()
         {
+            // Only the first call allocates memory. After that, resetting the engine
+            // copies the shared mesh topology's starting state into buffers we already own.
             outputVerifyCounter = 0;
-
-            frictionMap = SliderMapping(SliderScale::Exponential, {1.3f, -4.5f});
-            stiffnessMap = SliderMapping(SliderScale::Exponential, {-0.1f, 3.4f});
-            spanMap = SliderMapping(SliderScale::Linear, {0.0008, 0.0003});
-            curlMap = SliderMapping(SliderScale::Linear, {0.0f, 1.0f});
-            massMap = SliderMapping(SliderScale::Exponential, {0.0f, 1.0f});
-            tiltMap = SliderMapping(SliderScale::Linear, {0.0f, 1.0f});
+            peakLeft = peakRight = 0.0f;
 
             mp = CreateHex(mesh);
 
@@ -288,15 +977,13 @@ namespace Sapphire
 
         void setDcRejectFrequency(float frequency)
         {
-            leftLoCut.SetCutoffFrequency(frequency);
-            rightLoCut.SetCutoffFrequency(frequency);
+            loCut.SetCutoffFrequency(frequency);
         }
 
         void quiet()
         {
             mesh.Quiet();
-            leftLoCut.Reset();
-            rightLoCut.Reset();
+            loCut.Reset();
             agc.initialize();
         }
 
@@ -328,9 +1015,9 @@ namespace Sapphire
 
         void setMass(float slider = 0.0f)
         {
-            Ball& lmBall = mesh.GetBallAt(mp.leftVarMassBallIndex);
-            Ball& rmBall = mesh.GetBallAt(mp.rightVarMassBallIndex);
-            lmBall.mass = rmBall.mass = 1.0e-6 * massMap.Evaluate(Clamp(slider, -1.0f, +1.0f));
+            float mass = 1.0e-6 * massMap.Evaluate(Clamp(slider, -1.0f, +1.0f));
+            mesh.SetBallMass(mp.leftVarMassBallIndex, mass);
+            mesh.SetBallMass(mp.rightVarMassBallIndex, mass);
         }
 
         void setDrive(float slider = 1.0f)      // min = 0.0 (-inf dB), default = 1.0 (0 dB), max = 2.0 (+24 dB)
@@ -378,31 +1065,103 @@ namespace Sapphire
             return enableAgc ? (agc.getFollower() - 1.0) : 0.0;
         }
 
+        void readTelemetry(EngineTelemetry& frame)
+        {
+            // Merges this engine's status into `frame`, then starts a new peak measurement.
+            // Call from the audio thread at control rate; the caller publishes the frame.
+            frame.peakLeft = std::max(frame.peakLeft, peakLeft);
+            frame.peakRight = std::max(frame.peakRight, peakRight);
+            if (enableAgc)
+                frame.agcFollower = std::max(frame.agcFollower, static_cast<float>(agc.getFollower()));
+            frame.meshEnergy += mesh.KineticEnergy();
+            peakLeft = peakRight = 0.0f;
+        }
+
+        ProfileSnapshot getProfile() const
+        {
+            return profiler.snapshot();
+        }
+
+        static const uint32_t StateVersion = 2;
+        static uint32_t StateKind() { return StateTag('E', 'L', 'A', 'S'); }
+
+        void saveState(std::vector<uint8_t>& state) const
+        {
+            // Captures everything process() changes: the mesh, the DC reject filters, and the limiter.
+            // Settings such as friction or stiffness are not included; the caller owns those.
+            StateWriter writer(state, StateKind(), StateVersion);
+            writer.write(outputVerifyCounter);
+            mesh.SaveState(writer);
+            loCut.SaveState(writer);
+            agc.saveState(writer);
+            writer.finish();
+        }
+
+        void loadState(const std::vector<uint8_t>& state)
+        {
+            // Read the whole payload once without keeping any of it, so a bad blob
+            // throws before the mesh or filters have changed. Then read it again for real.
+            StateReader check(state.data(), state.size(), StateKind(), StateVersion);
+            int scratchCounter;
+            check.read(scratchCounter);
+            CheckMeshState(check, mesh.NumBalls());
+            StagedFilterBank<ELASTIKA_FILTER_LAYERS> scratchFilter = loCut;
+            scratchFilter.LoadState(check);
+            AutomaticGainLimiter scratchAgc = agc;
+            scratchAgc.loadState(check);
+            check.finish();
+
+            StateReader reader(state.data(), state.size(), StateKind(), StateVersion);
+            reader.read(outputVerifyCounter);
+            mesh.LoadState(reader);
+            loCut.LoadState(reader);
+            agc.loadState(reader);
+            reader.finish();
+        }
+
         void process(float sampleRate, float leftIn, float rightIn, float& leftOut, float& rightOut)
         {
-            // Feed audio stimulus into the mesh.
-            PhysicsVector leftInputDir = Interpolate(inTilt, mp.leftInputDir1, mp.leftInputDir2);
-            PhysicsVector rightInputDir = Interpolate(inTilt, mp.rightInputDir1, mp.rightInputDir2);
-            leftInput.Inject(mesh, leftInputDir, drive * leftIn);
-            rightInput.Inject(mesh, rightInputDir, drive * rightIn);
+            SAPPHIRE_REALTIME_SCOPE();
+
+            {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_INJECT);
+
+                // Feed audio stimulus into the mesh.
+                PhysicsVector leftInputDir = Interpolate(inTilt, mp.leftInputDir1, mp.leftInputDir2);
+                PhysicsVector rightInputDir = Interpolate(inTilt, mp.rightInputDir1, mp.rightInputDir2);
+                leftInput.Inject(mesh, leftInputDir, drive * leftIn);
+                rightInput.Inject(mesh, rightInputDir, drive * rightIn);
+            }
+
+            {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_MESH_UPDATE);
 
-            // Update the simulation state by one sample's worth of time.
-            mesh.Update(1.0/sampleRate, halfLife);
+                // Update the simulation state by one sample's worth of time.
+                mesh.Update(1.0/sampleRate, halfLife);
+            }
 
-            // Extract output for the left channel.
-            PhysicsVector leftOutputDir = Interpolate(outTilt, mp.leftOutputDir1, mp.leftOutputDir2);
-            leftOut = leftOutput.Extract(mesh, leftOutputDir);
-            leftOut = leftLoCut.UpdateHiPass(leftOut, sampleRate);
-            leftOut *= gain;
+            {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_EXTRACT);
 
-            // Extract output for the right channel.
-            PhysicsVector rightOutputDir = Interpolate(outTilt, mp.rightOutputDir1, mp.rightOutputDir2);
-            rightOut = rightOutput.Extract(mesh, rightOutputDir);
-            rightOut = rightLoCut.UpdateHiPass(rightOut, sampleRate);
-            rightOut *= gain;
+                // Extract output for the left and right channels.
+                PhysicsVector leftOutputDir = Interpolate(outTilt, mp.leftOutputDir1, mp.leftOutputDir2);
+                leftOut = leftOutput.Extract(mesh, leftOutputDir);
+                PhysicsVector rightOutputDir = Interpolate(outTilt, mp.rightOutputDir1, mp.rightOutputDir2);
+                rightOut = rightOutput.Extract(mesh, rightOutputDir);
+            }
+
+            {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_FILTER);
+
+                PhysicsVector filtered = loCut.UpdateHiPass(PhysicsVector(leftOut, rightOut, 0.0f, 0.0f), sampleRate);
+                leftOut = filtered[0] * gain;
+                rightOut = filtered[1] * gain;
+            }
 
             if (enableAgc)
             {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_AGC);
+
                 // Automatic gain control to limit excessive output voltages.
                 agc.process(sampleRate, leftOut, rightOut);
             }
@@ -423,8 +1182,15 @@ namespace Sapphire
                     leftOut = rightOut = 0.0f;
                 }
             }
+
+            peakLeft = std::max(peakLeft, std::abs(leftOut));
+            peakRight = std::max(peakRight, std::abs(rightOut));
         }
     };
+
+    using ElastikaEngine = BasicElastikaEngine<FixedHexMesh>;
+    using DynamicElastikaEngine = BasicElastikaEngine<PhysicsMesh>;
+    using LatticeElastikaEngine = BasicElastikaEngine<LatticeMesh>;
 }
 
 #endif // __COSINEKITTY_ELASTIKA_ENGINE_HPP
@@ -5,6 +5,10 @@
 
 namespace Sapphire
 {
+    constexpr int HexLayout::LiveBalls[];
+    constexpr int HexLayout::Slots[];
+    constexpr FixedLink HexLayout::Links[];
+
     const uint8_t SPRINGDIR_E  = (1 << 0);
     const uint8_t SPRINGDIR_N  = (1 << 1);
     const uint8_t SPRINGDIR_NW = (1 << 2);
@@ -45,13 +49,13 @@ namespace Sapphire
     {
     private:
         GridMap<HexGridElement> map;
-        PhysicsMesh& mesh;
+        MeshTopology& mesh;
         const float spacing;
         const float mass;
         int u1, u2, v1, v2;     // the bounding box that contains all mobile balls
 
     public:
-        HexBuilder(PhysicsMesh& _mesh, int _dimension, float _spacing, float _mass)
+        HexBuilder(MeshTopology& _mesh, int _dimension, float _spacing, float _mass)
             : map(-_dimension, +_dimension, -_dimension, +_dimension, HexGridElement())
             , mesh(_mesh)
             , spacing(_spacing)
@@ -107,7 +111,7 @@ namespace Sapphire
                 for (int v = v1; v <= v2; ++v)
                 {
                     const HexGridElement& h = map.at(u, v);
-                    if (h.ballIndex >= 0 && mesh.GetBallAt(h.ballIndex).IsMobile())
+                    if (h.ballIndex >= 0 && mesh.GetInitialBallAt(h.ballIndex).IsMobile())
                     {
                         AddMissingAnchor(SPRINGDIR_E , h, u+1, v+0);
                         AddMissingAnchor(SPRINGDIR_N , h, u+0, v+1);
@@ -130,7 +134,7 @@ namespace Sapphire
                 for (int v = v1; v <= v2; ++v)
                 {
                     HexGridElement& h = map.at(u, v);
-                    if (h.ballIndex >= 0 && mesh.GetBallAt(h.ballIndex).IsMobile())
+                    if (h.ballIndex >= 0 && mesh.GetInitialBallAt(h.ballIndex).IsMobile())
                     {
                         AddMissingSpring(SPRINGDIR_E , h, u+1, v+0);
                         AddMissingSpring(SPRINGDIR_N , h, u+0, v+1);
@@ -214,10 +218,19 @@ namespace Sapphire
     };
 
 
+    struct HexMesh
+    {
+        MeshTopology topology;
+        MeshAudioParameters mp;
+
+        HexMesh();
+    };
+
+
     // Create a mesh of hexagons. This reduces the spring overhead to 3 springs per ball.
     // hexWide is the number of hexagons whose centers lie along the direction [u = +1, v = -2].
     // hexFar  is the number of hexagons whose centers lie along the direction [u = +1, v = +1].
-    MeshAudioParameters CreateHex(PhysicsMesh& mesh)
+    HexMesh::HexMesh()
     {
         const float mass = 1.0e-6;
         const int hexWide = 2;
@@ -225,9 +238,7 @@ namespace Sapphire
         const float spacing = MESH_DEFAULT_REST_LENGTH;
         const float peakVoltage = 10.0f;
 
-        mesh.Clear();
-
-        HexBuilder builder(mesh, 10, spacing, mass);
+        HexBuilder builder(topology, 10, spacing, mass);
 
         for (int w = 0; w < hexWide; ++w)
             for (int f = 0; f < hexFar; ++f)
@@ -235,8 +246,6 @@ namespace Sapphire
 
         builder.Finalize();
 
-        MeshAudioParameters mp;
-
         mp.leftInputBallIndex    = builder.BallIndex(-1,  0, -1,  0);
         mp.rightInputBallIndex   = builder.BallIndex(+2, +2, +1,  0);
         mp.leftOutputBallIndex   = builder.BallIndex( 0, +2, -1, +1);
@@ -254,11 +263,65 @@ namespace Sapphire
         mp.rightOutputDir1 = pos_factor * PhysicsVector(0,  0, +1,  0);
         mp.rightOutputDir2 = pos_factor * PhysicsVector(0, +1,  0,  0);
 
-        assert(mesh.IsAnchor(mp.leftInputBallIndex));
-        assert(mesh.IsAnchor(mp.rightInputBallIndex));
-        assert(mesh.IsMobile(mp.leftOutputBallIndex));
-        assert(mesh.IsMobile(mp.rightOutputBallIndex));
+        // The input anchors move with the audio; all the other anchors stay put.
+        topology.MarkDriven(mp.leftInputBallIndex);
+        topology.MarkDriven(mp.rightInputBallIndex);
+
+        assert(topology.GetInitialBallAt(mp.leftInputBallIndex).IsAnchor());
+        assert(topology.GetInitialBallAt(mp.rightInputBallIndex).IsAnchor());
+        assert(topology.GetInitialBallAt(mp.leftOutputBallIndex).IsMobile());
+        assert(topology.GetInitialBallAt(mp.rightOutputBallIndex).IsMobile());
+    }
+
+
+    static const HexMesh& SharedHexMesh()
+    {
+        // Built by whichever thread gets here first; C++11 guarantees the others wait for it.
+        static const HexMesh hex;
+        return hex;
+    }
+
+
+    const MeshTopology& HexTopology()
+    {
+        return SharedHexMesh().topology;
+    }
 
-        return mp;
+
+    MeshAudioParameters CreateHex(PhysicsMesh& mesh)
+    {
+        const HexMesh& hex = SharedHexMesh();
+        mesh.Attach(hex.topology);
+        return hex.mp;
+    }
+
+
+    MeshAudioParameters CreateHex(FixedHexMesh& mesh)
+    {
+        const HexMesh& hex = SharedHexMesh();
+        mesh.Attach(hex.topology);
+        return hex.mp;
+    }
+
+
+    MeshAudioParameters CreateHex(LatticeMesh& mesh)
+    {
+        const HexMesh& hex = SharedHexMesh();
+        mesh.Attach(hex.topology);
+        return hex.mp;
+    }
+
+
+    void CreateHexPlate(MeshTopology& topology, int hexWide, int hexFar)
+    {
+        if (hexWide < 1 || hexFar < 1)
+            throw std::invalid_argument("A hex plate needs at least one hexagon in each direction.");
+
+        // The grid must be big enough to hold every ball and anchor in [u,v] coordinates.
+        HexBuilder builder(topology, 2*(hexWide + hexFar) + 2, MESH_DEFAULT_REST_LENGTH, 1.0e-6);
+        for (int w = 0; w < hexWide; ++w)
+            for (int f = 0; f < hexFar; ++f)
+                builder.AddHexagon(w, f);
+        builder.Finalize();
     }
 }
@@ -0,0 +1,461 @@
+#include <math.h>
+#include <limits>
+#include "sapphire_engine.hpp"
+#include "elastika_engine.hpp"
+
+// Sapphire lattice mesh solver, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+
+namespace Sapphire
+{
+    const int LATTICE_EAST      = 0;
+    const int LATTICE_NORTH     = 1;
+    const int LATTICE_NORTHWEST = 2;
+
+    static inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+    {
+        // For each lane, returns `a` where `mask` is all ones, or `b` where it is all zeros.
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    }
+
+
+    static inline float AllBits(bool flag)
+    {
+        union { uint32_t u; float f; } bits;
+        bits.u = flag ? 0xffffffffu : 0u;
+        return bits.f;
+    }
+
+
+    void LatticeMesh::Attach(const MeshTopology& _topology)
+    {
+        const int nballs = _topology.NumBalls();
+        if (_topology.NumSprings() == 0)
+            throw std::runtime_error("A lattice mesh needs at least one spring.");
+
+        // Every spring joins neighboring lattice sites, so the first one tells us the lattice spacing.
+        const Spring& first = _topology.GetSprings()[0];
+        const float spacing = Magnitude(_topology.GetBallOrigin(first.ballIndex2) - _topology.GetBallOrigin(first.ballIndex1));
+        if (!(spacing > 0.0f))
+            throw std::runtime_error("A lattice mesh spring has zero length.");
+
+        // Find each ball's [u,v] lattice coordinates, relative to ball 0.
+        // This is the inverse of HexBuilder::Location().
+        // Clearing and refilling vectors keeps their storage,
+        // so re-attaching the same topology never allocates.
+        const PhysicsVector origin0 = _topology.GetBallOrigin(0);
+        const float rowHeight = spacing * std::sqrt(0.75f);
+        const float tolerance = 0.01f;
+        std::vector<int>& ulist = ballList;     // borrow storage for the coordinates until the grid is laid out
+        std::vector<int>& vlist = siteList;
+        ulist.clear();
+        vlist.clear();
+        int vmin = 0, vmax = 0;
+        for (int i = 0; i < nballs; ++i)
+        {
+            const PhysicsVector d = _topology.GetBallOrigin(i) - origin0;
+            const float v = d[1] / rowHeight;
+            const float u = d[0] / spacing - v/2;
+            const int iu = static_cast<int>(std::round(u));
+            const int iv = static_cast<int>(std::round(v));
+            if (std::abs(u - iu) > tolerance || std::abs(v - iv) > tolerance || std::abs(d[2]) > tolerance * spacing)
+                throw std::runtime_error("Mesh ball " + std::to_string(i) + " is not on a triangular lattice.");
+            ulist.push_back(iu);
+            vlist.push_back(iv);
+            vmin = std::min(vmin, iv);
+            vmax = std::max(vmax, iv);
+        }
+
+        // Each row holds the span of u values its balls use, rounded up to whole vectors.
+        const int rows = 1 + vmax - vmin;
+        rowList.assign(rows, LatticeRow{0, 0, 0, 0});
+        for (LatticeRow& row : rowList)
+        {
+            row.umin = std::numeric_limits<int>::max();
+            row.width = std::numeric_limits<int>::min();   // holds umax until the rows are laid out
+        }
+        for (int i = 0; i < nballs; ++i)
+        {
+            LatticeRow& row = rowList[vlist[i] - vmin];
+            row.umin = std::min(row.umin, ulist[i]);
+            row.width = std::max(row.width, ulist[i]);
+        }
+
+        int cursor = 0;
+        for (LatticeRow& row : rowList)
+        {
+            if (row.umin > row.width)
+                row.umin = row.width = 0;      // an empty row
+            else
+                row.width = (1 + row.width - row.umin + 3) & ~3;
+            row.base = cursor;
+            cursor += row.width;
+        }
+
+        // The stencil reads whole vectors, sometimes a little past the sites that hold balls.
+        // Pad both ends of the arrays so those reads stay inside them.
+        int reach = 0;
+        for (int v = 0; v+1 < rows; ++v)
+        {
+            LatticeRow& row = rowList[v];
+            const LatticeRow& above = rowList[v+1];
+            row.north = (above.base - above.umin) - (row.base - row.umin);
+            reach = std::max(reach, std::abs(row.north));
+        }
+        const int margin = (reach + 8) & ~3;
+        for (LatticeRow& row : rowList)
+            row.base += margin;
+        firstSite = margin;
+        endSite = margin + cursor;
+        const size_t size = static_cast<size_t>(endSite + margin);
+
+        for (std::vector<float>* array : {&curr.px, &curr.py, &curr.pz, &curr.vx, &curr.vy, &curr.vz,
+                &next.px, &next.py, &next.pz, &next.vx, &next.vy, &next.vz,
+                &ox, &oy, &oz, &mass, &mobileMask, &springMask[0], &springMask[1], &springMask[2],
+                &springCount, &fx, &fy, &fz})
+        {
+            array->assign(size, 0.0f);
+        }
+
+        // Each spring becomes a mask bit at the site from which its other end is a forward neighbor.
+        for (const Spring& spring : _topology.GetSprings())
+        {
+            int b1 = spring.ballIndex1;
+            int b2 = spring.ballIndex2;
+            int du = ulist[b2] - ulist[b1];
+            int dv = vlist[b2] - vlist[b1];
+            if (dv < 0 || (dv == 0 && du < 0))
+            {
+                std::swap(b1, b2);
+                du = -du;
+                dv = -dv;
+            }
+
+            int dir;
+            if (du == +1 && dv == 0)
+                dir = LATTICE_EAST;
+            else if (du == 0 && dv == 1)
+                dir = LATTICE_NORTH;
+            else if (du == -1 && dv == 1)
+                dir = LATTICE_NORTHWEST;
+            else
+                throw std::runtime_error("Mesh balls " + std::to_string(b1) + " and " + std::to_string(b2) + " are not lattice neighbors.");
+
+            const LatticeRow& row1 = rowList[vlist[b1] - vmin];
+            const LatticeRow& row2 = rowList[vlist[b2] - vmin];
+            const int site1 = row1.base + (ulist[b1] - row1.umin);
+            const int site2 = row2.base + (ulist[b2] - row2.umin);
+            if (springMask[dir][site1] != 0.0f)
+                throw std::runtime_error("Mesh has more than one spring between balls " + std::to_string(b1) + " and " + std::to_string(b2));
+
+            springMask[dir][site1] = AllBits(true);
+            springCount[site1] += 1.0f;
+            springCount[site2] += 1.0f;
+        }
+
+        // Convert coordinates to sites in place, then build the reverse map.
+        for (int i = 0; i < nballs; ++i)
+        {
+            const LatticeRow& row = rowList[vlist[i] - vmin];
+            vlist[i] = row.base + (ulist[i] - row.umin);
+        }
+        ballList.assign(size, -1);
+        for (int i = 0; i < nballs; ++i)
+        {
+            const int site = siteList[i];
+            if (ballList[site] >= 0)
+                throw std::runtime_error("Mesh balls " + std::to_string(ballList[site]) + " and " + std::to_string(i) + " are at the same place.");
+            ballList[site] = i;
+
+            const Ball& ball = _topology.GetInitialBallAt(i);
+            ox[site] = ball.pos[0];
+            oy[site] = ball.pos[1];
+            oz[site] = ball.pos[2];
+            mass[site] = ball.mass;
+            mobileMask[site] = AllBits(ball.IsMobile());
+        }
+
+        topology = &_topology;
+        gravity = PhysicsVector::zero();
+        magnet = PhysicsVector::zero();
+        stiffness  = MESH_DEFAULT_STIFFNESS;
+        restLength = MESH_DEFAULT_REST_LENGTH;
+        speedLimit = MESH_DEFAULT_SPEED_LIMIT;
+        Quiet();
+    }
+
+
+    void LatticeMesh::Quiet()
+    {
+        for (int i = firstSite; i < endSite; ++i)
+        {
+            curr.px[i] = ox[i];
+            curr.py[i] = oy[i];
+            curr.pz[i] = oz[i];
+            curr.vx[i] = curr.vy[i] = curr.vz[i] = 0.0f;
+        }
+    }
+
+
+    Ball LatticeMesh::GetBallAt(int index) const
+    {
+        const int site = siteList.at(index);
+        return Ball(
+            mass[site],
+            PhysicsVector(curr.px[site], curr.py[site], curr.pz[site], 0.0f),
+            PhysicsVector(curr.vx[site], curr.vy[site], curr.vz[site], 0.0f)
+        );
+    }
+
+
+    void LatticeMesh::SetBallPosition(int index, PhysicsVector pos)
+    {
+        const int site = siteList.at(index);
+        curr.px[site] = pos[0];
+        curr.py[site] = pos[1];
+        curr.pz[site] = pos[2];
+    }
+
+
+    void LatticeMesh::SetBallMass(int index, float _mass)
+    {
+        const int site = siteList.at(index);
+        mass[site] = _mass;
+        mobileMask[site] = AllBits(_mass > 0.0f);
+    }
+
+
+    float LatticeMesh::KineticEnergy() const
+    {
+        float energy = 0.0f;
+        for (int site : siteList)
+        {
+            if (mass[site] > 0.0f)
+            {
+                const float speedSquared = curr.vx[site]*curr.vx[site] + curr.vy[site]*curr.vy[site] + curr.vz[site]*curr.vz[site];
+                energy += 0.5f * mass[site] * speedSquared;
+            }
+        }
+        return energy;
+    }
+
+
+    void LatticeMesh::SaveState(StateWriter& writer) const
+    {
+        const int nballs = NumBalls();
+        writer.write(static_cast<uint32_t>(nballs));
+        for (int i = 0; i < nballs; ++i)
+        {
+            const Ball b = GetBallAt(i);
+            writer.write(b.pos);
+            writer.write(b.vel);
+        }
+    }
+
+
+    void LatticeMesh::LoadState(StateReader& reader)
+    {
+        uint32_t nballs;
+        reader.read(nballs);
+        if (nballs != siteList.size())
+            throw std::runtime_error("Mesh state has the wrong number of balls.");
+
+        for (int site : siteList)
+        {
+            PhysicsVector pos, vel;
+            reader.read(pos);
+            reader.read(vel);
+            curr.px[site] = pos[0];
+            curr.py[site] = pos[1];
+            curr.pz[site] = pos[2];
+            curr.vx[site] = vel[0];
+            curr.vy[site] = vel[1];
+            curr.vz[site] = vel[2];
+        }
+    }
+
+
+    static inline void StencilSprings(
+        const float *px, const float *py, const float *pz,
+        int i, int j, __m128 present,
+        __m128 stiffness, __m128 restLength,
+        __m128& sx, __m128& sy, __m128& sz)
+    {
+        // The forces of the springs from sites i..i+3 to sites j..j+3, as felt by sites i..i+3.
+        // This is SpringForce() 4 springs at a time. Lanes without a spring may hold nonsense,
+        // so `present` zeroes them out.
+        const __m128 dx = _mm_sub_ps(_mm_loadu_ps(&px[j]), _mm_loadu_ps(&px[i]));
+        const __m128 dy = _mm_sub_ps(_mm_loadu_ps(&py[j]), _mm_loadu_ps(&py[i]));
+        const __m128 dz = _mm_sub_ps(_mm_loadu_ps(&pz[j]), _mm_loadu_ps(&pz[i]));
+        const __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        const __m128 attractiveForce = _mm_mul_ps(stiffness, _mm_sub_ps(dist, restLength));
+        const __m128 scale = _mm_div_ps(attractiveForce, dist);
+
+        // Where two balls coincide, pick the same arbitrary direction as SpringForce().
+        const __m128 coincide = _mm_cmplt_ps(dist, _mm_set1_ps(1.0e-9f));
+        sx = _mm_and_ps(present, _mm_andnot_ps(coincide, _mm_mul_ps(scale, dx)));
+        sy = _mm_and_ps(present, _mm_andnot_ps(coincide, _mm_mul_ps(scale, dy)));
+        sz = _mm_and_ps(present, Select(coincide, _mm_sub_ps(_mm_setzero_ps(), attractiveForce), _mm_mul_ps(scale, dz)));
+    }
+
+
+    static inline __m128 ShiftIn(__m128 carry, __m128 s)
+    {
+        // Returns [carry[3], s[0], s[1], s[2]].
+        const __m128 t = _mm_shuffle_ps(carry, s, _MM_SHUFFLE(0, 0, 3, 3));
+        return _mm_shuffle_ps(t, s, _MM_SHUFFLE(2, 1, 2, 0));
+    }
+
+
+    void LatticeMesh::CalcForces(const LatticeState& state)
+    {
+        const float *px = state.px.data();
+        const float *py = state.py.data();
+        const float *pz = state.pz.data();
+
+        // Gravity, plus the magnetic force, which PhysicsMesh applies once for each spring attached to a ball.
+        const __m128 gx = _mm_set1_ps(gravity[0]);
+        const __m128 gy = _mm_set1_ps(gravity[1]);
+        const __m128 gz = _mm_set1_ps(gravity[2]);
+        const __m128 mx = _mm_set1_ps(magnet[0]);
+        const __m128 my = _mm_set1_ps(magnet[1]);
+        const __m128 mz = _mm_set1_ps(magnet[2]);
+        for (int i = firstSite; i < endSite; i += 4)
+        {
+            const __m128 m = _mm_loadu_ps(&mass[i]);
+            const __m128 n = _mm_loadu_ps(&springCount[i]);
+            const __m128 vx = _mm_loadu_ps(&state.vx[i]);
+            const __m128 vy = _mm_loadu_ps(&state.vy[i]);
+            const __m128 vz = _mm_loadu_ps(&state.vz[i]);
+            const __m128 cx = _mm_sub_ps(_mm_mul_ps(vy, mz), _mm_mul_ps(vz, my));
+            const __m128 cy = _mm_sub_ps(_mm_mul_ps(vz, mx), _mm_mul_ps(vx, mz));
+            const __m128 cz = _mm_sub_ps(_mm_mul_ps(vx, my), _mm_mul_ps(vy, mx));
+            _mm_storeu_ps(&fx[i], _mm_add_ps(_mm_mul_ps(m, gx), _mm_mul_ps(n, cx)));
+            _mm_storeu_ps(&fy[i], _mm_add_ps(_mm_mul_ps(m, gy), _mm_mul_ps(n, cy)));
+            _mm_storeu_ps(&fz[i], _mm_add_ps(_mm_mul_ps(m, gz), _mm_mul_ps(n, cz)));
+        }
+
+        const __m128 k = _mm_set1_ps(stiffness);
+        const __m128 rest = _mm_set1_ps(restLength);
+        const float *eastMask = springMask[LATTICE_EAST].data();
+        const float *northMask = springMask[LATTICE_NORTH].data();
+        const float *northwestMask = springMask[LATTICE_NORTHWEST].data();
+        for (const LatticeRow& row : rowList)
+        {
+            const int end = row.base + row.width;
+
+            // East springs stay within the row. Each site gains the force of its own east spring,
+            // and loses the force of the spring from its west neighbor, which is
+            // one lane over, so shift it into place instead of writing memory twice.
+            __m128 carryX = _mm_setzero_ps();
+            __m128 carryY = _mm_setzero_ps();
+            __m128 carryZ = _mm_setzero_ps();
+            for (int i = row.base; i < end; i += 4)
+            {
+                const __m128 present = _mm_loadu_ps(&eastMask[i]);
+                __m128 sx = _mm_setzero_ps();
+                __m128 sy = _mm_setzero_ps();
+                __m128 sz = _mm_setzero_ps();
+                if (_mm_movemask_ps(present) != 0)
+                    StencilSprings(px, py, pz, i, i+1, present, k, rest, sx, sy, sz);
+                _mm_storeu_ps(&fx[i], _mm_add_ps(_mm_loadu_ps(&fx[i]), _mm_sub_ps(sx, ShiftIn(carryX, sx))));
+                _mm_storeu_ps(&fy[i], _mm_add_ps(_mm_loadu_ps(&fy[i]), _mm_sub_ps(sy, ShiftIn(carryY, sy))));
+                _mm_storeu_ps(&fz[i], _mm_add_ps(_mm_loadu_ps(&fz[i]), _mm_sub_ps(sz, ShiftIn(carryZ, sz))));
+                carryX = sx;
+                carryY = sy;
+                carryZ = sz;
+            }
+
+            // North and northwest springs reach into the next row.
+            if (row.north == 0)
+                continue;   // the top row has no springs going up
+
+            for (int dir = LATTICE_NORTH; dir <= LATTICE_NORTHWEST; ++dir)
+            {
+                const float *mask = (dir == LATTICE_NORTH) ? northMask : northwestMask;
+                const int offset = (dir == LATTICE_NORTH) ? row.north : (row.north - 1);
+                for (int i = row.base; i < end; i += 4)
+                {
+                    const __m128 present = _mm_loadu_ps(&mask[i]);
+                    if (_mm_movemask_ps(present) == 0)
+                        continue;   // no springs start at these 4 sites
+
+                    __m128 sx, sy, sz;
+                    const int j = i + offset;
+                    StencilSprings(px, py, pz, i, j, present, k, rest, sx, sy, sz);
+                    _mm_storeu_ps(&fx[i], _mm_add_ps(_mm_loadu_ps(&fx[i]), sx));
+                    _mm_storeu_ps(&fy[i], _mm_add_ps(_mm_loadu_ps(&fy[i]), sy));
+                    _mm_storeu_ps(&fz[i], _mm_add_ps(_mm_loadu_ps(&fz[i]), sz));
+                    _mm_storeu_ps(&fx[j], _mm_sub_ps(_mm_loadu_ps(&fx[j]), sx));
+                    _mm_storeu_ps(&fy[j], _mm_sub_ps(_mm_loadu_ps(&fy[j]), sy));
+                    _mm_storeu_ps(&fz[j], _mm_sub_ps(_mm_loadu_ps(&fz[j]), sz));
+                }
+            }
+        }
+    }
+
+
+    void LatticeMesh::Extrapolate(float dt, const LatticeState& source, LatticeState& target) const
+    {
+        // The same calculation as ExtrapolateBall(), 4 sites at a time.
+        // Sites without a mobile ball keep their state unchanged.
+        const __m128 vdt = _mm_set1_ps(dt);
+        const __m128 halfdt = _mm_set1_ps(dt / 2.0);
+        const bool limit = (speedLimit > 0.0);
+        const __m128 vlimit = _mm_set1_ps(speedLimit);
+        const __m128 limitSquared = _mm_set1_ps(speedLimit * speedLimit);
+        for (int i = firstSite; i < endSite; i += 4)
+        {
+            const __m128 mobile = _mm_loadu_ps(&mobileMask[i]);
+            const __m128 px = _mm_loadu_ps(&source.px[i]);
+            const __m128 py = _mm_loadu_ps(&source.py[i]);
+            const __m128 pz = _mm_loadu_ps(&source.pz[i]);
+            const __m128 vx = _mm_loadu_ps(&source.vx[i]);
+            const __m128 vy = _mm_loadu_ps(&source.vy[i]);
+            const __m128 vz = _mm_loadu_ps(&source.vz[i]);
+
+            const __m128 h = _mm_div_ps(vdt, _mm_loadu_ps(&mass[i]));
+            __m128 nx = _mm_add_ps(vx, _mm_mul_ps(h, _mm_loadu_ps(&fx[i])));
+            __m128 ny = _mm_add_ps(vy, _mm_mul_ps(h, _mm_loadu_ps(&fy[i])));
+            __m128 nz = _mm_add_ps(vz, _mm_mul_ps(h, _mm_loadu_ps(&fz[i])));
+
+            if (limit)
+            {
+                const __m128 speedSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+                const __m128 tooFast = _mm_cmpgt_ps(speedSquared, limitSquared);
+                if (_mm_movemask_ps(tooFast) != 0)
+                {
+                    const __m128 slow = _mm_div_ps(vlimit, _mm_sqrt_ps(speedSquared));
+                    nx = Select(tooFast, _mm_mul_ps(nx, slow), nx);
+                    ny = Select(tooFast, _mm_mul_ps(ny, slow), ny);
+                    nz = Select(tooFast, _mm_mul_ps(nz, slow), nz);
+                }
+            }
+
+            _mm_storeu_ps(&target.vx[i], Select(mobile, nx, vx));
+            _mm_storeu_ps(&target.vy[i], Select(mobile, ny, vy));
+            _mm_storeu_ps(&target.vz[i], Select(mobile, nz, vz));
+            _mm_storeu_ps(&target.px[i], Select(mobile, _mm_add_ps(px, _mm_mul_ps(halfdt, _mm_add_ps(vx, nx))), px));
+            _mm_storeu_ps(&target.py[i], Select(mobile, _mm_add_ps(py, _mm_mul_ps(halfdt, _mm_add_ps(vy, ny))), py));
+            _mm_storeu_ps(&target.pz[i], Select(mobile, _mm_add_ps(pz, _mm_mul_ps(halfdt, _mm_add_ps(vz, nz))), pz));
+        }
+    }
+
+
+    void LatticeMesh::Update(float dt, float halflife)
+    {
+        const float damp = MeshDampingFactor(dt, halflife);
+        for (int i = firstSite; i < endSite; ++i)
+        {
+            curr.vx[i] *= damp;
+            curr.vy[i] *= damp;
+            curr.vz[i] *= damp;
+        }
+
+        CalcForces(curr);
+        Extrapolate(dt / 2.0, curr, next);
+        CalcForces(next);
+        Extrapolate(dt, curr, next);
+        std::swap(curr, next);
+    }
+}
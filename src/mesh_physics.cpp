@@ -7,13 +7,71 @@
 
 namespace Sapphire
 {
-    void PhysicsMesh::Clear()
+    const MeshTopology& PhysicsMesh::EmptyTopology()
     {
-        springList.clear();
+        static const MeshTopology empty;
+        return empty;
+    }
+
+
+    void PhysicsMesh::Attach(const MeshTopology& _topology)
+    {
+        topology = &_topology;
+
+        // Clearing a vector keeps its storage, so re-attaching
+        // the same topology (reset, preset load) never allocates.
+        // Keep only the balls that can ever move: the mobile balls and the driven anchors.
+        const int nballs = topology->NumBalls();
+        slotList.clear();
+        liveList.clear();
         currBallList.clear();
-        nextBallList.clear();
-        originalPositions.clear();
-        forceList.clear();
+        for (int i = 0; i < nballs; ++i)
+        {
+            const Ball& ball = topology->GetInitialBallAt(i);
+            if (ball.IsMobile() || topology->IsDriven(i))
+            {
+                slotList.push_back(static_cast<int>(liveList.size()));
+                liveList.push_back(i);
+                currBallList.push_back(ball);
+            }
+            else
+            {
+                slotList.push_back(-1);
+            }
+        }
+        nextBallList = currBallList;
+        forceList.resize(currBallList.size());
+        for (PhysicsVector& f : forceList)
+            f = PhysicsVector::zero();
+
+        // Fold each fixed anchor into the springs attached to it as a constant position.
+        // Keep the original spring order, so every ball adds up its forces in the same order.
+        // A spring between two fixed anchors can never do anything, so it is left out.
+        linkList.clear();
+        for (const Spring& spring : topology->GetSprings())
+        {
+            MeshLink link;
+            link.slot1 = slotList[spring.ballIndex1];
+            link.slot2 = slotList[spring.ballIndex2];
+            if (link.slot1 < 0)
+            {
+                if (link.slot2 < 0)
+                    continue;
+
+                // Keep the live ball first. Swapping the ends of a spring exactly negates its force,
+                // so the results do not change. (Except when the balls coincide, where the
+                // direction of the force is arbitrary anyway.)
+                link.slot1 = link.slot2;
+                link.slot2 = -1;
+                link.anchorPos = topology->GetBallOrigin(spring.ballIndex1);
+            }
+            else if (link.slot2 < 0)
+            {
+                link.anchorPos = topology->GetBallOrigin(spring.ballIndex2);
+            }
+            linkList.push_back(link);
+        }
+
         gravity = PhysicsVector::zero();
         magnet = PhysicsVector::zero();
         stiffness  = MESH_DEFAULT_STIFFNESS;
@@ -24,52 +82,96 @@ namespace Sapphire
 
     void PhysicsMesh::Quiet()
     {
-        const size_t nballs = currBallList.size();
-        assert(nballs == originalPositions.size());
-        for (size_t i = 0; i < nballs; ++i)
+        const size_t nlive = currBallList.size();
+        for (size_t slot = 0; slot < nlive; ++slot)
         {
-            currBallList[i].pos = originalPositions.at(i);
-            currBallList[i].vel = PhysicsVector::zero();
+            currBallList[slot].pos = topology->GetBallOrigin(liveList[slot]);
+            currBallList[slot].vel = PhysicsVector::zero();
         }
     }
 
 
-    void PhysicsMesh::SetStiffness(float _stiffness)
+    const Ball& PhysicsMesh::GetBallAt(int index) const
     {
-        stiffness = std::max(0.0f, _stiffness);      // negative values would cause impossible & unstable physics
+        // A fixed anchor never leaves where the topology put it.
+        const int slot = slotList.at(index);
+        return (slot < 0) ? topology->GetInitialBallAt(index) : currBallList[slot];
     }
 
 
-    void PhysicsMesh::SetRestLength(float _restLength)
+    float PhysicsMesh::KineticEnergy() const
     {
-        restLength = std::max(0.0f, _restLength);
+        float energy = 0.0f;
+        for (const Ball& b : currBallList)
+            if (b.IsMobile())
+                energy += 0.5f * b.mass * Dot(b.vel, b.vel);
+        return energy;
+    }
+
+
+    void PhysicsMesh::SaveState(StateWriter& writer) const
+    {
+        // Masses, springs, and original positions are part of the mesh's structure
+        // and settings, not its dynamic state, so they are not saved.
+        // Fixed anchors are saved too, so the format does not depend on which balls are live.
+        const int nballs = NumBalls();
+        writer.write(static_cast<uint32_t>(nballs));
+        for (int i = 0; i < nballs; ++i)
+        {
+            const Ball& b = GetBallAt(i);
+            writer.write(b.pos);
+            writer.write(b.vel);
+        }
     }
 
 
-    int PhysicsMesh::Add(Ball ball)
+    void PhysicsMesh::LoadState(StateReader& reader)
     {
-        int index = static_cast<int>(currBallList.size());
+        uint32_t nballs;
+        reader.read(nballs);
+        if (nballs != slotList.size())
+            throw std::runtime_error("Mesh state has the wrong number of balls.");
+
+        for (int slot : slotList)
+        {
+            PhysicsVector pos, vel;
+            reader.read(pos);
+            reader.read(vel);
+            if (slot >= 0)
+            {
+                currBallList[slot].pos = pos;
+                currBallList[slot].vel = vel;
+            }
+        }
+    }
+
 
-        // Save this ball in `ballList`.
-        currBallList.push_back(ball);
+    void PhysicsMesh::SetStiffness(float _stiffness)
+    {
+        stiffness = std::max(0.0f, _stiffness);      // negative values would cause impossible & unstable physics
+    }
 
-        // Reserve a slot in the auxiliary array `nextBallList`.
-        nextBallList.push_back(ball);
 
-        // Reserve a slot for calculating forces.
-        forceList.push_back(PhysicsVector::zero());
+    void PhysicsMesh::SetRestLength(float _restLength)
+    {
+        restLength = std::max(0.0f, _restLength);
+    }
 
-        // Remember where each ball started, so we can put it back.
-        // This also provides a way to calculate the offset of a ball from its original position.
-        originalPositions.push_back(ball.pos);
 
+    int MeshTopology::Add(Ball ball)
+    {
+        // The ball's starting position doubles as its rest position:
+        // it is where PhysicsMesh::Quiet puts the ball back,
+        // and the reference point for calculating the ball's displacement.
+        int index = static_cast<int>(initialBallList.size());
+        initialBallList.push_back(ball);
         return index;
     }
 
 
-    bool PhysicsMesh::Add(Spring spring)
+    bool MeshTopology::Add(Spring spring)
     {
-        const int nballs = static_cast<int>(currBallList.size());
+        const int nballs = static_cast<int>(initialBallList.size());
 
         if (spring.ballIndex1 < 0 || spring.ballIndex1 >= nballs)
             return false;
@@ -82,6 +184,23 @@ namespace Sapphire
     }
 
 
+    bool MeshTopology::MarkDriven(int ballIndex)
+    {
+        if (ballIndex < 0 || ballIndex >= NumBalls())
+            return false;
+
+        if (!IsDriven(ballIndex))
+            drivenList.push_back(ballIndex);
+        return true;
+    }
+
+
+    bool MeshTopology::IsDriven(int ballIndex) const
+    {
+        return std::find(drivenList.begin(), drivenList.end(), ballIndex) != drivenList.end();
+    }
+
+
     void PhysicsMesh::CalcForces(
         BallList& blist,
         PhysicsVectorList& forceList)
@@ -94,39 +213,35 @@ namespace Sapphire
 
         // Calculate the force caused on balls by the tension in each spring.
         // Add equal and opposite force vectors to the pair of attached balls.
-        PhysicsVector force;
-        for (const Spring& spring : springList)
+        // A fixed anchor feels no force, so only the live ball at the other end needs updating.
+        for (const MeshLink& link : linkList)
         {
-            // dr = vector from ball 1 toward ball 2.
-            const Ball& b1 = blist[spring.ballIndex1];
-            const Ball& b2 = blist[spring.ballIndex2];
-            PhysicsVector dr = b2.pos - b1.pos;
-            float dist = Magnitude(dr);   // length of the spring
-            float attractiveForce = stiffness * (dist - restLength);
-            if (dist < 1.0e-9)
+            const Ball& b1 = blist[link.slot1];
+            if (link.slot2 < 0)
             {
-                // Think of this like two bullets hitting each other in a gunfight:
-                // it should almost never happen.
-                // The balls are so close together, it's hard to tell which direction the force should go.
-                // We also risk dividing by zero.
-                // It's a little weird/chaotic, but pick an arbitrary tension direction.
-                force = PhysicsVector(0.f, 0.f, -attractiveForce, 0.f);
+                if (b1.IsMobile())
+                {
+                    PhysicsVector force = SpringForce(b1.pos, link.anchorPos, stiffness, restLength);
+                    forceList[link.slot1] += force;
+                    forceList[link.slot1] += Cross(b1.vel, magnet);
+                }
             }
             else
             {
-                force = (attractiveForce / dist) * dr;
-            }
+                const Ball& b2 = blist[link.slot2];
+                PhysicsVector force = SpringForce(b1.pos, b2.pos, stiffness, restLength);
 
-            if (b1.IsMobile())
-            {
-                forceList[spring.ballIndex1] += force;
-                forceList[spring.ballIndex1] += Cross(b1.vel, magnet);
-            }
+                if (b1.IsMobile())
+                {
+                    forceList[link.slot1] += force;
+                    forceList[link.slot1] += Cross(b1.vel, magnet);
+                }
 
-            if (b2.IsMobile())
-            {
-                forceList[spring.ballIndex2] -= force;
-                forceList[spring.ballIndex2] += Cross(b2.vel, magnet);
+                if (b2.IsMobile())
+                {
+                    forceList[link.slot2] -= force;
+                    forceList[link.slot2] += Cross(b2.vel, magnet);
+                }
             }
         }
     }
@@ -134,8 +249,7 @@ namespace Sapphire
 
     void PhysicsMesh::Dampen(BallList& blist, float dt, float halflife)
     {
-        // damp^(frictionHalfLife/dt) = 0.5.
-        const float damp = pow(0.5, dt/halflife);
+        const float damp = MeshDampingFactor(dt, halflife);
         for (Ball& b : blist)
             b.vel *= damp;
     }
@@ -148,37 +262,9 @@ namespace Sapphire
         const BallList& sourceList,
         BallList& targetList)
     {
-        const float speedLimitSquared = speedLimit * speedLimit;
         const int nballs = static_cast<int>(sourceList.size());
         for (int i = 0; i < nballs; ++i)
-        {
-            const Ball& curr = sourceList[i];
-            Ball& next = targetList[i];
-            if (curr.IsAnchor())
-            {
-                // This is an "anchor" that never moves, not a normal ball.
-                next = curr;
-            }
-            else
-            {
-                // It is possible for the caller to modify a ball's mass.
-                // Make sure we keep masses in sync.
-                next.mass = curr.mass;
-
-                // Update the velocity vector from `curr` into `next`.
-                next.vel = curr.vel + ((dt / curr.mass) * forceList[i]);
-
-                if (speedLimit > 0.0)
-                {
-                    float speedSquared = Dot(next.vel, next.vel);
-                    if (speedSquared > speedLimitSquared)
-                        next.vel *= speedLimit / sqrt(speedSquared);
-                }
-
-                // Estimate the next position based on the average speed over the time increment.
-                next.pos = curr.pos + ((dt / 2.0) * (curr.vel + next.vel));
-            }
-        }
+            ExtrapolateBall(dt, speedLimit, forceList[i], sourceList[i], targetList[i]);
     }
 
 
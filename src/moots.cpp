@@ -60,6 +60,9 @@ struct Moots : Module
 
     bool isGateActive[NUM_CONTROLLERS];
     Sapphire::Slewer slewer[NUM_CONTROLLERS];
+    Sapphire::SettingSlot<bool> slewEnabled[NUM_CONTROLLERS];   // anti-click checkboxes, written by the UI thread
+    uint32_t slewVersion[NUM_CONTROLLERS];                      // versions of the checkboxes most recently applied
+    int settingsCountdown = 0;
 
     Moots()
     {
@@ -96,7 +99,10 @@ struct Moots : Module
         {
             isGateActive[i] = false;
             slewer[i].reset();
+            slewEnabled[i].set(false);
+            slewVersion[i] = 0;
         }
+        settingsCountdown = 0;
     }
 
     void onReset(const ResetEvent& e) override
@@ -115,9 +121,31 @@ struct Moots : Module
             slewer[i].setRampLength(newRampLength);
     }
 
+    void applySettings()
+    {
+        // Pick up any anti-click checkbox changes the UI thread made since the last block.
+        if (--settingsCountdown > 0)
+            return;
+        settingsCountdown = SETTINGS_POLL_SAMPLES;
+
+        for (int i = 0; i < NUM_CONTROLLERS; ++i)
+        {
+            bool enable;
+            if (slewEnabled[i].poll(slewVersion[i], enable) && enable != slewer[i].isEnabled())
+            {
+                if (enable)
+                    slewer[i].enable(isGateActive[i]);
+                else
+                    slewer[i].reset();
+            }
+        }
+    }
+
     void process(const ProcessArgs& args) override
     {
-        float volts[PORT_MAX_CHANNELS];
+        SAPPHIRE_REALTIME_SCOPE();
+
+        applySettings();
 
         for (int i = 0; i < NUM_CONTROLLERS; ++i)
         {
@@ -159,10 +187,11 @@ struct Moots : Module
             if (slewer[i].update(isGateActive[i]))
             {
                 auto & inp = inputs[INAUDIO1_INPUT + i];
-                inp.readVoltages(volts);
-                outp.channels = inp.getChannels();
-                slewer[i].process(volts, outp.channels);
-                outp.writeVoltages(volts);
+                const int channels = inp.getChannels();
+                outp.channels = channels;
+                // Pass the input straight through, then let the slewer scale it while ramping.
+                outp.writeVoltages(inp.getVoltages());
+                slewer[i].process(outp.getVoltages(), channels);
             }
             else
             {
@@ -178,7 +207,7 @@ struct Moots : Module
         json_t* flagList = json_array();
 
         for (int i = 0; i < NUM_CONTROLLERS; ++i)
-            json_array_append_new(flagList, json_boolean(slewer[i].isEnabled()));
+            json_array_append_new(flagList, json_boolean(slewEnabled[i].get()));
 
         json_object_set_new(root, "slew", flagList);
         return root;
@@ -194,13 +223,7 @@ struct Moots : Module
             {
                 json_t *flag = json_array_get(flagList, i);
                 if (json_is_boolean(flag))
-                {
-                    bool enable = json_boolean_value(flag);
-                    if (enable)
-                        slewer[i].enable(false);
-                    else
-                        slewer[i].reset();
-                }
+                    slewEnabled[i].set(json_boolean_value(flag));
             }
         }
     }
@@ -221,6 +244,7 @@ struct Moots : Module
 };
 
 
+#ifndef NO_RACK_DEPENDENCY
 struct MootsWidget : ModuleWidget
 {
     Moots* mootsModule;
@@ -269,15 +293,11 @@ struct MootsWidget : ModuleWidget
                 "",
                 [=]()
                 {
-                    return mootsModule->slewer[i].isEnabled();
+                    return mootsModule->slewEnabled[i].get();
                 },
                 [=](bool state)
                 {
-                    Sapphire::Slewer& s = mootsModule->slewer[i];
-                    if (state)
-                        s.enable(mootsModule->isGateActive[i]);
-                    else
-                        s.reset();
+                    mootsModule->slewEnabled[i].set(state);
                 }
             );
 
@@ -285,6 +305,9 @@ struct MootsWidget : ModuleWidget
         }
     }
 };
+#else
+struct MootsWidget;         // headless builds have no user interface
+#endif
 
 
 Model* modelMoots = createModel<Moots, MootsWidget>("Moots");
@@ -1,5 +1,14 @@
 #pragma once
+#include <chrono>
+#include <ctime>
+#ifdef NO_RACK_DEPENDENCY
+#include "rack_shim.hpp"        // headless builds for tests and benchmarks: see util/include
+#else
 #include <rack.hpp>
+#endif
+#include "sapphire_engine.hpp"
+#include "sapphire_handoff.hpp"
+#include "sapphire_capture.hpp"
 
 // Sapphire for VCV Rack 2, by Don Cross <cosinekitty@gmail.com>
 // https://github.com/cosinekitty/sapphire
@@ -58,6 +67,7 @@ struct SapphireControlGroup     // represents the combination: knob + CV input +
     {}
 };
 
+#ifndef NO_RACK_DEPENDENCY
 // Custom controls for Sapphire modules.
 
 struct SapphirePort : app::SvgPort
@@ -67,12 +77,110 @@ struct SapphirePort : app::SvgPort
         setSvg(Svg::load(asset::plugin(pluginInstance, "res/port.svg")));
     }
 };
+#endif
+
+
+// Number of samples between checks for menu setting changes in a module's process().
+const int SETTINGS_POLL_SAMPLES = 64;
+
+
+// Number of samples in each telemetry frame a module publishes for its widgets.
+const int TELEMETRY_FRAME_SAMPLES = 256;
+
+
+#ifndef NO_RACK_DEPENDENCY
+// Adds an item to a module's context menu that starts or stops capturing its session.
+// Traces go into the Sapphire/capture folder of the Rack user directory,
+// and can be replayed outside of Rack with util/cmdline/replay.
+inline void AddSessionCaptureMenuItem(Menu* menu, Sapphire::SessionCapture* capture, const std::string& slug, int numParams, int numInputs, int numOutputs)
+{
+    if (capture->isActive())
+    {
+        menu->addChild(createMenuItem("Stop session capture", "", [=]{
+            if (!capture->stop())
+                WARN("Session capture for %s is incomplete: the disk could not keep up.", slug.c_str());
+        }));
+        return;
+    }
+
+    menu->addChild(createMenuItem("Start session capture", "", [=]{
+        std::string dir = asset::user("Sapphire/capture");
+        system::createDirectories(dir);
+        char stamp[32];
+        std::time_t now = std::time(nullptr);
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&now));
+        std::string filename = system::join(dir, slug + "-" + stamp + ".sapc");
+        try
+        {
+            capture->start(filename, slug, numParams, numInputs, numOutputs);
+            INFO("Capturing %s session into %s", slug.c_str(), filename.c_str());
+        }
+        catch (const std::exception& e)
+        {
+            WARN("%s", e.what());
+        }
+    }));
+}
+#endif
+
+
+// Publishes a module's engine telemetry at control rate.
+// The audio thread calls begin() at the top of process() and end() at the bottom.
+// Once per frame, end() returns a cleared frame for the module to fill from its
+// engines before calling publish(). Widgets on the UI thread call read().
+// To keep timing overhead low, the CPU load is estimated by timing the
+// first process() call of each frame.
+class TelemetryPublisher
+{
+private:
+    Sapphire::TripleBuffer<Sapphire::EngineTelemetry> buffer;
+    std::chrono::steady_clock::time_point startTime;
+    int position = 0;
+    uint32_t sequence = 0;
+    float cpuLoad = 0.0f;
+
+public:
+    void begin()
+    {
+        if (position == 0)
+            startTime = std::chrono::steady_clock::now();
+    }
+
+    Sapphire::EngineTelemetry* end(float sampleRate)
+    {
+        if (position == 0)
+        {
+            std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - startTime;
+            cpuLoad = elapsed.count() * sampleRate;
+        }
+
+        if (++position < TELEMETRY_FRAME_SAMPLES)
+            return nullptr;
+
+        position = 0;
+        Sapphire::EngineTelemetry& frame = buffer.writeBuffer();
+        frame = Sapphire::EngineTelemetry();
+        frame.sequence = ++sequence;
+        frame.cpuLoad = cpuLoad;
+        return &frame;
+    }
+
+    void publish()
+    {
+        buffer.publish();
+    }
+
+    const Sapphire::EngineTelemetry& read()
+    {
+        return buffer.read();
+    }
+};
 
 
 struct SapphireQuantity : ParamQuantity
 {
-    float value = 0.0f;
-    bool changed = true;
+    // The menu slider writes from the UI thread; process() polls for changes once per block.
+    Sapphire::SettingSlot<float> setting {0.0f};
 
     SapphireQuantity()
     {
@@ -82,14 +190,11 @@ struct SapphireQuantity : ParamQuantity
     void setValue(float newValue) override
     {
         float clamped = math::clamp(newValue, getMinValue(), getMaxValue());
-        if (clamped != value)
-        {
-            changed = true;
-            value = clamped;
-        }
+        if (clamped != setting.get())
+            setting.set(clamped);
     }
 
-    float getValue() override { return value; }
+    float getValue() override { return setting.get(); }
 
     void setDisplayValue(float displayValue) override { setValue(displayValue); }
 };
@@ -104,11 +209,12 @@ struct DcRejectQuantity : SapphireQuantity
 {
     std::string getDisplayValueString() override
     {
-        return string::f("%i", (int)(math::normalizeZero(value) + 0.5f));
+        return string::f("%i", (int)(math::normalizeZero(setting.get()) + 0.5f));
     }
 };
 
 
+#ifndef NO_RACK_DEPENDENCY
 struct DcRejectSlider : ui::Slider
 {
     explicit DcRejectSlider(DcRejectQuantity *_quantity)
@@ -117,6 +223,7 @@ struct DcRejectSlider : ui::Slider
         box.size.x = 200.0f;        // without this, the menu display gets messed up
     }
 };
+#endif
 
 
 const float AGC_LEVEL_MIN = 5.0f;
@@ -128,8 +235,11 @@ const float AGC_DISABLE_MAX = 10.2f;
 
 struct AgcLevelQuantity : SapphireQuantity
 {
-    bool isAgcEnabled() const { return value < AGC_DISABLE_MIN; }
-    float clampedAgc() const { return clamp(value, AGC_LEVEL_MIN, AGC_LEVEL_MAX); }
+    static bool IsAgcEnabled(float level) { return level < AGC_DISABLE_MIN; }
+    static float ClampedAgc(float level) { return clamp(level, AGC_LEVEL_MIN, AGC_LEVEL_MAX); }
+
+    bool isAgcEnabled() const { return IsAgcEnabled(setting.get()); }
+    float clampedAgc() const { return ClampedAgc(setting.get()); }
 
     std::string getDisplayValueString() override
     {
@@ -138,6 +248,7 @@ struct AgcLevelQuantity : SapphireQuantity
 };
 
 
+#ifndef NO_RACK_DEPENDENCY
 struct AgcLevelSlider : ui::Slider
 {
     explicit AgcLevelSlider(AgcLevelQuantity *_quantity)
@@ -184,3 +295,4 @@ struct SapphireSvgOverlay : Widget
         Widget::step();
     }
 };
+#endif  // NO_RACK_DEPENDENCY
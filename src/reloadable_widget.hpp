@@ -9,27 +9,319 @@
     This allows for a much faster development cycle where
     the design can be updated iteratively without restarting
     VCV Rack or rebuilding your C++ code.
+
+    Automatic reloading is handled by one background thread shared by
+    every module instance. On Linux it sleeps until inotify reports
+    that a watched SVG file was written; elsewhere it checks each
+    file's modification time once per second. A changed file is parsed
+    once, off the UI thread, and every widget using that file picks up
+    the result on its next step() through an atomic pointer swap.
 */
 
 #pragma once
 #include <rack.hpp>
-#include <string>
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#define SAPPHIRE_SVG_WATCH_INOTIFY 1
+#else
+#define SAPPHIRE_SVG_WATCH_INOTIFY 0
+#endif
+
 namespace rack
 {
+    // One parse of a panel SVG file, shared by every widget showing that file.
+    class SvgRevision
+    {
+    private:
+        std::atomic<NSVGimage*> image;
+
+    public:
+        const int number;
+        const std::map<std::string, Vec> positions;     // center of each shape, keyed by SVG id
+
+        SvgRevision(int _number, NSVGimage* _image, std::map<std::string, Vec> _positions)
+            : image(_image)
+            , number(_number)
+            , positions(std::move(_positions))
+            {}
+
+        ~SvgRevision()
+        {
+            NSVGimage* unclaimed = image.exchange(nullptr);
+            if (unclaimed != nullptr)
+                nsvgDelete(unclaimed);
+        }
+
+        NSVGimage* claimImage()
+        {
+            // VCV Rack caches panel SVGs by file name, so all instances share one window::Svg.
+            // The first widget to see this revision takes ownership of the parsed image
+            // and installs it there; everyone else gets nullptr.
+            return image.exchange(nullptr);
+        }
+    };
+
+
+    class SvgReloadWatcher
+    {
+    public:
+        struct WatchedFile
+        {
+            int subscribers = 0;
+            int revisionCount = 0;
+            std::pair<time_t, off_t> stamp;         // modification time and size, for the polling fallback
+            std::shared_ptr<SvgRevision> latest;    // read and written only with std::atomic_load/store
+        };
+
+    private:
+        std::mutex mutex;       // guards the tables below; never touched by the audio thread
+        std::map<std::string, std::shared_ptr<WatchedFile>> files;
+        std::map<int, std::string> watchedDirs;     // inotify watch descriptor => directory
+        std::thread worker;
+        std::condition_variable wake;
+        bool stopRequested = false;
+        int inotifyFd = -1;
+        int wakeFd = -1;
+
+        static std::string DirectoryOf(const std::string& fileName)
+        {
+            size_t slash = fileName.find_last_of('/');
+            return (slash == std::string::npos) ? std::string(".") : fileName.substr(0, slash);
+        }
+
+        static std::pair<time_t, off_t> Stamp(const std::string& fileName)
+        {
+            // POSIX only promises whole seconds for the modification time,
+            // so also compare sizes to catch quick successive saves.
+            struct stat statBuf;
+            if (0 != stat(fileName.c_str(), &statBuf))
+                return std::make_pair(time_t(0), off_t(0));
+            return std::make_pair(statBuf.st_mtime, statBuf.st_size);
+        }
+
+        void parse(const std::string& fileName)
+        {
+            // Runs on the watcher thread. Parse first, without holding the lock,
+            // so subscribing widgets on the UI thread never wait for the parser.
+            NSVGimage* image = nsvgParseFromFile(fileName.c_str(), "px", SVG_DPI);
+            if (image == nullptr)
+            {
+                // Likely a half-written file. Keep the current panel; the next write will trigger another try.
+                WARN("Cannot load/parse SVG file [%s]", fileName.c_str());
+                return;
+            }
+
+            std::map<std::string, Vec> positions;
+            for (NSVGshape* shape = image->shapes; shape != nullptr; shape = shape->next)
+                positions[shape->id] = Vec{(shape->bounds[0] + shape->bounds[2]) / 2, (shape->bounds[1] + shape->bounds[3]) / 2};
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto search = files.find(fileName);
+            if (search == files.end())
+            {
+                nsvgDelete(image);      // every widget unsubscribed while we were parsing
+                return;
+            }
+
+            WatchedFile& file = *search->second;
+            auto revision = std::make_shared<SvgRevision>(++file.revisionCount, image, std::move(positions));
+            std::atomic_store(&file.latest, revision);
+        }
+
+        void run()
+        {
+#if SAPPHIRE_SVG_WATCH_INOTIFY
+            if (inotifyFd >= 0)
+            {
+                alignas(struct inotify_event) char buffer[4096];
+                while (true)
+                {
+                    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+                    if (poll(fds, 2, -1) < 0)
+                        continue;
+
+                    if (fds[1].revents & POLLIN)
+                        break;      // stop()
+
+                    ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+                    for (ssize_t offset = 0; offset < length; )
+                    {
+                        const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                        offset += sizeof(struct inotify_event) + event->len;
+                        if (event->len == 0)
+                            continue;
+
+                        std::string fileName;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            auto dir = watchedDirs.find(event->wd);
+                            if (dir == watchedDirs.end())
+                                continue;
+                            fileName = dir->second + "/" + event->name;
+                            if (files.find(fileName) == files.end())
+                                continue;   // some other file in the same directory
+                        }
+                        parse(fileName);
+                    }
+                }
+                return;
+            }
+#endif
+            // Without inotify, check modification times once per second, still off the UI thread.
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, std::chrono::seconds(1), [this]{ return stopRequested; }))
+            {
+                std::vector<std::string> changed;
+                for (auto& entry : files)
+                {
+                    std::pair<time_t, off_t> stamp = Stamp(entry.first);
+                    if (stamp.first != 0 && stamp != entry.second->stamp)
+                    {
+                        entry.second->stamp = stamp;
+                        changed.push_back(entry.first);
+                    }
+                }
+
+                lock.unlock();
+                for (const std::string& fileName : changed)
+                    parse(fileName);
+                lock.lock();
+            }
+        }
+
+        void start()
+        {
+            // Called with the lock held, when the first file is subscribed.
+            stopRequested = false;
+#if SAPPHIRE_SVG_WATCH_INOTIFY
+            inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            wakeFd = eventfd(0, EFD_CLOEXEC);
+            if (inotifyFd < 0 || wakeFd < 0)
+            {
+                WARN("Cannot start inotify; falling back to polling SVG files once per second.");
+                closeDescriptors();
+            }
+#endif
+            worker = std::thread(&SvgReloadWatcher::run, this);
+        }
+
+        void stop(std::unique_lock<std::mutex>& lock)
+        {
+            // Called with the lock held, when the last file is unsubscribed.
+            stopRequested = true;
+            wake.notify_all();
+#if SAPPHIRE_SVG_WATCH_INOTIFY
+            if (wakeFd >= 0)
+            {
+                uint64_t one = 1;
+                ssize_t ignored = write(wakeFd, &one, sizeof(one));
+                (void)ignored;
+            }
+#endif
+            std::thread finished = std::move(worker);
+            lock.unlock();      // the worker may need the lock to finish what it is doing
+            finished.join();
+            lock.lock();
+            closeDescriptors();
+            watchedDirs.clear();
+        }
+
+        void closeDescriptors()
+        {
+            if (inotifyFd >= 0)
+                close(inotifyFd);
+            if (wakeFd >= 0)
+                close(wakeFd);
+            inotifyFd = wakeFd = -1;
+        }
+
+    public:
+        ~SvgReloadWatcher()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (worker.joinable())
+                stop(lock);
+        }
+
+        static SvgReloadWatcher& Instance()
+        {
+            static SvgReloadWatcher watcher;
+            return watcher;
+        }
+
+        std::shared_ptr<const WatchedFile> subscribe(const std::string& fileName)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::shared_ptr<WatchedFile>& file = files[fileName];
+            if (file == nullptr)
+            {
+                file = std::make_shared<WatchedFile>();
+                file->stamp = Stamp(fileName);
+                if (!worker.joinable())
+                    start();
+#if SAPPHIRE_SVG_WATCH_INOTIFY
+                if (inotifyFd >= 0)
+                {
+                    // Watch the directory, not the file: many editors save by
+                    // writing a new file and renaming it over the old one.
+                    std::string dir = DirectoryOf(fileName);
+                    int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+                    if (wd >= 0)
+                        watchedDirs[wd] = dir;
+                    else
+                        WARN("Cannot watch directory [%s] for SVG changes.", dir.c_str());
+                }
+#endif
+            }
+            ++file->subscribers;
+            return file;
+        }
+
+        void unsubscribe(const std::string& fileName)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto search = files.find(fileName);
+            if (search == files.end())
+                return;
+
+            if (--search->second->subscribers == 0)
+            {
+                files.erase(search);
+                if (files.empty() && worker.joinable())
+                    stop(lock);
+            }
+        }
+
+        static std::shared_ptr<SvgRevision> Latest(const std::shared_ptr<const WatchedFile>& file)
+        {
+            // Lock-free: called by every subscribed widget on every frame.
+            return std::atomic_load(&file->latest);
+        }
+    };
+
+
     struct ReloadableModuleWidget : ModuleWidget
     {
         std::string svgFileName;
         std::map<std::string, Widget*> svgWidgetMap;
         app::SvgPanel* svgPanel = nullptr;
         bool isReloadEnabled = false;
-        bool isPollingEnabled = false;
-        double prevPollTime = 0.0;
-        struct stat prevStatBuf {};
+        std::shared_ptr<const SvgReloadWatcher::WatchedFile> watchedFile;   // non-null while polling is enabled
+        int appliedRevision = 0;
 
         explicit ReloadableModuleWidget(const std::string& panelSvgFileName)
             : svgFileName(panelSvgFileName)
@@ -38,6 +330,11 @@ namespace rack
             isReloadEnabled = (0 == access(flagFileName.c_str(), F_OK));
         }
 
+        ~ReloadableModuleWidget()
+        {
+            setPolling(false);
+        }
+
         void reloadPanel()
         {
             if (svgPanel == nullptr)
@@ -95,11 +392,70 @@ namespace rack
             }
         }
 
+        void applyRevision(SvgRevision& revision)
+        {
+            // Install a panel image the watcher thread already parsed.
+            // Only the first widget to see a revision has work to do on the shared SVG;
+            // every widget moves its own controls.
+            NSVGimage* image = revision.claimImage();
+            if (image != nullptr)
+            {
+                if (svgPanel && svgPanel->svg)
+                {
+                    if (svgPanel->svg->handle)
+                        nsvgDelete(svgPanel->svg->handle);
+                    svgPanel->svg->handle = image;
+                }
+                else
+                {
+                    nsvgDelete(image);
+                }
+            }
+
+            for (const auto& entry : svgWidgetMap)
+            {
+                auto search = revision.positions.find(entry.first);
+                if (search != revision.positions.end())
+                    reposition(entry.second, search->second);
+            }
+
+            if (svgPanel && svgPanel->fb)
+                svgPanel->fb->dirty = true;
+
+            appliedRevision = revision.number;
+        }
+
         void reposition(Widget* widget, NSVGshape* shape)
         {
             float x = (shape->bounds[0] + shape->bounds[2]) / 2;
             float y = (shape->bounds[1] + shape->bounds[3]) / 2;
-            widget->box.pos = Vec{x, y}.minus(widget->box.size.div(2));
+            reposition(widget, Vec{x, y});
+        }
+
+        void reposition(Widget* widget, Vec center)
+        {
+            widget->box.pos = center.minus(widget->box.size.div(2));
+        }
+
+        bool isPolling() const
+        {
+            return watchedFile != nullptr;
+        }
+
+        void setPolling(bool enable)
+        {
+            if (enable && !watchedFile)
+            {
+                watchedFile = SvgReloadWatcher::Instance().subscribe(svgFileName);
+                // Ignore revisions parsed before this widget subscribed; they are already on screen.
+                std::shared_ptr<SvgRevision> latest = SvgReloadWatcher::Latest(watchedFile);
+                appliedRevision = latest ? latest->number : 0;
+            }
+            else if (!enable && watchedFile)
+            {
+                watchedFile.reset();
+                SvgReloadWatcher::Instance().unsubscribe(svgFileName);
+            }
         }
 
         void addReloadableParam(ParamWidget* param, const std::string& svgid)
@@ -139,7 +495,12 @@ namespace rack
             {
                 menu->addChild(new MenuSeparator);
                 menu->addChild(createMenuItem("Reload panel now", "F5", [this]{ reloadPanel(); }));
-                menu->addChild(createBoolPtrMenuItem<bool>("Poll SVG for reload", "", &isPollingEnabled));
+                menu->addChild(createBoolMenuItem(
+                    "Poll SVG for reload",
+                    "",
+                    [this]{ return isPolling(); },
+                    [this](bool state){ setPolling(state); }
+                ));
             }
         }
 
@@ -157,28 +518,12 @@ namespace rack
         void step() override
         {
             ModuleWidget::step();
-            if (isPollingEnabled)
+            if (watchedFile)
             {
-                // Check the SVG file's last-modification-time once per second.
-                double now = system::getTime();
-                double elapsed = now - prevPollTime;
-                if (elapsed >= 1.0)
-                {
-                    prevPollTime = now;
-                    struct stat statBuf;
-                    if (0 == stat(svgFileName.c_str(), &statBuf))
-                    {
-                        // Has the SVG file's modification time changed?
-                        // For maximum source portability, check the POSIX-required seconds field only.
-                        // We aren't polling more than once per second, and realistically,
-                        // the SVG file isn't changing more than once per second either.
-                        if (0 != memcmp(&statBuf.st_mtime, &prevStatBuf.st_mtime, sizeof(statBuf.st_mtime)))
-                        {
-                            prevStatBuf = statBuf;
-                            reloadPanel();
-                        }
-                    }
-                }
+                // Cheap when nothing changed: one atomic load, no system calls.
+                std::shared_ptr<SvgRevision> latest = SvgReloadWatcher::Latest(watchedFile);
+                if (latest && latest->number != appliedRevision)
+                    applyRevision(*latest);
             }
         }
     };
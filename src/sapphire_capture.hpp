@@ -0,0 +1,778 @@
+#ifndef __COSINEKITTY_SAPPHIRE_CAPTURE_HPP
+#define __COSINEKITTY_SAPPHIRE_CAPTURE_HPP
+
+// Sapphire session capture, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+//
+// A module can record everything that reaches its process() function while it
+// runs inside VCV Rack: parameter values, input voltages, the menu settings it
+// applies, sample rate changes and resets, along with the output voltages it
+// produced. Feeding the trace back through the same module code outside of Rack
+// reproduces the session bit for bit, so real patches can be profiled and
+// used as regression tests. See util/include/session_replay.hpp.
+//
+// A capture may start in the middle of a session. The first records then hold
+// a snapshot of the module's dynamic state, so the replay starts exactly where
+// the capture did.
+//
+// Trace layout: a header, then a stream of records, each starting with a tag byte.
+//
+//      uint32  magic       'SAPC'
+//      uint32  version
+//      varint  length of the module's slug, followed by its characters
+//      varint  parameter count, input count, output count
+//
+// Each process() call is one Frame record. A frame is stored as the 32-bit words
+// that changed since the previous frame: every parameter value, and for each port,
+// its channel count followed by the voltage of each active channel.
+// A changed word is XORed with its previous value and stored as one header byte
+// followed by the nonzero bytes of the XOR. The low nibble of the header says which
+// of the four bytes follow; the high nibble counts the unchanged words skipped
+// since the previous change (15 means a varint with the rest of the count follows).
+// A header byte of zero ends the frame. Knobs and CV that sit still cost nothing,
+// and consecutive frames where nothing changed at all share one Idle record.
+//
+// As with engine state blobs, values are stored in the native byte order.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sapphire_state.hpp"
+
+namespace Sapphire
+{
+    const uint32_t CaptureMagic = 0x43504153;      // "SAPC" in little-endian memory order
+    const uint32_t CaptureVersion = 1;
+    const int CaptureMaxChannels = 16;
+
+    inline uint32_t CaptureSnapshotKind() { return StateTag('C', 'A', 'P', 'S'); }
+
+    enum class CaptureRecord : uint8_t
+    {
+        Frame = 1,      // one call to process()
+        Idle,           // varint: number of frames identical to the previous frame
+        SampleRate,     // float: the sample rate of the process() calls that follow
+        Reset,          // the module was reset
+        Setting,        // varint id, float value: the module applied a menu setting
+        Snapshot,       // varint length, then the module's dynamic state where the capture starts
+        End,            // uint8: 0 if the capture is complete, 1 if it stopped early
+    };
+
+
+    struct CaptureLayout    // where each parameter and port lives in a frame's array of words
+    {
+        static const int PortWords = 1 + CaptureMaxChannels;      // channel count, then voltages
+
+        int numParams = 0;
+        int numInputs = 0;
+        int numOutputs = 0;
+
+        int paramWord(int id) const { return id; }
+        int inputWord(int id) const { return numParams + id*PortWords; }
+        int outputWord(int id) const { return numParams + (numInputs + id)*PortWords; }
+        int wordCount() const { return numParams + (numInputs + numOutputs)*PortWords; }
+    };
+
+
+    class CaptureTarget;
+
+
+    inline void WriteStateBlob(StateWriter& writer, const std::vector<uint8_t>& blob)
+    {
+        // Embeds an engine's state blob inside a larger state.
+        writer.write(static_cast<uint32_t>(blob.size()));
+        writer.writeBytes(blob.data(), blob.size());
+    }
+
+    inline std::vector<uint8_t> ReadStateBlob(StateReader& reader)
+    {
+        uint32_t length;
+        reader.read(length);
+        std::vector<uint8_t> blob(length);
+        reader.readBytes(blob.data(), length);
+        return blob;
+    }
+
+
+    inline uint32_t FloatBits(float x)
+    {
+        uint32_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    inline float BitsFloat(uint32_t bits)
+    {
+        float x;
+        memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+
+
+    // One capture in progress: encodes records on the audio thread,
+    // and writes them to the trace file from a background thread.
+    // The two threads share a ring buffer allocated up front. If the disk falls
+    // so far behind that the ring fills, the capture stops and the trace is
+    // marked incomplete, rather than ever making the audio thread wait.
+    class CaptureSession
+    {
+    private:
+        static const size_t RingBytes = 1 << 22;
+
+        const CaptureLayout layout;
+        FILE *file;
+        std::vector<uint8_t> ring;
+        std::atomic<uint64_t> head {0};     // bytes committed by the audio thread
+        std::atomic<uint64_t> tail {0};     // bytes written to the file
+        std::atomic<bool> finished {false};
+        bool writeFailed = false;
+        std::thread thread;
+
+        // Owned by the audio thread.
+        std::vector<uint32_t> previous;     // every word of the most recent frame
+        std::vector<uint8_t> record;        // room for the largest possible record
+        std::vector<uint8_t> snapshotBuffer;
+        std::vector<uint8_t> scratch;
+        uint32_t idleFrames = 0;
+        float sampleRate = 0.0f;
+        bool started = false;
+        bool overflow = false;
+
+        static void PutVarint(uint8_t*& p, uint32_t x)
+        {
+            while (x >= 0x80)
+            {
+                *p++ = static_cast<uint8_t>(x | 0x80);
+                x >>= 7;
+            }
+            *p++ = static_cast<uint8_t>(x);
+        }
+
+        static void PutWord(uint8_t*& p, uint32_t x)
+        {
+            memcpy(p, &x, sizeof(x));
+            p += sizeof(x);
+        }
+
+        bool reserve(size_t nbytes)
+        {
+            // Once a record does not fit, the capture is over: a trace with a gap could not be replayed.
+            if (!overflow && head.load(std::memory_order_relaxed) + nbytes - tail.load(std::memory_order_acquire) > ring.size())
+                overflow = true;
+            return !overflow;
+        }
+
+        void commit(const uint8_t *data, size_t nbytes)
+        {
+            if (!reserve(nbytes))
+                return;
+
+            const uint64_t h = head.load(std::memory_order_relaxed);
+            const size_t offset = static_cast<size_t>(h % ring.size());
+            const size_t first = std::min(nbytes, ring.size() - offset);
+            memcpy(&ring[offset], data, first);
+            memcpy(&ring[0], data + first, nbytes - first);
+            head.store(h + nbytes, std::memory_order_release);
+        }
+
+        void commit(const uint8_t *end)
+        {
+            commit(record.data(), static_cast<size_t>(end - record.data()));
+        }
+
+        void WriterThread()
+        {
+            for(;;)
+            {
+                const uint64_t t = tail.load(std::memory_order_relaxed);
+                const uint64_t h = head.load(std::memory_order_acquire);
+                if (h == t)
+                {
+                    if (finished.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == t)
+                        return;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+
+                const size_t offset = static_cast<size_t>(t % ring.size());
+                const size_t nbytes = static_cast<size_t>(std::min<uint64_t>(h - t, ring.size() - offset));
+                if (!writeFailed && fwrite(&ring[offset], 1, nbytes, file) != nbytes)
+                    writeFailed = true;     // keep draining the ring, so the audio thread is never stuck
+                tail.store(t + nbytes, std::memory_order_release);
+            }
+        }
+
+    public:
+        CaptureSession(const std::string& filename, const std::string& slug, const CaptureLayout& _layout)
+            : layout(_layout)
+            , file(fopen(filename.c_str(), "wb"))
+            , ring(RingBytes)
+            , previous(layout.wordCount())
+            , record(32 + slug.size() + 10*layout.wordCount())
+        {
+            if (file == nullptr)
+                throw std::runtime_error("Cannot open capture file: " + filename);
+
+            // Room for the largest engine states: Tube Unit's delay lines at their longest
+            // take about 160 KB per engine, and a module can have 16 engines.
+            snapshotBuffer.reserve(3 << 20);
+            scratch.reserve(1 << 18);
+
+            uint8_t *p = record.data();
+            PutWord(p, CaptureMagic);
+            PutWord(p, CaptureVersion);
+            PutVarint(p, static_cast<uint32_t>(slug.size()));
+            memcpy(p, slug.data(), slug.size());
+            p += slug.size();
+            PutVarint(p, static_cast<uint32_t>(layout.numParams));
+            PutVarint(p, static_cast<uint32_t>(layout.numInputs));
+            PutVarint(p, static_cast<uint32_t>(layout.numOutputs));
+            const size_t headerLength = static_cast<size_t>(p - record.data());
+            if (fwrite(record.data(), 1, headerLength, file) != headerLength)
+            {
+                fclose(file);
+                throw std::runtime_error("Cannot write capture file: " + filename);
+            }
+
+            thread = std::thread(&CaptureSession::WriterThread, this);
+        }
+
+        CaptureSession(const CaptureSession&) = delete;
+        CaptureSession& operator = (const CaptureSession&) = delete;
+
+        ~CaptureSession()
+        {
+            finish();
+        }
+
+        bool finish()
+        {
+            // Call only once the audio thread has stopped using this session.
+            // Returns true if the whole session reached the file.
+            if (file == nullptr)
+                return !overflow && !writeFailed;
+
+            flushIdle();
+            finished.store(true, std::memory_order_release);
+            if (thread.joinable())
+                thread.join();
+
+            const uint8_t end[2] = { static_cast<uint8_t>(CaptureRecord::End), static_cast<uint8_t>(overflow ? 1 : 0) };
+            if (fwrite(end, 1, sizeof(end), file) != sizeof(end))
+                writeFailed = true;
+            if (fclose(file) != 0)
+                writeFailed = true;
+            file = nullptr;
+            return !overflow && !writeFailed;
+        }
+
+        // The rest is called only from the audio thread, and never allocates.
+
+        bool isStarted() const { return started; }
+
+        void flushIdle()
+        {
+            if (idleFrames > 0)
+            {
+                uint8_t idle[8];
+                uint8_t *p = idle;
+                *p++ = static_cast<uint8_t>(CaptureRecord::Idle);
+                PutVarint(p, idleFrames);
+                idleFrames = 0;
+                commit(idle, static_cast<size_t>(p - idle));
+            }
+        }
+
+        void writeSampleRate(float rate)
+        {
+            if (rate == sampleRate)
+                return;
+            sampleRate = rate;
+            flushIdle();
+            uint8_t *p = record.data();
+            *p++ = static_cast<uint8_t>(CaptureRecord::SampleRate);
+            PutWord(p, FloatBits(rate));
+            commit(p);
+        }
+
+        void writeSnapshot(const CaptureTarget& target);
+
+        void writeSetting(int id, float value)
+        {
+            flushIdle();
+            uint8_t *p = record.data();
+            *p++ = static_cast<uint8_t>(CaptureRecord::Setting);
+            PutVarint(p, static_cast<uint32_t>(id));
+            PutWord(p, FloatBits(value));
+            commit(p);
+        }
+
+        void writeReset()
+        {
+            flushIdle();
+            const uint8_t tag = static_cast<uint8_t>(CaptureRecord::Reset);
+            commit(&tag, 1);
+        }
+
+        template <typename params_t, typename inputs_t, typename outputs_t>
+        void writeFrame(params_t& params, inputs_t& inputs, outputs_t& outputs)
+        {
+            if (overflow)
+                return;
+
+            uint8_t *p = record.data();
+            *p++ = static_cast<uint8_t>(CaptureRecord::Frame);
+            uint8_t * const first = p;
+            int lastChanged = -1;
+
+            for (int i = 0; i < layout.numParams; ++i)
+                putWord(p, lastChanged, layout.paramWord(i), FloatBits(params[i].getValue()));
+
+            for (int i = 0; i < layout.numInputs; ++i)
+                putPort(p, lastChanged, layout.inputWord(i), inputs[i]);
+
+            for (int i = 0; i < layout.numOutputs; ++i)
+                putPort(p, lastChanged, layout.outputWord(i), outputs[i]);
+
+            if (p == first)
+            {
+                ++idleFrames;
+                return;
+            }
+
+            *p++ = 0;
+            flushIdle();
+            commit(p);
+        }
+
+    private:
+        void putWord(uint8_t*& p, int& lastChanged, int index, uint32_t word)
+        {
+            const uint32_t change = word ^ previous[index];
+            if (change == 0)
+                return;
+            previous[index] = word;
+
+            const uint32_t skip = static_cast<uint32_t>(index - lastChanged - 1);
+            lastChanged = index;
+            uint8_t mask = 0;
+            for (int b = 0; b < 4; ++b)
+                if ((change >> (8*b)) & 0xff)
+                    mask |= static_cast<uint8_t>(1 << b);
+
+            *p++ = static_cast<uint8_t>(mask | (std::min<uint32_t>(skip, 15) << 4));
+            if (skip >= 15)
+                PutVarint(p, skip - 15);
+            for (int b = 0; b < 4; ++b)
+                if (mask & (1 << b))
+                    *p++ = static_cast<uint8_t>(change >> (8*b));
+        }
+
+        template <typename port_t>
+        void putPort(uint8_t*& p, int& lastChanged, int index, port_t& port)
+        {
+            const int channels = std::min(CaptureMaxChannels, port.getChannels());
+            putWord(p, lastChanged, index, static_cast<uint32_t>(channels));
+            for (int c = 0; c < channels; ++c)
+                putWord(p, lastChanged, index + 1 + c, FloatBits(port.getVoltage(c)));
+        }
+    };
+
+
+    // A module's handle for capturing its sessions.
+    // The UI thread calls start() and stop(). The audio thread brackets every
+    // call to process() with begin() and frame(), and calls reset() from onReset().
+    class SessionCapture
+    {
+    private:
+        std::unique_ptr<CaptureSession> session;        // owned by the UI thread
+        std::atomic<CaptureSession*> active {nullptr};
+        std::atomic<bool> busy {false};                 // true while the audio thread may be using `active`
+        CaptureSession *current = nullptr;              // the audio thread's copy, between begin() and frame()
+
+        CaptureSession* acquire()
+        {
+            // No capture is installed almost all of the time, and then a relaxed load
+            // is the only cost to process(). A stale non-null value is harmless,
+            // because the handshake below checks `active` again.
+            if (active.load(std::memory_order_relaxed) == nullptr)
+                return nullptr;
+
+            // The UI thread clears `active` before it checks `busy`, and we set `busy`
+            // before we read `active` again, so it can never delete a session we are using.
+            busy.store(true);
+            CaptureSession *s = active.load();
+            if (s == nullptr)
+                busy.store(false);
+            return s;
+        }
+
+        void release()
+        {
+            // Call only after acquire() returned a session.
+            busy.store(false);
+        }
+
+    public:
+        SessionCapture() {}
+        SessionCapture(const SessionCapture&) = delete;
+        SessionCapture& operator = (const SessionCapture&) = delete;
+
+        ~SessionCapture()
+        {
+            stop();
+        }
+
+        bool isActive() const
+        {
+            return session != nullptr;
+        }
+
+        void start(const std::string& filename, const std::string& slug, int numParams, int numInputs, int numOutputs)
+        {
+            // Throws std::runtime_error if the file cannot be created.
+            stop();
+            CaptureLayout layout;
+            layout.numParams = numParams;
+            layout.numInputs = numInputs;
+            layout.numOutputs = numOutputs;
+            session.reset(new CaptureSession(filename, slug, layout));
+            active.store(session.get());
+        }
+
+        bool stop()
+        {
+            // Returns true if the entire session since start() was saved.
+            if (session == nullptr)
+                return false;
+
+            // The audio thread sets `busy` only while `active` is non-null, so this wait is short.
+            active.store(nullptr);
+            while (busy.load())
+                std::this_thread::yield();
+
+            const bool complete = session->finish();
+            session.reset();
+            return complete;
+        }
+
+        bool begin(float sampleRate)
+        {
+            // Call at the top of process(). Returns true when the capture starts with this sample:
+            // the caller must then make its next poll re-apply every menu setting, and call snapshot().
+            current = acquire();
+            if (current == nullptr)
+                return false;
+            current->writeSampleRate(sampleRate);
+            return !current->isStarted();
+        }
+
+        void snapshot(const CaptureTarget& target)
+        {
+            if (current != nullptr)
+                current->writeSnapshot(target);
+        }
+
+        void setting(int id, float value)
+        {
+            if (current != nullptr && current->isStarted())
+                current->writeSetting(id, value);
+        }
+
+        template <typename params_t, typename inputs_t, typename outputs_t>
+        void frame(params_t& params, inputs_t& inputs, outputs_t& outputs)
+        {
+            // Call on every path out of process(), once the outputs have been set.
+            if (current != nullptr)
+            {
+                if (current->isStarted())
+                    current->writeFrame(params, inputs, outputs);
+                current = nullptr;
+                release();
+            }
+        }
+
+        void reset()
+        {
+            CaptureSession *s = acquire();
+            if (s != nullptr)
+            {
+                if (s->isStarted())
+                    s->writeReset();
+                release();
+            }
+        }
+    };
+
+
+    class CaptureTarget     // a module whose sessions can be captured and replayed
+    {
+    public:
+        SessionCapture capture;     // see SessionCapture for how process() must use this
+
+        virtual ~CaptureTarget() {}
+
+        // Saves or restores everything process() depends on, other than inputs, parameters,
+        // menu settings and the sample rate, which the trace records separately.
+        // `scratch` has room reserved for engine state blobs, so saving does not allocate.
+        virtual void saveCaptureState(StateWriter& writer, std::vector<uint8_t>& scratch) const = 0;
+        virtual void loadCaptureState(StateReader& reader) = 0;
+
+        // Hands a menu setting to the module, the way its context menu would.
+        virtual void replaySetting(int id, float value) = 0;
+    };
+
+
+    inline void CaptureSession::writeSnapshot(const CaptureTarget& target)
+    {
+        StateWriter writer(snapshotBuffer, CaptureSnapshotKind(), CaptureVersion);
+        target.saveCaptureState(writer, scratch);
+        writer.finish();
+
+        uint8_t *p = record.data();
+        *p++ = static_cast<uint8_t>(CaptureRecord::Snapshot);
+        PutVarint(p, static_cast<uint32_t>(snapshotBuffer.size()));
+        if (reserve(static_cast<size_t>(p - record.data()) + snapshotBuffer.size()))
+        {
+            commit(p);
+            commit(snapshotBuffer.data(), snapshotBuffer.size());
+        }
+        started = true;
+    }
+
+
+    // Decodes a trace written by SessionCapture.
+    class CaptureReader
+    {
+    private:
+        struct Truncated {};    // thrown when the file ends in the middle of something
+
+        FILE *file = nullptr;
+        std::vector<uint8_t> buffer;
+        size_t position = 0;
+        size_t length = 0;
+        std::string slug;
+        CaptureLayout layout;
+        std::vector<uint32_t> words;
+        uint32_t idleFrames = 0;
+        float rate = 0.0f;
+        int settingId = 0;
+        float settingValue = 0.0f;
+        std::vector<uint8_t> snapshotData;
+        bool complete = false;
+        bool ended = false;
+
+        uint8_t readByte()
+        {
+            if (position == length)
+            {
+                position = 0;
+                length = fread(buffer.data(), 1, buffer.size(), file);
+                if (length == 0)
+                    throw Truncated();
+            }
+            return buffer[position++];
+        }
+
+        uint32_t readVarint()
+        {
+            uint32_t x = 0;
+            for (int shift = 0; shift < 35; shift += 7)
+            {
+                const uint8_t b = readByte();
+                x |= static_cast<uint32_t>(b & 0x7f) << shift;
+                if (b < 0x80)
+                    return x;
+            }
+            throw std::runtime_error("Capture trace has an invalid number.");
+        }
+
+        uint32_t readWord()
+        {
+            uint8_t bytes[4];
+            for (int b = 0; b < 4; ++b)
+                bytes[b] = readByte();
+            uint32_t x;
+            memcpy(&x, bytes, sizeof(x));
+            return x;
+        }
+
+        void readHeader(const std::string& filename)
+        {
+            try
+            {
+                if (readWord() != CaptureMagic)
+                    throw std::runtime_error("Not a Sapphire capture file: " + filename);
+                if (readWord() != CaptureVersion)
+                    throw std::runtime_error("Capture file has an unsupported version: " + filename);
+                const uint32_t slugLength = readVarint();
+                for (uint32_t i = 0; i < slugLength; ++i)
+                    slug.push_back(static_cast<char>(readByte()));
+                layout.numParams = static_cast<int>(readVarint());
+                layout.numInputs = static_cast<int>(readVarint());
+                layout.numOutputs = static_cast<int>(readVarint());
+                words.resize(layout.wordCount());
+            }
+            catch (const Truncated&)
+            {
+                throw std::runtime_error("Capture file is truncated: " + filename);
+            }
+        }
+
+        void readFrame()
+        {
+            int index = -1;
+            for(;;)
+            {
+                const uint8_t header = readByte();
+                if (header == 0)
+                    return;
+
+                uint32_t skip = header >> 4;
+                if (skip == 15)
+                    skip += readVarint();
+                index += 1 + static_cast<int>(skip);
+                if (index >= static_cast<int>(words.size()))
+                    throw std::runtime_error("Capture trace has a frame that does not fit the module.");
+
+                uint32_t change = 0;
+                for (int b = 0; b < 4; ++b)
+                    if (header & (1 << b))
+                        change |= static_cast<uint32_t>(readByte()) << (8*b);
+                words[index] ^= change;
+            }
+        }
+
+        CaptureRecord decode()
+        {
+            const CaptureRecord tag = static_cast<CaptureRecord>(readByte());
+            switch (tag)
+            {
+            case CaptureRecord::Frame:
+                readFrame();
+                break;
+
+            case CaptureRecord::Idle:
+                idleFrames = readVarint();
+                if (idleFrames == 0)
+                    throw std::runtime_error("Capture trace has an empty idle record.");
+                --idleFrames;
+                return CaptureRecord::Frame;
+
+            case CaptureRecord::SampleRate:
+                rate = BitsFloat(readWord());
+                break;
+
+            case CaptureRecord::Reset:
+                break;
+
+            case CaptureRecord::Setting:
+                settingId = static_cast<int>(readVarint());
+                settingValue = BitsFloat(readWord());
+                break;
+
+            case CaptureRecord::Snapshot:
+                snapshotData.resize(readVarint());
+                for (uint8_t& b : snapshotData)
+                    b = readByte();
+                break;
+
+            case CaptureRecord::End:
+                complete = (readByte() == 0);
+                ended = true;
+                break;
+
+            default:
+                throw std::runtime_error("Capture trace has an unknown record type.");
+            }
+            return tag;
+        }
+
+        int channels(int word) const
+        {
+            return std::min(CaptureMaxChannels, static_cast<int>(words[word]));
+        }
+
+    public:
+        explicit CaptureReader(const std::string& filename)
+            : file(fopen(filename.c_str(), "rb"))
+            , buffer(1 << 16)
+        {
+            if (file == nullptr)
+                throw std::runtime_error("Cannot open capture file: " + filename);
+
+            try
+            {
+                readHeader(filename);
+            }
+            catch (...)
+            {
+                fclose(file);
+                throw;
+            }
+        }
+
+        CaptureReader(const CaptureReader&) = delete;
+        CaptureReader& operator = (const CaptureReader&) = delete;
+
+        ~CaptureReader()
+        {
+            fclose(file);
+        }
+
+        const std::string& moduleSlug() const { return slug; }
+        int paramCount() const { return layout.numParams; }
+        int inputCount() const { return layout.numInputs; }
+        int outputCount() const { return layout.numOutputs; }
+
+        CaptureRecord next()
+        {
+            // Decodes the next record. Each Idle record is returned as that many Frame records.
+            // A trace whose writer never finished (say, because VCV Rack crashed)
+            // ends after its last complete record, and isComplete() returns false.
+            if (idleFrames > 0)
+            {
+                --idleFrames;
+                return CaptureRecord::Frame;
+            }
+
+            if (!ended)
+            {
+                try
+                {
+                    return decode();
+                }
+                catch (const Truncated&)
+                {
+                    ended = true;
+                }
+            }
+            return CaptureRecord::End;
+        }
+
+        bool isComplete() const { return complete; }
+
+        // Details of the most recent SampleRate, Setting, and Snapshot records.
+        float sampleRate() const { return rate; }
+        int setting() const { return settingId; }
+        float settingAsFloat() const { return settingValue; }
+        const std::vector<uint8_t>& snapshot() const { return snapshotData; }
+
+        // The values of the most recent frame.
+        float param(int id) const { return BitsFloat(words[layout.paramWord(id)]); }
+        int inputChannels(int id) const { return channels(layout.inputWord(id)); }
+        float inputVoltage(int id, int c) const { return BitsFloat(words[layout.inputWord(id) + 1 + c]); }
+        int outputChannels(int id) const { return channels(layout.outputWord(id)); }
+        uint32_t outputBits(int id, int c) const { return words[layout.outputWord(id) + 1 + c]; }
+    };
+}
+
+#endif // __COSINEKITTY_SAPPHIRE_CAPTURE_HPP
@@ -7,6 +7,9 @@
 #include <vector>
 #include <stdexcept>
 
+#include "sapphire_realtime.hpp"
+#include "sapphire_state.hpp"
+
 #ifdef NO_RACK_DEPENDENCY
 /*
  * In the rack context this ifdef isn't needed; rack gives you simde for free
@@ -62,11 +65,24 @@ namespace Sapphire
         SlewState state = Disabled;
         int rampLength = 1;
         int count = 0;          // IMPORTANT: valid only when state == Ramping; must ignore otherwise
+        float gain = 1.0f;      // IMPORTANT: valid only when state == Ramping; must ignore otherwise
+
+        void updateGain()
+        {
+            // The sample rate could change at any moment,
+            // including while we are ramping.
+            // Therefore we need to make sure the ratio count/rampLength
+            // is bounded to the range [0, 1].
+            // Computed once per update(), so process() never divides.
+            gain = Clamp(static_cast<float>(count) / static_cast<float>(rampLength));
+        }
 
     public:
         void setRampLength(int newRampLength)
         {
             rampLength = std::max(1, newRampLength);
+            if (state == Ramping)
+                updateGain();
         }
 
         void reset()
@@ -85,6 +101,17 @@ namespace Sapphire
             return state != Disabled;
         }
 
+        bool isRamping() const
+        {
+            // When not ramping, an active output passes its input through unchanged.
+            return state == Ramping;
+        }
+
+        float getGain() const
+        {
+            return (state == Ramping) ? gain : 1.0f;
+        }
+
         bool update(bool active)
         {
             switch (state)
@@ -98,6 +125,7 @@ namespace Sapphire
                     // Start an upward ramp.
                     state = Ramping;
                     count = 0;
+                    updateGain();
                 }
                 break;
 
@@ -107,6 +135,7 @@ namespace Sapphire
                     // Start a downward ramp.
                     state = Ramping;
                     count = rampLength - 1;
+                    updateGain();
                 }
                 break;
 
@@ -128,6 +157,7 @@ namespace Sapphire
                     else
                         state = Off;
                 }
+                updateGain();
                 break;
 
             default:
@@ -138,26 +168,34 @@ namespace Sapphire
             return state != Off;
         }
 
-        void process(float volts[], int channels)
+        void process(float volts[], int channels) const
         {
             if (state != Ramping)
-                return;     // not ramping, so we must ignore `count`
+                return;     // not ramping, so we must ignore `gain`
 
-            if (channels < 1)
-                return;     // another short-cut to save processing time
+            // Scale 4 channels at a time, then finish any leftovers one at a time.
+            const __m128 g = _mm_set1_ps(gain);
+            int c = 0;
+            for (; c+4 <= channels; c += 4)
+                _mm_storeu_ps(&volts[c], _mm_mul_ps(g, _mm_loadu_ps(&volts[c])));
 
-            if (rampLength <= 0)
-                return;     // prevent division by zero or other weird behavior
-
-            // The sample rate could change at any moment,
-            // including while we are ramping.
-            // Therefore we need to make sure the ratio count/rampLength
-            // is bounded to the range [0, 1].
+            for (; c < channels; ++c)
+                volts[c] *= gain;
+        }
 
-            float gain = Clamp(static_cast<float>(count) / static_cast<float>(rampLength));
+        void saveState(StateWriter& writer) const
+        {
+            // The ramp length is not included: it follows the sample rate.
+            writer.write(state);
+            writer.write(count);
+            writer.write(gain);
+        }
 
-            for (int c = 0; c < channels; ++c)
-                volts[c] *= gain;
+        void loadState(StateReader& reader)
+        {
+            reader.read(state);
+            reader.read(count);
+            reader.read(gain);
         }
     };
 
@@ -254,6 +292,12 @@ namespace Sapphire
 
     using PhysicsVectorList = std::vector<PhysicsVector>;
 
+    inline float LoHiPassCoefficient(float sampleRateHz, float cutoffFrequencyHz)
+    {
+        return sampleRateHz / (M_PI * cutoffFrequencyHz);
+    }
+
+
     template <typename value_t>
     class LoHiPassFilter
     {
@@ -262,6 +306,10 @@ namespace Sapphire
         value_t xprev {};
         value_t yprev {};
         float fc {20.0f};
+        float cachedSampleRate {0.0f};
+        float cachedFc {0.0f};
+        float oneMinusC {0.0f};         // coefficients cached until the sample rate or cutoff changes
+        float onePlusC {0.0f};
 
     public:
         void Reset() { first = true; }
@@ -276,14 +324,35 @@ namespace Sapphire
             }
             else
             {
-                float c = sampleRateHz / (M_PI * fc);
-                yprev = (x + xprev - yprev*(1 - c)) / (1 + c);
+                if (sampleRateHz != cachedSampleRate || fc != cachedFc)
+                {
+                    cachedSampleRate = sampleRateHz;
+                    cachedFc = fc;
+                    float c = LoHiPassCoefficient(sampleRateHz, fc);
+                    oneMinusC = 1 - c;
+                    onePlusC = 1 + c;
+                }
+                yprev = (x + xprev - yprev*oneMinusC) / onePlusC;
             }
             xprev = x;
         }
 
         value_t HiPass() const { return xprev - yprev; }
         value_t LoPass() const { return yprev; };
+
+        void SaveState(StateWriter& writer) const
+        {
+            writer.write(first);
+            writer.write(xprev);
+            writer.write(yprev);
+        }
+
+        void LoadState(StateReader& reader)
+        {
+            reader.read(first);
+            reader.read(xprev);
+            reader.read(yprev);
+        }
     };
 
 
@@ -327,6 +396,145 @@ namespace Sapphire
             }
             return y;
         }
+
+        void SaveState(StateWriter& writer) const
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].SaveState(writer);
+        }
+
+        void LoadState(StateReader& reader)
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].LoadState(reader);
+        }
+    };
+
+
+    // A bank of 4 identical one-pole filters, one per SSE lane, sharing one cutoff frequency.
+    // Each lane produces exactly the same output as a scalar LoHiPassFilter<float> would.
+    // Use the lanes for stereo pairs, the real and imaginary parts of complex signals,
+    // or up to 4 polyphonic voices.
+    class LoHiPassFilterBank
+    {
+    private:
+        bool first {true};
+        PhysicsVector xprev;
+        PhysicsVector yprev;
+        float fc {20.0f};
+        float cachedSampleRate {0.0f};
+        float cachedFc {0.0f};
+        PhysicsVector oneMinusC;
+        PhysicsVector onePlusC;
+
+    public:
+        void Reset() { first = true; }
+        void SetCutoffFrequency(float cutoffFrequencyHz) { fc = cutoffFrequencyHz; }
+
+        void Update(const PhysicsVector& x, float sampleRateHz)
+        {
+            if (first)
+            {
+                first = false;
+                yprev = x;
+            }
+            else
+            {
+                if (sampleRateHz != cachedSampleRate || fc != cachedFc)
+                {
+                    cachedSampleRate = sampleRateHz;
+                    cachedFc = fc;
+                    float c = LoHiPassCoefficient(sampleRateHz, fc);
+                    oneMinusC = PhysicsVector(1 - c);
+                    onePlusC = PhysicsVector(1 + c);
+                }
+                yprev = PhysicsVector(_mm_div_ps((x + xprev - yprev*oneMinusC).v, onePlusC.v));
+            }
+            xprev = x;
+        }
+
+        PhysicsVector HiPass() const { return xprev - yprev; }
+        PhysicsVector LoPass() const { return yprev; }
+
+        void SaveState(StateWriter& writer) const
+        {
+            writer.write(first);
+            writer.write(xprev);
+            writer.write(yprev);
+        }
+
+        void LoadState(StateReader& reader)
+        {
+            reader.read(first);
+            reader.read(xprev);
+            reader.read(yprev);
+        }
+    };
+
+
+    template <int LAYERS>
+    class StagedFilterBank
+    {
+    private:
+        LoHiPassFilterBank stage[LAYERS];
+
+    public:
+        void Reset()
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].Reset();
+        }
+
+        void SetCutoffFrequency(float cutoffFrequencyHz)
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].SetCutoffFrequency(cutoffFrequencyHz);
+        }
+
+        PhysicsVector UpdateLoPass(PhysicsVector x, float sampleRateHz)
+        {
+            for (int i = 0; i < LAYERS; ++i)
+            {
+                stage[i].Update(x, sampleRateHz);
+                x = stage[i].LoPass();
+            }
+            return x;
+        }
+
+        PhysicsVector UpdateHiPass(PhysicsVector x, float sampleRateHz)
+        {
+            for (int i = 0; i < LAYERS; ++i)
+            {
+                stage[i].Update(x, sampleRateHz);
+                x = stage[i].HiPass();
+            }
+            return x;
+        }
+
+        // Block processing: `frames` holds `nframes` groups of 4 interleaved lanes, filtered in place.
+        void ProcessLoPass(float *frames, size_t nframes, float sampleRateHz)
+        {
+            for (size_t i = 0; i < nframes; ++i)
+                _mm_storeu_ps(frames + 4*i, UpdateLoPass(PhysicsVector(_mm_loadu_ps(frames + 4*i)), sampleRateHz).v);
+        }
+
+        void ProcessHiPass(float *frames, size_t nframes, float sampleRateHz)
+        {
+            for (size_t i = 0; i < nframes; ++i)
+                _mm_storeu_ps(frames + 4*i, UpdateHiPass(PhysicsVector(_mm_loadu_ps(frames + 4*i)), sampleRateHz).v);
+        }
+
+        void SaveState(StateWriter& writer) const
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].SaveState(writer);
+        }
+
+        void LoadState(StateReader& reader)
+        {
+            for (int i = 0; i < LAYERS; ++i)
+                stage[i].LoadState(reader);
+        }
     };
 
 
@@ -450,6 +658,38 @@ namespace Sapphire
         {
             return follower;
         }
+
+        void saveState(StateWriter& writer) const
+        {
+            writer.write(follower);
+            writer.write(countdown);
+            writer.write(prevmax);
+            writer.write(currmax);
+        }
+
+        void loadState(StateReader& reader)
+        {
+            reader.read(follower);
+            reader.read(countdown);
+            reader.read(prevmax);
+            reader.read(currmax);
+        }
+    };
+
+
+    struct EngineTelemetry      // a compact status report an engine publishes at control rate
+    {
+        uint32_t sequence = 0;      // counts published frames, so a reader can tell when a new one arrives
+        float peakLeft = 0.0f;      // largest absolute output sample since the previous frame, dimensionless
+        float peakRight = 0.0f;
+        float agcFollower = 1.0f;   // the limiter's gain divisor: 1 when idle or disabled, larger while limiting
+        float meshEnergy = 0.0f;    // kinetic energy of Elastika's mesh; 0 for engines without a mesh
+        float cpuLoad = 0.0f;       // fraction of the real-time budget spent in the module's process()
+
+        float agcDistortion() const     // returns 0 when no distortion, or a positive value correlated with AGC distortion
+        {
+            return agcFollower - 1.0f;
+        }
     };
 
 
@@ -474,7 +714,7 @@ namespace Sapphire
             // Access an item at an integer offset toward the future from the back of the delay line.
             if (offset >= bufsize)
                 throw std::range_error("Delay line offset is out of bounds.");
-            return buffer.at((back + offset) % bufsize);
+            return buffer[(back + offset) % bufsize];
         }
 
         item_t readBackward(size_t offset) const
@@ -482,12 +722,12 @@ namespace Sapphire
             // Access an item at an integer offset into the past from the front of the delay line.
             if (offset >= bufsize)
                 throw std::range_error("Delay line offset is out of bounds.");
-            return buffer.at(((bufsize + front) - (offset + 1)) % bufsize);
+            return buffer[((bufsize + front) - (offset + 1)) % bufsize];
         }
 
         void write(const item_t& x)
         {
-            buffer.at(front) = x;
+            buffer[front] = x;
             front = (front + 1) % bufsize;
             back = (back + 1) % bufsize;
         }
@@ -525,6 +765,46 @@ namespace Sapphire
             for (item_t& x : buffer)
                 x = {};
         }
+
+        void saveState(StateWriter& writer) const
+        {
+            // Only the samples between `back` and `front` can be read,
+            // so only those are saved. This keeps a short delay compact.
+            const uint32_t length = static_cast<uint32_t>(getLength());
+            writer.write(static_cast<uint32_t>(front));
+            writer.write(length);
+            for (uint32_t i = 0; i < length; ++i)
+                writer.write(buffer[(back + i) % bufsize]);
+        }
+
+        void checkState(StateReader& reader) const
+        {
+            // Reads past a saved state without changing anything,
+            // and throws if loadState would reject it.
+            uint32_t newFront, length;
+            reader.read(newFront);
+            reader.read(length);
+            if (newFront >= bufsize || length < 1 || length > getMaxLength())
+                throw std::runtime_error("Delay line state is invalid.");
+            reader.skip(length * sizeof(item_t));
+        }
+
+        void loadState(StateReader& reader)
+        {
+            StateReader check = reader;
+            checkState(check);
+
+            uint32_t newFront, length;
+            reader.read(newFront);
+            reader.read(length);
+
+            // Samples older than the saved length come back as silence.
+            clear();
+            front = newFront;
+            back = ((front + bufsize) - length) % bufsize;
+            for (uint32_t i = 0; i < length; ++i)
+                reader.read(buffer[(back + i) % bufsize]);
+        }
     };
 
     inline float Sinc(float x)
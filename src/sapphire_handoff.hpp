@@ -0,0 +1,117 @@
+#ifndef __COSINEKITTY_SAPPHIRE_HANDOFF_HPP
+#define __COSINEKITTY_SAPPHIRE_HANDOFF_HPP
+
+// Sapphire lock-free data handoff between threads, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+//
+// VCV Rack changes menu settings on the UI thread while modules run on an audio thread.
+// The audio thread must never wait for a lock, so settings and telemetry pass
+// between threads through atomic variables only.
+
+#include <atomic>
+#include <cstdint>
+
+namespace Sapphire
+{
+    // One setting written by any thread and consumed by the audio thread.
+    // The writer stores the value and then bumps a version number.
+    // The reader remembers the last version it saw, so it can cheaply check
+    // for news once per block and apply only settings that actually changed.
+    // If several writes happen between checks, the reader sees only the latest value.
+    template <typename value_t>
+    class SettingSlot
+    {
+    private:
+        std::atomic<value_t> value;
+        std::atomic<uint32_t> version;
+
+    public:
+        SettingSlot()
+            : SettingSlot(value_t())
+            {}
+
+        explicit SettingSlot(value_t initial)
+            : value(initial)
+            , version(1)        // readers start at version 0, so their first poll always reports the value
+            {}
+
+        SettingSlot(const SettingSlot&) = delete;
+        SettingSlot& operator = (const SettingSlot&) = delete;
+
+        value_t get() const
+        {
+            return value.load(std::memory_order_acquire);
+        }
+
+        void set(value_t newValue)
+        {
+            value.store(newValue, std::memory_order_release);
+            version.fetch_add(1, std::memory_order_release);
+        }
+
+        bool poll(uint32_t& seenVersion, value_t& current) const
+        {
+            // Returns true, and the current value, if the setting was written since `seenVersion`.
+            const uint32_t v = version.load(std::memory_order_acquire);
+            if (v == seenVersion)
+                return false;
+            seenVersion = v;
+            current = value.load(std::memory_order_acquire);
+            return true;
+        }
+    };
+
+
+    // Passes whole frames of data from one writer thread to one reader thread.
+    // The writer fills the back buffer and publishes it; the reader always gets
+    // the most recently published frame, complete and unchanging while it reads.
+    // Neither side ever waits for the other: each owns one buffer outright,
+    // and the third buffer is exchanged between them with a single atomic operation.
+    template <typename frame_t>
+    class TripleBuffer
+    {
+    private:
+        static const unsigned FreshBit  = 4;    // set when `middle` holds a frame the reader has not taken yet
+        static const unsigned IndexMask = 3;
+
+        frame_t buffer[3];
+        std::atomic<unsigned> middle;
+        unsigned back;      // owned by the writer
+        unsigned front;     // owned by the reader
+
+    public:
+        TripleBuffer()
+            : buffer()
+            , middle(1)
+            , back(0)
+            , front(2)
+            {}
+
+        TripleBuffer(const TripleBuffer&) = delete;
+        TripleBuffer& operator = (const TripleBuffer&) = delete;
+
+        frame_t& writeBuffer()
+        {
+            // Writer only: the frame to fill before calling publish().
+            // It may hold stale data from an older frame, so overwrite all of it.
+            return buffer[back];
+        }
+
+        void publish()
+        {
+            // Writer only: hand the back buffer to the reader, and take the middle buffer in exchange.
+            back = middle.exchange(back | FreshBit, std::memory_order_acq_rel) & IndexMask;
+        }
+
+        const frame_t& read()
+        {
+            // Reader only: returns the latest published frame.
+            // The reference remains valid and unchanged until the next call to read().
+            if (middle.load(std::memory_order_relaxed) & FreshBit)
+                front = middle.exchange(front, std::memory_order_acq_rel) & IndexMask;
+            return buffer[front];
+        }
+    };
+}
+
+#endif // __COSINEKITTY_SAPPHIRE_HANDOFF_HPP
@@ -0,0 +1,222 @@
+#ifndef __COSINEKITTY_SAPPHIRE_PROFILE_HPP
+#define __COSINEKITTY_SAPPHIRE_PROFILE_HPP
+
+// Sapphire per-stage engine profiling, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+//
+// Profiling is compiled out unless SAPPHIRE_ENABLE_PROFILING is defined as 1,
+// for example with `make FLAGS+=-DSAPPHIRE_ENABLE_PROFILING=1`.
+// When disabled, SAPPHIRE_PROFILE_SCOPE expands to nothing and
+// getProfile() returns a snapshot with `enabled` set to false.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef SAPPHIRE_ENABLE_PROFILING
+#define SAPPHIRE_ENABLE_PROFILING 0
+#endif
+
+#if SAPPHIRE_ENABLE_PROFILING
+#   if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#       include <intrin.h>
+#       define SAPPHIRE_PROFILE_RDTSC 1
+#   elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#       include <x86intrin.h>
+#       define SAPPHIRE_PROFILE_RDTSC 1
+#   else
+#       include <chrono>
+#       define SAPPHIRE_PROFILE_RDTSC 0
+#   endif
+#endif
+
+namespace Sapphire
+{
+    struct ProfileStage
+    {
+        const char *name;
+        uint64_t ticks;         // total clock ticks spent in this stage
+        uint64_t calls;         // number of times this stage ran
+
+        double ticksPerCall() const
+        {
+            return (calls > 0) ? static_cast<double>(ticks) / calls : 0.0;
+        }
+    };
+
+    struct ProfileSnapshot
+    {
+        bool enabled = false;
+        const char *clockName = "";     // "cycles" (rdtsc) or "ns" (steady_clock)
+        std::vector<ProfileStage> stages;
+
+        uint64_t totalTicks() const
+        {
+            uint64_t sum = 0;
+            for (const ProfileStage& s : stages)
+                sum += s.ticks;
+            return sum;
+        }
+
+        void add(const ProfileSnapshot& other)
+        {
+            // Combine the profiles of several engines of the same kind, e.g. polyphonic voices.
+            if (!other.enabled)
+                return;
+
+            if (!enabled)
+            {
+                *this = other;
+                return;
+            }
+
+            for (size_t i = 0; i < stages.size() && i < other.stages.size(); ++i)
+            {
+                stages[i].ticks += other.stages[i].ticks;
+                stages[i].calls += other.stages[i].calls;
+            }
+        }
+
+        ProfileSnapshot since(const ProfileSnapshot& baseline) const
+        {
+            // Counters only ever increase, so "resetting" a profile means remembering
+            // a baseline snapshot and subtracting it later. That keeps the audio thread
+            // the only writer of the counters.
+            ProfileSnapshot diff = *this;
+            if (baseline.enabled)
+            {
+                for (size_t i = 0; i < diff.stages.size() && i < baseline.stages.size(); ++i)
+                {
+                    diff.stages[i].ticks -= baseline.stages[i].ticks;
+                    diff.stages[i].calls -= baseline.stages[i].calls;
+                }
+            }
+            return diff;
+        }
+
+        std::string format(size_t index) const
+        {
+            // Returns a line like "mesh update: 1234.5 cycles/call, 81.2%".
+            const ProfileStage& s = stages.at(index);
+            const uint64_t total = totalTicks();
+            const double percent = (total > 0) ? (100.0 * s.ticks) / total : 0.0;
+            char text[100];
+            snprintf(text, sizeof(text), "%s: %0.1f %s/call, %0.1f%%", s.name, s.ticksPerCall(), clockName, percent);
+            return text;
+        }
+
+        void print(FILE *outfile, const char *title) const
+        {
+            if (!enabled)
+                return;
+
+            fprintf(outfile, "%s profile:\n", title);
+            for (size_t i = 0; i < stages.size(); ++i)
+                fprintf(outfile, "    %s  [%llu calls]\n", format(i).c_str(), static_cast<unsigned long long>(stages[i].calls));
+        }
+    };
+
+
+#if SAPPHIRE_ENABLE_PROFILING
+
+    inline uint64_t ProfileClock()
+    {
+#if SAPPHIRE_PROFILE_RDTSC
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    template <int STAGES>
+    class StageProfiler
+    {
+    private:
+        // The audio thread is the only writer, so plain relaxed loads and stores
+        // are enough: no locked read-modify-write instructions in the hot path.
+        // Readers on other threads see each counter change atomically.
+        std::atomic<uint64_t> ticks[STAGES];
+        std::atomic<uint64_t> calls[STAGES];
+        const char * const *names;
+
+    public:
+        static const int StageCount = STAGES;
+
+        explicit StageProfiler(const char * const *_names)
+            : names(_names)
+        {
+            for (int i = 0; i < STAGES; ++i)
+            {
+                ticks[i].store(0, std::memory_order_relaxed);
+                calls[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void record(int stage, uint64_t elapsed)
+        {
+            ticks[stage].store(ticks[stage].load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+            calls[stage].store(calls[stage].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        ProfileSnapshot snapshot() const
+        {
+            ProfileSnapshot snap;
+            snap.enabled = true;
+            snap.clockName = SAPPHIRE_PROFILE_RDTSC ? "cycles" : "ns";
+            for (int i = 0; i < STAGES; ++i)
+            {
+                ProfileStage s;
+                s.name = names[i];
+                s.ticks = ticks[i].load(std::memory_order_relaxed);
+                s.calls = calls[i].load(std::memory_order_relaxed);
+                snap.stages.push_back(s);
+            }
+            return snap;
+        }
+    };
+
+    template <int STAGES>
+    class ProfileScope      // charges the time between construction and destruction to one stage
+    {
+    private:
+        StageProfiler<STAGES>& profiler;
+        const int stage;
+        const uint64_t start;
+
+    public:
+        ProfileScope(StageProfiler<STAGES>& _profiler, int _stage)
+            : profiler(_profiler)
+            , stage(_stage)
+            , start(ProfileClock())
+            {}
+
+        ~ProfileScope()
+        {
+            profiler.record(stage, ProfileClock() - start);
+        }
+    };
+
+#   define SAPPHIRE_PROFILE_CONCAT_(a, b)   a ## b
+#   define SAPPHIRE_PROFILE_CONCAT(a, b)    SAPPHIRE_PROFILE_CONCAT_(a, b)
+#   define SAPPHIRE_PROFILE_SCOPE(profiler, stage) \
+        ::Sapphire::ProfileScope<decltype(profiler)::StageCount> SAPPHIRE_PROFILE_CONCAT(profileScope_, __LINE__)((profiler), (stage))
+
+#else
+
+    template <int STAGES>
+    class StageProfiler     // does nothing and costs nothing when profiling is disabled
+    {
+    public:
+        explicit StageProfiler(const char * const *) {}
+        ProfileSnapshot snapshot() const { return ProfileSnapshot(); }
+    };
+
+#   define SAPPHIRE_PROFILE_SCOPE(profiler, stage)
+
+#endif
+}
+
+#endif // __COSINEKITTY_SAPPHIRE_PROFILE_HPP
@@ -0,0 +1,52 @@
+#ifndef __COSINEKITTY_SAPPHIRE_REALTIME_HPP
+#define __COSINEKITTY_SAPPHIRE_REALTIME_HPP
+
+// Sapphire real-time safety markers, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+//
+// Audio processing code must not allocate or free memory, and must not throw
+// exceptions, because either one can take an unbounded amount of time.
+// SAPPHIRE_REALTIME_SCOPE() marks the rest of the enclosing block as real-time code.
+//
+// The markers are compiled out unless SAPPHIRE_REALTIME_GUARD is defined as 1.
+// Test programs that enable it also include util/include/realtime_guard.hpp,
+// which intercepts the memory allocator and exception throws, and fails with
+// a stack trace whenever one happens while the current thread is inside a marked scope.
+
+#ifndef SAPPHIRE_REALTIME_GUARD
+#define SAPPHIRE_REALTIME_GUARD 0
+#endif
+
+namespace Sapphire
+{
+#if SAPPHIRE_REALTIME_GUARD
+
+    inline int& RealtimeDepth()
+    {
+        // How many real-time scopes the calling thread is nested inside.
+        static thread_local int depth = 0;
+        return depth;
+    }
+
+    class RealtimeScope
+    {
+    public:
+        RealtimeScope() { ++RealtimeDepth(); }
+        ~RealtimeScope() { --RealtimeDepth(); }
+        RealtimeScope(const RealtimeScope&) = delete;
+        RealtimeScope& operator = (const RealtimeScope&) = delete;
+    };
+
+#   define SAPPHIRE_REALTIME_CONCAT_(a, b)  a ## b
+#   define SAPPHIRE_REALTIME_CONCAT(a, b)   SAPPHIRE_REALTIME_CONCAT_(a, b)
+#   define SAPPHIRE_REALTIME_SCOPE() \
+        ::Sapphire::RealtimeScope SAPPHIRE_REALTIME_CONCAT(realtimeScope_, __LINE__)
+
+#else
+
+#   define SAPPHIRE_REALTIME_SCOPE()
+
+#endif
+}
+
+#endif // __COSINEKITTY_SAPPHIRE_REALTIME_HPP
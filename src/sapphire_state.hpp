@@ -0,0 +1,150 @@
+#ifndef __COSINEKITTY_SAPPHIRE_STATE_HPP
+#define __COSINEKITTY_SAPPHIRE_STATE_HPP
+
+// Sapphire engine state snapshots, by Don Cross <cosinekitty@gmail.com>
+// https://github.com/cosinekitty/sapphire
+//
+// An engine's dynamic state (everything that evolves while audio is processed,
+// as opposed to the settings a host controls through knobs and menus)
+// can be saved into a compact binary blob and restored later.
+// Restoring a warmed-up state lets a host swap sounds instantly,
+// or lets an offline render skip the time an engine takes to settle.
+//
+// Layout: a 16-byte header followed by the engine's own payload.
+//
+//      uint32  magic       'SAPS'
+//      uint32  kind        identifies the engine, e.g. 'ELAS' or 'TUBE'
+//      uint32  version     the engine's payload layout version
+//      uint32  length      payload size in bytes
+//
+// Values are stored in the native byte order of the machine that saved them.
+// The blobs are intended as a cache, not as a file interchange format.
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace Sapphire
+{
+    const uint32_t StateMagic = 0x53504153;        // "SAPS" in little-endian memory order
+
+    inline uint32_t StateTag(char a, char b, char c, char d)
+    {
+        return
+            static_cast<uint32_t>(static_cast<uint8_t>(a)) |
+            static_cast<uint32_t>(static_cast<uint8_t>(b)) << 8 |
+            static_cast<uint32_t>(static_cast<uint8_t>(c)) << 16 |
+            static_cast<uint32_t>(static_cast<uint8_t>(d)) << 24;
+    }
+
+    class StateWriter
+    {
+    private:
+        std::vector<uint8_t>& buffer;
+        size_t headerOffset;
+
+    public:
+        // Starts a new state blob in `_buffer`, replacing its contents.
+        // Reusing the same buffer for repeated saves avoids reallocating it.
+        StateWriter(std::vector<uint8_t>& _buffer, uint32_t kind, uint32_t version)
+            : buffer(_buffer)
+            , headerOffset(0)
+        {
+            buffer.clear();
+            write(StateMagic);
+            write(kind);
+            write(version);
+            headerOffset = buffer.size();
+            write(static_cast<uint32_t>(0));    // payload length, patched by finish()
+        }
+
+        template <typename value_t>
+        void write(const value_t& value)
+        {
+            static_assert(std::is_trivially_copyable<value_t>::value, "State values must be plain data.");
+            writeBytes(&value, sizeof(value));
+        }
+
+        void writeBytes(const void *data, size_t nbytes)
+        {
+            const uint8_t *bytes = static_cast<const uint8_t *>(data);
+            buffer.insert(buffer.end(), bytes, bytes + nbytes);
+        }
+
+        void finish()
+        {
+            const size_t payloadStart = headerOffset + sizeof(uint32_t);
+            const uint32_t length = static_cast<uint32_t>(buffer.size() - payloadStart);
+            memcpy(buffer.data() + headerOffset, &length, sizeof(length));
+        }
+    };
+
+    class StateReader
+    {
+    private:
+        const uint8_t *data;
+        size_t size;
+        size_t offset;
+
+        uint32_t readHeaderWord()
+        {
+            uint32_t x;
+            read(x);
+            return x;
+        }
+
+    public:
+        // Validates the header and positions the reader at the start of the payload.
+        // Throws std::runtime_error if the blob belongs to a different engine or layout version,
+        // so nothing is modified when the caller is handed the wrong state.
+        StateReader(const uint8_t *_data, size_t _size, uint32_t kind, uint32_t version)
+            : data(_data)
+            , size(_size)
+            , offset(0)
+        {
+            if (readHeaderWord() != StateMagic)
+                throw std::runtime_error("Not a Sapphire engine state.");
+
+            if (readHeaderWord() != kind)
+                throw std::runtime_error("Engine state belongs to a different engine.");
+
+            if (readHeaderWord() != version)
+                throw std::runtime_error("Engine state has an unsupported version.");
+
+            if (readHeaderWord() != size - offset)
+                throw std::runtime_error("Engine state has the wrong length.");
+        }
+
+        template <typename value_t>
+        void read(value_t& value)
+        {
+            static_assert(std::is_trivially_copyable<value_t>::value, "State values must be plain data.");
+            readBytes(&value, sizeof(value));
+        }
+
+        void readBytes(void *target, size_t nbytes)
+        {
+            if (nbytes > size - offset)
+                throw std::runtime_error("Engine state is truncated.");
+            memcpy(target, data + offset, nbytes);
+            offset += nbytes;
+        }
+
+        void skip(size_t nbytes)
+        {
+            if (nbytes > size - offset)
+                throw std::runtime_error("Engine state is truncated.");
+            offset += nbytes;
+        }
+
+        void finish() const
+        {
+            if (offset != size)
+                throw std::runtime_error("Engine state has unexpected trailing data.");
+        }
+    };
+}
+
+#endif // __COSINEKITTY_SAPPHIRE_STATE_HPP
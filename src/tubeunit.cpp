@@ -8,13 +8,23 @@
 extern const std::vector<SapphireControlGroup> tubeUnitControls;
 
 
-struct TubeUnitModule : Module
+struct TubeUnitModule : Module, Sapphire::CaptureTarget
 {
     Sapphire::TubeUnitEngine engine[PORT_MAX_CHANNELS];
     AgcLevelQuantity *agcLevelQuantity = nullptr;
-    bool enableLimiterWarning = true;
-    bool isInvertedVentPort = false;
+    Sapphire::SettingSlot<bool> enableLimiterWarning {true};
+    Sapphire::SettingSlot<bool> isInvertedVentPort {false};
+    Sapphire::SettingSlot<Sapphire::TubeInterpolation> interpolation {Sapphire::TubeInterpolation::Sinc};     // chosen in the right-click menu
+    bool ventInverted = false;          // audio thread's copy of isInvertedVentPort
+    uint32_t agcLevelVersion = 0;       // versions of the menu settings most recently applied to the engines
+    uint32_t ventVersion = 0;
+    uint32_t interpolationVersion = 0;
+    int settingsCountdown = 0;
+    TelemetryPublisher telemetry;       // read by the warning light on the UI thread
     int numActiveChannels = 0;
+#if SAPPHIRE_ENABLE_PROFILING
+    Sapphire::ProfileSnapshot profileBaseline;      // "Reset profile" remembers the counters at that moment
+#endif
 
     enum ParamId
     {
@@ -78,6 +88,13 @@ struct TubeUnitModule : Module
         LIGHTS_LEN
     };
 
+    enum CaptureSettingId       // menu settings, as recorded in session captures
+    {
+        CAPTURE_AGC_LEVEL,
+        CAPTURE_VENT_INVERTED,
+        CAPTURE_INTERPOLATION,
+    };
+
     const SapphireControlGroup *cgLookup[INPUTS_LEN] {};
 
     TubeUnitModule()
@@ -103,7 +120,7 @@ struct TubeUnitModule : Module
             AGC_LEVEL_DEFAULT,
             "Output limiter"
         );
-        agcLevelQuantity->value = AGC_LEVEL_DEFAULT;
+        agcLevelQuantity->setting.set(AGC_LEVEL_DEFAULT);
 
         auto levelKnob = configParam(LEVEL_KNOB_PARAM, 0, 2, 1, "Output level", " dB", -10, 80);
         levelKnob->randomizeEnabled = false;
@@ -121,15 +138,23 @@ struct TubeUnitModule : Module
     void initialize()
     {
         numActiveChannels = 0;
-        enableLimiterWarning = true;
-        isInvertedVentPort = false;
+        enableLimiterWarning.set(true);
+        isInvertedVentPort.set(false);
+        interpolation.set(Sapphire::TubeInterpolation::Sinc);
 
         for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
             engine[c].initialize();
+
+        // Make the next call to process() apply every menu setting to the freshly initialized engines.
+        agcLevelVersion = 0;
+        ventVersion = 0;
+        interpolationVersion = 0;
+        settingsCountdown = 0;
     }
 
     void onReset(const ResetEvent& e) override
     {
+        capture.reset();
         Module::onReset(e);
         initialize();
     }
@@ -137,8 +162,9 @@ struct TubeUnitModule : Module
     json_t* dataToJson() override
     {
         json_t* root = json_object();
-        json_object_set_new(root, "limiterWarningLight", json_boolean(enableLimiterWarning));
-        json_object_set_new(root, "toggleVentPort", json_boolean(isInvertedVentPort));
+        json_object_set_new(root, "limiterWarningLight", json_boolean(enableLimiterWarning.get()));
+        json_object_set_new(root, "toggleVentPort", json_boolean(isInvertedVentPort.get()));
+        json_object_set_new(root, "interpolation", json_integer(static_cast<int>(interpolation.get())));
         return root;
     }
 
@@ -146,11 +172,19 @@ struct TubeUnitModule : Module
     {
         // If the JSON is damaged, default to enabling the warning light.
         json_t *warningFlag = json_object_get(root, "limiterWarningLight");
-        enableLimiterWarning = !json_is_false(warningFlag);
+        enableLimiterWarning.set(!json_is_false(warningFlag));
 
         // Upgrade from older/damaged JSON by defaulting the vent toggle to OFF.
         json_t *ventFlag = json_object_get(root, "toggleVentPort");
-        isInvertedVentPort = json_is_true(ventFlag);
+        isInvertedVentPort.set(json_is_true(ventFlag));
+
+        // Patches saved before interpolation was selectable used the windowed sinc.
+        json_t *interpJson = json_object_get(root, "interpolation");
+        int mode = json_is_integer(interpJson) ? static_cast<int>(json_integer_value(interpJson)) : -1;
+        if (mode >= 0 && mode < static_cast<int>(Sapphire::TubeInterpolation::Count))
+            interpolation.set(static_cast<Sapphire::TubeInterpolation>(mode));
+        else
+            interpolation.set(Sapphire::TubeInterpolation::Sinc);
     }
 
     void onSampleRateChange(const SampleRateChangeEvent& e) override
@@ -192,16 +226,16 @@ struct TubeUnitModule : Module
         {
             float qv = inputs[QUIET_GATE_INPUT].getVoltage(c);
             if (qv >= 1.0f)
-                quiet = !isInvertedVentPort;
+                quiet = !ventInverted;
             else if (qv < 0.1f)
-                quiet = isInvertedVentPort;
+                quiet = ventInverted;
             else
                 quiet = engine[c].getQuiet();
         }
         else if (quietGateChannels > 0)
             quiet = engine[quietGateChannels-1].getQuiet();
         else
-            quiet = isInvertedVentPort;
+            quiet = ventInverted;
 
         engine[c].setQuiet(quiet);
     }
@@ -210,7 +244,12 @@ struct TubeUnitModule : Module
     {
         using namespace Sapphire;
 
-        reflectAgcSlider();
+        SAPPHIRE_REALTIME_SCOPE();
+
+        telemetry.begin();
+        if (capture.begin(args.sampleRate))
+            startCapture();
+        applySettings();
 
         // Whichever input has the most channels selects the output channel count.
         // Other inputs have their final supplied value (or default value if none)
@@ -252,44 +291,126 @@ struct TubeUnitModule : Module
             outputs[AUDIO_LEFT_OUTPUT ].setVoltage(5.0f * leftOut,  c);
             outputs[AUDIO_RIGHT_OUTPUT].setVoltage(5.0f * rightOut, c);
         }
+
+        capture.frame(params, inputs, outputs);
+        publishTelemetry(args);
+    }
+
+    void publishTelemetry(const ProcessArgs& args)
+    {
+        Sapphire::EngineTelemetry* frame = telemetry.end(args.sampleRate);
+        if (frame != nullptr)
+        {
+            // Report the loudest of the engines that are actively producing output.
+            // Idle engines are read too, so stale peaks don't show up when their channels return.
+            Sapphire::EngineTelemetry idle;
+            for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
+                engine[c].readTelemetry((c < numActiveChannels) ? *frame : idle);
+            telemetry.publish();
+        }
     }
 
-    void reflectAgcSlider()
+    void applySettings()
     {
+        // Pick up any menu setting changes the UI thread made since the last block.
+        // Checking once per block keeps atomic loads out of the per-sample, per-channel path.
+        if (--settingsCountdown > 0)
+            return;
+        settingsCountdown = SETTINGS_POLL_SAMPLES;
+
         // Check for changes to the automatic gain control: its level, and whether enabled/disabled.
-        if (agcLevelQuantity && agcLevelQuantity->changed)
+        float level;
+        if (agcLevelQuantity->setting.poll(agcLevelVersion, level))
         {
-            bool enabled = agcLevelQuantity->isAgcEnabled();
+            bool enabled = AgcLevelQuantity::IsAgcEnabled(level);
             for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
             {
                 if (enabled)
-                    engine[c].setAgcLevel(agcLevelQuantity->clampedAgc() / 5.0f);
+                    engine[c].setAgcLevel(AgcLevelQuantity::ClampedAgc(level) / 5.0f);
                 engine[c].setAgcEnabled(enabled);
             }
-            agcLevelQuantity->changed = false;
+            capture.setting(CAPTURE_AGC_LEVEL, level);
+        }
+
+        if (isInvertedVentPort.poll(ventVersion, ventInverted))
+            capture.setting(CAPTURE_VENT_INVERTED, ventInverted ? 1.0f : 0.0f);
+
+        Sapphire::TubeInterpolation mode;
+        if (interpolation.poll(interpolationVersion, mode))
+        {
+            for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
+                engine[c].setInterpolation(mode);
+            capture.setting(CAPTURE_INTERPOLATION, static_cast<float>(static_cast<int>(mode)));
         }
     }
 
-    float getAgcDistortion()
+    void startCapture()
     {
-        // Return the maximum distortion from the engines that are actively producing output.
-        float maxDistortion = 0.0f;
-        for (int c = 0; c < numActiveChannels; ++c)
+        // Record every menu setting at the start of the capture, by re-applying them all now.
+        // Everything else the replay needs to start from goes into the snapshot.
+        agcLevelVersion = 0;
+        ventVersion = 0;
+        interpolationVersion = 0;
+        settingsCountdown = 0;
+        capture.snapshot(*this);
+    }
+
+    void saveCaptureState(Sapphire::StateWriter& writer, std::vector<uint8_t>& scratch) const override
+    {
+        for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
         {
-            float distortion = engine[c].getAgcDistortion();
-            if (distortion > maxDistortion)
-                maxDistortion = distortion;
+            // Settings that reset part of an engine's state when they change are restored
+            // before the state itself, so replaying them later does not disturb it.
+            writer.write(engine[c].getQuiet());
+            writer.write(engine[c].getAgcEnabled());
+            writer.write(engine[c].getInterpolation());
+            engine[c].saveState(scratch);
+            Sapphire::WriteStateBlob(writer, scratch);
         }
-        return maxDistortion;
+    }
+
+    void loadCaptureState(Sapphire::StateReader& reader) override
+    {
+        for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
+        {
+            bool quiet, agcEnabled;
+            Sapphire::TubeInterpolation mode;
+            reader.read(quiet);
+            reader.read(agcEnabled);
+            reader.read(mode);
+            engine[c].setQuiet(quiet);
+            engine[c].setAgcEnabled(agcEnabled);
+            engine[c].setInterpolation(mode);
+            engine[c].loadState(Sapphire::ReadStateBlob(reader));
+        }
+    }
+
+    void replaySetting(int id, float value) override
+    {
+        if (id == CAPTURE_AGC_LEVEL)
+            agcLevelQuantity->setting.set(value);
+        else if (id == CAPTURE_VENT_INVERTED)
+            isInvertedVentPort.set(value != 0.0f);
+        else if (id == CAPTURE_INTERPOLATION)
+            interpolation.set(static_cast<Sapphire::TubeInterpolation>(static_cast<int>(value)));
     }
 
     bool hasAudioInput()
     {
         return inputs[AUDIO_LEFT_INPUT].getChannels() + inputs[AUDIO_RIGHT_INPUT].getChannels() > 0;
     }
+
+    Sapphire::ProfileSnapshot getProfile() const
+    {
+        Sapphire::ProfileSnapshot profile;
+        for (int c = 0; c < PORT_MAX_CHANNELS; ++c)
+            profile.add(engine[c].getProfile());
+        return profile;
+    }
 };
 
 
+#ifndef NO_RACK_DEPENDENCY
 class TubeUnitWarningLightWidget : public LightWidget
 {
 private:
@@ -302,7 +423,7 @@ private:
 
     NVGcolor warningColor(double distortion)
     {
-        bool enableWarning = tubeUnitModule && tubeUnitModule->enableLimiterWarning;
+        bool enableWarning = tubeUnitModule && tubeUnitModule->enableLimiterWarning.get();
 
         if (!enableWarning || distortion <= 0.0)
             return nvgRGBA(0, 0, 0, 0);     // no warning light
@@ -332,7 +453,7 @@ public:
         {
             // Update the warning light state dynamically.
             // Turn on the warning when the AGC is limiting the output.
-            double distortion = tubeUnitModule ? tubeUnitModule->getAgcDistortion() : 0.0;
+            double distortion = tubeUnitModule ? tubeUnitModule->telemetry.read().agcDistortion() : 0.0;
             color = warningColor(distortion);
         }
         LightWidget::drawLayer(args, layer);
@@ -424,17 +545,58 @@ struct TubeUnitWidget : ModuleWidget
         {
             menu->addChild(new MenuSeparator);
 
-            if (tubeUnitModule->agcLevelQuantity)
+            TubeUnitModule* tu = tubeUnitModule;
+
+            if (tu->agcLevelQuantity)
             {
                 // Add slider to adjust the AGC's level setting (5V .. 10V) or to disable AGC.
-                menu->addChild(new AgcLevelSlider(tubeUnitModule->agcLevelQuantity));
+                menu->addChild(new AgcLevelSlider(tu->agcLevelQuantity));
 
                 // Add an option to enable/disable the warning slider.
-                menu->addChild(createBoolPtrMenuItem<bool>("Limiter warning light", "", &tubeUnitModule->enableLimiterWarning));
+                menu->addChild(createBoolMenuItem(
+                    "Limiter warning light",
+                    "",
+                    [tu]{ return tu->enableLimiterWarning.get(); },
+                    [tu](bool state){ tu->enableLimiterWarning.set(state); }
+                ));
 
                 // Add toggle for whether the VENT port should be inverted to a SEAL port.
-                menu->addChild(createBoolPtrMenuItem<bool>("Toggle VENT/SEAL", "", &tubeUnitModule->isInvertedVentPort));
+                menu->addChild(createBoolMenuItem(
+                    "Toggle VENT/SEAL",
+                    "",
+                    [tu]{ return tu->isInvertedVentPort.get(); },
+                    [tu](bool state){ tu->isInvertedVentPort.set(state); }
+                ));
             }
+
+            // Cheaper interpolation lets dense polyphonic patches use less CPU, at some cost in tone and pitch accuracy.
+            menu->addChild(createIndexSubmenuItem(
+                "Tube interpolation",
+                {"Linear (lowest CPU)", "Cubic Hermite", "Thiran allpass", "Windowed sinc (best)"},
+                [tu]{ return static_cast<size_t>(tu->interpolation.get()); },
+                [tu](size_t mode){ tu->interpolation.set(static_cast<Sapphire::TubeInterpolation>(mode)); }
+            ));
+
+            menu->addChild(new MenuSeparator);
+            AddSessionCaptureMenuItem(
+                menu,
+                &tu->capture,
+                "TubeUnit",
+                TubeUnitModule::PARAMS_LEN,
+                TubeUnitModule::INPUTS_LEN,
+                TubeUnitModule::OUTPUTS_LEN
+            );
+
+#if SAPPHIRE_ENABLE_PROFILING
+            // Show where the engines have spent their time, summed over all polyphonic channels,
+            // since the module started or the profile was last reset.
+            Sapphire::ProfileSnapshot profile = tu->getProfile().since(tu->profileBaseline);
+            menu->addChild(new MenuSeparator);
+            menu->addChild(createMenuLabel("Engine profile"));
+            for (size_t i = 0; i < profile.stages.size(); ++i)
+                menu->addChild(createMenuLabel(profile.format(i)));
+            menu->addChild(createMenuItem("Reset profile", "", [tu]{ tu->profileBaseline = tu->getProfile(); }));
+#endif
         }
     }
 
@@ -443,7 +605,7 @@ struct TubeUnitWidget : ModuleWidget
         if (tubeUnitModule != nullptr)
         {
             // Toggle between showing "SEAL" or "VENT" depending on the toggle state.
-            bool showSeal = tubeUnitModule->isInvertedVentPort;
+            bool showSeal = tubeUnitModule->isInvertedVentPort.get();
             if (sealLabel->isVisible() != showSeal)
             {
                 sealLabel->setVisible(showSeal);
@@ -461,6 +623,9 @@ struct TubeUnitWidget : ModuleWidget
         ModuleWidget::step();
     }
 };
+#else
+struct TubeUnitWidget;      // headless builds have no user interface
+#endif
 
 const std::vector<SapphireControlGroup> tubeUnitControls {
     {
@@ -7,6 +7,7 @@
 #include <complex>
 
 #include "sapphire_engine.hpp"
+#include "sapphire_profile.hpp"
 
 namespace Sapphire
 {
@@ -14,8 +15,47 @@ namespace Sapphire
 
     const float TubeUnitDefaultRootFrequencyHz = 3.0f;
 
+    enum class TubeInterpolation    // how the tube's fractional length is read from its delay line
+    {
+        Linear,     // 2 taps: cheapest, but dulls high frequencies
+        Hermite,    // 4-point cubic Hermite (Catmull-Rom)
+        Thiran,     // first-order allpass: flat magnitude, but keeps state between samples
+        Sinc,       // 11-tap windowed sinc: the most accurate and the most expensive (default)
+        Count
+    };
+
     class TubeUnitEngine
     {
+    public:
+        enum Stage      // sections of process() measured when SAPPHIRE_ENABLE_PROFILING is enabled
+        {
+            STAGE_DELAY_READ,
+            STAGE_INTERPOLATE,
+            STAGE_DC_REJECT,
+            STAGE_PISTON,
+            STAGE_REFLECTION,
+            STAGE_DELAY_WRITE,
+            STAGE_LOWPASS,
+            STAGE_AGC,
+            STAGE_COUNT
+        };
+
+        static const char * const *StageNames()
+        {
+            static const char * const names[STAGE_COUNT] =
+            {
+                "delay read",
+                "interpolate",
+                "DC reject",
+                "piston",
+                "reflection",
+                "delay write",
+                "lowpass",
+                "limiter",
+            };
+            return names;
+        }
+
     private:
         float sampleRate = 0.0f;
         bool isQuiet;
@@ -42,10 +82,15 @@ namespace Sapphire
         bool enableAgc = false;
         float gain;
         float vortex;
-        StagedFilter<complex_t, 1> dcRejectFilter;
-        StagedFilter<complex_t, 1> loPassFilter;
+        StagedFilterBank<1> dcRejectFilter;     // complex signals: real part in lane 0, imaginary in lane 1
+        StagedFilterBank<1> loPassFilter;
         static const int windowSteps = 5;
         Interpolator<complex_t, windowSteps> interp;
+        TubeInterpolation interpolation = TubeInterpolation::Sinc;
+        complex_t thiranOutput;         // the allpass interpolator's previous output sample
+        float peakLeft = 0.0f;          // largest output magnitudes since the last call to readTelemetry()
+        float peakRight = 0.0f;
+        StageProfiler<STAGE_COUNT> profiler {StageNames()};
 
     public:
         TubeUnitEngine()
@@ -82,6 +127,8 @@ namespace Sapphire
             dcRejectFilter.Reset();
             loPassFilter.SetCutoffFrequency(8000.0f);
             loPassFilter.Reset();
+            thiranOutput = {};
+            peakLeft = peakRight = 0.0f;
         }
 
         bool getQuiet() const
@@ -168,6 +215,17 @@ namespace Sapphire
             return enableAgc ? (agc.getFollower() - 1.0) : 0.0;
         }
 
+        void readTelemetry(EngineTelemetry& frame)
+        {
+            // Merges this engine's status into `frame`, then starts a new peak measurement.
+            // Call from the audio thread at control rate; the caller publishes the frame.
+            frame.peakLeft = std::max(frame.peakLeft, peakLeft);
+            frame.peakRight = std::max(frame.peakRight, peakRight);
+            if (enableAgc)
+                frame.agcFollower = std::max(frame.agcFollower, static_cast<float>(agc.getFollower()));
+            peakLeft = peakRight = 0.0f;
+        }
+
         void setGain(float slider = 1.0f)       // min = 0.0 (-inf dB), default = 1.0 (0 dB), max = 2.0 (+24 dB)
         {
             gain = std::pow(Clamp(slider, 0.0f, 2.0f), 4.0f) / 80.0f;
@@ -205,8 +263,150 @@ namespace Sapphire
             vortex = v;
         }
 
+        TubeInterpolation getInterpolation() const
+        {
+            return interpolation;
+        }
+
+        void setInterpolation(TubeInterpolation mode)
+        {
+            if (mode != interpolation)
+            {
+                // The allpass filter must not resume from a stale output sample.
+                thiranOutput = {};
+                interpolation = mode;
+            }
+        }
+
+        ProfileSnapshot getProfile() const
+        {
+            return profiler.snapshot();
+        }
+
+        static const uint32_t StateVersion = 3;
+        static uint32_t StateKind() { return StateTag('T', 'U', 'B', 'E'); }
+
+        void saveState(std::vector<uint8_t>& state) const
+        {
+            // Captures everything process() changes: both waveguides, the mouth and piston,
+            // the filters, and the limiter. Knob settings are not included; the caller owns those.
+            // The interpolator is refilled from the outbound delay line on every sample,
+            // so it has no state of its own to save.
+            StateWriter writer(state, StateKind(), StateVersion);
+            outbound.saveState(writer);
+            inbound.saveState(writer);
+            writer.write(mouthPressure);
+            writer.write(pistonPosition);
+            writer.write(pistonSpeed);
+            writer.write(thiranOutput);
+            dcRejectFilter.SaveState(writer);
+            loPassFilter.SaveState(writer);
+            agc.saveState(writer);
+            writer.finish();
+        }
+
+        void loadState(const std::vector<uint8_t>& state)
+        {
+            // Read the whole payload once without keeping any of it, so a bad blob
+            // throws before anything has changed. Then read it again for real.
+            StateReader check(state.data(), state.size(), StateKind(), StateVersion);
+            outbound.checkState(check);
+            inbound.checkState(check);
+            complex_t scratch;
+            check.read(scratch);
+            check.read(scratch);
+            check.read(scratch);
+            check.read(scratch);
+            StagedFilterBank<1> scratchFilter = dcRejectFilter;
+            scratchFilter.LoadState(check);
+            scratchFilter.LoadState(check);
+            AutomaticGainLimiter scratchAgc = agc;
+            scratchAgc.loadState(check);
+            check.finish();
+
+            StateReader reader(state.data(), state.size(), StateKind(), StateVersion);
+            outbound.loadState(reader);
+            inbound.loadState(reader);
+            reader.read(mouthPressure);
+            reader.read(pistonPosition);
+            reader.read(pistonSpeed);
+            reader.read(thiranOutput);
+            dcRejectFilter.LoadState(reader);
+            loPassFilter.LoadState(reader);
+            agc.loadState(reader);
+            reader.finish();
+        }
+
+    private:
+        static PhysicsVector ToVector(complex_t z)
+        {
+            return PhysicsVector(z.real(), z.imag(), 0.0f, 0.0f);
+        }
+
+        static complex_t ToComplex(const PhysicsVector& v)
+        {
+            return complex_t{v[0], v[1]};
+        }
+
+        complex_t readBell(float position)
+        {
+            // Read the outbound delay line `position` samples away from the center
+            // of the interpolation window, where -1 < position <= 0.
+            const int c = windowSteps;
+            switch (interpolation)
+            {
+            case TubeInterpolation::Linear:
+                {
+                    complex_t a = outbound.readForward(c-1);
+                    complex_t b = outbound.readForward(c);
+                    return b + position*(b - a);
+                }
+
+            case TubeInterpolation::Hermite:
+                {
+                    complex_t y0 = outbound.readForward(c-2);
+                    complex_t y1 = outbound.readForward(c-1);
+                    complex_t y2 = outbound.readForward(c);
+                    complex_t y3 = outbound.readForward(c+1);
+                    float t = 1.0f + position;
+                    complex_t c1 = 0.5f*(y2 - y0);
+                    complex_t c2 = y0 - 2.5f*y1 + 2.0f*y2 - 0.5f*y3;
+                    complex_t c3 = 0.5f*(y3 - y0) + 1.5f*(y1 - y2);
+                    return ((c3*t + c2)*t + c1)*t + y1;
+                }
+
+            case TubeInterpolation::Thiran:
+                {
+                    // The allpass approximates a delay D best when 0.5 <= D < 1.5,
+                    // so for small delays, start one sample newer and delay by one more.
+                    float delay = -position;
+                    int newest = c;
+                    if (delay < 0.5f)
+                    {
+                        delay += 1.0f;
+                        newest = c+1;
+                    }
+                    float eta = (1.0f - delay) / (1.0f + delay);
+                    complex_t x0 = outbound.readForward(newest);
+                    complex_t x1 = outbound.readForward(newest-1);      // the previous input sample
+                    thiranOutput = eta*(x0 - thiranOutput) + x1;
+                    return thiranOutput;
+                }
+
+            case TubeInterpolation::Sinc:
+            default:
+                // Copy the window of outbound samples into a sinc-interpolator.
+                for (int n = -windowSteps; n <= +windowSteps; ++n)
+                    interp.write(n, outbound.readForward(n + windowSteps));
+                return interp.read(position);
+            }
+        }
+
+    public:
         void process(float& leftOutput, float& rightOutput, float leftInput, float rightInput)
         {
+            SAPPHIRE_REALTIME_SCOPE();
+
             if (sampleRate <= 0.0f)
                 throw std::logic_error("Invalid sample rate in TubeUnitEngine");
 
@@ -221,116 +421,149 @@ namespace Sapphire
 
             // Divide wavelength by 2 because we have both inbound and outbound delay lines.
             // Add extra samples needed for the interpolator window, and round up to next higher integer.
-            double roundTripSamples = (sampleRate / (2.0 * rootFrequency));
+            // At very low sample rates, the highest root frequencies would leave too few samples
+            // for the interpolator window. Saturate the pitch there instead of failing.
+            double roundTripSamples = std::max(sampleRate / (2.0 * rootFrequency), 2.0*windowSteps + 1.0);
 
             size_t nsamples = static_cast<size_t>(std::floor(roundTripSamples));
-            size_t smallerHalf = nsamples / 2;
-            size_t largerHalf = nsamples - smallerHalf;
-
-            if (largerHalf < windowSteps + 1)
-                throw std::logic_error("outbound delay line is not large enough for interpolation.");
-
-            outbound.setLength(largerHalf + windowSteps);
-            inbound.setLength(smallerHalf);
-
-            // Copy the window of outbound samples into a sinc-interpolator.
-            for (int n = -windowSteps; n <= +windowSteps; ++n)
-                interp.write(n, outbound.readForward(n + windowSteps));
-
-            // Find the effective pressure the open end of the tube (the "bell").
-            // Use the interpolator to handle the fractional number of samples needed
-            // to produce the exact root frequency.
-
-            complex_t bellPressure = interp.read(nsamples - roundTripSamples);
-            bellPressure = dcRejectFilter.UpdateHiPass(bellPressure, sampleRate);
-
-            // The tube has two ends: the breech and the bell.
-            // The breech is where air enters from the mouth, around the piston, through the bypass.
-            // The bell is where air exits at the end of the tube.
-            complex_t breechPressure = inbound.readForward(0);
-
-            // Use the piston's current position to determine whether,
-            // and how much, the bypass valve is open.
-            float bypassFraction = Clamp((pistonPosition.real() - bypass1)/(bypass2 - bypass1));
+            complex_t breechPressure;
+            {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_DELAY_READ);
 
-            // The flow rate through the bypass is proportional to the pressure difference
-            // across it, multiplied by the fraction it is currently open.
-            complex_t bypassFlowRate = bypassFraction * bypassResistance * (mouthPressure - breechPressure);
+                size_t smallerHalf = nsamples / 2;
+                size_t largerHalf = nsamples - smallerHalf;
 
-            complex_t outSignal = breechPressure + bypassFlowRate;
-            if (!isQuiet)
-                outSignal += 5.0f*complex_t{leftInput, rightInput};
+                if (largerHalf < windowSteps + 1)
+                    throw std::logic_error("outbound delay line is not large enough for interpolation.");
 
-            // Keep vibrations moving through the two waveguides (delay lines).
-            outbound.write(outSignal);
+                outbound.setLength(largerHalf + windowSteps);
+                inbound.setLength(smallerHalf);
 
-            // Reflection from the open end of a tube causes the return pressure
-            // wave to be inverted.
-            // Convert the (decay, angle) pair into a complex coefficient.
-            float halflife = std::pow(10.0f, (2.0 * reflectionDecay) - 1.0);     // exponential range 0.1 seconds ... 10 seconds.
-            float magnitude = std::pow(0.5f, static_cast<float>(1.0 / (rootFrequency * halflife)));
-            float radians = M_PI * reflectionAngle;
-            complex_t reflectionFraction { magnitude * std::cos(radians), magnitude * std::sin(radians) };
-            inbound.write(-reflectionFraction * bellPressure);
+                // The tube has two ends: the breech and the bell.
+                // The breech is where air enters from the mouth, around the piston, through the bypass.
+                // The bell is where air exits at the end of the tube.
+                breechPressure = inbound.readForward(0);
+            }
 
-            if (isQuiet)
+            complex_t bellPressure;
             {
-                // Immediately vent all mouth pressure and ignore all airflow.
-                mouthPressure = {};
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_INTERPOLATE);
+
+                // Find the effective pressure the open end of the tube (the "bell").
+                // Use the interpolator to handle the fractional number of samples needed
+                // to produce the exact root frequency.
+                bellPressure = readBell(nsamples - roundTripSamples);
             }
-            else
+
             {
-                // Update the pressure in the mouth by adding inbound airflow and subtracting outbound airflow.
-                mouthPressure += (airflow - bypassFlowRate) / (mouthVolume * sampleRate);
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_DC_REJECT);
+                bellPressure = ToComplex(dcRejectFilter.UpdateHiPass(ToVector(bellPressure), sampleRate));
             }
 
-            // Update the piston's position and speed using F=ma,
-            // where F = ((net pressure) * area) - (spring force).
-            // Then from force, calculate velocity increment:
-            // F = m*(dv/dt) ==> dv = (F/m)*dt = (F/m)/sampleRate
-            complex_t dv = (
-                (mouthPressure - breechPressure)*pistonArea -
-                (pistonPosition - springRestLength)*springConstant
-            ) / (pistonMass * sampleRate);
-
-            // Include a little weirdness using the `vortex` parameter.
-            float dvmag = std::abs(dv);
-            if (dvmag > 0.0f)       // prevent division by zero; if dv=0, leave it 0.
+            complex_t outSignal;
             {
-                float x = vortex / 2;
-                complex_t dir = dv / dvmag;
-                dv *= ((1-x) + x*dir);
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_PISTON);
+
+                // Use the piston's current position to determine whether,
+                // and how much, the bypass valve is open.
+                float bypassFraction = Clamp((pistonPosition.real() - bypass1)/(bypass2 - bypass1));
+
+                // The flow rate through the bypass is proportional to the pressure difference
+                // across it, multiplied by the fraction it is currently open.
+                complex_t bypassFlowRate = bypassFraction * bypassResistance * (mouthPressure - breechPressure);
+
+                outSignal = breechPressure + bypassFlowRate;
+                if (!isQuiet)
+                    outSignal += 5.0f*complex_t{leftInput, rightInput};
+
+                if (isQuiet)
+                {
+                    // Immediately vent all mouth pressure and ignore all airflow.
+                    mouthPressure = {};
+                }
+                else
+                {
+                    // Update the pressure in the mouth by adding inbound airflow and subtracting outbound airflow.
+                    mouthPressure += (airflow - bypassFlowRate) / (mouthVolume * sampleRate);
+                }
+
+                // Update the piston's position and speed using F=ma,
+                // where F = ((net pressure) * area) - (spring force).
+                // Then from force, calculate velocity increment:
+                // F = m*(dv/dt) ==> dv = (F/m)*dt = (F/m)/sampleRate
+                complex_t dv = (
+                    (mouthPressure - breechPressure)*pistonArea -
+                    (pistonPosition - springRestLength)*springConstant
+                ) / (pistonMass * sampleRate);
+
+                // Include a little weirdness using the `vortex` parameter.
+                float dvmag = std::abs(dv);
+                if (dvmag > 0.0f)       // prevent division by zero; if dv=0, leave it 0.
+                {
+                    float x = vortex / 2;
+                    complex_t dir = dv / dvmag;
+                    dv *= ((1-x) + x*dir);
+                }
+
+                // dx/dt = v ==> dx = v*dt = v/sampleRate
+                // Use the mean speed over the interval.
+                pistonPosition += (pistonSpeed + dv/2.0f) / sampleRate;
+
+                // If the piston hits a stopper, halt its speed also.
+                if (pistonPosition.real() < stopper1)
+                {
+                    pistonPosition = stopper1;
+                    pistonSpeed = {};
+                }
+                else if (pistonPosition.real() > stopper2)
+                {
+                    pistonPosition = stopper2;
+                    pistonSpeed = {};
+                }
+                else
+                {
+                    pistonSpeed += dv;
+                }
             }
 
-            // dx/dt = v ==> dx = v*dt = v/sampleRate
-            // Use the mean speed over the interval.
-            pistonPosition += (pistonSpeed + dv/2.0f) / sampleRate;
-
-            // If the piston hits a stopper, halt its speed also.
-            if (pistonPosition.real() < stopper1)
+            complex_t reflectionFraction;
             {
-                pistonPosition = stopper1;
-                pistonSpeed = {};
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_REFLECTION);
+
+                // Reflection from the open end of a tube causes the return pressure
+                // wave to be inverted.
+                // Convert the (decay, angle) pair into a complex coefficient.
+                float halflife = std::pow(10.0f, (2.0 * reflectionDecay) - 1.0);     // exponential range 0.1 seconds ... 10 seconds.
+                float magnitude = std::pow(0.5f, static_cast<float>(1.0 / (rootFrequency * halflife)));
+                float radians = M_PI * reflectionAngle;
+                reflectionFraction = complex_t{ magnitude * std::cos(radians), magnitude * std::sin(radians) };
             }
-            else if (pistonPosition.real() > stopper2)
+
             {
-                pistonPosition = stopper2;
-                pistonSpeed = {};
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_DELAY_WRITE);
+
+                // Keep vibrations moving through the two waveguides (delay lines).
+                outbound.write(outSignal);
+                inbound.write(-reflectionFraction * bellPressure);
             }
-            else
+
             {
-                pistonSpeed += dv;
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_LOWPASS);
+                complex_t result = ToComplex(loPassFilter.UpdateLoPass(ToVector(bellPressure * complex_t{1,1}), sampleRate));
+                leftOutput  = result.real() * gain;
+                rightOutput = result.imag() * gain;
             }
 
-            complex_t result = loPassFilter.UpdateLoPass(bellPressure * complex_t{1,1}, sampleRate);
-            leftOutput  = result.real() * gain;
-            rightOutput = result.imag() * gain;
-
             if (enableAgc)
             {
+                SAPPHIRE_PROFILE_SCOPE(profiler, STAGE_AGC);
+
                 // Automatic gain control to limit excessive output voltages.
                 agc.process(sampleRate, leftOutput, rightOutput);
             }
+
+            peakLeft = std::max(peakLeft, std::abs(leftOutput));
+            peakRight = std::max(peakRight, std::abs(rightOutput));
         }
     };
 }
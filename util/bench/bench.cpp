@@ -0,0 +1,690 @@
+/*
+    bench.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Benchmark runner for the Sapphire engines.
+    Times each kernel over many samples and reports the cost per sample.
+    With -p, also wraps each measurement in Linux hardware performance counters
+    and reports instructions per cycle and cache/branch misses per sample,
+    which show whether a kernel is limited by memory or by computation.
+
+    With -t, also measures how far each cheaper Tube Unit interpolation tier
+    moves the pitch away from the windowed-sinc reference.
+
+    The mod-* kernels run the complete module classes from the src directory,
+    built against the headless Rack shim (util/include/rack_shim.hpp),
+    with scripted CV, gates, and polyphonic audio on their ports.
+    Comparing them with the engine kernels shows what the module layer costs.
+
+    Usage: bench [-p] [-t] [-n samples] [-r repeats] [kernel ...]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "elastika_engine.hpp"
+#include "tubeunit_engine.hpp"
+#include "perf_counters.hpp"
+#include "rack_shim.hpp"
+
+using namespace Sapphire;
+
+const float BENCH_SAMPLE_RATE = 44100.0f;
+volatile float BenchSink;      // kernel results are stored here, so the compiler cannot discard them
+
+
+class BenchKernel
+{
+public:
+    float sink = 0.0f;      // accumulates output, copied to BenchSink when the kernel is done
+
+    virtual ~BenchKernel() {}
+    virtual void run(size_t frames) = 0;
+};
+
+
+class NoiseSource       // cheap, deterministic excitation
+{
+private:
+    uint32_t state = 0x2468ace1;
+
+public:
+    float next()
+    {
+        state = 1664525u*state + 1013904223u;
+        return static_cast<float>(static_cast<int32_t>(state)) / 2147483648.0f;
+    }
+};
+
+
+template <typename mesh_t>
+class MeshKernel : public BenchKernel
+{
+private:
+    mesh_t mesh;
+    MeshAudioParameters mp;
+    NoiseSource noise;
+
+public:
+    MeshKernel()
+    {
+        mp = CreateHex(mesh);
+    }
+
+    void run(size_t frames) override
+    {
+        const float dt = 1.0f / BENCH_SAMPLE_RATE;
+        for (size_t i = 0; i < frames; ++i)
+        {
+            mesh.SetBallPosition(mp.leftInputBallIndex, mesh.GetBallOrigin(mp.leftInputBallIndex) + (1.0e-4f * noise.next()) * mp.leftInputDir1);
+            mesh.Update(dt, 1.0f);
+            sink += mesh.GetBallDisplacement(mp.leftOutputBallIndex).s[0];
+        }
+    }
+};
+
+
+template <typename mesh_t>
+class PlateKernel : public BenchKernel
+{
+private:
+    MeshTopology topology;
+    mesh_t mesh;
+    int outputBallIndex;
+    int steps = 0;
+
+public:
+    PlateKernel()
+    {
+        CreateHexPlate(topology, 24, 20);
+        mesh.Attach(topology);
+        outputBallIndex = topology.NumBalls() / 2;
+    }
+
+    void run(size_t frames) override
+    {
+        const float dt = 1.0f / BENCH_SAMPLE_RATE;
+        for (size_t i = 0; i < frames; ++i)
+        {
+            // Pluck a ball every now and then so the plate keeps ringing.
+            if (steps++ % 10000 == 0)
+                mesh.SetBallPosition(outputBallIndex / 2, topology.GetBallOrigin(outputBallIndex / 2) + PhysicsVector(0.0f, 0.0f, 2.0e-4f, 0.0f));
+            mesh.Update(dt, 1.0f);
+            sink += mesh.GetBallDisplacement(outputBallIndex).s[2];
+        }
+    }
+};
+
+
+template <typename engine_t>
+class ElastikaKernel : public BenchKernel
+{
+private:
+    engine_t engine;
+    NoiseSource noise;
+
+public:
+    void run(size_t frames) override
+    {
+        float left, right;
+        for (size_t i = 0; i < frames; ++i)
+        {
+            engine.process(BENCH_SAMPLE_RATE, noise.next(), noise.next(), left, right);
+            sink += left + right;
+        }
+    }
+};
+
+
+template <int VOICES, TubeInterpolation MODE = TubeInterpolation::Sinc>
+class TubeUnitKernel : public BenchKernel
+{
+private:
+    TubeUnitEngine engine[VOICES];
+
+public:
+    TubeUnitKernel()
+    {
+        for (int v = 0; v < VOICES; ++v)
+        {
+            engine[v].setSampleRate(BENCH_SAMPLE_RATE);
+            engine[v].setAirflow(1.0f);
+            // Spread the voices over a few octaves, like a polyphonic chord,
+            // so each one has a different delay line length.
+            engine[v].setRootFrequency(4.0f * std::pow(2.0f, 2.7279248f + v/4.0f));
+            engine[v].setInterpolation(MODE);
+        }
+    }
+
+    void run(size_t frames) override
+    {
+        // Process all voices for each sample, the same way TubeUnitModule does.
+        float left, right;
+        for (size_t i = 0; i < frames; ++i)
+        {
+            for (int v = 0; v < VOICES; ++v)
+            {
+                engine[v].process(left, right, 0.0f, 0.0f);
+                sink += left + right;
+            }
+        }
+    }
+};
+
+
+static rack::plugin::Plugin& SapphirePlugin()
+{
+    static rack::plugin::Plugin plugin;
+    if (plugin.models.empty())
+        init(&plugin);
+    return plugin;
+}
+
+
+class ModuleKernel : public BenchKernel
+{
+protected:
+    std::unique_ptr<rack::engine::Module> module;
+    rack::engine::Module::ProcessArgs args;
+
+    static void Verify(int id, const char *kind, const char *name)
+    {
+        if (id < 0)
+            throw std::runtime_error(std::string("Module has no ") + kind + " named '" + name + "'");
+    }
+
+    rack::engine::Input& input(const char *name, int channels)
+    {
+        // Connecting a cable is simply a matter of giving the port some channels.
+        int id = module->findInput(name);
+        Verify(id, "input", name);
+        module->inputs[id].channels = channels;
+        return module->inputs[id];
+    }
+
+    rack::engine::Output& output(const char *name)
+    {
+        int id = module->findOutput(name);
+        Verify(id, "output", name);
+        module->outputs[id].channels = 1;
+        return module->outputs[id];
+    }
+
+    rack::engine::Param& param(const char *name)
+    {
+        int id = module->findParam(name);
+        Verify(id, "parameter", name);
+        return module->params[id];
+    }
+
+    void process()
+    {
+        module->process(args);
+        ++args.frame;
+    }
+
+public:
+    explicit ModuleKernel(const char *slug)
+    {
+        rack::plugin::Model *model = SapphirePlugin().getModel(slug);
+        if (model == nullptr)
+            throw std::runtime_error(std::string("No module with slug ") + slug);
+        module.reset(model->createModule());
+
+        args.sampleRate = BENCH_SAMPLE_RATE;
+        args.sampleTime = 1.0f / BENCH_SAMPLE_RATE;
+        args.frame = 0;
+        module->onSampleRateChange({args.sampleRate, args.sampleTime});
+    }
+};
+
+
+class Lfo       // slow triangle wave in [-5, +5] volts, for scripted CV
+{
+private:
+    float phase;
+    float step;
+
+public:
+    Lfo(float frequencyHz, float startPhase)
+        : phase(startPhase)
+        , step(frequencyHz / BENCH_SAMPLE_RATE)
+        {}
+
+    float next()
+    {
+        phase += step;
+        if (phase >= 1.0f)
+            phase -= 1.0f;
+        return 20.0f * std::abs(phase - 0.5f) - 5.0f;
+    }
+};
+
+
+class ElastikaModuleKernel : public ModuleKernel
+{
+private:
+    static const int CV_COUNT = 5;
+    rack::engine::Input *cv[CV_COUNT];
+    std::vector<Lfo> lfo;
+    rack::engine::Input& leftIn;
+    rack::engine::Input& rightIn;
+    rack::engine::Output& leftOut;
+    rack::engine::Output& rightOut;
+    NoiseSource noise;
+
+public:
+    ElastikaModuleKernel()
+        : ModuleKernel("Elastika")
+        , leftIn(input("Left audio", 1))
+        , rightIn(input("Right audio", 1))
+        , leftOut(output("Left audio"))
+        , rightOut(output("Right audio"))
+    {
+        const char *names[CV_COUNT] = {"Friction", "Stiffness", "Spring span", "Magnetic field", "Impurity mass"};
+        for (int i = 0; i < CV_COUNT; ++i)
+        {
+            cv[i] = &input((std::string(names[i]) + " CV").c_str(), 1);
+            param((std::string(names[i]) + " attenuverter").c_str()).setValue(0.2f);
+            lfo.push_back(Lfo(0.1f + 0.07f*i, 0.2f*i));
+        }
+    }
+
+    void run(size_t frames) override
+    {
+        for (size_t i = 0; i < frames; ++i)
+        {
+            for (int k = 0; k < CV_COUNT; ++k)
+                cv[k]->setVoltage(lfo[k].next());
+            leftIn.setVoltage(5.0f * noise.next());
+            rightIn.setVoltage(5.0f * noise.next());
+            process();
+            sink += leftOut.getVoltage() + rightOut.getVoltage();
+        }
+    }
+};
+
+
+class TubeUnitModuleKernel : public ModuleKernel
+{
+private:
+    static const int CHANNELS = 16;
+    rack::engine::Input& airflow;
+    rack::engine::Input& vent;
+    rack::engine::Output& leftOut;
+    rack::engine::Output& rightOut;
+    Lfo airflowLfo {0.3f, 0.0f};
+
+public:
+    TubeUnitModuleKernel()
+        : ModuleKernel("TubeUnit")
+        , airflow(input("Airflow CV", 1))
+        , vent(input("Vent gate", CHANNELS))
+        , leftOut(output("Left audio"))
+        , rightOut(output("Right audio"))
+    {
+        // A 16-note chord on the polyphonic pitch input.
+        rack::engine::Input& pitch = input("Root frequency CV", CHANNELS);
+        for (int c = 0; c < CHANNELS; ++c)
+            pitch.setVoltage(c / 4.0f - 2.0f, c);
+        param("Root frequency attenuverter").setValue(0.125f);
+        param("Airflow attenuverter").setValue(0.1f);
+    }
+
+    void run(size_t frames) override
+    {
+        for (size_t i = 0; i < frames; ++i)
+        {
+            // Staggered gates open and close each voice's vent about twice per second.
+            const int64_t t = args.frame;
+            for (int c = 0; c < CHANNELS; ++c)
+                vent.setVoltage((((t + 1379*c) / 11025) % 4 == 0) ? 10.0f : 0.0f, c);
+            airflow.setVoltage(airflowLfo.next());
+            process();
+            for (int c = 0; c < leftOut.getChannels(); ++c)
+                sink += leftOut.getVoltage(c) + rightOut.getVoltage(c);
+        }
+    }
+};
+
+
+class MootsModuleKernel : public ModuleKernel
+{
+private:
+    static const int CONTROLLERS = 5;
+    static const int CHANNELS = 16;
+    rack::engine::Input *signal[CONTROLLERS];
+    rack::engine::Input *gate[CONTROLLERS];
+    rack::engine::Output *out[CONTROLLERS];
+    NoiseSource noise;
+
+public:
+    MootsModuleKernel()
+        : ModuleKernel("Moots")
+    {
+        for (int k = 0; k < CONTROLLERS; ++k)
+        {
+            std::string number = std::to_string(k+1);
+            signal[k] = &input(("Signal " + number).c_str(), CHANNELS);
+            gate[k] = &input(("Gate " + number).c_str(), 1);
+            out[k] = &output(("Signal " + number).c_str());
+        }
+
+        // Turn on anti-click ramping everywhere, the same way a saved patch would.
+        json_t *root = json_object();
+        json_t *flags = json_array();
+        for (int k = 0; k < CONTROLLERS; ++k)
+            json_array_append_new(flags, json_true());
+        json_object_set_new(root, "slew", flags);
+        module->dataFromJson(root);
+        json_decref(root);
+    }
+
+    void run(size_t frames) override
+    {
+        for (size_t i = 0; i < frames; ++i)
+        {
+            // Each controller toggles at its own rate, so ramps happen often.
+            const int64_t t = args.frame;
+            for (int k = 0; k < CONTROLLERS; ++k)
+            {
+                gate[k]->setVoltage(((t / (2205*(k+1))) % 2 == 0) ? 10.0f : 0.0f);
+                const float x = noise.next();
+                for (int c = 0; c < CHANNELS; ++c)
+                    signal[k]->setVoltage(x, c);
+            }
+            process();
+            for (int k = 0; k < CONTROLLERS; ++k)
+                sink += out[k]->getVoltage(0);
+        }
+    }
+};
+
+
+template <typename kernel_t>
+static std::unique_ptr<BenchKernel> Create()
+{
+    return std::unique_ptr<BenchKernel>(new kernel_t);
+}
+
+
+struct BenchEntry
+{
+    const char *name;
+    const char *description;
+    std::unique_ptr<BenchKernel> (*create)();
+};
+
+
+static const BenchEntry BenchTable[] =
+{
+    { "elastika",   "ElastikaEngine::process, noise input",         Create<ElastikaKernel<ElastikaEngine>>          },
+    { "elastika-dynamic", "DynamicElastikaEngine::process, noise input",    Create<ElastikaKernel<DynamicElastikaEngine>>   },
+    { "mesh",       "PhysicsMesh::Update on the Elastika hex mesh", Create<MeshKernel<PhysicsMesh>>     },
+    { "mesh-fixed", "FixedHexMesh::Update, topology known at compile time", Create<MeshKernel<FixedHexMesh>>    },
+    { "mesh-lattice", "LatticeMesh::Update on the Elastika hex mesh", Create<MeshKernel<LatticeMesh>>   },
+    { "plate",      "PhysicsMesh::Update, 24 x 20 hexagon plate",   Create<PlateKernel<PhysicsMesh>>    },
+    { "plate-lattice", "LatticeMesh::Update, 24 x 20 hexagon plate",    Create<PlateKernel<LatticeMesh>>    },
+    { "tubeunit",   "TubeUnitEngine::process, 1 voice",             Create<TubeUnitKernel<1>>   },
+    { "tubeunit16", "TubeUnitEngine::process, 16 voices",           Create<TubeUnitKernel<16>>  },
+    { "tu16-linear",  "16 voices, linear interpolation",            Create<TubeUnitKernel<16, TubeInterpolation::Linear>>   },
+    { "tu16-hermite", "16 voices, cubic Hermite interpolation",     Create<TubeUnitKernel<16, TubeInterpolation::Hermite>>  },
+    { "tu16-thiran",  "16 voices, Thiran allpass interpolation",    Create<TubeUnitKernel<16, TubeInterpolation::Thiran>>   },
+    { "mod-elastika", "ElastikaModule::process with CV and audio",  Create<ElastikaModuleKernel>    },
+    { "mod-tubeunit", "TubeUnitModule::process, 16-channel poly CV and gates",  Create<TubeUnitModuleKernel>    },
+    { "mod-moots",    "Moots::process, 5 x 16-channel audio, gates toggling",   Create<MootsModuleKernel>       },
+    { nullptr, nullptr, nullptr }
+};
+
+
+static int KernelNameWidth()
+{
+    // Wide enough for the longest kernel name, so the columns line up.
+    int width = 0;
+    for (int i = 0; BenchTable[i].name; ++i)
+        width = std::max(width, static_cast<int>(strlen(BenchTable[i].name)));
+    return width;
+}
+
+
+static double EstimatePitch(TubeInterpolation mode, float rootFrequencyHz)
+{
+    // Let a Tube Unit voice settle into a steady tone, then find its period
+    // from the peak of the autocorrelation near the expected period.
+    // A parabola through the peak and its neighbors refines the period to a fraction of a sample.
+    TubeUnitEngine engine;
+    engine.setSampleRate(BENCH_SAMPLE_RATE);
+    engine.setAirflow(1.0f);
+    engine.setRootFrequency(rootFrequencyHz);
+    engine.setInterpolation(mode);
+
+    const int settle = static_cast<int>(BENCH_SAMPLE_RATE);
+    const int length = static_cast<int>(BENCH_SAMPLE_RATE);
+    std::vector<float> signal(length);
+    float left, right;
+    for (int i = 0; i < settle; ++i)
+        engine.process(left, right, 0.0f, 0.0f);
+    for (int i = 0; i < length; ++i)
+    {
+        engine.process(left, right, 0.0f, 0.0f);
+        signal[i] = left;
+    }
+
+    const double expected = BENCH_SAMPLE_RATE / rootFrequencyHz;
+    const int minLag = static_cast<int>(0.7 * expected);
+    const int maxLag = static_cast<int>(1.4 * expected) + 1;
+    const int window = length - maxLag - 1;
+    std::vector<double> corr(maxLag + 2);
+    for (int lag = minLag - 1; lag <= maxLag + 1; ++lag)
+    {
+        double sum = 0.0;
+        for (int i = 0; i < window; ++i)
+            sum += static_cast<double>(signal[i]) * signal[i + lag];
+        corr[lag] = sum;
+    }
+
+    int best = minLag;
+    for (int lag = minLag; lag <= maxLag; ++lag)
+        if (corr[lag] > corr[best])
+            best = lag;
+
+    const double a = corr[best-1];
+    const double b = corr[best];
+    const double c = corr[best+1];
+    const double denom = a - 2*b + c;
+    const double shift = (denom != 0.0) ? 0.5 * (a - c) / denom : 0.0;
+    return BENCH_SAMPLE_RATE / (best + shift);
+}
+
+
+static void PitchReport()
+{
+    // Compare the pitch produced by each cheaper interpolation tier against the windowed sinc.
+    const float frequencies[] = { 55.0f, 220.0f, 880.0f };
+    const int nfreq = sizeof(frequencies) / sizeof(frequencies[0]);
+    const struct { const char *name; TubeInterpolation mode; } tiers[] =
+    {
+        { "linear",  TubeInterpolation::Linear  },
+        { "hermite", TubeInterpolation::Hermite },
+        { "thiran",  TubeInterpolation::Thiran  },
+    };
+
+    double reference[nfreq];
+    printf("\nTube Unit pitch error relative to windowed sinc [cents]\n");
+    printf("%-12s", "tier");
+    for (int f = 0; f < nfreq; ++f)
+    {
+        reference[f] = EstimatePitch(TubeInterpolation::Sinc, frequencies[f]);
+        char heading[32];
+        snprintf(heading, sizeof(heading), "%0.0f Hz", frequencies[f]);
+        printf(" %10s", heading);
+    }
+    printf("\n");
+
+    for (const auto& tier : tiers)
+    {
+        printf("%-12s", tier.name);
+        for (int f = 0; f < nfreq; ++f)
+            printf(" %10.3f", 1200.0 * std::log2(EstimatePitch(tier.mode, frequencies[f]) / reference[f]));
+        printf("\n");
+    }
+}
+
+
+struct BenchOptions
+{
+    bool perf = false;
+    bool pitch = false;
+    size_t frames = 200000;
+    int repeats = 5;
+    std::vector<std::string> names;
+};
+
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "USAGE:\n"
+        "    bench [-p] [-t] [-n samples] [-r repeats] [kernel ...]\n"
+        "\n"
+        "    -p          also measure hardware performance counters (Linux perf_event)\n"
+        "    -t          also report Tube Unit pitch error for each interpolation tier\n"
+        "    -n samples  samples processed per repeat [default 200000]\n"
+        "    -r repeats  number of timed repeats; the fastest is reported [default 5]\n"
+        "\n"
+        "KERNELS:\n"
+    );
+
+    for (int i = 0; BenchTable[i].name; ++i)
+        fprintf(stderr, "    %-*s  %s\n", KernelNameWidth(), BenchTable[i].name, BenchTable[i].description);
+}
+
+
+static std::string FormatPerSample(const PerfReading& reading, PerfEvent event, double frames)
+{
+    if (!reading.has(event))
+        return "-";
+    char text[32];
+    snprintf(text, sizeof(text), "%0.3f", reading.get(event) / frames);
+    return text;
+}
+
+
+static void RunKernel(const BenchEntry& entry, const BenchOptions& opt, PerfCounters& perf)
+{
+    using namespace std::chrono;
+
+    std::unique_ptr<BenchKernel> kernel = entry.create();
+    kernel->run(opt.frames / 10);      // warm up caches and let the engine settle
+
+    double bestSeconds = 1.0e+30;
+    PerfReading total;
+    for (int r = 0; r < opt.repeats; ++r)
+    {
+        if (perf.IsOpen())
+            perf.Start();
+
+        auto start = steady_clock::now();
+        kernel->run(opt.frames);
+        auto finish = steady_clock::now();
+
+        if (perf.IsOpen())
+            total.add(perf.Stop());
+
+        bestSeconds = std::min(bestSeconds, duration<double>(finish - start).count());
+    }
+
+    const double nsPerSample = 1.0e+9 * bestSeconds / opt.frames;
+    const double realtime = 1.0e+9 / (nsPerSample * BENCH_SAMPLE_RATE);
+    printf("%-*s %10.2f %10.1f", KernelNameWidth(), entry.name, nsPerSample, realtime);
+
+    if (perf.IsOpen())
+    {
+        const double frames = static_cast<double>(opt.frames) * opt.repeats;
+        std::string ipc = "-";
+        if (total.has(PerfEvent::Cycles) && total.has(PerfEvent::Instructions) && total.get(PerfEvent::Cycles) > 0.0)
+        {
+            char text[32];
+            snprintf(text, sizeof(text), "%0.2f", total.get(PerfEvent::Instructions) / total.get(PerfEvent::Cycles));
+            ipc = text;
+        }
+        printf(" %8s %10s %10s %10s %10s",
+            ipc.c_str(),
+            FormatPerSample(total, PerfEvent::Cycles, frames).c_str(),
+            FormatPerSample(total, PerfEvent::L1dMisses, frames).c_str(),
+            FormatPerSample(total, PerfEvent::LlcMisses, frames).c_str(),
+            FormatPerSample(total, PerfEvent::BranchMisses, frames).c_str());
+    }
+
+    printf("\n");
+    BenchSink = kernel->sink;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    // VCV Rack runs its engine threads with denormals flushed to zero.
+    // Do the same, or a mesh ringing down slowly fills with denormals and crawls.
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+    BenchOptions opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-p"))
+            opt.perf = true;
+        else if (!strcmp(argv[i], "-t"))
+            opt.pitch = true;
+        else if (!strcmp(argv[i], "-n") && i+1 < argc)
+            opt.frames = static_cast<size_t>(std::max(1, atoi(argv[++i])));
+        else if (!strcmp(argv[i], "-r") && i+1 < argc)
+            opt.repeats = std::max(1, atoi(argv[++i]));
+        else if (argv[i][0] == '-')
+        {
+            PrintUsage();
+            return 1;
+        }
+        else
+            opt.names.push_back(argv[i]);
+    }
+
+    for (const std::string& name : opt.names)
+    {
+        bool found = false;
+        for (int i = 0; BenchTable[i].name; ++i)
+            found = found || (name == BenchTable[i].name);
+        if (!found)
+        {
+            fprintf(stderr, "bench: unknown kernel '%s'\n", name.c_str());
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    PerfCounters perf;
+    if (opt.perf)
+    {
+        std::string reason;
+        if (!perf.Open(reason))
+            printf("bench: hardware counters unavailable; reporting time only. %s\n", reason.c_str());
+    }
+
+    printf("%-*s %10s %10s", KernelNameWidth(), "kernel", "ns/sample", "realtime");
+    if (perf.IsOpen())
+        printf(" %8s %10s %10s %10s %10s", "IPC", "cyc/smp", "L1D/smp", "LLC/smp", "brmiss/smp");
+    printf("\n");
+
+    for (int i = 0; BenchTable[i].name; ++i)
+        if (opt.names.empty() || std::find(opt.names.begin(), opt.names.end(), BenchTable[i].name) != opt.names.end())
+            RunKernel(BenchTable[i], opt, perf);
+
+    if (opt.pitch)
+        PitchReport();
+
+    return 0;
+}
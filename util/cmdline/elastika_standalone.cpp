@@ -7,7 +7,7 @@
 #include <string>
 #include <vector>
 #include "elastika_engine.hpp"
-#include "wavefile.hpp"
+#include "async_wavefile.hpp"
 
 int main()
 {
@@ -34,7 +34,8 @@ int main()
     engine.setInputTilt(0.5);
     engine.setOutputTilt(0.5);
 
-    WaveFileWriter wave;
+    // Encode and write audio on a background thread, so disk I/O does not stall the engine.
+    AsyncWaveWriter<WaveFileWriter> wave;
     const char *filename = "test/elastika.wav";
     if (!wave.Open(filename, SAMPLE_RATE, CHANNELS))
     {
@@ -55,5 +56,7 @@ int main()
         }
     }
 
+    wave.Close();
+    engine.getProfile().print(stdout, "Elastika");
     return 0;
 }
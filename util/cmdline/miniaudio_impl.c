@@ -0,0 +1,16 @@
+/*
+    miniaudio_impl.c  -  Don Cross <cosinekitty@gmail.com>
+
+    Compiles the miniaudio implementation once, as its own object file,
+    so that tools using it do not pay for recompiling it every time.
+    Only the low-level device API is needed.
+*/
+
+#define MINIAUDIO_IMPLEMENTATION
+#define MA_NO_DECODING
+#define MA_NO_ENCODING
+#define MA_NO_GENERATION
+#define MA_NO_RESOURCE_MANAGER
+#define MA_NO_NODE_GRAPH
+#define MA_NO_ENGINE
+#include "miniaudio.h"
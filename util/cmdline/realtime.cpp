@@ -0,0 +1,399 @@
+/*
+    realtime.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Runs a Sapphire engine inside a real audio device callback, using miniaudio,
+    and measures how much of each buffer's deadline the engine consumes.
+    With the null backend (-n), the same measurement works on machines
+    without audio hardware, such as continuous integration servers.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "miniaudio.h"
+#include "render_engine.hpp"
+
+using namespace Sapphire;
+
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "USAGE:\n"
+        "    realtime engine [options] [name=value ...]\n"
+        "\n"
+        "    engine        elastika or tubeunit\n"
+        "    name=value    set an engine parameter; run `sweep -p engine` for the list\n"
+        "\n"
+        "OPTIONS:\n"
+        "    -n            use miniaudio's null backend instead of a real audio device\n"
+        "    -p frames     buffer sizes to test, comma separated [default 32,64]\n"
+        "    -r rate       sample rate [default 48000]\n"
+        "    -d seconds    how long to run each buffer size [default 5]\n"
+        "    -x            excite the engine with white noise instead of silence\n"
+        "    -l file.csv   log every callback's duration and headroom\n"
+        "\n"
+        "Exits with status 2 if any callback missed its deadline.\n"
+    );
+}
+
+
+struct RealtimeOptions
+{
+    std::string engineName;
+    bool nullBackend = false;
+    std::vector<int> periods { 32, 64 };
+    int sampleRate = 48000;
+    double seconds = 5.0;
+    bool noise = false;
+    std::string logFileName;
+    std::vector<std::pair<std::string, float>> settings;
+};
+
+
+static bool ParseCommandLine(int argc, const char *argv[], RealtimeOptions& opt)
+{
+    if (argc < 2)
+        return false;
+
+    opt.engineName = argv[1];
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = (i+1 < argc);
+        if (arg == "-n")
+            opt.nullBackend = true;
+        else if (arg == "-x")
+            opt.noise = true;
+        else if (arg == "-r" && hasValue)
+            opt.sampleRate = atoi(argv[++i]);
+        else if (arg == "-d" && hasValue)
+            opt.seconds = atof(argv[++i]);
+        else if (arg == "-l" && hasValue)
+            opt.logFileName = argv[++i];
+        else if (arg == "-p" && hasValue)
+        {
+            opt.periods.clear();
+            const char *p = argv[++i];
+            while (*p)
+            {
+                char *end;
+                long frames = strtol(p, &end, 10);
+                if (end == p || frames < 1)
+                    return false;
+                opt.periods.push_back(static_cast<int>(frames));
+                p = (*end == ',') ? end + 1 : end;
+            }
+        }
+        else
+        {
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos || eq == 0)
+                return false;
+            opt.settings.push_back(std::make_pair(arg.substr(0, eq), static_cast<float>(atof(arg.c_str() + eq + 1))));
+        }
+    }
+
+    return !opt.periods.empty() && opt.sampleRate >= 1000 && opt.seconds > 0.0;
+}
+
+
+struct CallbackRecord
+{
+    uint32_t frames;
+    float micros;       // time spent inside the callback
+};
+
+
+class RealtimeHost
+{
+private:
+    static const size_t MAX_FRAMES = 4096;      // the engine is fed in chunks of at most this many frames
+
+    RenderEngine& engine;
+    const bool noise;
+    const double sampleRate;
+    float left[MAX_FRAMES];
+    float right[MAX_FRAMES];
+    uint32_t rand = 0x12345678;
+
+    // Statistics are written only by the audio thread while the device runs,
+    // and read by the main thread only after `done` is set or the device is stopped.
+    std::vector<CallbackRecord> log;    // preallocated: the callback never allocates
+    size_t logCount = 0;
+    uint64_t framesRemaining = 0;
+    std::atomic<bool> done {false};
+
+    float noiseSample()
+    {
+        // A tiny LCG: cheap, deterministic, and allocation-free.
+        rand = 1664525u*rand + 1013904223u;
+        return static_cast<float>(static_cast<int32_t>(rand)) / 2147483648.0f;
+    }
+
+    void render(float *output, uint32_t frameCount)
+    {
+        uint32_t offset = 0;
+        while (offset < frameCount)
+        {
+            const uint32_t n = std::min(frameCount - offset, static_cast<uint32_t>(MAX_FRAMES));
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                left[i]  = noise ? noiseSample() : 0.0f;
+                right[i] = noise ? noiseSample() : 0.0f;
+            }
+
+            engine.process(n, left, right, left, right);
+
+            // Engines produce voltages. Bring them back to digital full scale for the device.
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                output[2*(offset+i)]   = 0.2f * left[i];
+                output[2*(offset+i)+1] = 0.2f * right[i];
+            }
+            offset += n;
+        }
+    }
+
+public:
+    RealtimeHost(RenderEngine& _engine, bool _noise, int _sampleRate)
+        : engine(_engine)
+        , noise(_noise)
+        , sampleRate(_sampleRate)
+        {}
+
+    void prepare(double seconds, int period)
+    {
+        framesRemaining = static_cast<uint64_t>(seconds * sampleRate);
+        // Backends may deliver smaller buffers than requested. Leave plenty of room for that.
+        log.assign(4 * (framesRemaining / period + 16), CallbackRecord{});
+        logCount = 0;
+        done = false;
+    }
+
+    bool isDone() const { return done.load(std::memory_order_acquire); }
+    const CallbackRecord *records() const { return log.data(); }
+    size_t recordCount() const { return logCount; }
+
+    static void Callback(ma_device* device, void* output, const void* input, ma_uint32 frameCount)
+    {
+        RealtimeHost& host = *static_cast<RealtimeHost *>(device->pUserData);
+        float *out = static_cast<float *>(output);
+        if (host.done.load(std::memory_order_relaxed))
+        {
+            std::fill(out, out + 2*frameCount, 0.0f);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        host.render(out, frameCount);
+        auto finish = std::chrono::steady_clock::now();
+
+        if (host.logCount < host.log.size())
+        {
+            CallbackRecord& rec = host.log[host.logCount++];
+            rec.frames = frameCount;
+            rec.micros = std::chrono::duration<float, std::micro>(finish - start).count();
+        }
+
+        if (frameCount >= host.framesRemaining || host.logCount == host.log.size())
+            host.done.store(true, std::memory_order_release);
+        else
+            host.framesRemaining -= frameCount;
+    }
+};
+
+
+struct PeriodReport
+{
+    int period = 0;
+    size_t callbacks = 0;
+    size_t xruns = 0;
+    size_t oddSizes = 0;        // callbacks whose buffer size differed from the requested period
+    float meanMicros = 0.0f;
+    float maxMicros = 0.0f;
+    float p99Micros = 0.0f;
+    float minHeadroom = 1.0f;   // fraction of the deadline left over in the worst callback
+    float meanHeadroom = 1.0f;
+};
+
+
+static PeriodReport Summarize(int period, int sampleRate, const CallbackRecord *rec, size_t count, FILE *logFile)
+{
+    PeriodReport report;
+    report.period = period;
+    report.callbacks = count;
+    if (count == 0)
+        return report;
+
+    std::vector<float> durations(count);
+    double sumMicros = 0.0;
+    double sumHeadroom = 0.0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float deadline = 1.0e+6f * rec[i].frames / sampleRate;
+        const float headroom = 1.0f - rec[i].micros / deadline;
+        durations[i] = rec[i].micros;
+        sumMicros += rec[i].micros;
+        sumHeadroom += headroom;
+        report.maxMicros = std::max(report.maxMicros, rec[i].micros);
+        report.minHeadroom = std::min(report.minHeadroom, headroom);
+        if (headroom < 0.0f)
+            ++report.xruns;
+        if (rec[i].frames != static_cast<uint32_t>(period))
+            ++report.oddSizes;
+        if (logFile != nullptr)
+            fprintf(logFile, "%d,%u,%0.3f,%0.3f,%0.5f\n", period, rec[i].frames, rec[i].micros, deadline, headroom);
+    }
+
+    std::sort(durations.begin(), durations.end());
+    report.p99Micros = durations[std::min(count - 1, (count * 99) / 100)];
+    report.meanMicros = static_cast<float>(sumMicros / count);
+    report.meanHeadroom = static_cast<float>(sumHeadroom / count);
+    return report;
+}
+
+
+static int RunPeriod(
+    ma_context& context,
+    RealtimeHost& host,
+    const RealtimeOptions& opt,
+    int period,
+    FILE *logFile,
+    PeriodReport& report)
+{
+    host.prepare(opt.seconds, period);
+
+    ma_device_config config = ma_device_config_init(ma_device_type_playback);
+    config.playback.format = ma_format_f32;
+    config.playback.channels = 2;
+    config.sampleRate = static_cast<ma_uint32>(opt.sampleRate);
+    config.periodSizeInFrames = static_cast<ma_uint32>(period);
+    config.performanceProfile = ma_performance_profile_low_latency;
+    config.noPreSilencedOutputBuffer = MA_TRUE;
+    config.noClip = MA_TRUE;
+    config.dataCallback = RealtimeHost::Callback;
+    config.pUserData = &host;
+
+    ma_device device;
+    if (ma_device_init(&context, &config, &device) != MA_SUCCESS)
+    {
+        fprintf(stderr, "realtime: cannot open playback device for %d-frame buffers.\n", period);
+        return 1;
+    }
+
+    if (device.sampleRate != config.sampleRate)
+        fprintf(stderr, "realtime: WARNING: device runs at %u Hz, not %d Hz.\n", device.sampleRate, opt.sampleRate);
+
+    if (ma_device_start(&device) != MA_SUCCESS)
+    {
+        ma_device_uninit(&device);
+        fprintf(stderr, "realtime: cannot start playback device.\n");
+        return 1;
+    }
+
+    // Give up if the device stops calling us: allow double the expected time, plus a second.
+    auto timeout = std::chrono::steady_clock::now() + std::chrono::duration<double>(2.0*opt.seconds + 1.0);
+    while (!host.isDone() && std::chrono::steady_clock::now() < timeout)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    ma_device_uninit(&device);      // stops the device and joins its thread
+
+    report = Summarize(period, opt.sampleRate, host.records(), host.recordCount(), logFile);
+    if (!host.isDone())
+    {
+        fprintf(stderr, "realtime: timed out waiting for the device after %d callbacks.\n", static_cast<int>(report.callbacks));
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    RealtimeOptions opt;
+    if (!ParseCommandLine(argc, argv, opt))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(opt.engineName);
+    if (!engine)
+    {
+        fprintf(stderr, "realtime: unknown engine: %s\n", opt.engineName.c_str());
+        return 1;
+    }
+
+    engine->setSampleRate(static_cast<float>(opt.sampleRate));
+    for (const auto& setting : opt.settings)
+    {
+        int id = engine->findParameter(setting.first);
+        if (id < 0)
+        {
+            fprintf(stderr, "realtime: engine %s has no parameter named '%s'\n", opt.engineName.c_str(), setting.first.c_str());
+            return 1;
+        }
+        engine->setParameter(id, setting.second);
+    }
+
+    ma_context context;
+    ma_backend nullBackend[] = { ma_backend_null };
+    if (ma_context_init(opt.nullBackend ? nullBackend : nullptr, opt.nullBackend ? 1 : 0, nullptr, &context) != MA_SUCCESS)
+    {
+        fprintf(stderr, "realtime: cannot initialize audio context.\n");
+        return 1;
+    }
+
+    FILE *logFile = nullptr;
+    if (!opt.logFileName.empty())
+    {
+        logFile = fopen(opt.logFileName.c_str(), "wt");
+        if (logFile == nullptr)
+        {
+            fprintf(stderr, "realtime: cannot create log file: %s\n", opt.logFileName.c_str());
+            ma_context_uninit(&context);
+            return 1;
+        }
+        fprintf(logFile, "period,frames,micros,deadline_micros,headroom\n");
+    }
+
+    printf("realtime: %s on the %s backend at %d Hz, %0.1f seconds per buffer size.\n",
+        engine->name(), ma_get_backend_name(context.backend), opt.sampleRate, opt.seconds);
+    printf("%8s %10s %8s %8s %10s %10s %10s %10s %10s\n",
+        "period", "callbacks", "xruns", "resized", "mean_us", "p99_us", "max_us", "headroom", "worst");
+
+    int rc = 0;
+    size_t totalXruns = 0;
+    auto host = std::unique_ptr<RealtimeHost>(new RealtimeHost(*engine, opt.noise, opt.sampleRate));
+    for (int period : opt.periods)
+    {
+        PeriodReport report;
+        if (RunPeriod(context, *host, opt, period, logFile, report))
+        {
+            rc = 1;
+            break;
+        }
+        totalXruns += report.xruns;
+        printf("%8d %10d %8d %8d %10.2f %10.2f %10.2f %9.1f%% %9.1f%%\n",
+            report.period, static_cast<int>(report.callbacks), static_cast<int>(report.xruns), static_cast<int>(report.oddSizes),
+            report.meanMicros, report.p99Micros, report.maxMicros, 100.0f*report.meanHeadroom, 100.0f*report.minHeadroom);
+    }
+
+    if (logFile != nullptr)
+        fclose(logFile);
+
+    ma_context_uninit(&context);
+
+    if (rc == 0 && totalXruns > 0)
+        rc = 2;
+
+    return rc;
+}
@@ -0,0 +1,171 @@
+/*
+    replay.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Replays a session that Elastika or Tube Unit captured inside VCV Rack
+    (right-click menu: "Start session capture") through the same module code,
+    built without Rack. Verifies that every output sample matches the capture
+    bit for bit, and reports the time spent in the module's process() function.
+    Real sessions can thus be profiled, for example by running this program
+    under perf, and kept as regression tests.
+
+    Usage: replay trace.sapc [-r repeats] [-o output.wav]
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <vector>
+#include "session_replay.hpp"
+#include "wavefile.hpp"
+
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "USAGE:\n"
+        "    replay trace.sapc [-r repeats] [-o output.wav]\n"
+        "\n"
+        "    -r repeats    replay the session this many times and report the fastest [default 1]\n"
+        "    -o output     write the first channel of the first two outputs to a float32 WAV file,\n"
+        "                  scaled so that 5 V is digital full scale\n"
+        "\n"
+        "Exit status is 1 if any output sample differs from the capture.\n"
+    );
+}
+
+
+struct ReplayResult
+{
+    std::string slug;
+    long frames = 0;
+    long mismatches = 0;
+    long firstMismatch = -1;
+    bool complete = false;
+    float sampleRate = 0.0f;
+    double seconds = 0.0;
+};
+
+
+static ReplayResult Replay(const std::string& traceFileName, const std::string& outFileName)
+{
+    SessionReplay replay(traceFileName);
+    WaveFileWriter wave;
+    std::vector<float> block;
+
+    while (replay.step())
+    {
+        if (!outFileName.empty())
+        {
+            if (!wave.IsOpen())
+            {
+                // A WAV file has a single sample rate: use the rate of the first frame.
+                if (!wave.Open(outFileName.c_str(), static_cast<int>(replay.sampleRate()), 2, WaveSampleFormat::Float32))
+                    throw std::runtime_error("Cannot open output file: " + outFileName);
+            }
+
+            const rack::engine::Module& module = replay.getModule();
+            for (int i = 0; i < 2; ++i)
+            {
+                float volts = (i < static_cast<int>(module.outputs.size())) ? module.outputs[i].getVoltage(0) : 0.0f;
+                block.push_back(volts / 5.0f);
+            }
+
+            if (block.size() >= 0x10000)
+            {
+                wave.WriteSamples(block.data(), block.size());
+                block.clear();
+            }
+        }
+    }
+
+    if (wave.IsOpen())
+    {
+        wave.WriteSamples(block.data(), block.size());
+        wave.Close();
+    }
+
+    ReplayResult result;
+    result.slug = replay.moduleSlug();
+    result.frames = replay.frames();
+    result.mismatches = replay.mismatches();
+    result.firstMismatch = replay.firstMismatchFrame();
+    result.complete = replay.isComplete();
+    result.sampleRate = replay.sampleRate();
+    result.seconds = replay.secondsInProcess();
+    return result;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    std::string traceFileName;
+    std::string outFileName;
+    int repeats = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-r" && i+1 < argc)
+            repeats = std::max(1, atoi(argv[++i]));
+        else if (arg == "-o" && i+1 < argc)
+            outFileName = argv[++i];
+        else if (traceFileName.empty() && arg[0] != '-')
+            traceFileName = arg;
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (traceFileName.empty())
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        ReplayResult best;
+        for (int r = 0; r < repeats; ++r)
+        {
+            ReplayResult result = Replay(traceFileName, (r == 0) ? outFileName : "");
+            if (r == 0 || result.seconds < best.seconds)
+                best = result;
+        }
+
+        printf("replay: %s, %ld frames", best.slug.c_str(), best.frames);
+        if (best.sampleRate > 0.0f)
+            printf(" (%0.3f seconds at %g Hz)", best.frames / best.sampleRate, best.sampleRate);
+        printf(".\n");
+
+        if (!best.complete)
+            printf("replay: NOTE: the capture stopped early, or was never finished. Replayed the part that was saved.\n");
+
+        if (best.frames > 0)
+        {
+            const double nsPerFrame = 1.0e9 * best.seconds / best.frames;
+            const double load = (best.sampleRate > 0.0f) ? 100.0 * best.seconds * best.sampleRate / best.frames : 0.0;
+            printf("replay: process() takes %0.1f ns per frame, %0.3f%% of real time", nsPerFrame, load);
+            if (repeats > 1)
+                printf(" (fastest of %d replays)", repeats);
+            printf(".\n");
+        }
+
+        if (best.mismatches > 0)
+        {
+            printf("replay: FAIL: %ld frames differ from the capture, starting at frame %ld.\n", best.mismatches, best.firstMismatch);
+            return 1;
+        }
+
+        printf("replay: every output sample matches the capture.\n");
+        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "replay: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,444 @@
+/*
+    stream.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Runs audio through a Sapphire engine as an effect, outside of VCV Rack.
+    Reads a WAV file or raw PCM from standard input, processes it in
+    fixed-size blocks, and writes a WAV file or raw PCM to standard output.
+    Memory use does not depend on the length of the input, so arbitrarily
+    long recordings can be processed on headless machines.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "render_engine.hpp"
+#include "async_wavefile.hpp"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+using namespace Sapphire;
+
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "USAGE:\n"
+        "    stream engine -i input -o output [options] [name=value ...]\n"
+        "\n"
+        "    engine        elastika or tubeunit\n"
+        "    -i input      input WAV file, or '-' for raw PCM on standard input\n"
+        "    -o output     output WAV file, or '-' for raw PCM on standard output\n"
+        "    name=value    set an engine parameter; run `sweep -p engine` for the list\n"
+        "\n"
+        "OPTIONS:\n"
+        "    -r rate       sample rate of raw input [default 44100]\n"
+        "    -c channels   channel count of raw input [default 2]\n"
+        "    -e encoding   raw PCM encoding for stdin/stdout: s16 or f32 [default f32]\n"
+        "    -f format     WAV output format: int16, int24, or float32 [default float32]\n"
+        "    -b frames     processing block size in sample frames [default 512]\n"
+        "    -t seconds    keep processing silence after the input ends, to let the sound ring out\n"
+        "    -v volts      voltage corresponding to digital full scale [default 5]\n"
+        "    -x            allow WAV output larger than 4 GB (RF64)\n"
+        "    -L file       start from an engine state saved earlier with -S\n"
+        "    -S file       save the engine state when processing is done\n"
+        "\n"
+        "The output is always stereo. Mono input feeds both engine inputs;\n"
+        "input channels beyond the first two are ignored.\n"
+        "Integer output is clipped to full scale; float32 output is not.\n"
+    );
+}
+
+
+enum class RawEncoding
+{
+    Int16,
+    Float32,
+};
+
+
+struct StreamOptions
+{
+    std::string engineName;
+    std::string inputName;
+    std::string outputName;
+    int rawSampleRate = 44100;
+    int rawChannels = 2;
+    RawEncoding rawEncoding = RawEncoding::Float32;
+    WaveSampleFormat waveFormat = WaveSampleFormat::Float32;
+    size_t blockFrames = 512;
+    double tailSeconds = 0.0;
+    float fullScaleVolts = 5.0f;
+    bool enableRf64 = false;
+    std::string loadStateName;
+    std::string saveStateName;
+    std::vector<std::pair<std::string, float>> settings;
+};
+
+
+static bool Fatal(const std::string& message)
+{
+    fprintf(stderr, "stream: %s\n", message.c_str());
+    return false;
+}
+
+
+static bool ParseCommandLine(int argc, const char *argv[], StreamOptions& opt)
+{
+    if (argc < 2)
+        return false;
+
+    opt.engineName = argv[1];
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = (i+1 < argc);
+        if (arg == "-i" && hasValue)
+            opt.inputName = argv[++i];
+        else if (arg == "-o" && hasValue)
+            opt.outputName = argv[++i];
+        else if (arg == "-r" && hasValue)
+            opt.rawSampleRate = atoi(argv[++i]);
+        else if (arg == "-c" && hasValue)
+            opt.rawChannels = atoi(argv[++i]);
+        else if (arg == "-b" && hasValue)
+            opt.blockFrames = static_cast<size_t>(std::max(1, atoi(argv[++i])));
+        else if (arg == "-t" && hasValue)
+            opt.tailSeconds = std::max(0.0, atof(argv[++i]));
+        else if (arg == "-v" && hasValue)
+            opt.fullScaleVolts = static_cast<float>(atof(argv[++i]));
+        else if (arg == "-x")
+            opt.enableRf64 = true;
+        else if (arg == "-L" && hasValue)
+            opt.loadStateName = argv[++i];
+        else if (arg == "-S" && hasValue)
+            opt.saveStateName = argv[++i];
+        else if (arg == "-e" && hasValue)
+        {
+            const std::string enc = argv[++i];
+            if (enc == "s16")
+                opt.rawEncoding = RawEncoding::Int16;
+            else if (enc == "f32")
+                opt.rawEncoding = RawEncoding::Float32;
+            else
+                return Fatal("unknown raw encoding: " + enc);
+        }
+        else if (arg == "-f" && hasValue)
+        {
+            const std::string fmt = argv[++i];
+            if (fmt == "int16")
+                opt.waveFormat = WaveSampleFormat::Int16;
+            else if (fmt == "int24")
+                opt.waveFormat = WaveSampleFormat::Int24;
+            else if (fmt == "float32")
+                opt.waveFormat = WaveSampleFormat::Float32;
+            else
+                return Fatal("unknown WAV format: " + fmt);
+        }
+        else
+        {
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos || eq == 0)
+                return Fatal("invalid argument: " + arg);
+            opt.settings.push_back(std::make_pair(arg.substr(0, eq), static_cast<float>(atof(arg.c_str() + eq + 1))));
+        }
+    }
+
+    if (opt.inputName.empty() || opt.outputName.empty())
+        return Fatal("both -i and -o are required");
+
+    if (opt.rawSampleRate < 1000 || opt.rawChannels < 1 || opt.fullScaleVolts <= 0.0f)
+        return Fatal("invalid raw input format or full-scale voltage");
+
+    return true;
+}
+
+
+class AudioSource       // delivers interleaved float samples from a WAV file or raw stdin
+{
+private:
+    WaveFileReader reader;
+    FILE *rawInput = nullptr;
+    RawEncoding encoding = RawEncoding::Float32;
+    std::vector<int16_t> rawBuffer;
+    int sampleRate = 0;
+    int channels = 0;
+
+public:
+    bool open(const StreamOptions& opt)
+    {
+        if (opt.inputName == "-")
+        {
+            rawInput = stdin;
+            encoding = opt.rawEncoding;
+            sampleRate = opt.rawSampleRate;
+            channels = opt.rawChannels;
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            return true;
+        }
+
+        if (!reader.Open(opt.inputName.c_str()))
+            return Fatal("cannot open input WAV file: " + opt.inputName);
+
+        sampleRate = reader.SampleRate();
+        channels = reader.Channels();
+        return true;
+    }
+
+    int getSampleRate() const { return sampleRate; }
+    int getChannels() const { return channels; }
+
+    size_t read(float *data, size_t nframes)
+    {
+        // Returns the number of complete frames read. Zero means end of input.
+        const size_t nsamples = nframes * channels;
+        size_t received;
+        if (rawInput == nullptr)
+        {
+            received = reader.Read(data, nsamples);
+        }
+        else if (encoding == RawEncoding::Float32)
+        {
+            received = fread(data, sizeof(float), nsamples, rawInput);
+        }
+        else
+        {
+            rawBuffer.resize(nsamples);
+            received = fread(rawBuffer.data(), sizeof(int16_t), nsamples, rawInput);
+            for (size_t i = 0; i < received; ++i)
+                data[i] = static_cast<float>(rawBuffer[i]) / IntSampleScale;
+        }
+        return received / channels;
+    }
+};
+
+
+class AudioSink         // accepts interleaved stereo float samples for a WAV file or raw stdout
+{
+private:
+    AsyncWaveWriter<WaveFileWriter> wave;
+    FILE *rawOutput = nullptr;
+    RawEncoding encoding = RawEncoding::Float32;
+    bool clip = true;
+    std::vector<int16_t> rawBuffer;
+    uint64_t clipCount = 0;
+
+public:
+    bool open(const StreamOptions& opt, int sampleRate)
+    {
+        if (opt.outputName == "-")
+        {
+            rawOutput = stdout;
+            encoding = opt.rawEncoding;
+            clip = (encoding != RawEncoding::Float32);
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            return true;
+        }
+
+        clip = (opt.waveFormat != WaveSampleFormat::Float32);
+        if (!wave.Open(opt.outputName.c_str(), sampleRate, 2, opt.waveFormat, opt.enableRf64))
+            return Fatal("cannot open output WAV file: " + opt.outputName);
+
+        return true;
+    }
+
+    void write(float *data, size_t nsamples)
+    {
+        if (clip)
+        {
+            for (size_t i = 0; i < nsamples; ++i)
+            {
+                const float x = std::max(-1.0f, std::min(+1.0f, data[i]));     // NAN becomes -1
+                clipCount += (x != data[i]);
+                data[i] = x;
+            }
+        }
+
+        if (rawOutput == nullptr)
+        {
+            wave.WriteSamples(data, nsamples);
+        }
+        else if (encoding == RawEncoding::Float32)
+        {
+            if (fwrite(data, sizeof(float), nsamples, rawOutput) != nsamples)
+                throw std::runtime_error("Cannot write to standard output.");
+        }
+        else
+        {
+            rawBuffer.resize(nsamples);
+            ConvertFloatToInt16(data, rawBuffer.data(), nsamples);
+            if (fwrite(rawBuffer.data(), sizeof(int16_t), nsamples, rawOutput) != nsamples)
+                throw std::runtime_error("Cannot write to standard output.");
+        }
+    }
+
+    void close()
+    {
+        if (rawOutput != nullptr)
+            fflush(rawOutput);
+        else
+            wave.Close();
+    }
+
+    uint64_t getClipCount() const { return clipCount; }
+};
+
+
+static void ReadStateFile(const std::string& fileName, std::vector<uint8_t>& state)
+{
+    FILE *infile = fopen(fileName.c_str(), "rb");
+    if (infile == nullptr)
+        throw std::runtime_error("Cannot open state file: " + fileName);
+
+    state.clear();
+    uint8_t block[4096];
+    size_t nread;
+    while ((nread = fread(block, 1, sizeof(block), infile)) > 0)
+        state.insert(state.end(), block, block + nread);
+    fclose(infile);
+}
+
+
+static void WriteStateFile(const std::string& fileName, const std::vector<uint8_t>& state)
+{
+    FILE *outfile = fopen(fileName.c_str(), "wb");
+    if (outfile == nullptr)
+        throw std::runtime_error("Cannot create state file: " + fileName);
+
+    const bool ok = (fwrite(state.data(), 1, state.size(), outfile) == state.size());
+    if (fclose(outfile) != 0 || !ok)
+        throw std::runtime_error("Cannot write state file: " + fileName);
+}
+
+
+static int Stream(const StreamOptions& opt)
+{
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(opt.engineName);
+    if (!engine)
+    {
+        Fatal("unknown engine: " + opt.engineName);
+        return 1;
+    }
+
+    for (const auto& setting : opt.settings)
+    {
+        int id = engine->findParameter(setting.first);
+        if (id < 0)
+        {
+            Fatal("engine " + opt.engineName + " has no parameter named '" + setting.first + "'");
+            return 1;
+        }
+        engine->setParameter(id, setting.second);
+    }
+
+    AudioSource source;
+    if (!source.open(opt))
+        return 1;
+
+    AudioSink sink;
+    if (!sink.open(opt, source.getSampleRate()))
+        return 1;
+
+    engine->setSampleRate(static_cast<float>(source.getSampleRate()));
+
+    std::vector<uint8_t> state;
+    if (!opt.loadStateName.empty())
+    {
+        ReadStateFile(opt.loadStateName, state);
+        engine->loadState(state);
+    }
+
+    // All buffers are allocated once, up front. Nothing below grows with the input length.
+    const int channels = source.getChannels();
+    const size_t n = opt.blockFrames;
+    std::vector<float> inBuffer(n * channels);
+    std::vector<float> left(n), right(n);
+    std::vector<float> outBuffer(2 * n);
+    const float inScale = opt.fullScaleVolts;
+    const float outScale = 1.0f / opt.fullScaleVolts;
+    const uint64_t tailFrames = static_cast<uint64_t>(opt.tailSeconds * source.getSampleRate());
+    uint64_t tailRemaining = tailFrames;
+    uint64_t totalFrames = 0;
+
+    for(;;)
+    {
+        size_t nframes = source.read(inBuffer.data(), n);
+        if (nframes > 0)
+        {
+            const int rightChannel = std::min(1, channels - 1);
+            for (size_t i = 0; i < nframes; ++i)
+            {
+                left[i]  = inScale * inBuffer[i*channels];
+                right[i] = inScale * inBuffer[i*channels + rightChannel];
+            }
+        }
+        else if (tailRemaining > 0)
+        {
+            nframes = static_cast<size_t>(std::min<uint64_t>(n, tailRemaining));
+            tailRemaining -= nframes;
+            std::fill(left.begin(), left.begin() + nframes, 0.0f);
+            std::fill(right.begin(), right.begin() + nframes, 0.0f);
+        }
+        else
+        {
+            break;
+        }
+
+        engine->process(nframes, left.data(), right.data(), left.data(), right.data());
+
+        for (size_t i = 0; i < nframes; ++i)
+        {
+            outBuffer[2*i]   = outScale * left[i];
+            outBuffer[2*i+1] = outScale * right[i];
+        }
+        sink.write(outBuffer.data(), 2*nframes);
+        totalFrames += nframes;
+    }
+
+    sink.close();
+
+    if (!opt.saveStateName.empty())
+    {
+        engine->saveState(state);
+        WriteStateFile(opt.saveStateName, state);
+    }
+
+    fprintf(stderr, "stream: processed %0.3f seconds of audio through %s",
+        static_cast<double>(totalFrames) / source.getSampleRate(), engine->name());
+    if (sink.getClipCount() > 0)
+        fprintf(stderr, "; clipped %llu samples", static_cast<unsigned long long>(sink.getClipCount()));
+    fprintf(stderr, ".\n");
+    engine->getProfile().print(stderr, engine->name());
+    return 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    StreamOptions opt;
+    if (!ParseCommandLine(argc, argv, opt))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        return Stream(opt);
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "stream: %s\n", ex.what());
+        return 1;
+    }
+}
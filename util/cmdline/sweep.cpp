@@ -0,0 +1,610 @@
+/*
+    sweep.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Renders many parameter combinations of a Sapphire engine in parallel,
+    for building preset libraries and sound-design datasets.
+
+    Usage: sweep specfile [-j threads] [-o outdir]
+
+    The spec file is plain text, one directive per line. '#' starts a comment.
+
+        engine elastika             which engine to render: elastika or tubeunit
+        samplerate 44100            sample rate in Hz
+        seconds 2.5                 length of each render
+        input impulse               excitation: silence, impulse, noise, or a WAV file name
+        points 10                   renders per grid point (useful with random parameters)
+        seed 12345                  seed for random parameter values and noise
+        output renders              output directory (overridden by -o)
+        set drive 1.3               hold a parameter at a fixed value
+        grid friction 0.1 0.9 5     sweep evenly from 0.1 to 0.9 in 5 steps
+        list curl -1 0 1            sweep an explicit list of values
+        random mass -1 1            pick a uniformly random value for every render
+
+    Grid and list parameters form a Cartesian product. Every parameter not
+    mentioned keeps its default value. Run `sweep -p engine` to list parameters.
+
+    The output directory receives one float32 WAV file per render,
+    plus index.csv listing every render's parameter values and output levels.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "render_engine.hpp"
+#include "wavefile.hpp"
+
+using namespace Sapphire;
+
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "USAGE:\n"
+        "    sweep specfile [-j threads] [-o outdir]\n"
+        "    sweep -p engine        (list the parameters of elastika or tubeunit)\n"
+    );
+}
+
+
+struct SweepAxis
+{
+    int paramId = -1;
+    bool isRandom = false;
+    float randomMin = 0.0f;
+    float randomMax = 0.0f;
+    std::vector<float> values;      // grid/list values, or a single value for `set`
+};
+
+
+struct SweepSpec
+{
+    std::string engineName;
+    int sampleRate = 44100;
+    double seconds = 2.0;
+    std::string input = "impulse";
+    int points = 1;
+    unsigned seed = 1;
+    std::string outputDir = "sweep_output";
+    std::vector<SweepAxis> axes;
+};
+
+
+struct SweepTask
+{
+    int index = 0;
+    unsigned seed = 0;
+    std::vector<float> values;      // one value per engine parameter
+};
+
+
+struct SweepResult
+{
+    bool done = false;
+    bool finite = true;
+    float peak = 0.0f;
+    float rms = 0.0f;
+    double seconds = 0.0;           // wall-clock time spent rendering
+    std::string fileName;
+    std::string error;
+};
+
+
+static bool Fatal(const std::string& message)
+{
+    fprintf(stderr, "sweep: %s\n", message.c_str());
+    return false;
+}
+
+
+static bool ParseSpec(const char *specFileName, SweepSpec& spec)
+{
+    std::ifstream infile(specFileName);
+    if (!infile)
+        return Fatal(std::string("Cannot open spec file: ") + specFileName);
+
+    std::unique_ptr<RenderEngine> engine;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(infile, line))
+    {
+        ++lineNumber;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.resize(hash);
+
+        std::istringstream tokens(line);
+        std::string directive;
+        if (!(tokens >> directive))
+            continue;       // blank line
+
+        const std::string where = std::string(specFileName) + " line " + std::to_string(lineNumber) + ": ";
+
+        if (directive == "engine")
+        {
+            tokens >> spec.engineName;
+            engine = CreateRenderEngine(spec.engineName);
+            if (!engine)
+                return Fatal(where + "unknown engine '" + spec.engineName + "'");
+        }
+        else if (directive == "samplerate")
+        {
+            if (!(tokens >> spec.sampleRate) || spec.sampleRate < 1000)
+                return Fatal(where + "invalid sample rate");
+        }
+        else if (directive == "seconds")
+        {
+            if (!(tokens >> spec.seconds) || spec.seconds <= 0.0)
+                return Fatal(where + "invalid duration");
+        }
+        else if (directive == "input")
+        {
+            std::getline(tokens >> std::ws, spec.input);
+        }
+        else if (directive == "points")
+        {
+            if (!(tokens >> spec.points) || spec.points < 1)
+                return Fatal(where + "invalid number of points");
+        }
+        else if (directive == "seed")
+        {
+            tokens >> spec.seed;
+        }
+        else if (directive == "output")
+        {
+            std::getline(tokens >> std::ws, spec.outputDir);
+        }
+        else if (directive == "set" || directive == "grid" || directive == "list" || directive == "random")
+        {
+            if (!engine)
+                return Fatal(where + "the 'engine' directive must come before any parameters");
+
+            std::string paramName;
+            tokens >> paramName;
+            SweepAxis axis;
+            axis.paramId = engine->findParameter(paramName);
+            if (axis.paramId < 0)
+                return Fatal(where + "engine " + spec.engineName + " has no parameter named '" + paramName + "'");
+
+            if (directive == "set")
+            {
+                float x;
+                if (!(tokens >> x))
+                    return Fatal(where + "missing value");
+                axis.values.push_back(x);
+            }
+            else if (directive == "grid")
+            {
+                float a, b;
+                int n;
+                if (!(tokens >> a >> b >> n) || n < 1)
+                    return Fatal(where + "expected: grid name first last count");
+                for (int i = 0; i < n; ++i)
+                    axis.values.push_back((n == 1) ? a : a + (b - a)*i/(n - 1));
+            }
+            else if (directive == "list")
+            {
+                float x;
+                while (tokens >> x)
+                    axis.values.push_back(x);
+                if (axis.values.empty())
+                    return Fatal(where + "empty list");
+            }
+            else
+            {
+                const EngineParameter& p = engine->parameters()[axis.paramId];
+                axis.isRandom = true;
+                axis.randomMin = p.minValue;
+                axis.randomMax = p.maxValue;
+                tokens >> axis.randomMin >> axis.randomMax;
+            }
+            spec.axes.push_back(axis);
+        }
+        else
+        {
+            return Fatal(where + "unknown directive '" + directive + "'");
+        }
+    }
+
+    if (!engine)
+        return Fatal(std::string("Missing 'engine' directive in ") + specFileName);
+
+    return true;
+}
+
+
+static std::vector<SweepTask> ExpandSpec(const SweepSpec& spec)
+{
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(spec.engineName);
+    std::vector<float> defaults;
+    for (const EngineParameter& p : engine->parameters())
+        defaults.push_back(p.defaultValue);
+
+    // Count the Cartesian product of all grid/list axes.
+    size_t gridCount = 1;
+    for (const SweepAxis& axis : spec.axes)
+        if (!axis.isRandom)
+            gridCount *= axis.values.size();
+
+    std::mt19937 rand(spec.seed);
+    std::vector<SweepTask> tasks;
+    for (size_t g = 0; g < gridCount; ++g)
+    {
+        for (int p = 0; p < spec.points; ++p)
+        {
+            SweepTask task;
+            task.index = static_cast<int>(tasks.size());
+            task.seed = static_cast<unsigned>(rand());
+            task.values = defaults;
+
+            // Decode `g` as a mixed-radix number, one digit per grid/list axis.
+            size_t remainder = g;
+            for (const SweepAxis& axis : spec.axes)
+            {
+                if (axis.isRandom)
+                {
+                    std::uniform_real_distribution<float> dist(axis.randomMin, axis.randomMax);
+                    task.values[axis.paramId] = dist(rand);
+                }
+                else
+                {
+                    task.values[axis.paramId] = axis.values[remainder % axis.values.size()];
+                    remainder /= axis.values.size();
+                }
+            }
+
+            tasks.push_back(task);
+        }
+    }
+    return tasks;
+}
+
+
+class WorkStealingPool      // each worker owns a deque of task indices; idle workers steal from the others
+{
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int> items;
+    };
+
+    std::vector<Queue> queues;
+
+    bool popOwn(int worker, int& item)
+    {
+        // Take from the back of our own queue...
+        Queue& q = queues[worker];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.items.empty())
+            return false;
+        item = q.items.back();
+        q.items.pop_back();
+        return true;
+    }
+
+    bool steal(int worker, int& item)
+    {
+        // ...and from the front of somebody else's, so owner and thief rarely contend.
+        const int n = static_cast<int>(queues.size());
+        for (int k = 1; k < n; ++k)
+        {
+            Queue& q = queues[(worker + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.items.empty())
+            {
+                item = q.items.front();
+                q.items.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(int nworkers)
+        : queues(nworkers)
+        {}
+
+    void seed(int ntasks)
+    {
+        // Deal out contiguous runs, so neighboring tasks start on the same worker.
+        const int n = static_cast<int>(queues.size());
+        for (int i = 0; i < ntasks; ++i)
+            queues[(static_cast<long>(i) * n) / ntasks].items.push_back(i);
+    }
+
+    template <typename func_t>
+    uint64_t run(func_t func)
+    {
+        // Returns the number of tasks that were stolen.
+        std::atomic<uint64_t> steals {0};
+        std::vector<std::thread> threads;
+        for (int w = 0; w < static_cast<int>(queues.size()); ++w)
+        {
+            threads.emplace_back([this, w, &func, &steals]()
+            {
+                int item;
+                for(;;)
+                {
+                    if (popOwn(w, item))
+                        func(item);
+                    else if (steal(w, item))
+                    {
+                        ++steals;
+                        func(item);
+                    }
+                    else
+                        break;      // nothing left anywhere: no new tasks are ever added once we start
+                }
+            });
+        }
+
+        for (std::thread& t : threads)
+            t.join();
+
+        return steals;
+    }
+};
+
+
+struct InputSignal
+{
+    std::string kind;
+    std::vector<float> left;        // used only when kind == "file"
+    std::vector<float> right;
+
+    bool load(const std::string& input, int sampleRate)
+    {
+        if (input == "silence" || input == "impulse" || input == "noise")
+        {
+            kind = input;
+            return true;
+        }
+
+        kind = "file";
+        WaveFileReader reader;
+        if (!reader.Open(input.c_str()))
+            return Fatal(std::string("Cannot open input WAV file: ") + input);
+
+        if (reader.SampleRate() != sampleRate)
+            return Fatal(std::string("Input file sample rate does not match spec: ") + input);
+
+        const int channels = reader.Channels();
+        std::vector<float> frame(channels);
+        while (reader.Read(frame.data(), channels) == static_cast<size_t>(channels))
+        {
+            left.push_back(frame[0]);
+            right.push_back(frame[std::min(1, channels-1)]);
+        }
+        return true;
+    }
+
+    void fill(size_t position, size_t nframes, std::mt19937& rand, float *inLeft, float *inRight) const
+    {
+        for (size_t i = 0; i < nframes; ++i)
+        {
+            const size_t t = position + i;
+            if (kind == "impulse")
+            {
+                inLeft[i] = inRight[i] = (t == 0) ? 1.0f : 0.0f;
+            }
+            else if (kind == "noise")
+            {
+                std::uniform_real_distribution<float> dist(-1.0f, +1.0f);
+                inLeft[i] = dist(rand);
+                inRight[i] = dist(rand);
+            }
+            else if (kind == "file" && t < left.size())
+            {
+                inLeft[i] = left[t];
+                inRight[i] = right[t];
+            }
+            else
+            {
+                inLeft[i] = inRight[i] = 0.0f;
+            }
+        }
+    }
+};
+
+
+static void Render(
+    const SweepSpec& spec,
+    const InputSignal& input,
+    const SweepTask& task,
+    SweepResult& result)
+{
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(spec.engineName);
+    engine->setSampleRate(static_cast<float>(spec.sampleRate));
+    for (int i = 0; i < engine->numParameters(); ++i)
+        engine->setParameter(i, task.values[i]);
+
+    char name[40];
+    snprintf(name, sizeof(name), "render_%06d.wav", task.index);
+    result.fileName = name;
+    const std::string path = (std::filesystem::path(spec.outputDir) / name).string();
+
+    WaveFileWriter wave;
+    if (!wave.Open(path.c_str(), spec.sampleRate, 2, WaveSampleFormat::Float32, true))
+    {
+        result.error = "cannot open output file";
+        return;
+    }
+
+    const size_t blockFrames = 256;
+    float inLeft[blockFrames], inRight[blockFrames], outLeft[blockFrames], outRight[blockFrames];
+    float interleaved[2*blockFrames];
+    std::mt19937 rand(task.seed);
+    const size_t totalFrames = static_cast<size_t>(spec.seconds * spec.sampleRate);
+    double sumSquares = 0.0;
+
+    for (size_t position = 0; position < totalFrames; position += blockFrames)
+    {
+        const size_t n = std::min(blockFrames, totalFrames - position);
+        input.fill(position, n, rand, inLeft, inRight);
+        engine->process(n, inLeft, inRight, outLeft, outRight);
+        for (size_t i = 0; i < n; ++i)
+        {
+            interleaved[2*i]   = outLeft[i];
+            interleaved[2*i+1] = outRight[i];
+            result.finite = result.finite && std::isfinite(outLeft[i]) && std::isfinite(outRight[i]);
+            result.peak = std::max(result.peak, std::max(std::abs(outLeft[i]), std::abs(outRight[i])));
+            sumSquares += outLeft[i]*outLeft[i] + outRight[i]*outRight[i];
+        }
+        wave.WriteSamples(interleaved, 2*n);
+    }
+
+    wave.Close();
+    result.rms = (totalFrames > 0) ? static_cast<float>(std::sqrt(sumSquares / (2*totalFrames))) : 0.0f;
+    result.seconds = duration<double>(steady_clock::now() - start).count();
+    result.done = true;
+}
+
+
+static bool WriteIndex(
+    const SweepSpec& spec,
+    const std::vector<SweepTask>& tasks,
+    const std::vector<SweepResult>& results)
+{
+    const std::string path = (std::filesystem::path(spec.outputDir) / "index.csv").string();
+    FILE *outfile = fopen(path.c_str(), "wt");
+    if (outfile == nullptr)
+        return Fatal(std::string("Cannot create index file: ") + path);
+
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(spec.engineName);
+    fprintf(outfile, "index,file");
+    for (const EngineParameter& p : engine->parameters())
+        fprintf(outfile, ",%s", p.name);
+    fprintf(outfile, ",peak,rms,finite,render_seconds,error\n");
+
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        const SweepResult& r = results[i];
+        fprintf(outfile, "%d,%s", tasks[i].index, r.fileName.c_str());
+        for (float x : tasks[i].values)
+            fprintf(outfile, ",%.9g", x);
+        fprintf(outfile, ",%.9g,%.9g,%d,%.6f,%s\n", r.peak, r.rms, r.finite ? 1 : 0, r.seconds, r.error.c_str());
+    }
+
+    fclose(outfile);
+    return true;
+}
+
+
+static int ListParameters(const char *engineName)
+{
+    std::unique_ptr<RenderEngine> engine = CreateRenderEngine(engineName);
+    if (!engine)
+    {
+        fprintf(stderr, "sweep: unknown engine '%s'\n", engineName);
+        return 1;
+    }
+
+    for (const EngineParameter& p : engine->parameters())
+        printf("%-12s [%8.3f, %8.3f] default %8.3f   %s\n", p.name, p.minValue, p.maxValue, p.defaultValue, p.description);
+
+    return 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    using namespace std::chrono;
+
+    if (argc == 3 && !strcmp(argv[1], "-p"))
+        return ListParameters(argv[2]);
+
+    if (argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    SweepSpec spec;
+    if (!ParseSpec(argv[1], spec))
+        return 1;
+
+    int nthreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-j") && i+1 < argc)
+            nthreads = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            spec.outputDir = argv[++i];
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(spec.outputDir, ec);
+    if (ec)
+    {
+        fprintf(stderr, "sweep: cannot create output directory %s: %s\n", spec.outputDir.c_str(), ec.message().c_str());
+        return 1;
+    }
+
+    InputSignal input;
+    if (!input.load(spec.input, spec.sampleRate))
+        return 1;
+
+    std::vector<SweepTask> tasks = ExpandSpec(spec);
+    std::vector<SweepResult> results(tasks.size());
+    nthreads = std::min(nthreads, std::max(1, static_cast<int>(tasks.size())));
+
+    printf("sweep: rendering %d %s configurations of %0.3f seconds each on %d threads.\n",
+        static_cast<int>(tasks.size()), spec.engineName.c_str(), spec.seconds, nthreads);
+
+    auto start = steady_clock::now();
+
+    WorkStealingPool pool(nthreads);
+    pool.seed(static_cast<int>(tasks.size()));
+    uint64_t steals = pool.run([&](int i)
+    {
+        try
+        {
+            Render(spec, input, tasks[i], results[i]);
+        }
+        catch (const std::exception& ex)
+        {
+            results[i].error = ex.what();
+        }
+    });
+
+    const double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    if (!WriteIndex(spec, tasks, results))
+        return 1;
+
+    int failures = 0;
+    for (const SweepResult& r : results)
+        if (!r.done)
+            ++failures;
+
+    const double rendersPerSecond = tasks.size() / elapsed;
+    const double audioSeconds = tasks.size() * spec.seconds;
+    printf("sweep: %d renders in %0.3f seconds (%d failed, %d stolen).\n",
+        static_cast<int>(tasks.size()), elapsed, failures, static_cast<int>(steals));
+    printf("sweep: %0.3f renders/second, %0.3f renders/second/core, %0.1fx real time per core.\n",
+        rendersPerSecond, rendersPerSecond / nthreads, audioSeconds / (elapsed * nthreads));
+
+    return (failures > 0) ? 1 : 0;
+}
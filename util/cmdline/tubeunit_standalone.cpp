@@ -7,7 +7,7 @@
 #include <string>
 #include <vector>
 #include "tubeunit_engine.hpp"
-#include "wavefile.hpp"
+#include "async_wavefile.hpp"
 
 int main()
 {
@@ -22,7 +22,8 @@ int main()
     TubeUnitEngine engine;
     engine.setSampleRate(SAMPLE_RATE);
 
-    ScaledWaveFileWriter wave;
+    // Encode and write audio on a background thread, so disk I/O does not stall the engine.
+    AsyncWaveWriter<ScaledWaveFileWriter> wave;
     const char *filename = "test/tubeunit.wav";
     if (!wave.Open(filename, SAMPLE_RATE, CHANNELS))
     {
@@ -43,5 +44,7 @@ int main()
         wave.WriteSamples(sample, CHANNELS);
     }
 
+    wave.Close();
+    engine.getProfile().print(stdout, "TubeUnit");
     return 0;
 }
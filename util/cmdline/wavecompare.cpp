@@ -0,0 +1,188 @@
+/*
+    wavecompare.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Audio regression checker. Compares rendered WAV files against reference
+    renderings, passing as long as the differences stay within per-test
+    tolerances. This lets optimizations change the last few bits of the
+    output (FMA, SIMD reordering, a different integrator) without breaking
+    the tests, while still catching audible regressions.
+
+    Usage:
+        wavecompare tolerance_file
+        wavecompare reference.wav test.wav [maxabs=x] [snr=y] [spectral=z]
+
+    Each non-blank line of a tolerance file lists a reference file, a test file,
+    and the thresholds for that pair. '#' starts a comment. For example:
+
+        correct/elastika.wav  test/elastika.wav  maxabs=1.0e-3  snr=60  spectral=0.1
+
+    maxabs      largest allowed absolute difference in any one sample (full scale = 1.0)
+    snr         smallest allowed ratio of reference power to difference power [dB]
+    spectral    largest allowed RMS difference between third-octave band spectra [dB]
+
+    Thresholds not given default to requiring an exact match.
+    A threshold of '-' leaves that measurement unchecked, for example when
+    only the spectrum can be expected to match:
+
+        correct/elastika.wav  test/elastika.wav  maxabs=-  snr=-  spectral=5.0
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "wavecompare.hpp"
+
+
+static bool ParseTolerance(const std::string& token, WaveTolerance& tol)
+{
+    size_t eq = token.find('=');
+    if (eq == std::string::npos)
+        return false;
+
+    const std::string name = token.substr(0, eq);
+    const std::string text = token.substr(eq + 1);
+    const bool unchecked = (text == "-");
+    double value = 0.0;
+    if (!unchecked)
+    {
+        char *end = nullptr;
+        value = strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || std::isnan(value))
+            return false;
+    }
+
+    // An unchecked threshold is one that no comparison can fail.
+    const double inf = std::numeric_limits<double>::infinity();
+    if (name == "maxabs")
+        tol.maxAbsError = unchecked ? inf : value;
+    else if (name == "snr")
+        tol.minSnrDb = unchecked ? -inf : value;
+    else if (name == "spectral")
+        tol.maxSpectralDb = unchecked ? inf : value;
+    else
+        return false;
+
+    return true;
+}
+
+
+static std::string FormatLimit(const char *format, double limit, double uncheckedLimit)
+{
+    if (limit == uncheckedLimit)
+        return "unchecked";
+
+    char text[64];
+    snprintf(text, sizeof(text), format, limit);
+    return text;
+}
+
+
+static WaveTolerance ExactMatch()
+{
+    WaveTolerance tol;
+    tol.maxAbsError = 0.0;
+    tol.minSnrDb = std::numeric_limits<double>::infinity();
+    tol.maxSpectralDb = 0.0;
+    return tol;
+}
+
+
+static bool Check(const std::string& refName, const std::string& testName, const WaveTolerance& tol)
+{
+    WaveComparison cmp = CompareWaveFiles(refName.c_str(), testName.c_str());
+    if (!cmp.problem.empty())
+    {
+        printf("FAIL %s: %s\n", testName.c_str(), cmp.problem.c_str());
+        return false;
+    }
+
+    const bool pass = cmp.passes(tol);
+    const double inf = std::numeric_limits<double>::infinity();
+    printf("%s %s: maxabs=%0.3g (limit %s) at sample %llu, snr=%0.2f dB (limit %s), spectral=%0.4f dB (limit %s)\n",
+        pass ? "pass" : "FAIL",
+        testName.c_str(),
+        cmp.maxAbsError, FormatLimit("%0.3g", tol.maxAbsError, inf).c_str(), static_cast<unsigned long long>(cmp.worstSample),
+        cmp.snrDb, FormatLimit("%0.2f", tol.minSnrDb, -inf).c_str(),
+        cmp.spectralDb, FormatLimit("%0.4f", tol.maxSpectralDb, inf).c_str());
+
+    return pass;
+}
+
+
+static int CheckToleranceFile(const char *fileName)
+{
+    std::ifstream infile(fileName);
+    if (!infile)
+    {
+        fprintf(stderr, "wavecompare: cannot open tolerance file: %s\n", fileName);
+        return 1;
+    }
+
+    int failures = 0;
+    int tests = 0;
+    int lineNumber = 0;
+    std::string line;
+    while (std::getline(infile, line))
+    {
+        ++lineNumber;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.resize(hash);
+
+        std::istringstream tokens(line);
+        std::string refName, testName, token;
+        if (!(tokens >> refName))
+            continue;
+
+        WaveTolerance tol = ExactMatch();
+        bool valid = !!(tokens >> testName);
+        while (valid && (tokens >> token))
+            valid = ParseTolerance(token, tol);
+
+        if (!valid)
+        {
+            fprintf(stderr, "wavecompare: syntax error on line %d of %s\n", lineNumber, fileName);
+            return 1;
+        }
+
+        ++tests;
+        if (!Check(refName, testName, tol))
+            ++failures;
+    }
+
+    printf("wavecompare: %d of %d comparisons passed.\n", tests - failures, tests);
+    return (failures > 0) ? 1 : 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    if (argc == 2)
+        return CheckToleranceFile(argv[1]);
+
+    if (argc >= 3)
+    {
+        WaveTolerance tol = ExactMatch();
+        for (int i = 3; i < argc; ++i)
+        {
+            if (!ParseTolerance(argv[i], tol))
+            {
+                fprintf(stderr, "wavecompare: invalid tolerance: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        return Check(argv[1], argv[2], tol) ? 0 : 1;
+    }
+
+    fprintf(stderr,
+        "USAGE:\n"
+        "    wavecompare tolerance_file\n"
+        "    wavecompare reference.wav test.wav [maxabs=x] [snr=y] [spectral=z]\n"
+        "\n"
+        "    A threshold of '-', as in maxabs=-, leaves that measurement unchecked.\n"
+    );
+    return 1;
+}
@@ -0,0 +1,235 @@
+/*
+    async_wavefile.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Moves WAV file encoding and disk writes onto a background thread,
+    so a rendering loop is limited by the speed of its engine,
+    not by the speed of the filesystem.
+*/
+
+#ifndef __COSINEKITTY_ASYNC_WAVEFILE_HPP
+#define __COSINEKITTY_ASYNC_WAVEFILE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "wavefile.hpp"
+
+// AsyncWaveWriter wraps any writer class that provides
+// Open(...), WriteSamples(const float *, size_t), and Close(),
+// such as WaveFileWriter or ScaledWaveFileWriter.
+//
+// The caller fills fixed-size blocks of samples. Each full block is handed
+// to the background thread through a single-producer/single-consumer ring.
+// Memory is bounded by the number of blocks: when every block is waiting
+// to be written, the caller waits until the writer thread frees one.
+template <typename writer_t>
+class AsyncWaveWriter
+{
+private:
+    struct Block
+    {
+        std::vector<float> data;
+        size_t count = 0;
+    };
+
+    writer_t writer;
+    std::vector<Block> ring;
+    size_t blockSamples;
+    std::atomic<uint64_t> head {0};     // number of blocks submitted by the caller
+    std::atomic<uint64_t> tail {0};     // number of blocks finished by the writer thread
+    std::atomic<bool> finished {false};
+    std::atomic<bool> failed {false};
+    std::exception_ptr error;
+    std::thread thread;
+    bool isOpen = false;
+    uint64_t stallCount = 0;
+
+    static void Pause(int& spins)
+    {
+        // Spin briefly, then yield, then sleep: cheap when the other thread
+        // is about to catch up, but without burning a whole core while idle.
+        if (++spins < 64)
+            return;
+        if (spins < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    Block& Current()
+    {
+        return ring[head.load(std::memory_order_relaxed) % ring.size()];
+    }
+
+    void WriterThread()
+    {
+        try
+        {
+            for(;;)
+            {
+                uint64_t t = tail.load(std::memory_order_relaxed);
+                int spins = 0;
+                while (head.load(std::memory_order_acquire) == t)
+                {
+                    if (finished.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == t)
+                        return;
+                    Pause(spins);
+                }
+
+                const Block& block = ring[t % ring.size()];
+                writer.WriteSamples(block.data.data(), block.count);
+                tail.store(t + 1, std::memory_order_release);
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            failed.store(true, std::memory_order_release);
+        }
+    }
+
+    void CheckError()
+    {
+        if (failed.load(std::memory_order_acquire))
+        {
+            // The writer thread has already exited. Shut down so Close() has nothing left to do.
+            isOpen = false;
+            Stop();
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    void Submit()
+    {
+        Block& block = Current();
+        if (block.count == 0)
+            return;
+
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+        // Backpressure: wait until the writer thread has released the next block we will fill.
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= ring.size())
+        {
+            ++stallCount;
+            int spins = 0;
+            while (h - tail.load(std::memory_order_acquire) >= ring.size())
+            {
+                CheckError();
+                Pause(spins);
+            }
+        }
+
+        Current().count = 0;
+    }
+
+    void Stop()
+    {
+        finished.store(true, std::memory_order_release);
+        if (thread.joinable())
+            thread.join();
+    }
+
+public:
+    explicit AsyncWaveWriter(size_t _blockSamples = 0x10000, size_t blockCount = 8)
+        : ring(std::max(static_cast<size_t>(2), blockCount))
+        , blockSamples(std::max(static_cast<size_t>(1), _blockSamples))
+    {
+        for (Block& block : ring)
+            block.data.resize(blockSamples);
+    }
+
+    AsyncWaveWriter(const AsyncWaveWriter&) = delete;
+    AsyncWaveWriter& operator = (const AsyncWaveWriter&) = delete;
+
+    ~AsyncWaveWriter()
+    {
+        try
+        {
+            Close();
+        }
+        catch (...)
+        {
+            // Destructors must not throw. Call Close() explicitly to find out about write errors.
+        }
+    }
+
+    template <typename... args_t>
+    bool Open(args_t&&... args)
+    {
+        Close();
+
+        if (!writer.Open(std::forward<args_t>(args)...))
+            return false;
+
+        head.store(0);
+        tail.store(0);
+        finished.store(false);
+        failed.store(false);
+        error = nullptr;
+        stallCount = 0;
+        for (Block& block : ring)
+            block.count = 0;
+
+        thread = std::thread(&AsyncWaveWriter::WriterThread, this);
+        isOpen = true;
+        return true;
+    }
+
+    void WriteSamples(const float *data, size_t ndata)
+    {
+        if (!isOpen)
+            throw std::logic_error("AsyncWaveWriter is not open.");
+
+        CheckError();
+        while (ndata > 0)
+        {
+            Block& block = Current();
+            size_t n = std::min(ndata, blockSamples - block.count);
+            std::copy(data, data + n, block.data.begin() + block.count);
+            block.count += n;
+            data += n;
+            ndata -= n;
+            if (block.count == blockSamples)
+                Submit();
+        }
+    }
+
+    void Close()
+    {
+        if (isOpen)
+        {
+            isOpen = false;
+            if (!failed.load(std::memory_order_acquire))
+                Submit();       // hand over the partially filled final block
+            Stop();
+            if (error)
+            {
+                // Report the writer thread's error, not whatever closing
+                // the half-written file might throw after it.
+                std::exception_ptr e = error;
+                error = nullptr;
+                try
+                {
+                    writer.Close();
+                }
+                catch (...)
+                {
+                }
+                std::rethrow_exception(e);
+            }
+            writer.Close();
+        }
+    }
+
+    // Number of times the caller had to wait for the disk. Nonzero means rendering was I/O-bound.
+    uint64_t StallCount() const { return stallCount; }
+};
+
+#endif // __COSINEKITTY_ASYNC_WAVEFILE_HPP
@@ -0,0 +1,198 @@
+/*
+    perf_counters.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Hardware performance counters for benchmarks, using Linux perf_event_open.
+    Counts CPU cycles, retired instructions, L1 data cache read misses,
+    last-level cache misses, and branch mispredictions for the calling thread.
+
+    Counters are optional. On other operating systems, inside containers,
+    or when /proc/sys/kernel/perf_event_paranoid forbids them, Open() fails
+    with a reason, and the caller carries on with wall-clock timing only.
+    Individual events the CPU does not support are simply reported as missing.
+*/
+
+#ifndef __COSINEKITTY_PERF_COUNTERS_HPP
+#define __COSINEKITTY_PERF_COUNTERS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum class PerfEvent
+{
+    Cycles,
+    Instructions,
+    L1dMisses,
+    LlcMisses,
+    BranchMisses,
+    Count
+};
+
+
+inline const char *PerfEventName(PerfEvent event)
+{
+    switch (event)
+    {
+    case PerfEvent::Cycles:         return "cycles";
+    case PerfEvent::Instructions:   return "instructions";
+    case PerfEvent::L1dMisses:      return "L1D misses";
+    case PerfEvent::LlcMisses:      return "LLC misses";
+    case PerfEvent::BranchMisses:   return "branch misses";
+    default:                        return "?";
+    }
+}
+
+
+const int PerfEventCount = static_cast<int>(PerfEvent::Count);
+
+
+struct PerfReading
+{
+    bool valid[PerfEventCount] {};
+    double value[PerfEventCount] {};      // scaled up if the kernel had to multiplex counters
+
+    bool has(PerfEvent e) const { return valid[static_cast<int>(e)]; }
+    double get(PerfEvent e) const { return value[static_cast<int>(e)]; }
+
+    void add(const PerfReading& other)
+    {
+        for (int i = 0; i < PerfEventCount; ++i)
+        {
+            valid[i] = valid[i] || other.valid[i];
+            value[i] += other.value[i];
+        }
+    }
+};
+
+
+class PerfCounters
+{
+private:
+    int fd[PerfEventCount];
+    bool isOpen = false;
+
+#ifdef __linux__
+    static int OpenEvent(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;        // user-space only: allowed at perf_event_paranoid <= 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t CacheConfig(uint64_t cache, uint64_t op, uint64_t result)
+    {
+        return cache | (op << 8) | (result << 16);
+    }
+
+    void Ioctl(unsigned long request)
+    {
+        for (int i = 0; i < PerfEventCount; ++i)
+            if (fd[i] >= 0)
+                ioctl(fd[i], request, 0);
+    }
+#endif
+
+public:
+    PerfCounters()
+    {
+        for (int i = 0; i < PerfEventCount; ++i)
+            fd[i] = -1;
+    }
+
+    ~PerfCounters()
+    {
+        Close();
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator = (const PerfCounters&) = delete;
+
+    bool Open(std::string& reason)
+    {
+        Close();
+#ifdef __linux__
+        fd[static_cast<int>(PerfEvent::Cycles)]       = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        const int firstErrno = errno;
+        fd[static_cast<int>(PerfEvent::Instructions)] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fd[static_cast<int>(PerfEvent::L1dMisses)]    = OpenEvent(PERF_TYPE_HW_CACHE, CacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+        fd[static_cast<int>(PerfEvent::LlcMisses)]    = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fd[static_cast<int>(PerfEvent::BranchMisses)] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+        for (int i = 0; i < PerfEventCount; ++i)
+            if (fd[i] >= 0)
+                isOpen = true;
+
+        if (!isOpen)
+        {
+            reason = std::string("perf_event_open failed: ") + strerror(firstErrno);
+            if (firstErrno == EACCES || firstErrno == EPERM)
+                reason += " (try: sudo sysctl kernel.perf_event_paranoid=2)";
+            else if (firstErrno == ENOENT || firstErrno == ENODEV || firstErrno == EOPNOTSUPP)
+                reason += " (no hardware counters here, e.g. inside a virtual machine)";
+        }
+#else
+        reason = "hardware performance counters are only supported on Linux";
+#endif
+        return isOpen;
+    }
+
+    void Close()
+    {
+#ifdef __linux__
+        for (int i = 0; i < PerfEventCount; ++i)
+        {
+            if (fd[i] >= 0)
+            {
+                close(fd[i]);
+                fd[i] = -1;
+            }
+        }
+#endif
+        isOpen = false;
+    }
+
+    bool IsOpen() const { return isOpen; }
+
+    void Start()
+    {
+#ifdef __linux__
+        Ioctl(PERF_EVENT_IOC_RESET);
+        Ioctl(PERF_EVENT_IOC_ENABLE);
+#endif
+    }
+
+    PerfReading Stop()
+    {
+        PerfReading reading;
+#ifdef __linux__
+        Ioctl(PERF_EVENT_IOC_DISABLE);
+        for (int i = 0; i < PerfEventCount; ++i)
+        {
+            uint64_t data[3];   // value, time enabled, time running
+            if (fd[i] >= 0 && read(fd[i], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)) && data[2] > 0)
+            {
+                reading.valid[i] = true;
+                reading.value[i] = static_cast<double>(data[0]) * (static_cast<double>(data[1]) / data[2]);
+            }
+        }
+#endif
+        return reading;
+    }
+};
+
+#endif // __COSINEKITTY_PERF_COUNTERS_HPP
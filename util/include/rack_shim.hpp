@@ -0,0 +1,488 @@
+/*
+    rack_shim.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    A minimal headless stand-in for the parts of the VCV Rack SDK
+    that Sapphire's module classes use. When src/plugin.hpp is compiled
+    with NO_RACK_DEPENDENCY, it includes this header instead of <rack.hpp>,
+    and each module source file leaves out its widget code.
+    That lets test programs and benchmarks create the real module classes,
+    connect scripted signals to their ports, and call process() directly,
+    so the per-sample control logic can be measured outside of VCV Rack.
+
+    Only behavior the modules depend on is imitated:
+    - Ports carry up to 16 polyphonic channels. A port with zero channels
+      is disconnected, and setChannels() cannot connect it, just as in Rack.
+      A test program connects a port by assigning its `channels` directly.
+    - configParam() and friends record names and ranges, so callers can
+      look up ports by the names the module gave them.
+    - A tiny subset of the jansson API supports dataToJson/dataFromJson.
+      Values are not reference counted: json_decref() frees a whole tree.
+*/
+
+#ifndef __COSINEKITTY_RACK_SHIM_HPP
+#define __COSINEKITTY_RACK_SHIM_HPP
+
+#ifndef NO_RACK_DEPENDENCY
+#error "rack_shim.hpp is only for builds with NO_RACK_DEPENDENCY."
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__arm64)
+#define SIMDE_ENABLE_NATIVE_ALIASES
+#include "simde/x86/sse4.2.h"
+#else
+#include <pmmintrin.h>
+#endif
+
+
+// A subset of the jansson JSON API.
+
+enum json_type { JSON_OBJECT, JSON_ARRAY, JSON_INTEGER, JSON_TRUE, JSON_FALSE };
+
+struct json_t
+{
+    json_type type;
+    long long integer = 0;
+    std::vector<std::pair<std::string, json_t*>> members;    // JSON_OBJECT
+    std::vector<json_t*> items;                             // JSON_ARRAY
+
+    explicit json_t(json_type _type) : type(_type) {}
+
+    ~json_t()
+    {
+        for (auto& m : members)
+            delete m.second;
+        for (json_t* item : items)
+            delete item;
+    }
+};
+
+inline json_t* json_object() { return new json_t(JSON_OBJECT); }
+inline json_t* json_array() { return new json_t(JSON_ARRAY); }
+inline json_t* json_boolean(bool value) { return new json_t(value ? JSON_TRUE : JSON_FALSE); }
+inline json_t* json_true() { return json_boolean(true); }
+inline json_t* json_false() { return json_boolean(false); }
+
+inline json_t* json_integer(long long value)
+{
+    json_t* j = new json_t(JSON_INTEGER);
+    j->integer = value;
+    return j;
+}
+
+inline void json_decref(json_t* j) { delete j; }
+
+inline bool json_is_object(const json_t* j) { return j && j->type == JSON_OBJECT; }
+inline bool json_is_array(const json_t* j) { return j && j->type == JSON_ARRAY; }
+inline bool json_is_integer(const json_t* j) { return j && j->type == JSON_INTEGER; }
+inline bool json_is_true(const json_t* j) { return j && j->type == JSON_TRUE; }
+inline bool json_is_false(const json_t* j) { return j && j->type == JSON_FALSE; }
+inline bool json_is_boolean(const json_t* j) { return json_is_true(j) || json_is_false(j); }
+inline bool json_boolean_value(const json_t* j) { return json_is_true(j); }
+inline long long json_integer_value(const json_t* j) { return json_is_integer(j) ? j->integer : 0; }
+
+inline int json_object_set_new(json_t* object, const char* key, json_t* value)
+{
+    // Takes ownership of `value`, replacing any existing member with the same key.
+    if (!json_is_object(object) || value == nullptr)
+    {
+        delete value;
+        return -1;
+    }
+
+    for (auto& m : object->members)
+    {
+        if (m.first == key)
+        {
+            delete m.second;
+            m.second = value;
+            return 0;
+        }
+    }
+    object->members.push_back(std::make_pair(std::string(key), value));
+    return 0;
+}
+
+inline json_t* json_object_get(const json_t* object, const char* key)
+{
+    if (json_is_object(object))
+        for (const auto& m : object->members)
+            if (m.first == key)
+                return m.second;
+    return nullptr;
+}
+
+inline int json_array_append_new(json_t* array, json_t* value)
+{
+    if (!json_is_array(array) || value == nullptr)
+    {
+        delete value;
+        return -1;
+    }
+    array->items.push_back(value);
+    return 0;
+}
+
+inline size_t json_array_size(const json_t* array)
+{
+    return json_is_array(array) ? array->items.size() : 0;
+}
+
+inline json_t* json_array_get(const json_t* array, size_t index)
+{
+    return (json_is_array(array) && index < array->items.size()) ? array->items[index] : nullptr;
+}
+
+
+namespace rack
+{
+    const int PORT_MAX_CHANNELS = 16;
+
+    namespace math
+    {
+        inline float clamp(float x, float a = 0.0f, float b = 1.0f)
+        {
+            return std::fmax(std::fmin(x, b), a);
+        }
+
+        inline float normalizeZero(float x)
+        {
+            return x + 0.0f;    // turns -0 into +0
+        }
+    }
+
+    namespace string
+    {
+        inline std::string f(const char* format, ...)
+        {
+            char text[256];
+            va_list args;
+            va_start(args, format);
+            vsnprintf(text, sizeof(text), format, args);
+            va_end(args);
+            return text;
+        }
+    }
+
+    namespace simd
+    {
+        struct float_4
+        {
+            __m128 v;
+
+            float_4() : v(_mm_setzero_ps()) {}
+            float_4(float x) : v(_mm_set1_ps(x)) {}
+            float_4(__m128 _v) : v(_v) {}
+
+            static float_4 load(const float* x) { return float_4(_mm_loadu_ps(x)); }
+            void store(float* x) const { _mm_storeu_ps(x, v); }
+        };
+
+        inline float_4 operator * (const float_4& a, const float_4& b) { return float_4(_mm_mul_ps(a.v, b.v)); }
+        inline float_4 operator + (const float_4& a, const float_4& b) { return float_4(_mm_add_ps(a.v, b.v)); }
+    }
+
+    namespace engine
+    {
+        struct Module;
+
+        struct Param
+        {
+            float value = 0.0f;
+
+            float getValue() const { return value; }
+            void setValue(float _value) { value = _value; }
+        };
+
+        struct Port
+        {
+            float voltages[PORT_MAX_CHANNELS] {};
+            uint8_t channels = 0;
+
+            float getVoltage(int channel = 0) const { return voltages[channel]; }
+            void setVoltage(float voltage, int channel = 0) { voltages[channel] = voltage; }
+            float* getVoltages(int firstChannel = 0) { return &voltages[firstChannel]; }
+            int getChannels() const { return channels; }
+            bool isConnected() const { return channels > 0; }
+
+            float getVoltageSum() const
+            {
+                float sum = 0.0f;
+                for (int c = 0; c < channels; ++c)
+                    sum += voltages[c];
+                return sum;
+            }
+
+            void setChannels(int _channels)
+            {
+                // A disconnected port stays disconnected; only a cable can change that.
+                if (channels == 0)
+                    return;
+                for (int c = _channels; c < channels; ++c)
+                    voltages[c] = 0.0f;
+                channels = static_cast<uint8_t>(std::max(1, std::min(PORT_MAX_CHANNELS, _channels)));
+            }
+
+            void writeVoltages(const float* v)
+            {
+                std::memmove(voltages, v, channels * sizeof(float));
+            }
+
+            template <typename T>
+            T getVoltageSimd(int firstChannel) const
+            {
+                return T::load(&voltages[firstChannel]);
+            }
+
+            template <typename T>
+            void setVoltageSimd(T v, int firstChannel)
+            {
+                v.store(&voltages[firstChannel]);
+            }
+        };
+
+        struct Input : Port {};
+        struct Output : Port {};
+
+        struct Light
+        {
+            float value = 0.0f;
+
+            void setBrightness(float brightness) { value = brightness; }
+            float getBrightness() const { return value; }
+        };
+
+        struct PortInfo
+        {
+            std::string name;
+        };
+
+        struct ParamQuantity
+        {
+            Module* module = nullptr;
+            int paramId = -1;
+            float minValue = 0.0f;
+            float maxValue = 1.0f;
+            float defaultValue = 0.0f;
+            std::string name;
+            std::string unit;
+            float displayBase = 0.0f;
+            float displayMultiplier = 1.0f;
+            float displayOffset = 0.0f;
+            bool resetEnabled = true;
+            bool randomizeEnabled = true;
+
+            virtual ~ParamQuantity() {}
+            virtual void setValue(float value);
+            virtual float getValue();
+            virtual float getMinValue() { return minValue; }
+            virtual float getMaxValue() { return maxValue; }
+            virtual float getDefaultValue() { return defaultValue; }
+            virtual void setDisplayValue(float displayValue) { setValue(displayValue); }
+            virtual std::string getDisplayValueString() { return string::f("%g", getValue()); }
+            virtual void reset() { setValue(getDefaultValue()); }
+        };
+
+        struct Module
+        {
+            std::vector<Param> params;
+            std::vector<Input> inputs;
+            std::vector<Output> outputs;
+            std::vector<Light> lights;
+            std::vector<std::unique_ptr<ParamQuantity>> paramQuantities;
+            std::vector<std::unique_ptr<PortInfo>> inputInfos;
+            std::vector<std::unique_ptr<PortInfo>> outputInfos;
+            std::vector<std::pair<int, int>> bypassRoutes;
+
+            struct ProcessArgs
+            {
+                float sampleRate;
+                float sampleTime;
+                int64_t frame;
+            };
+
+            struct ResetEvent {};
+            struct BypassEvent {};
+
+            struct SampleRateChangeEvent
+            {
+                float sampleRate;
+                float sampleTime;
+            };
+
+            virtual ~Module() {}
+
+            void config(int numParams, int numInputs, int numOutputs, int numLights = 0)
+            {
+                params.resize(numParams);
+                inputs.resize(numInputs);
+                outputs.resize(numOutputs);
+                lights.resize(numLights);
+                paramQuantities.resize(numParams);
+                inputInfos.resize(numInputs);
+                outputInfos.resize(numOutputs);
+                for (int i = 0; i < numParams; ++i)
+                    configParam(i, 0.0f, 1.0f, 0.0f);
+                for (int i = 0; i < numInputs; ++i)
+                    configInput(i);
+                for (int i = 0; i < numOutputs; ++i)
+                    configOutput(i);
+            }
+
+            template <class TParamQuantity = ParamQuantity>
+            TParamQuantity* configParam(
+                int paramId,
+                float minValue,
+                float maxValue,
+                float defaultValue,
+                std::string name = "",
+                std::string unit = "",
+                float displayBase = 0.0f,
+                float displayMultiplier = 1.0f,
+                float displayOffset = 0.0f)
+            {
+                TParamQuantity* q = new TParamQuantity;
+                q->module = this;
+                q->paramId = paramId;
+                q->minValue = minValue;
+                q->maxValue = maxValue;
+                q->defaultValue = defaultValue;
+                q->name = name;
+                q->unit = unit;
+                q->displayBase = displayBase;
+                q->displayMultiplier = displayMultiplier;
+                q->displayOffset = displayOffset;
+                paramQuantities.at(paramId).reset(q);
+                params.at(paramId).value = q->getDefaultValue();
+                return q;
+            }
+
+            ParamQuantity* configButton(int paramId, std::string name = "")
+            {
+                return configParam(paramId, 0.0f, 1.0f, 0.0f, name);
+            }
+
+            PortInfo* configInput(int portId, std::string name = "")
+            {
+                inputInfos.at(portId).reset(new PortInfo {name});
+                return inputInfos[portId].get();
+            }
+
+            PortInfo* configOutput(int portId, std::string name = "")
+            {
+                outputInfos.at(portId).reset(new PortInfo {name});
+                return outputInfos[portId].get();
+            }
+
+            void configBypass(int inputId, int outputId)
+            {
+                bypassRoutes.push_back(std::make_pair(inputId, outputId));
+            }
+
+            virtual void process(const ProcessArgs& args) {}
+
+            virtual void onReset(const ResetEvent& e)
+            {
+                for (auto& q : paramQuantities)
+                    if (q && q->resetEnabled)
+                        q->reset();
+            }
+
+            virtual void onSampleRateChange(const SampleRateChangeEvent& e) {}
+            virtual void onBypass(const BypassEvent& e) {}
+            virtual json_t* dataToJson() { return nullptr; }
+            virtual void dataFromJson(json_t* root) {}
+
+            // Shim-only helpers for test programs: find a control or port by the name the module gave it.
+            // Each returns -1 if there is no such name.
+            int findInput(const std::string& name) const { return FindPort(inputInfos, name); }
+            int findOutput(const std::string& name) const { return FindPort(outputInfos, name); }
+
+            int findParam(const std::string& name) const
+            {
+                for (size_t i = 0; i < paramQuantities.size(); ++i)
+                    if (paramQuantities[i] && paramQuantities[i]->name == name)
+                        return static_cast<int>(i);
+                return -1;
+            }
+
+        private:
+            static int FindPort(const std::vector<std::unique_ptr<PortInfo>>& infos, const std::string& name)
+            {
+                for (size_t i = 0; i < infos.size(); ++i)
+                    if (infos[i] && infos[i]->name == name)
+                        return static_cast<int>(i);
+                return -1;
+            }
+        };
+
+        inline void ParamQuantity::setValue(float value)
+        {
+            module->params.at(paramId).setValue(math::clamp(value, getMinValue(), getMaxValue()));
+        }
+
+        inline float ParamQuantity::getValue()
+        {
+            return module->params.at(paramId).getValue();
+        }
+    }
+
+    namespace plugin
+    {
+        struct Model
+        {
+            std::string slug;
+
+            virtual ~Model() {}
+            virtual engine::Module* createModule() = 0;
+        };
+
+        struct Plugin
+        {
+            std::vector<Model*> models;
+
+            void addModel(Model* model) { models.push_back(model); }
+
+            Model* getModel(const std::string& slug) const
+            {
+                for (Model* m : models)
+                    if (m->slug == slug)
+                        return m;
+                return nullptr;
+            }
+        };
+    }
+
+    using namespace math;
+    using namespace engine;
+    using namespace plugin;
+
+    template <class TModule, class TModuleWidget>
+    Model* createModel(const std::string& slug)
+    {
+        // The headless build has no widgets, so TModuleWidget may be an incomplete type.
+        struct TModel : Model
+        {
+            engine::Module* createModule() override { return new TModule; }
+        };
+
+        TModel* model = new TModel;
+        model->slug = slug;
+        return model;
+    }
+}
+
+extern "C" void init(rack::plugin::Plugin* plugin);
+
+#endif // __COSINEKITTY_RACK_SHIM_HPP
@@ -0,0 +1,218 @@
+/*
+    realtime_guard.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Test-mode enforcement of real-time safety in Sapphire audio code.
+    Include this header in exactly ONE source file of a test program,
+    and compile everything with SAPPHIRE_REALTIME_GUARD=1.
+
+    It replaces malloc, calloc, realloc, free, the aligned allocators
+    (posix_memalign, aligned_alloc, memalign), every operator new and delete,
+    and the C++ exception allocator for the whole program. Whenever one
+    of them is called while the current thread is inside a
+    SAPPHIRE_REALTIME_SCOPE(), the guard prints what happened and a
+    stack trace to stderr, then aborts the program so the test fails.
+
+    Tests of the guard itself can switch to counting mode, where
+    violations are only counted and execution continues normally.
+
+    Only Linux with glibc is supported. Elsewhere the guard compiles
+    to nothing and RealtimeGuard::IsActive() returns false.
+*/
+
+#ifndef __COSINEKITTY_REALTIME_GUARD_HPP
+#define __COSINEKITTY_REALTIME_GUARD_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include "sapphire_realtime.hpp"
+
+#if !SAPPHIRE_REALTIME_GUARD
+#error "realtime_guard.hpp requires compiling with SAPPHIRE_REALTIME_GUARD=1."
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+#define SAPPHIRE_REALTIME_GUARD_HOOKS 1
+#include <cerrno>
+#include <cstring>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <unistd.h>
+#else
+#define SAPPHIRE_REALTIME_GUARD_HOOKS 0
+#endif
+
+namespace RealtimeGuard
+{
+    std::atomic<long> ViolationCount {0};
+    std::atomic<bool> Fatal {true};
+
+    inline bool IsActive() { return SAPPHIRE_REALTIME_GUARD_HOOKS != 0; }
+
+    inline long Violations() { return ViolationCount.load(); }
+
+    inline void SetFatal(bool fatal) { Fatal.store(fatal); }
+
+#if SAPPHIRE_REALTIME_GUARD_HOOKS
+    inline void WriteText(const char *text)
+    {
+        // write() goes straight to the kernel, so reporting never allocates.
+        ssize_t ignored = write(STDERR_FILENO, text, strlen(text));
+        (void)ignored;
+    }
+
+    inline void Check(const char *operation)
+    {
+        int& depth = Sapphire::RealtimeDepth();
+        if (depth <= 0)
+            return;
+
+        ViolationCount.fetch_add(1);
+        if (!Fatal.load())
+            return;
+
+        // Leave the real-time scope, so anything the reporting does is not reported again.
+        depth = 0;
+        WriteText("\n*** REAL-TIME VIOLATION: ");
+        WriteText(operation);
+        WriteText(" inside SAPPHIRE_REALTIME_SCOPE. Stack trace:\n");
+        void *frames[64];
+        int nframes = backtrace(frames, 64);
+        backtrace_symbols_fd(frames, nframes, STDERR_FILENO);
+        abort();
+    }
+
+    using ExceptionAllocator = void *(*)(size_t);
+
+    inline ExceptionAllocator& RealExceptionAllocator()
+    {
+        static ExceptionAllocator func = nullptr;
+        return func;
+    }
+
+    struct Startup
+    {
+        Startup()
+        {
+            // The first call to backtrace() loads libgcc, and dlsym() may allocate.
+            // Do both now, outside of any real-time scope.
+            void *frames[4];
+            backtrace(frames, 4);
+            RealExceptionAllocator() = reinterpret_cast<ExceptionAllocator>(dlsym(RTLD_NEXT, "__cxa_allocate_exception"));
+        }
+    };
+
+    Startup StartupInstance;
+#endif
+}
+
+
+#if SAPPHIRE_REALTIME_GUARD_HOOKS
+
+extern "C"
+{
+    void *__libc_malloc(size_t);
+    void *__libc_calloc(size_t, size_t);
+    void *__libc_realloc(void *, size_t);
+    void *__libc_memalign(size_t, size_t);
+    void __libc_free(void *);
+
+    void *malloc(size_t size)
+    {
+        RealtimeGuard::Check("malloc");
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size)
+    {
+        RealtimeGuard::Check("calloc");
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        RealtimeGuard::Check("realloc");
+        return __libc_realloc(ptr, size);
+    }
+
+    int posix_memalign(void **ptr, size_t alignment, size_t size)
+    {
+        RealtimeGuard::Check("posix_memalign");
+        // The alignment must be a power of 2, and a multiple of sizeof(void*).
+        if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+            return EINVAL;
+        void *p = __libc_memalign(alignment, size);
+        if (p == nullptr)
+            return ENOMEM;
+        *ptr = p;
+        return 0;
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size)
+    {
+        RealtimeGuard::Check("aligned_alloc");
+        return __libc_memalign(alignment, size);
+    }
+
+    void *memalign(size_t alignment, size_t size)
+    {
+        RealtimeGuard::Check("memalign");
+        return __libc_memalign(alignment, size);
+    }
+
+    void free(void *ptr)
+    {
+        if (ptr != nullptr)
+            RealtimeGuard::Check("free");
+        __libc_free(ptr);
+    }
+
+    void *__cxa_allocate_exception(size_t size) noexcept
+    {
+        // Every C++ throw starts here, before the exception object is constructed.
+        // The real allocator calls malloc; keep that from being reported a second time.
+        RealtimeGuard::Check("throw");
+        int& depth = Sapphire::RealtimeDepth();
+        const int saved = depth;
+        depth = 0;
+        RealtimeGuard::ExceptionAllocator& real = RealtimeGuard::RealExceptionAllocator();
+        if (real == nullptr)    // thrown during static initialization, before Startup ran
+            real = reinterpret_cast<RealtimeGuard::ExceptionAllocator>(dlsym(RTLD_NEXT, "__cxa_allocate_exception"));
+        void *exception = real(size);
+        depth = saved;
+        return exception;
+    }
+}
+
+static void *GuardedNew(size_t size, size_t alignment, const char *operation)
+{
+    RealtimeGuard::Check(operation);
+    if (size == 0)
+        size = 1;
+    void *ptr = (alignment > alignof(std::max_align_t)) ? __libc_memalign(alignment, size) : __libc_malloc(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new(size_t size) { return GuardedNew(size, 0, "operator new"); }
+void *operator new[](size_t size) { return GuardedNew(size, 0, "operator new[]"); }
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, std::align_val_t align) { return GuardedNew(size, static_cast<size_t>(align), "operator new"); }
+void *operator new[](size_t size, std::align_val_t align) { return GuardedNew(size, static_cast<size_t>(align), "operator new[]"); }
+void operator delete(void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+#endif
+
+#endif  // SAPPHIRE_REALTIME_GUARD_HOOKS
+
+#endif  // __COSINEKITTY_REALTIME_GUARD_HPP
@@ -0,0 +1,288 @@
+/*
+    render_engine.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    A uniform, name-addressable parameter interface over the Sapphire engines,
+    for command-line tools that render or process audio outside of VCV Rack.
+    Parameter values use the same ranges as the knobs and sliders on the
+    corresponding VCV Rack module, and are mapped onto the engine the same way.
+*/
+
+#ifndef __COSINEKITTY_RENDER_ENGINE_HPP
+#define __COSINEKITTY_RENDER_ENGINE_HPP
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "elastika_engine.hpp"
+#include "tubeunit_engine.hpp"
+
+namespace Sapphire
+{
+    struct EngineParameter
+    {
+        const char *name;
+        float minValue;
+        float maxValue;
+        float defaultValue;
+        const char *description;
+    };
+
+    // Output limiter settings, matching the module's right-click menu slider.
+    // Any value at or above RENDER_AGC_DISABLE turns the limiter off.
+    const float RENDER_AGC_MIN = 5.0f;
+    const float RENDER_AGC_DEFAULT = 8.5f;
+    const float RENDER_AGC_DISABLE = 10.1f;
+    const float RENDER_AGC_MAX = 10.2f;
+
+    class RenderEngine
+    {
+    protected:
+        std::vector<float> values;
+        float sampleRate = 44100.0f;
+
+        virtual void apply(int id, float value) = 0;
+
+        void applyDefaults()
+        {
+            const std::vector<EngineParameter>& plist = parameters();
+            values.resize(plist.size());
+            for (size_t i = 0; i < plist.size(); ++i)
+                setParameter(static_cast<int>(i), plist[i].defaultValue);
+        }
+
+    public:
+        virtual ~RenderEngine() {}
+        virtual const char *name() const = 0;
+        virtual const std::vector<EngineParameter>& parameters() const = 0;
+        virtual void initialize() = 0;      // cold start, with every parameter at its default value
+        virtual void setSampleRate(float sampleRateHz) { sampleRate = sampleRateHz; }
+
+        // Per-stage timing of the engine; empty unless built with SAPPHIRE_ENABLE_PROFILING=1.
+        virtual ProfileSnapshot getProfile() const = 0;
+
+        // Binary snapshot of the engine's dynamic state, for starting a render from a warmed-up sound.
+        // Parameter values are not included. loadState throws std::runtime_error for an unusable blob.
+        virtual void saveState(std::vector<uint8_t>& state) const = 0;
+        virtual void loadState(const std::vector<uint8_t>& state) = 0;
+
+        // Process a block of stereo audio. The input and output buffers may be the same.
+        virtual void process(size_t nframes, const float *inLeft, const float *inRight, float *outLeft, float *outRight) = 0;
+
+        int numParameters() const { return static_cast<int>(parameters().size()); }
+        float getSampleRate() const { return sampleRate; }
+
+        int findParameter(const std::string& paramName) const
+        {
+            const std::vector<EngineParameter>& plist = parameters();
+            for (size_t i = 0; i < plist.size(); ++i)
+                if (paramName == plist[i].name)
+                    return static_cast<int>(i);
+            return -1;
+        }
+
+        bool setParameter(int id, float value)
+        {
+            if (id < 0 || id >= numParameters())
+                return false;
+            const EngineParameter& p = parameters()[id];
+            value = Clamp(value, p.minValue, p.maxValue);
+            values[id] = value;
+            apply(id, value);
+            return true;
+        }
+
+        float getParameter(int id) const
+        {
+            return (id >= 0 && id < numParameters()) ? values[id] : 0.0f;
+        }
+    };
+
+
+    class ElastikaRenderEngine : public RenderEngine
+    {
+    private:
+        ElastikaEngine engine;
+
+    public:
+        enum ParamId
+        {
+            FRICTION, STIFFNESS, SPAN, CURL, MASS, DRIVE, LEVEL, INPUT_TILT, OUTPUT_TILT, DC_REJECT, LIMITER,
+        };
+
+        ElastikaRenderEngine()
+        {
+            initialize();
+        }
+
+        const char *name() const override { return "elastika"; }
+
+        const std::vector<EngineParameter>& parameters() const override
+        {
+            static const std::vector<EngineParameter> plist
+            {
+                { "friction",    0.0f,  1.0f,   0.5f, "Friction slider" },
+                { "stiffness",   0.0f,  1.0f,   0.5f, "Stiffness slider" },
+                { "span",        0.0f,  1.0f,   0.5f, "Spring span slider" },
+                { "curl",       -1.0f, +1.0f,   0.0f, "Magnetic field slider" },
+                { "mass",       -1.0f, +1.0f,   0.0f, "Impurity mass slider" },
+                { "drive",       0.0f,  2.0f,   1.0f, "Input drive knob" },
+                { "level",       0.0f,  2.0f,   1.0f, "Output level knob" },
+                { "intilt",      0.0f,  1.0f,   0.5f, "Input tilt angle knob" },
+                { "outtilt",     0.0f,  1.0f,   0.5f, "Output tilt angle knob" },
+                { "dcreject",   20.0f, 400.0f, 20.0f, "DC reject cutoff frequency [Hz]" },
+                { "limiter", RENDER_AGC_MIN, RENDER_AGC_MAX, RENDER_AGC_DEFAULT, "Output limiter level [V]; 10.1 and above disables" },
+            };
+            return plist;
+        }
+
+        void initialize() override
+        {
+            engine.initialize();
+            applyDefaults();
+        }
+
+        ElastikaEngine& getEngine() { return engine; }
+        ProfileSnapshot getProfile() const override { return engine.getProfile(); }
+        void saveState(std::vector<uint8_t>& state) const override { engine.saveState(state); }
+        void loadState(const std::vector<uint8_t>& state) override { engine.loadState(state); }
+
+        void process(size_t nframes, const float *inLeft, const float *inRight, float *outLeft, float *outRight) override
+        {
+            for (size_t i = 0; i < nframes; ++i)
+                engine.process(sampleRate, inLeft[i], inRight[i], outLeft[i], outRight[i]);
+        }
+
+    protected:
+        void apply(int id, float value) override
+        {
+            switch (id)
+            {
+            case FRICTION:      engine.setFriction(value);          break;
+            case STIFFNESS:     engine.setStiffness(value);         break;
+            case SPAN:          engine.setSpan(value);              break;
+            case CURL:          engine.setCurl(value);              break;
+            case MASS:          engine.setMass(value);              break;
+            case DRIVE:         engine.setDrive(value);             break;
+            case LEVEL:         engine.setGain(value);              break;
+            case INPUT_TILT:    engine.setInputTilt(value);         break;
+            case OUTPUT_TILT:   engine.setOutputTilt(value);        break;
+            case DC_REJECT:     engine.setDcRejectFrequency(value); break;
+            case LIMITER:
+                if (value < RENDER_AGC_DISABLE)
+                    engine.setAgcLevel(value);
+                engine.setAgcEnabled(value < RENDER_AGC_DISABLE);
+                break;
+            }
+        }
+    };
+
+
+    class TubeUnitRenderEngine : public RenderEngine
+    {
+    private:
+        TubeUnitEngine engine;
+
+    public:
+        enum ParamId
+        {
+            AIRFLOW, VORTEX, BYPASS_WIDTH, BYPASS_CENTER, REFLECTION_DECAY, REFLECTION_ANGLE, ROOT_FREQUENCY, STIFFNESS, LEVEL, LIMITER, VENT, INTERPOLATION,
+        };
+
+        TubeUnitRenderEngine()
+        {
+            initialize();
+        }
+
+        const char *name() const override { return "tubeunit"; }
+
+        const std::vector<EngineParameter>& parameters() const override
+        {
+            static const std::vector<EngineParameter> plist
+            {
+                { "airflow",     0.0f,  5.0f, 1.0f,       "Airflow knob" },
+                { "vortex",      0.0f,  1.0f, 0.0f,       "Vortex knob" },
+                { "width",       0.5f, 20.0f, 6.0f,       "Bypass width knob" },
+                { "center",    -10.0f, 10.0f, 5.0f,       "Bypass center knob" },
+                { "decay",       0.0f,  1.0f, 0.5f,       "Reflection decay knob" },
+                { "angle",       0.0f,  1.0f, 0.1f,       "Reflection angle knob" },
+                { "root",        0.0f,  8.0f, 2.7279248f, "Root frequency knob: 4*2^root Hz" },
+                { "stiffness",   0.0f,  1.0f, 0.5f,       "Stiffness knob" },
+                { "level",       0.0f,  2.0f, 1.0f,       "Output level knob" },
+                { "limiter", RENDER_AGC_MIN, RENDER_AGC_MAX, RENDER_AGC_DEFAULT, "Output limiter level [V]; 10.1 and above disables" },
+                { "vent",        0.0f,  1.0f, 0.0f,       "Vent gate: 1 vents the mouth and ignores airflow" },
+                { "interp",      0.0f,  3.0f, 3.0f,       "Tube length interpolation: 0=linear, 1=Hermite, 2=Thiran, 3=sinc" },
+            };
+            return plist;
+        }
+
+        void initialize() override
+        {
+            engine.initialize();
+            engine.setSampleRate(sampleRate);
+            applyDefaults();
+        }
+
+        TubeUnitEngine& getEngine() { return engine; }
+        ProfileSnapshot getProfile() const override { return engine.getProfile(); }
+        void saveState(std::vector<uint8_t>& state) const override { engine.saveState(state); }
+        void loadState(const std::vector<uint8_t>& state) override { engine.loadState(state); }
+
+        void setSampleRate(float sampleRateHz) override
+        {
+            RenderEngine::setSampleRate(sampleRateHz);
+            engine.setSampleRate(sampleRateHz);
+        }
+
+        void process(size_t nframes, const float *inLeft, const float *inRight, float *outLeft, float *outRight) override
+        {
+            for (size_t i = 0; i < nframes; ++i)
+            {
+                float left = inLeft[i];
+                float right = inRight[i];
+                engine.process(outLeft[i], outRight[i], left, right);
+            }
+        }
+
+    protected:
+        void apply(int id, float value) override
+        {
+            // Map knob values onto the engine exactly the way TubeUnitModule does.
+            switch (id)
+            {
+            case AIRFLOW:           engine.setAirflow(value);                                       break;
+            case VORTEX:            engine.setVortex(value);                                        break;
+            case BYPASS_WIDTH:      engine.setBypassWidth(value);                                   break;
+            case BYPASS_CENTER:     engine.setBypassCenter(value);                                  break;
+            case REFLECTION_DECAY:  engine.setReflectionDecay(value);                               break;
+            case REFLECTION_ANGLE:  engine.setReflectionAngle(M_PI * value);                        break;
+            case ROOT_FREQUENCY:    engine.setRootFrequency(4 * std::pow(2.0f, value));             break;
+            case STIFFNESS:         engine.setSpringConstant(0.005f * std::pow(10.0f, 4.0f * value)); break;
+            case LEVEL:             engine.setGain(value);                                          break;
+            case VENT:              engine.setQuiet(value >= 0.5f);                                 break;
+            case INTERPOLATION:     engine.setInterpolation(static_cast<TubeInterpolation>(static_cast<int>(std::round(value))));  break;
+            case LIMITER:
+                // Tube Unit's limiter is calibrated in dimensionless units, not volts.
+                if (value < RENDER_AGC_DISABLE)
+                    engine.setAgcLevel(value / 5.0f);
+                engine.setAgcEnabled(value < RENDER_AGC_DISABLE);
+                break;
+            }
+        }
+    };
+
+
+    inline std::unique_ptr<RenderEngine> CreateRenderEngine(const std::string& engineName)
+    {
+        if (engineName == "elastika")
+            return std::unique_ptr<RenderEngine>(new ElastikaRenderEngine);
+
+        if (engineName == "tubeunit")
+            return std::unique_ptr<RenderEngine>(new TubeUnitRenderEngine);
+
+        return nullptr;
+    }
+}
+
+#endif // __COSINEKITTY_RENDER_ENGINE_HPP
@@ -0,0 +1,165 @@
+/*
+    session_replay.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Replays a session captured by a Sapphire module inside VCV Rack
+    (see src/sapphire_capture.hpp) through the same module class,
+    built headless against util/include/rack_shim.hpp.
+
+    Every parameter value, input voltage, menu setting, sample rate change
+    and reset reaches the module exactly as it did in Rack, so the module
+    produces the same output voltages bit for bit. Each frame's outputs are
+    compared with the ones recorded in the trace, and any difference is counted.
+*/
+
+#ifndef __COSINEKITTY_SESSION_REPLAY_HPP
+#define __COSINEKITTY_SESSION_REPLAY_HPP
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "plugin.hpp"
+
+inline rack::plugin::Plugin& HeadlessSapphirePlugin()
+{
+    // The plugin's models, registered the same way VCV Rack would register them.
+    static rack::plugin::Plugin plugin;
+    if (plugin.models.empty())
+        init(&plugin);
+    return plugin;
+}
+
+
+class SessionReplay
+{
+private:
+    Sapphire::CaptureReader reader;
+    std::unique_ptr<rack::engine::Module> module;
+    Sapphire::CaptureTarget *target = nullptr;
+    rack::engine::Module::ProcessArgs args {};
+    long frameCount = 0;
+    long mismatchCount = 0;
+    long firstMismatch = -1;
+    double processSeconds = 0.0;
+
+    void loadFrame()
+    {
+        for (int i = 0; i < reader.paramCount(); ++i)
+            module->params[i].setValue(reader.param(i));
+
+        for (int i = 0; i < reader.inputCount(); ++i)
+        {
+            rack::engine::Input& input = module->inputs[i];
+            input.channels = static_cast<uint8_t>(reader.inputChannels(i));
+            for (int c = 0; c < input.channels; ++c)
+                input.voltages[c] = reader.inputVoltage(i, c);
+        }
+
+        // Connect the same output cables the module had; it sets their channel counts itself.
+        for (int i = 0; i < reader.outputCount(); ++i)
+            module->outputs[i].channels = static_cast<uint8_t>(reader.outputChannels(i));
+    }
+
+    bool outputsMatch() const
+    {
+        for (int i = 0; i < reader.outputCount(); ++i)
+        {
+            const rack::engine::Output& output = module->outputs[i];
+            if (output.getChannels() != reader.outputChannels(i))
+                return false;
+            for (int c = 0; c < output.getChannels(); ++c)
+                if (Sapphire::FloatBits(output.getVoltage(c)) != reader.outputBits(i, c))
+                    return false;
+        }
+        return true;
+    }
+
+public:
+    explicit SessionReplay(const std::string& filename)
+        : reader(filename)
+    {
+        rack::plugin::Model *model = HeadlessSapphirePlugin().getModel(reader.moduleSlug());
+        if (model == nullptr)
+            throw std::runtime_error("Capture is from an unknown module: " + reader.moduleSlug());
+
+        module.reset(model->createModule());
+        target = dynamic_cast<Sapphire::CaptureTarget *>(module.get());
+        if (target == nullptr)
+            throw std::runtime_error("Module does not support session replay: " + reader.moduleSlug());
+
+        if (reader.paramCount() != static_cast<int>(module->params.size()) ||
+            reader.inputCount() != static_cast<int>(module->inputs.size()) ||
+            reader.outputCount() != static_cast<int>(module->outputs.size()))
+            throw std::runtime_error("Capture was made by a different version of " + reader.moduleSlug());
+    }
+
+    bool step()
+    {
+        // Replays the records up to and including the next frame.
+        // Returns false once the trace has no more frames.
+        for(;;)
+        {
+            switch (reader.next())
+            {
+            case Sapphire::CaptureRecord::SampleRate:
+                args.sampleRate = reader.sampleRate();
+                args.sampleTime = 1.0f / args.sampleRate;
+                module->onSampleRateChange({args.sampleRate, args.sampleTime});
+                break;
+
+            case Sapphire::CaptureRecord::Snapshot:
+            {
+                const std::vector<uint8_t>& data = reader.snapshot();
+                Sapphire::StateReader state(data.data(), data.size(), Sapphire::CaptureSnapshotKind(), Sapphire::CaptureVersion);
+                target->loadCaptureState(state);
+                state.finish();
+                break;
+            }
+
+            case Sapphire::CaptureRecord::Setting:
+                target->replaySetting(reader.setting(), reader.settingAsFloat());
+                break;
+
+            case Sapphire::CaptureRecord::Reset:
+                module->onReset(rack::engine::Module::ResetEvent());
+                break;
+
+            case Sapphire::CaptureRecord::Frame:
+            {
+                if (args.sampleRate <= 0.0f)
+                    throw std::runtime_error("Capture has a frame before its sample rate.");
+                loadFrame();
+                auto start = std::chrono::steady_clock::now();
+                module->process(args);
+                processSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (!outputsMatch())
+                {
+                    if (firstMismatch < 0)
+                        firstMismatch = frameCount;
+                    ++mismatchCount;
+                }
+                ++frameCount;
+                ++args.frame;
+                return true;
+            }
+
+            case Sapphire::CaptureRecord::End:
+                return false;
+
+            default:
+                throw std::runtime_error("Capture has an unexpected record.");
+            }
+        }
+    }
+
+    const std::string& moduleSlug() const { return reader.moduleSlug(); }
+    const rack::engine::Module& getModule() const { return *module; }
+    float sampleRate() const { return args.sampleRate; }
+    bool isComplete() const { return reader.isComplete(); }         // valid after step() returns false
+    long frames() const { return frameCount; }
+    long mismatches() const { return mismatchCount; }
+    long firstMismatchFrame() const { return firstMismatch; }       // -1 if every frame matched
+    double secondsInProcess() const { return processSeconds; }
+};
+
+#endif // __COSINEKITTY_SESSION_REPLAY_HPP
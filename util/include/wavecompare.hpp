@@ -0,0 +1,275 @@
+/*
+    wavecompare.hpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Compares a rendered WAV file against a reference rendering,
+    using error measures that tolerate inaudible numeric differences:
+    maximum absolute sample error, signal-to-noise ratio of the difference,
+    and the distance between their average third-octave band spectra.
+*/
+
+#ifndef __COSINEKITTY_WAVECOMPARE_HPP
+#define __COSINEKITTY_WAVECOMPARE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <string>
+#include <vector>
+#include "wavefile.hpp"
+
+struct WaveTolerance
+{
+    double maxAbsError = 0.0;       // largest allowed |test - reference| for any one sample
+    double minSnrDb = 0.0;          // reference power over difference power, in decibels
+    double maxSpectralDb = 0.0;     // largest allowed RMS third-octave band difference, in decibels
+};
+
+
+struct WaveComparison
+{
+    std::string problem;            // empty if the files could be compared, even if they differ
+    size_t samples = 0;
+    double maxAbsError = 0.0;
+    size_t worstSample = 0;         // interleaved sample index where maxAbsError occurs
+    double snrDb = std::numeric_limits<double>::infinity();
+    double spectralDb = 0.0;
+
+    bool passes(const WaveTolerance& tol) const
+    {
+        return problem.empty() &&
+            maxAbsError <= tol.maxAbsError &&
+            snrDb >= tol.minSnrDb &&
+            spectralDb <= tol.maxSpectralDb;
+    }
+};
+
+
+inline void FourierTransform(std::vector<std::complex<double>>& x)
+{
+    // In-place iterative radix-2 FFT. The length must be a power of 2.
+    const size_t n = x.size();
+    for (size_t i = 1, j = 0; i < n; ++i)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(x[i], x[j]);
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1)
+    {
+        const double angle = -2.0 * M_PI / len;
+        const std::complex<double> step(std::cos(angle), std::sin(angle));
+        for (size_t i = 0; i < n; i += len)
+        {
+            std::complex<double> w(1.0, 0.0);
+            for (size_t k = 0; k < len/2; ++k)
+            {
+                std::complex<double> u = x[i+k];
+                std::complex<double> v = w * x[i+k+len/2];
+                x[i+k] = u + v;
+                x[i+k+len/2] = u - v;
+                w *= step;
+            }
+        }
+    }
+}
+
+
+class PowerSpectrum     // Welch-style average power spectrum of all channels mixed together
+{
+private:
+    static const size_t FRAME = 4096;
+    static const size_t HOP = FRAME / 2;
+
+    std::vector<double> window;
+    std::vector<double> pending;        // mono samples not yet analyzed
+    std::vector<std::complex<double>> buffer;
+    std::vector<double> power;
+    size_t frames = 0;
+
+    void analyze()
+    {
+        for (size_t i = 0; i < FRAME; ++i)
+            buffer[i] = std::complex<double>(window[i] * pending[i], 0.0);
+
+        FourierTransform(buffer);
+
+        for (size_t k = 0; k < power.size(); ++k)
+            power[k] += std::norm(buffer[k]);
+
+        ++frames;
+        pending.erase(pending.begin(), pending.begin() + HOP);
+    }
+
+public:
+    PowerSpectrum()
+        : window(FRAME)
+        , buffer(FRAME)
+        , power(FRAME/2 + 1)
+    {
+        for (size_t i = 0; i < FRAME; ++i)
+            window[i] = 0.5 - 0.5*std::cos((2.0 * M_PI * i) / FRAME);
+    }
+
+    void append(const float *data, size_t frameCount, int channels)
+    {
+        for (size_t f = 0; f < frameCount; ++f)
+        {
+            double sum = 0.0;
+            for (int c = 0; c < channels; ++c)
+                sum += data[f*channels + c];
+            pending.push_back(sum);
+            if (pending.size() == FRAME)
+                analyze();
+        }
+    }
+
+    const std::vector<double>& finish()
+    {
+        if (frames == 0 && !pending.empty())
+        {
+            // Short file: analyze it as a single zero-padded frame.
+            pending.resize(FRAME, 0.0);
+            analyze();
+        }
+        if (frames > 0)
+            for (double& p : power)
+                p /= frames;
+        return power;
+    }
+
+    static std::vector<double> Bands(const std::vector<double>& power)
+    {
+        // Sum the power spectrum into third-octave bands, starting just above DC.
+        // Band energies are stable even when the fine structure of the spectrum is not,
+        // as happens when chaotic systems like Elastika drift apart sample by sample.
+        std::vector<double> bands;
+        size_t lo = 1;
+        while (lo < power.size())
+        {
+            size_t hi = std::max(lo + 1, static_cast<size_t>(std::round(lo * 1.2599210498948732)));
+            hi = std::min(hi, power.size());
+            double sum = 0.0;
+            for (size_t k = lo; k < hi; ++k)
+                sum += power[k];
+            bands.push_back(sum);
+            lo = hi;
+        }
+        return bands;
+    }
+
+    static double Distance(const std::vector<double>& refPower, const std::vector<double>& testPower)
+    {
+        // RMS difference in decibels over the third-octave bands where the reference has meaningful energy.
+        // Bands more than 100 dB below the reference's strongest band are ignored:
+        // differences there are below the noise floor of any output format we write.
+        const std::vector<double> ref = Bands(refPower);
+        const std::vector<double> test = Bands(testPower);
+
+        double peak = 0.0;
+        for (double p : ref)
+            peak = std::max(peak, p);
+
+        if (peak == 0.0)
+        {
+            for (double p : test)
+                if (p != 0.0)
+                    return std::numeric_limits<double>::infinity();
+            return 0.0;
+        }
+
+        const double floor = peak * 1.0e-10;
+        double sum = 0.0;
+        size_t count = 0;
+        for (size_t k = 0; k < ref.size(); ++k)
+        {
+            if (ref[k] >= floor)
+            {
+                const double db = 10.0 * std::log10((test[k] + floor) / (ref[k] + floor));
+                sum += db * db;
+                ++count;
+            }
+        }
+        return std::sqrt(sum / count);
+    }
+};
+
+
+inline WaveComparison CompareWaveFiles(const char *referenceFileName, const char *testFileName)
+{
+    WaveComparison result;
+    WaveFileReader ref;
+    WaveFileReader test;
+
+    if (!ref.Open(referenceFileName))
+    {
+        result.problem = std::string("cannot open reference file ") + referenceFileName;
+        return result;
+    }
+
+    if (!test.Open(testFileName))
+    {
+        result.problem = std::string("cannot open test file ") + testFileName;
+        return result;
+    }
+
+    if (ref.SampleRate() != test.SampleRate() || ref.Channels() != test.Channels())
+    {
+        result.problem = "sample rate or channel count does not match the reference";
+        return result;
+    }
+
+    if (ref.TotalSamples() != test.TotalSamples())
+    {
+        result.problem =
+            "length " + std::to_string(test.TotalSamples()) +
+            " samples does not match reference length " + std::to_string(ref.TotalSamples());
+        return result;
+    }
+
+    const int channels = ref.Channels();
+    const size_t blockSamples = 4096 * channels;
+    std::vector<float> a(blockSamples);
+    std::vector<float> b(blockSamples);
+    PowerSpectrum refSpectrum;
+    PowerSpectrum testSpectrum;
+    double signalPower = 0.0;
+    double errorPower = 0.0;
+
+    for(;;)
+    {
+        const size_t n = ref.Read(a.data(), blockSamples);
+        if (n == 0 || test.Read(b.data(), n) != n)
+            break;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const double diff = static_cast<double>(b[i]) - static_cast<double>(a[i]);
+            if (!(std::abs(diff) <= result.maxAbsError))     // also catches NAN in either file
+            {
+                result.maxAbsError = std::isnan(diff) ? std::numeric_limits<double>::infinity() : std::abs(diff);
+                result.worstSample = result.samples + i;
+            }
+            signalPower += static_cast<double>(a[i]) * a[i];
+            errorPower += diff * diff;
+        }
+
+        refSpectrum.append(a.data(), n / channels, channels);
+        testSpectrum.append(b.data(), n / channels, channels);
+        result.samples += n;
+    }
+
+    if (std::isnan(errorPower))
+        result.snrDb = -std::numeric_limits<double>::infinity();
+    else if (errorPower > 0.0)
+        result.snrDb = (signalPower > 0.0) ? 10.0 * std::log10(signalPower / errorPower) : -std::numeric_limits<double>::infinity();
+
+    result.spectralDb = PowerSpectrum::Distance(refSpectrum.finish(), testSpectrum.finish());
+    return result;
+}
+
+#endif // __COSINEKITTY_WAVECOMPARE_HPP
@@ -1,6 +1,6 @@
 /*
     wavefile.hpp  -  Don Cross <cosinekitty@gmail.com>
-    Quick and dirty 16-bit PCM WAV file reader/writer.
+    WAV file reader/writer for 16-bit PCM, 24-bit PCM, and 32-bit float audio.
 */
 
 #ifndef __COSINEKITTY_WAVEFILE_HPP
@@ -9,12 +9,54 @@
 #include <cinttypes>
 #include <cstring>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <limits>
 #include <vector>
 #include <stdexcept>
 #include <string>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COSINEKITTY_WAVEFILE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 
 const int IntSampleScale = 32700;
+const int Int24SampleScale = 256 * IntSampleScale;     // same headroom as 16-bit, 8 more bits of precision
+
+
+enum class WaveSampleFormat
+{
+    Int16,      // 16-bit signed integer PCM
+    Int24,      // 24-bit signed integer PCM, packed into 3 bytes per sample
+    Float32,    // 32-bit IEEE floating point
+};
+
+
+inline int WaveBytesPerSample(WaveSampleFormat format)
+{
+    switch (format)
+    {
+    case WaveSampleFormat::Int16:   return 2;
+    case WaveSampleFormat::Int24:   return 3;
+    case WaveSampleFormat::Float32: return 4;
+    default:
+        throw std::logic_error("Invalid WaveSampleFormat");
+    }
+}
 
 
 inline int16_t IntSampleFromFloat(float x)
@@ -35,101 +77,427 @@ inline float FloatFromIntSample(int16_t s)
 }
 
 
+inline void CheckFloatSampleRange(const float *data, size_t ndata)
+{
+    // Verify an entire block at once, so the conversion loops stay branch-free.
+    // Only if something is out of range do we go back and find which sample it was.
+    size_t i = 0;
+    bool bad = false;
+#if COSINEKITTY_WAVEFILE_SSE2
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 flags = _mm_setzero_ps();
+    for (; i+4 <= ndata; i += 4)
+        flags = _mm_or_ps(flags, _mm_cmpgt_ps(_mm_and_ps(absMask, _mm_loadu_ps(&data[i])), one));
+    bad = (0 != _mm_movemask_ps(flags));
+#endif
+    for (; i < ndata; ++i)
+        bad = bad || (data[i] < -1.0f || data[i] > +1.0f);
+
+    if (bad)
+        for (i = 0; i < ndata; ++i)
+            IntSampleFromFloat(data[i]);    // throws the same exception as the one-sample version
+}
+
+
+inline void ConvertFloatToInt16(const float *data, int16_t *out, size_t ndata)
+{
+    // IMPORTANT: caller must verify the range of the data first.
+    size_t i = 0;
+#if COSINEKITTY_WAVEFILE_SSE2
+    // Truncate toward zero, exactly like static_cast<int16_t>, 8 samples at a time.
+    const __m128 scale = _mm_set1_ps(static_cast<float>(IntSampleScale));
+    for (; i+8 <= ndata; i += 8)
+    {
+        __m128i a = _mm_cvttps_epi32(_mm_mul_ps(scale, _mm_loadu_ps(&data[i])));
+        __m128i b = _mm_cvttps_epi32(_mm_mul_ps(scale, _mm_loadu_ps(&data[i+4])));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i]), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < ndata; ++i)
+        out[i] = static_cast<int16_t>(IntSampleScale * data[i]);
+}
+
+
+inline void ConvertFloatToInt24(const float *data, uint8_t *out, size_t ndata)
+{
+    // IMPORTANT: caller must verify the range of the data first.
+    const float scale = static_cast<float>(Int24SampleScale);
+    size_t i = 0;
+#if COSINEKITTY_WAVEFILE_SSE2
+    // Convert 4 samples at a time, truncating exactly like static_cast<int32_t>.
+    // SSE2 has no byte shuffle, so pack pairs of 24-bit samples into the low 48 bits
+    // of each 64-bit lane, then store both lanes with 8-byte writes that overlap by 2 bytes.
+    // Each write's top 2 bytes are overwritten by the next write, so stop while
+    // at least one more sample remains to keep the last write inside the buffer.
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128i lowMask = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+    const __m128i highMask = _mm_set_epi32(0x00ffffff, 0, 0x00ffffff, 0);
+    for (; i+5 <= ndata; i += 4)
+    {
+        __m128i s = _mm_cvttps_epi32(_mm_mul_ps(vscale, _mm_loadu_ps(&data[i])));
+        __m128i packed = _mm_or_si128(_mm_and_si128(s, lowMask), _mm_srli_epi64(_mm_and_si128(s, highMask), 8));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(&out[3*i]), packed);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(&out[3*i+6]), _mm_unpackhi_epi64(packed, packed));
+    }
+#endif
+    for (; i < ndata; ++i)
+    {
+        int32_t s = static_cast<int32_t>(scale * data[i]);
+        out[3*i+0] = static_cast<uint8_t>(s);
+        out[3*i+1] = static_cast<uint8_t>(s >> 8);
+        out[3*i+2] = static_cast<uint8_t>(s >> 16);
+    }
+}
+
+
+class MemoryMappedFile      // view of an entire file's contents, read-only unless requested otherwise
+{
+private:
+    uint8_t *base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mapHandle = nullptr;
+#endif
+
+public:
+    MemoryMappedFile() {}
+    MemoryMappedFile(const MemoryMappedFile&) = delete;
+    MemoryMappedFile& operator = (const MemoryMappedFile&) = delete;
+
+    ~MemoryMappedFile()
+    {
+        Close();
+    }
+
+    const uint8_t *Data() const { return base; }
+    uint8_t *WritableData() const { return base; }     // valid only when opened with `writable` = true
+    size_t Length() const { return length; }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (base != nullptr)
+            UnmapViewOfFile(base);
+        if (mapHandle != nullptr)
+            CloseHandle(mapHandle);
+        if (fileHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(fileHandle);
+        mapHandle = nullptr;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (base != nullptr)
+            munmap(base, length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    bool Open(const char *filename, bool writable = false)
+    {
+        Close();
+#ifdef _WIN32
+        fileHandle = CreateFileA(
+            filename,
+            writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+            writable ? 0 : FILE_SHARE_READ,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+
+        mapHandle = CreateFileMappingA(fileHandle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        if (mapHandle == nullptr)
+        {
+            Close();
+            return false;
+        }
+
+        base = static_cast<uint8_t *>(MapViewOfFile(mapHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+        if (base == nullptr)
+        {
+            Close();
+            return false;
+        }
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat statBuf;
+        if (fstat(fd, &statBuf) != 0 || statBuf.st_size <= 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void *map = mmap(
+            nullptr,
+            static_cast<size_t>(statBuf.st_size),
+            writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+            writable ? MAP_SHARED : MAP_PRIVATE,
+            fd,
+            0);
+        close(fd);      // the mapping stays valid after the descriptor is closed
+        if (map == MAP_FAILED)
+            return false;
+
+        base = static_cast<uint8_t *>(map);
+        length = static_cast<size_t>(statBuf.st_size);
+
+        // We almost always stream front to back; let the kernel read ahead aggressively.
+        madvise(map, length, MADV_SEQUENTIAL);
+#endif
+        return true;
+    }
+};
+
+
 class WaveFileWriter
 {
 private:
+    static const size_t bufferBytes = 1 << 20;     // accumulate this much audio before each fwrite
+    static const uint32_t maxChunkSize = 0xffffffff;
+
     FILE *outfile = nullptr;
-    std::vector<int16_t> buffer;
+    std::vector<uint8_t> buffer;
+    size_t bufferUsed = 0;
+    WaveSampleFormat format = WaveSampleFormat::Int16;
+    bool allowRf64 = false;
     int nchannels = 0;
     int sampleRateHz = 0;
-    int byteLength = 0;
+    uint64_t byteLength = 0;
+    size_t headerLength = 0;
+
+    static void Encode16(std::vector<uint8_t>& header, uint32_t value)
+    {
+        header.push_back(static_cast<uint8_t>(value));
+        header.push_back(static_cast<uint8_t>(value >> 8));
+    }
+
+    static void Encode32(std::vector<uint8_t>& header, uint32_t value)
+    {
+        Encode16(header, value);
+        Encode16(header, value >> 16);
+    }
+
+    static void Encode64(std::vector<uint8_t>& header, uint64_t value)
+    {
+        Encode32(header, static_cast<uint32_t>(value));
+        Encode32(header, static_cast<uint32_t>(value >> 32));
+    }
+
+    static void EncodeTag(std::vector<uint8_t>& header, const char *tag)
+    {
+        for (int i = 0; i < 4; ++i)
+            header.push_back(static_cast<uint8_t>(tag[i]));
+    }
 
-    void Encode16(uint8_t *header, int offset, int value)
+    static uint32_t Clip32(uint64_t value)
     {
-        header[offset+0] = value;
-        header[offset+1] = value >> 8;
+        return (value > maxChunkSize) ? maxChunkSize : static_cast<uint32_t>(value);
     }
 
-    void Encode32(uint8_t *header, int offset, int value)
+    int BytesPerSample() const
     {
-        header[offset+0] = value;
-        header[offset+1] = value >> 8;
-        header[offset+2] = value >> 16;
-        header[offset+3] = value >> 24;
+        return WaveBytesPerSample(format);
+    }
+
+    void BuildHeader(std::vector<uint8_t>& header) const
+    {
+        BuildHeader(header, format, nchannels, sampleRateHz, byteLength, allowRf64);
     }
 
     void WriteHeader()
     {
-        // 00000000  52 49 46 46 c4 ea 1a 00  57 41 56 45 66 6d 74 20  |RIFF....WAVEfmt |
-        // 00000010  10 00 00 00 01 00 02 00  44 ac 00 00 10 b1 02 00  |........D.......|
-        // 00000020  04 00 10 00 64 61 74 61  a0 ea 1a 00 00 00 00 00  |....data........|
-        // 00000030  00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00  |................|
-        // 00000040  ff ff 00 00 02 00 ff ff  fd ff 02 00 04 00 fe ff  |................|
-
-        uint8_t header[] = {
-            0x52, 0x49, 0x46, 0x46,     // "RIFF"
-            0, 0, 0, 0,                 // placeholder for size of RIFF chunk
-            0x57, 0x41, 0x56, 0x45,     // "WAVE"
-            0x66, 0x6d, 0x74, 0x20,     // "fmt "
-            0x10, 0x00, 0x00, 0x00,     // length of format payload = 16
-            0x01, 0x00,                 // format = 1 = PCM
-            0, 0,                       // placeholder for number of channels
-            0, 0, 0, 0,                 // placeholder for sample rate
-            0, 0, 0, 0,                 // placeholder for bitrate
-            0, 0,                       // placeholder for bytes/sample
-            0x10, 0x00,                 // bits per sample = 16
-            0x64, 0x61, 0x74, 0x61,     // "data"
-            0, 0, 0, 0                  // placeholder for data length
-        };
-
-        Encode32(header,  4, byteLength+44-8);   // RIFF payload size = (file size) - ("RIFF" + 4 bytes for storing size)
-        Encode16(header, 22, nchannels);
-        Encode32(header, 24, sampleRateHz);
-        Encode32(header, 28, sampleRateHz*(2*nchannels));   // bitrate
-        Encode16(header, 32, 2*nchannels);                  // bytes per sample
-        Encode32(header, 40, byteLength);
-
-        if (fwrite(header, sizeof(header), 1, outfile) != 1)
+        std::vector<uint8_t> header;
+        BuildHeader(header);
+        if (headerLength != 0 && header.size() != headerLength)
+            throw std::logic_error("WAV header length changed unexpectedly.");
+        headerLength = header.size();
+
+        if (fwrite(header.data(), header.size(), 1, outfile) != 1)
             throw std::runtime_error("Cannot write header to WAV file.");
     }
 
     void Flush()
     {
-        if (outfile != nullptr)
+        if (outfile != nullptr && bufferUsed > 0)
         {
-            if (fwrite(buffer.data(), sizeof(int16_t), buffer.size(), outfile) != buffer.size())
+            if (fwrite(buffer.data(), 1, bufferUsed, outfile) != bufferUsed)
                 throw std::runtime_error("Cannot write audio to WAV file.");
         }
-        buffer.clear();
+        bufferUsed = 0;
+    }
+
+    uint8_t *Reserve(size_t ndata, size_t& accepted)
+    {
+        // Find room in the output buffer for as many of `ndata` samples as will fit,
+        // flushing to disk first if the buffer is full.
+        if (outfile == nullptr)
+            throw std::logic_error("WaveFileWriter is not open.");
+
+        const size_t bytesPerSample = BytesPerSample();
+        if (bufferUsed + bytesPerSample > buffer.size())
+            Flush();
+
+        accepted = std::min(ndata, (buffer.size() - bufferUsed) / bytesPerSample);
+        const uint64_t nbytes = accepted * bytesPerSample;
+        if (!allowRf64 && (byteLength + nbytes + headerLength - 8 > maxChunkSize))
+            throw std::range_error("WAV file exceeds 4 GB. Open it with RF64 enabled to write longer files.");
+
+        uint8_t *dest = &buffer[bufferUsed];
+        bufferUsed += nbytes;
+        byteLength += nbytes;
+        return dest;
     }
 
 public:
+    // The header for a file with the given format and amount of sample data.
+    // Public so that tests can check headers for files too large to write.
+    static void BuildHeader(
+        std::vector<uint8_t>& header,
+        WaveSampleFormat format,
+        int nchannels,
+        int sampleRateHz,
+        uint64_t byteLength,
+        bool allowRf64)
+    {
+        // For the default 16-bit PCM format, this produces the classic 44-byte header:
+        // 00000000  52 49 46 46 c4 ea 1a 00  57 41 56 45 66 6d 74 20  |RIFF....WAVEfmt |
+        // 00000010  10 00 00 00 01 00 02 00  44 ac 00 00 10 b1 02 00  |........D.......|
+        // 00000020  04 00 10 00 64 61 74 61  a0 ea 1a 00 00 00 00 00  |....data........|
+        //
+        // Float files add an 18-byte format payload and a "fact" chunk.
+        // When RF64 support is requested, a 28-byte "JUNK" chunk reserves room
+        // for the "ds64" chunk we need if the file grows past 4 GB.
+        // The header length never changes after Open(), so we can rewrite it in place on Close().
+
+        const bool isFloat = (format == WaveSampleFormat::Float32);
+        const int bytesPerSample = WaveBytesPerSample(format);
+        const uint64_t frames = (nchannels > 0) ? byteLength / (bytesPerSample * nchannels) : 0;
+
+        header.clear();
+        EncodeTag(header, "RIFF");
+        Encode32(header, 0);        // placeholder for RIFF chunk size; patched below
+        EncodeTag(header, "WAVE");
+
+        if (allowRf64)
+        {
+            EncodeTag(header, "JUNK");
+            Encode32(header, 28);
+            Encode64(header, 0);    // RIFF size (64-bit)
+            Encode64(header, 0);    // data size (64-bit)
+            Encode64(header, 0);    // sample frame count (64-bit)
+            Encode32(header, 0);    // no table entries
+        }
+
+        EncodeTag(header, "fmt ");
+        Encode32(header, isFloat ? 18 : 16);
+        Encode16(header, isFloat ? 3 : 1);                      // 1 = PCM, 3 = IEEE float
+        Encode16(header, nchannels);
+        Encode32(header, sampleRateHz);
+        Encode32(header, sampleRateHz * bytesPerSample * nchannels);   // byte rate
+        Encode16(header, bytesPerSample * nchannels);           // block alignment
+        Encode16(header, 8 * bytesPerSample);                   // bits per sample
+        if (isFloat)
+        {
+            Encode16(header, 0);    // no extension bytes
+            EncodeTag(header, "fact");
+            Encode32(header, 4);
+            Encode32(header, Clip32(frames));
+        }
+
+        EncodeTag(header, "data");
+        Encode32(header, Clip32(byteLength));
+
+        // RIFF payload size = (file size) - ("RIFF" + 4 bytes for storing size)
+        const uint64_t riffSize = header.size() + byteLength - 8;
+        if (allowRf64 && (riffSize > maxChunkSize || byteLength > maxChunkSize))
+        {
+            // Convert to RF64: all 32-bit sizes become 0xffffffff, and the real sizes live in "ds64".
+            memcpy(&header[0], "RF64", 4);
+            memcpy(&header[12], "ds64", 4);
+            std::vector<uint8_t> ds64;
+            Encode64(ds64, riffSize);
+            Encode64(ds64, byteLength);
+            Encode64(ds64, frames);
+            std::copy(ds64.begin(), ds64.end(), header.begin() + 20);
+        }
+
+        std::vector<uint8_t> riff;
+        Encode32(riff, Clip32(riffSize));
+        std::copy(riff.begin(), riff.end(), header.begin() + 4);
+    }
+
     ~WaveFileWriter()
     {
-        Close();
+        try
+        {
+            Close();
+        }
+        catch (...)
+        {
+            // Destructors must not throw. Call Close() explicitly to find out about write errors.
+        }
     }
 
     void Close()
     {
-        Flush();
         if (outfile != nullptr)
         {
-            fflush(outfile);
-            if (fseek(outfile, 0, SEEK_SET))
-                throw std::runtime_error("Could not seek back to beginning of WAV file");
-            WriteHeader();      // write header again to update data length
+            try
+            {
+                Flush();
+                fflush(outfile);
+                if (fseek(outfile, 0, SEEK_SET))
+                    throw std::runtime_error("Could not seek back to beginning of WAV file");
+                WriteHeader();      // write header again to update data length
+            }
+            catch (...)
+            {
+                // Release the file even when it could not be finished,
+                // so that a failed Close() is never attempted again.
+                fclose(outfile);
+                outfile = nullptr;
+                bufferUsed = 0;
+                throw;
+            }
             fclose(outfile);
             outfile = nullptr;
         }
+        bufferUsed = 0;
     }
 
-    bool Open(const char *filename, int sampleRate, int channels)
+    bool Open(
+        const char *filename,
+        int sampleRate,
+        int channels,
+        WaveSampleFormat sampleFormat = WaveSampleFormat::Int16,
+        bool enableRf64 = false)
     {
         Close();
 
         sampleRateHz = sampleRate;
         nchannels = channels;
+        format = sampleFormat;
+        allowRf64 = enableRf64;
         byteLength = 0;
+        headerLength = 0;
+        bufferUsed = 0;
+        if (buffer.size() != bufferBytes)
+            buffer.resize(bufferBytes);
 
         outfile = fopen(filename, "wb");
         if (outfile == nullptr)
@@ -139,146 +507,325 @@ public:
         return true;
     }
 
-    void WriteSamples(const float *data, int ndata)
+    bool IsOpen() const { return outfile != nullptr; }
+    WaveSampleFormat Format() const { return format; }
+    int SampleRate() const { return sampleRateHz; }
+    int Channels() const { return nchannels; }
+    uint64_t DataBytes() const { return byteLength; }
+    size_t HeaderBytes() const { return headerLength; }
+
+    void WriteSamples(const float *data, size_t ndata)
     {
-        if (outfile == nullptr)
-            throw std::logic_error("WaveFileWriter is not open.");
+        if (format != WaveSampleFormat::Float32)
+            CheckFloatSampleRange(data, ndata);
 
-        for (int i = 0; i < ndata; ++i)
-            buffer.push_back(IntSampleFromFloat(data[i]));
+        while (ndata > 0)
+        {
+            size_t accepted;
+            uint8_t *dest = Reserve(ndata, accepted);
+            switch (format)
+            {
+            case WaveSampleFormat::Int16:
+                ConvertFloatToInt16(data, reinterpret_cast<int16_t *>(dest), accepted);
+                break;
 
-        byteLength += (2 * ndata);
+            case WaveSampleFormat::Int24:
+                ConvertFloatToInt24(data, dest, accepted);
+                break;
 
-        if (buffer.size() >= 10000)
-            Flush();
+            case WaveSampleFormat::Float32:
+                memcpy(dest, data, accepted * sizeof(float));
+                break;
+            }
+            data += accepted;
+            ndata -= accepted;
+        }
     }
 
-    void WriteSamples(const int16_t *data, int ndata)
+    void WriteSamples(const int16_t *data, size_t ndata)
     {
-        if (outfile == nullptr)
-            throw std::logic_error("WaveFileWriter is not open.");
-
-        for (int i = 0; i < ndata; ++i)
-            buffer.push_back(data[i]);
-
-        byteLength += (2 * ndata);
-
-        if (buffer.size() >= 10000)
-            Flush();
+        while (ndata > 0)
+        {
+            size_t accepted;
+            uint8_t *dest = Reserve(ndata, accepted);
+            switch (format)
+            {
+            case WaveSampleFormat::Int16:
+                memcpy(dest, data, accepted * sizeof(int16_t));
+                break;
+
+            case WaveSampleFormat::Int24:
+                for (size_t i = 0; i < accepted; ++i)
+                {
+                    dest[3*i+0] = 0;
+                    dest[3*i+1] = static_cast<uint8_t>(data[i]);
+                    dest[3*i+2] = static_cast<uint8_t>(data[i] >> 8);
+                }
+                break;
+
+            case WaveSampleFormat::Float32:
+                for (size_t i = 0; i < accepted; ++i)
+                {
+                    float x = static_cast<float>(data[i]) / IntSampleScale;
+                    memcpy(dest + i*sizeof(float), &x, sizeof(float));
+                }
+                break;
+            }
+            data += accepted;
+            ndata -= accepted;
+        }
     }
 };
 
 
-class ScaledWaveFileWriter
+class ScaledWaveFileWriter      // writes float32 audio normalized so the loudest sample has magnitude 1
 {
 private:
     WaveFileWriter wave;
+    std::string fileName;
     float maximum = 0.0f;
-    FILE *tempFile = nullptr;
-    std::string tempFileName;
 
-public:
-    ~ScaledWaveFileWriter()
+    void UpdateMaximum(const float *data, size_t ndata)
     {
-        Close();
+        size_t i = 0;
+        bool finite = true;
+#if COSINEKITTY_WAVEFILE_SSE2
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 largest = _mm_set1_ps(std::numeric_limits<float>::max());
+        __m128 peak = _mm_setzero_ps();
+        __m128 ok = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (; i+4 <= ndata; i += 4)
+        {
+            __m128 a = _mm_and_ps(absMask, _mm_loadu_ps(&data[i]));
+            ok = _mm_and_ps(ok, _mm_cmple_ps(a, largest));      // false for both infinity and NAN
+            peak = _mm_max_ps(peak, a);
+        }
+        finite = (0xf == _mm_movemask_ps(ok));
+        float lanes[4];
+        _mm_storeu_ps(lanes, peak);
+        maximum = std::max(maximum, std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+#endif
+        for (; i < ndata; ++i)
+        {
+            finite = finite && std::isfinite(data[i]);
+            maximum = std::max(maximum, std::abs(data[i]));
+        }
+
+        if (!finite)
+            throw std::range_error("Non-finite audio data not allowed.");
     }
 
-    bool Open(const char *filename, int sampleRate, int channels)
+    void Rescale()
     {
-        tempFileName = std::string(filename) + ".tmp";
-        tempFile = fopen(tempFileName.c_str(), "wb");
-        if (tempFile == nullptr)
-            return false;
+        // Divide every sample by the peak magnitude, directly inside the file.
+        MemoryMappedFile map;
+        if (!map.Open(fileName.c_str(), true))
+            throw std::runtime_error(std::string("Could not map WAV file for rescaling: ") + fileName);
+
+        const size_t offset = wave.HeaderBytes();
+        const size_t nsamples = static_cast<size_t>(wave.DataBytes() / sizeof(float));
+        if (offset + nsamples*sizeof(float) > map.Length())
+            throw std::logic_error(std::string("WAV file is shorter than expected: ") + fileName);
+
+        uint8_t *data = map.WritableData() + offset;
+        size_t i = 0;
+#if COSINEKITTY_WAVEFILE_SSE2
+        const __m128 divisor = _mm_set1_ps(maximum);
+        for (; i+4 <= nsamples; i += 4)
+        {
+            float *p = reinterpret_cast<float *>(data + i*sizeof(float));
+            _mm_storeu_ps(p, _mm_div_ps(_mm_loadu_ps(p), divisor));
+        }
+#endif
+        for (; i < nsamples; ++i)
+        {
+            float x;
+            memcpy(&x, data + i*sizeof(float), sizeof(float));
+            x /= maximum;
+            memcpy(data + i*sizeof(float), &x, sizeof(float));
+        }
+    }
 
-        if (!wave.Open(filename, sampleRate, channels))
+public:
+    ~ScaledWaveFileWriter()
+    {
+        try
         {
-            fclose(tempFile);
-            remove(tempFileName.c_str());
-            return false;
+            Close();
         }
+        catch (...)
+        {
+            // Destructors must not throw. Call Close() explicitly to find out about write errors.
+        }
+    }
 
+    bool Open(const char *filename, int sampleRate, int channels, bool enableRf64 = false)
+    {
+        Close();
+        fileName = filename;
         maximum = 0.0f;
-        return true;
+        return wave.Open(filename, sampleRate, channels, WaveSampleFormat::Float32, enableRf64);
     }
 
-    void WriteSamples(const float *data, int ndata)
+    void WriteSamples(const float *data, size_t ndata)
     {
-        if (tempFile == nullptr)
+        if (!wave.IsOpen())
             throw std::logic_error("ScaledWaveFileWriter is not open.");
 
-        for (int i = 0; i < ndata; ++i)
-        {
-            if (!std::isfinite(data[i]))
-                throw std::range_error("Non-finite audio data not allowed.");
-            maximum = std::max(maximum, std::abs(data[i]));
-        }
-
-        if (static_cast<size_t>(ndata) != fwrite(data, sizeof(float), ndata, tempFile))
-            throw std::runtime_error("Error writing to temporary file.");
-
+        UpdateMaximum(data, ndata);
+        wave.WriteSamples(data, ndata);
     }
 
     void Close()
     {
-        if (tempFile)
+        if (wave.IsOpen())
         {
-            fclose(tempFile);
-            tempFile = nullptr;
-
-            FILE *rfile = fopen(tempFileName.c_str(), "rb");
-            if (rfile == nullptr)
-                throw std::logic_error(std::string("Coult not re-open temporary file for read: ") + tempFileName);
+            wave.Close();
 
             // Handle the case where silence was written. Avoid dividing by zero.
-            if (maximum == 0.0f)
-                maximum = 1.0f;
-
-            std::vector<float> buffer;
-            const size_t bufsize = 1024;
-            buffer.resize(bufsize);
-
-            for(;;)
-            {
-                size_t nread = fread(buffer.data(), sizeof(float), bufsize, rfile);
-                for (size_t i = 0; i < nread; ++i)
-                    buffer[i] /= maximum;
-
-                wave.WriteSamples(buffer.data(), nread);
-                if (nread < bufsize)
-                    break;
-            }
-
-            fclose(rfile);
-            remove(tempFileName.c_str());
+            // Also skip the pass entirely when the audio is already normalized.
+            if (maximum != 0.0f && maximum != 1.0f)
+                Rescale();
         }
     }
 };
 
 
+struct WaveBlockView        // zero-copy window into the sample data of a mapped WAV file
+{
+    const uint8_t *data = nullptr;      // little-endian samples in the file's native format
+    size_t samples = 0;                 // number of individual samples (not frames) in the view
+    WaveSampleFormat format = WaveSampleFormat::Int16;
+};
+
+
 class WaveFileReader
 {
 private:
-    FILE *infile = nullptr;
+    static const uint16_t FormatTagPcm = 0x0001;
+    static const uint16_t FormatTagFloat = 0x0003;
+    static const uint16_t FormatTagExtensible = 0xfffe;
+
+    MemoryMappedFile file;
+    const uint8_t *sampleData = nullptr;
+    WaveSampleFormat format = WaveSampleFormat::Int16;
+    int bytesPerSample = 2;
     int sampleRate = 0;
     int channels = 0;
-    size_t totalSamples = 0;     // total number of 16-bit integer data points
+    size_t totalSamples = 0;     // total number of individual data points in the file
     size_t samplesRead = 0;
-    std::vector<int16_t> conversionBuffer;  // for assisting reads into floating point buffer
 
-    int Decode16(const uint8_t *header, int offset)
+    static uint32_t Decode16(const uint8_t *p)
     {
         return
-            static_cast<int>(header[offset+0]) |
-            static_cast<int>(header[offset+1] << 8);
+            static_cast<uint32_t>(p[0]) |
+            static_cast<uint32_t>(p[1]) << 8;
     }
 
-    int Decode32(const uint8_t *header, int offset)
+    static uint32_t Decode32(const uint8_t *p)
     {
-        return
-            static_cast<int>(header[offset+0]) |
-            static_cast<int>(header[offset+1] <<  8) |
-            static_cast<int>(header[offset+2] << 16) |
-            static_cast<int>(header[offset+3] << 24);
+        return Decode16(p) | (Decode16(p+2) << 16);
+    }
+
+    static uint64_t Decode64(const uint8_t *p)
+    {
+        return static_cast<uint64_t>(Decode32(p)) | (static_cast<uint64_t>(Decode32(p+4)) << 32);
+    }
+
+    bool Fail()
+    {
+        Close();
+        return false;
+    }
+
+    bool ParseFormat(const uint8_t *payload, uint64_t size)
+    {
+        if (size < 16)
+            return false;
+
+        uint16_t formatTag = static_cast<uint16_t>(Decode16(payload));
+        channels = static_cast<int>(Decode16(payload + 2));
+        sampleRate = static_cast<int>(Decode32(payload + 4));
+        int bitsPerSample = static_cast<int>(Decode16(payload + 14));
+
+        if (formatTag == FormatTagExtensible)
+        {
+            // WAVE_FORMAT_EXTENSIBLE: the real format tag is the first 2 bytes of the subformat GUID.
+            // cbSize(2) + validBits(2) + channelMask(4) + GUID(16) follow the basic 16 bytes.
+            if (size < 40)
+                return false;
+            formatTag = static_cast<uint16_t>(Decode16(payload + 24));
+        }
+
+        if (channels <= 0 || sampleRate <= 0)
+            return false;
+
+        if (formatTag == FormatTagPcm && bitsPerSample == 16)
+            format = WaveSampleFormat::Int16;
+        else if (formatTag == FormatTagPcm && bitsPerSample == 24)
+            format = WaveSampleFormat::Int24;
+        else if (formatTag == FormatTagFloat && bitsPerSample == 32)
+            format = WaveSampleFormat::Float32;
+        else
+            return false;       // unsupported sample format
+
+        bytesPerSample = WaveBytesPerSample(format);
+        return true;
+    }
+
+    static void ConvertToFloat(WaveSampleFormat sampleFormat, const uint8_t *in, float *out, size_t n)
+    {
+        size_t i = 0;
+        switch (sampleFormat)
+        {
+        case WaveSampleFormat::Int16:
+#if COSINEKITTY_WAVEFILE_SSE2
+            {
+                // Sign-extend 8 samples at a time into 32-bit integers, then divide.
+                // Division (not multiplication by a reciprocal) keeps the results
+                // identical to the scalar formula.
+                const __m128 scale = _mm_set1_ps(static_cast<float>(IntSampleScale));
+                for (; i+8 <= n; i += 8)
+                {
+                    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2*i));
+                    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+                    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+                    _mm_storeu_ps(&out[i],   _mm_div_ps(_mm_cvtepi32_ps(lo), scale));
+                    _mm_storeu_ps(&out[i+4], _mm_div_ps(_mm_cvtepi32_ps(hi), scale));
+                }
+            }
+#endif
+            for (; i < n; ++i)
+                out[i] = static_cast<float>(static_cast<int16_t>(Decode16(in + 2*i))) / IntSampleScale;
+            break;
+
+        case WaveSampleFormat::Int24:
+            for (; i < n; ++i)
+            {
+                // Put the 24 bits at the top of a 32-bit integer, then shift back down to sign-extend.
+                int32_t s = static_cast<int32_t>(
+                    (static_cast<uint32_t>(in[3*i+0]) <<  8) |
+                    (static_cast<uint32_t>(in[3*i+1]) << 16) |
+                    (static_cast<uint32_t>(in[3*i+2]) << 24)) >> 8;
+                out[i] = static_cast<float>(s) / Int24SampleScale;
+            }
+            break;
+
+        case WaveSampleFormat::Float32:
+            memcpy(out, in, n * sizeof(float));
+            break;
+        }
+    }
+
+    static int16_t Int16FromFloat(float x)
+    {
+        // Saturate rather than throw: input files may be hotter than our own 16-bit headroom.
+        float y = std::round(IntSampleScale * x);
+        if (!(y > -32768.0f))       // also catches NAN
+            return -32768;
+        if (y > 32767.0f)
+            return 32767;
+        return static_cast<int16_t>(y);
     }
 
 public:
@@ -289,11 +836,8 @@ public:
 
     void Close()
     {
-        if (infile != nullptr)
-        {
-            fclose(infile);
-            infile = nullptr;
-        }
+        file.Close();
+        sampleData = nullptr;
         sampleRate = 0;
         channels = 0;
         totalSamples = 0;
@@ -304,67 +848,118 @@ public:
     {
         Close();
 
-        infile = fopen(filename, "rb");
-        if (!infile)
+        if (!file.Open(filename))
             return false;
 
-        uint8_t header[44];
-        size_t nread = fread(header, sizeof(header), 1, infile);
-        if (nread != 1)
-        {
-            // Too small to be a valid wave file.
-            Close();
-            return false;
-        }
+        const uint8_t *base = file.Data();
+        const uint64_t length = file.Length();
 
-        // 00000000  52 49 46 46 ba 53 1f 00  57 41 56 45 66 6d 74 20  |RIFF.S..WAVEfmt |
-        // 00000010  10 00 00 00 01 00 02 00  44 ac 00 00 10 b1 02 00  |........D.......|
-        // 00000020  04 00 10 00 64 61 74 61  f4 52 1f 00 00 00 00 00  |....data.R......|
-        // 00000030  01 00 01 00 ff ff fe ff  01 00 01 00 ff ff 00 00  |................|
-        // 00000040  01 00 fe ff ff ff 03 00  02 00 fc ff ff ff 03 00  |................|
+        if (length < 12 || memcmp(base + 8, "WAVE", 4))
+            return Fail();
 
-        if (memcmp(header, "RIFF", 4) || memcmp(&header[8], "WAVEfmt ", 8))
+        const bool isRf64 = !memcmp(base, "RF64", 4);
+        if (!isRf64 && memcmp(base, "RIFF", 4))
+            return Fail();
+
+        // Walk the chunk list. Each chunk is a 4-byte tag followed by a 32-bit little-endian size,
+        // then the payload, padded to an even number of bytes.
+        bool foundFormat = false;
+        uint64_t ds64DataSize = 0;
+        uint64_t offset = 12;
+        while (offset + 8 <= length)
         {
-            // Incorrect signature
-            Close();
-            return false;
+            const uint8_t *chunk = base + offset;
+            uint64_t size = Decode32(chunk + 4);
+            const uint8_t *payload = chunk + 8;
+            const uint64_t available = length - (offset + 8);
+
+            if (!memcmp(chunk, "ds64", 4))
+            {
+                if (size < 24 || size > available)
+                    return Fail();
+                ds64DataSize = Decode64(payload + 8);
+            }
+            else if (!memcmp(chunk, "fmt ", 4))
+            {
+                if (size > available || !ParseFormat(payload, size))
+                    return Fail();
+                foundFormat = true;
+            }
+            else if (!memcmp(chunk, "data", 4))
+            {
+                if (!foundFormat)
+                    return Fail();      // we require "fmt " before "data"
+
+                if (isRf64 && size == 0xffffffff)
+                    size = ds64DataSize;
+
+                // Tolerate files whose data length was never patched (e.g. streamed output)
+                // or that were truncated: use whatever data is actually present.
+                size = std::min(size, available);
+                sampleData = payload;
+                totalSamples = static_cast<size_t>(size / bytesPerSample);
+                return true;
+            }
+
+            offset += 8 + size + (size & 1);
         }
 
-        channels = Decode16(header, 22);
-        sampleRate = Decode32(header, 24);
-        unsigned nbytes = static_cast<unsigned>(Decode32(header, 40));
-        totalSamples = nbytes / sizeof(int16_t);    // FIXFIXFIX: should validate sample format is 16-bit
-        return true;
+        return Fail();      // never found a data chunk
     }
 
     int SampleRate() const { return sampleRate; }
     int Channels() const { return channels; }
     size_t TotalSamples() const { return totalSamples; }
+    size_t RemainingSamples() const { return totalSamples - samplesRead; }
+    WaveSampleFormat Format() const { return format; }
 
-    size_t Read(int16_t *data, size_t requestedSamples)
+    void Seek(size_t sampleIndex)
     {
-        size_t remaining = totalSamples - samplesRead;
-        size_t attempt = std::min(requestedSamples, remaining);
-        size_t received = fread(data, sizeof(int16_t), attempt, infile);
-        samplesRead += received;
-        return received;
+        samplesRead = std::min(sampleIndex, totalSamples);
     }
 
-    size_t Read(float *data, size_t requestedSamples)
+    WaveBlockView View(size_t requestedSamples)
     {
-        size_t remaining = totalSamples - samplesRead;
-        size_t attempt = std::min(requestedSamples, remaining);
+        // Return a window directly into the mapped file, without copying, and advance past it.
+        WaveBlockView view;
+        view.format = format;
+        view.samples = std::min(requestedSamples, RemainingSamples());
+        view.data = (sampleData != nullptr) ? (sampleData + samplesRead*bytesPerSample) : nullptr;
+        samplesRead += view.samples;
+        return view;
+    }
 
-        if (conversionBuffer.size() < attempt)
-            conversionBuffer.resize(attempt);
+    size_t Read(int16_t *data, size_t requestedSamples)
+    {
+        WaveBlockView view = View(requestedSamples);
+        switch (format)
+        {
+        case WaveSampleFormat::Int16:
+            memcpy(data, view.data, view.samples * sizeof(int16_t));
+            break;
 
-        size_t received = fread(conversionBuffer.data(), sizeof(int16_t), attempt, infile);
-        samplesRead += received;
+        case WaveSampleFormat::Int24:
+            for (size_t i = 0; i < view.samples; ++i)
+                data[i] = static_cast<int16_t>(Decode16(view.data + 3*i + 1));   // keep the top 16 bits
+            break;
 
-        for (size_t i = 0; i < received; ++i)
-            data[i] = FloatFromIntSample(conversionBuffer[i]);
+        case WaveSampleFormat::Float32:
+            for (size_t i = 0; i < view.samples; ++i)
+            {
+                float x;
+                memcpy(&x, view.data + 4*i, sizeof(float));
+                data[i] = Int16FromFloat(x);
+            }
+            break;
+        }
+        return view.samples;
+    }
 
-        return received;
+    size_t Read(float *data, size_t requestedSamples)
+    {
+        WaveBlockView view = View(requestedSamples);
+        ConvertToFloat(format, view.data, data, view.samples);
+        return view.samples;
     }
 };
 
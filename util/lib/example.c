@@ -0,0 +1,88 @@
+/*
+    example.c  -  Don Cross <cosinekitty@gmail.com>
+
+    Shows how a host program uses libsapphire through its C interface.
+    Tube Unit generates a tone, and Elastika processes it in place,
+    one block at a time, the way an audio callback would.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include "sapphire.h"
+
+#define SAMPLE_RATE     48000.0f
+#define BLOCK_FRAMES    256
+#define BLOCK_COUNT     375         /* 2 seconds */
+
+static void PrintParameters(const char *title, const SapphireEngine *engine)
+{
+    int id;
+    SapphireParamInfo info;
+
+    printf("%s parameters:\n", title);
+    for (id = 0; id < sapphire_param_count(engine); ++id)
+        if (sapphire_param_info(engine, id, &info) == SAPPHIRE_OK)
+            printf("    %-10s [%g, %g] default %g: %s\n", info.name, info.minValue, info.maxValue, info.defaultValue, info.description);
+}
+
+int main(void)
+{
+    /* Buffers belong to the host. The engines read and write them directly. */
+    static float silence[BLOCK_FRAMES];
+    static float left[BLOCK_FRAMES];
+    static float right[BLOCK_FRAMES];
+    const float *tubeInputs[SAPPHIRE_CHANNELS] = { silence, silence };
+    float *tubeOutputs[SAPPHIRE_CHANNELS] = { left, right };
+    const float *meshInputs[SAPPHIRE_CHANNELS] = { left, right };
+    float peak = 0.0f;
+    int block, i, status = 0;
+
+    SapphireEngine *tube = sapphire_create(SAPPHIRE_TUBEUNIT, SAMPLE_RATE);
+    SapphireEngine *mesh = sapphire_create(SAPPHIRE_ELASTIKA, SAMPLE_RATE);
+    if (tube == NULL || mesh == NULL)
+    {
+        fprintf(stderr, "example: cannot create engines.\n");
+        sapphire_destroy(tube);
+        sapphire_destroy(mesh);
+        return 1;
+    }
+
+    PrintParameters("Tube Unit", tube);
+    PrintParameters("Elastika", mesh);
+
+    /* Everything from here on is safe to do inside an audio callback. */
+    status |= sapphire_set_param(tube, SAPPHIRE_TUBEUNIT_AIRFLOW, 2.0f);
+    status |= sapphire_set_param(tube, SAPPHIRE_TUBEUNIT_ROOT_FREQUENCY, 3.5f);
+    status |= sapphire_set_param(mesh, sapphire_find_param(mesh, "stiffness"), 0.7f);
+
+    for (block = 0; status == SAPPHIRE_OK && block < BLOCK_COUNT; ++block)
+    {
+        if (block == BLOCK_COUNT / 2)
+            status |= sapphire_set_param(mesh, SAPPHIRE_ELASTIKA_CURL, 0.4f);
+
+        status |= sapphire_process_block(tube, tubeInputs, tubeOutputs, BLOCK_FRAMES);
+        status |= sapphire_process_block(mesh, meshInputs, tubeOutputs, BLOCK_FRAMES);
+        for (i = 0; i < BLOCK_FRAMES; ++i)
+        {
+            peak = fmaxf(peak, fabsf(left[i]));
+            peak = fmaxf(peak, fabsf(right[i]));
+        }
+    }
+
+    sapphire_destroy(tube);
+    sapphire_destroy(mesh);
+
+    if (status != SAPPHIRE_OK)
+    {
+        fprintf(stderr, "example: engine call failed with status %d.\n", status);
+        return 1;
+    }
+
+    printf("example: processed %d blocks of %d frames; peak output = %0.3f V.\n", BLOCK_COUNT, BLOCK_FRAMES, peak);
+    if (!(peak > 0.01f && peak < 20.0f))
+    {
+        fprintf(stderr, "example: the output level is not plausible.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+    sapphire.h  -  Don Cross <cosinekitty@gmail.com>
+
+    C interface to libsapphire: the Elastika and Tube Unit engines,
+    without VCV Rack, for hosting inside another audio program.
+
+    Each engine is an opaque handle. All memory the engine needs is
+    allocated by sapphire_create(). After that, no function allocates or
+    frees memory, takes a lock, or throws, so every function except
+    sapphire_create() and sapphire_destroy() is safe to call from an
+    audio thread. A handle is not thread-safe: use it from one thread at a time.
+
+    Audio is processed in blocks of planar (non-interleaved) float buffers
+    that the caller owns. The engines read and write those buffers directly.
+    Signals use the same scale as the VCV Rack modules: 5 V is a typical peak.
+
+    Parameter values use the same ranges as the knobs, sliders, and menu settings
+    on the corresponding VCV Rack module. Use sapphire_param_info() to list them.
+*/
+
+#ifndef __COSINEKITTY_LIBSAPPHIRE_H
+#define __COSINEKITTY_LIBSAPPHIRE_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#  if defined(SAPPHIRE_BUILD_SHARED)
+#    define SAPPHIRE_API __declspec(dllexport)
+#  else
+#    define SAPPHIRE_API
+#  endif
+#else
+#  define SAPPHIRE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SapphireEngine SapphireEngine;
+
+typedef enum
+{
+    SAPPHIRE_ELASTIKA,
+    SAPPHIRE_TUBEUNIT
+}
+SapphireEngineKind;
+
+/* Status codes returned by the functions below. */
+#define SAPPHIRE_OK                 0
+#define SAPPHIRE_ERROR_ARGUMENT   (-1)     /* a null pointer, unknown parameter id, or invalid sample rate */
+#define SAPPHIRE_ERROR_ENGINE     (-2)     /* the engine failed internally; call sapphire_reset() */
+
+/* Every engine processes stereo audio: 2 input channels and 2 output channels. */
+#define SAPPHIRE_CHANNELS           2
+
+/* Elastika parameter ids. */
+enum
+{
+    SAPPHIRE_ELASTIKA_FRICTION,         /* [0, 1] */
+    SAPPHIRE_ELASTIKA_STIFFNESS,        /* [0, 1] */
+    SAPPHIRE_ELASTIKA_SPAN,             /* [0, 1] */
+    SAPPHIRE_ELASTIKA_CURL,             /* [-1, +1] magnetic field */
+    SAPPHIRE_ELASTIKA_MASS,             /* [-1, +1] impurity mass */
+    SAPPHIRE_ELASTIKA_DRIVE,            /* [0, 2] input drive */
+    SAPPHIRE_ELASTIKA_LEVEL,            /* [0, 2] output level */
+    SAPPHIRE_ELASTIKA_INPUT_TILT,       /* [0, 1] */
+    SAPPHIRE_ELASTIKA_OUTPUT_TILT,      /* [0, 1] */
+    SAPPHIRE_ELASTIKA_DC_REJECT,        /* [20, 400] Hz */
+    SAPPHIRE_ELASTIKA_LIMITER,          /* [5, 10.2] V; 10.1 and above disables the limiter */
+    SAPPHIRE_ELASTIKA_PARAM_COUNT
+};
+
+/* Tube Unit parameter ids. */
+enum
+{
+    SAPPHIRE_TUBEUNIT_AIRFLOW,          /* [0, 5] */
+    SAPPHIRE_TUBEUNIT_VORTEX,           /* [0, 1] */
+    SAPPHIRE_TUBEUNIT_BYPASS_WIDTH,     /* [0.5, 20] */
+    SAPPHIRE_TUBEUNIT_BYPASS_CENTER,    /* [-10, +10] */
+    SAPPHIRE_TUBEUNIT_REFLECTION_DECAY, /* [0, 1] */
+    SAPPHIRE_TUBEUNIT_REFLECTION_ANGLE, /* [0, 1] */
+    SAPPHIRE_TUBEUNIT_ROOT_FREQUENCY,   /* [0, 8]: 4*2^root Hz */
+    SAPPHIRE_TUBEUNIT_STIFFNESS,        /* [0, 1] */
+    SAPPHIRE_TUBEUNIT_LEVEL,            /* [0, 2] output level */
+    SAPPHIRE_TUBEUNIT_LIMITER,          /* [5, 10.2] V; 10.1 and above disables the limiter */
+    SAPPHIRE_TUBEUNIT_VENT,             /* 0 or 1: 1 vents the mouth and ignores airflow */
+    SAPPHIRE_TUBEUNIT_INTERPOLATION,    /* 0=linear, 1=Hermite, 2=Thiran, 3=sinc */
+    SAPPHIRE_TUBEUNIT_PARAM_COUNT
+};
+
+typedef struct
+{
+    const char *name;           /* short name, as used by the command-line tools */
+    const char *description;
+    float minValue;
+    float maxValue;
+    float defaultValue;
+}
+SapphireParamInfo;
+
+/* Returns a new engine with every parameter at its default value, or NULL if it could not be created. */
+SAPPHIRE_API SapphireEngine *sapphire_create(SapphireEngineKind kind, float sampleRateHz);
+SAPPHIRE_API void sapphire_destroy(SapphireEngine *engine);
+
+/* Returns the engine to its state right after sapphire_create(), keeping the sample rate. */
+SAPPHIRE_API int sapphire_reset(SapphireEngine *engine);
+SAPPHIRE_API int sapphire_set_sample_rate(SapphireEngine *engine, float sampleRateHz);
+
+/* Values outside a parameter's range are clamped to it. */
+SAPPHIRE_API int sapphire_param_count(const SapphireEngine *engine);
+SAPPHIRE_API int sapphire_param_info(const SapphireEngine *engine, int paramId, SapphireParamInfo *info);
+SAPPHIRE_API int sapphire_find_param(const SapphireEngine *engine, const char *name);    /* -1 if unknown */
+SAPPHIRE_API int sapphire_set_param(SapphireEngine *engine, int paramId, float value);
+SAPPHIRE_API float sapphire_get_param(const SapphireEngine *engine, int paramId);
+
+/*
+    Processes nframes samples. inputs and outputs each point to SAPPHIRE_CHANNELS
+    channel buffers of nframes floats: [0] is left, [1] is right.
+    An output buffer may be the same as the input buffer of the same channel.
+*/
+SAPPHIRE_API int sapphire_process_block(
+    SapphireEngine *engine,
+    const float * const *inputs,
+    float * const *outputs,
+    size_t nframes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COSINEKITTY_LIBSAPPHIRE_H */
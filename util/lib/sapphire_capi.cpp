@@ -0,0 +1,162 @@
+/*
+    sapphire_capi.cpp  -  Don Cross <cosinekitty@gmail.com>
+
+    Implements the C interface in sapphire.h on top of the RenderEngine
+    classes that the command-line tools use, so a host program drives
+    the engines exactly the same way those tools do.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <vector>
+#include "render_engine.hpp"
+#include "sapphire.h"
+
+using Sapphire::RenderEngine;
+using Sapphire::ElastikaRenderEngine;
+using Sapphire::TubeUnitRenderEngine;
+
+static_assert(SAPPHIRE_ELASTIKA_LIMITER == static_cast<int>(ElastikaRenderEngine::LIMITER), "Elastika parameter ids do not match ElastikaRenderEngine.");
+static_assert(SAPPHIRE_TUBEUNIT_INTERPOLATION == static_cast<int>(TubeUnitRenderEngine::INTERPOLATION), "Tube Unit parameter ids do not match TubeUnitRenderEngine.");
+
+struct SapphireEngine
+{
+    std::unique_ptr<RenderEngine> render;
+};
+
+
+static bool IsValidSampleRate(float sampleRateHz)
+{
+    return std::isfinite(sampleRateHz) && sampleRateHz > 0.0f;
+}
+
+
+SapphireEngine *sapphire_create(SapphireEngineKind kind, float sampleRateHz)
+{
+    if (!IsValidSampleRate(sampleRateHz))
+        return nullptr;
+
+    try
+    {
+        std::unique_ptr<SapphireEngine> engine(new SapphireEngine);
+        if (kind == SAPPHIRE_ELASTIKA)
+            engine->render.reset(new ElastikaRenderEngine);
+        else if (kind == SAPPHIRE_TUBEUNIT)
+            engine->render.reset(new TubeUnitRenderEngine);
+        else
+            return nullptr;
+
+        engine->render->setSampleRate(sampleRateHz);
+        return engine.release();
+    }
+    catch (const std::exception&)
+    {
+        return nullptr;
+    }
+}
+
+
+void sapphire_destroy(SapphireEngine *engine)
+{
+    delete engine;
+}
+
+
+int sapphire_reset(SapphireEngine *engine)
+{
+    if (engine == nullptr)
+        return SAPPHIRE_ERROR_ARGUMENT;
+
+    // initialize() only allocates the first time, which happened in sapphire_create().
+    engine->render->initialize();
+    return SAPPHIRE_OK;
+}
+
+
+int sapphire_set_sample_rate(SapphireEngine *engine, float sampleRateHz)
+{
+    if (engine == nullptr || !IsValidSampleRate(sampleRateHz))
+        return SAPPHIRE_ERROR_ARGUMENT;
+
+    engine->render->setSampleRate(sampleRateHz);
+    return SAPPHIRE_OK;
+}
+
+
+int sapphire_param_count(const SapphireEngine *engine)
+{
+    return (engine != nullptr) ? engine->render->numParameters() : 0;
+}
+
+
+int sapphire_param_info(const SapphireEngine *engine, int paramId, SapphireParamInfo *info)
+{
+    if (engine == nullptr || info == nullptr || paramId < 0 || paramId >= engine->render->numParameters())
+        return SAPPHIRE_ERROR_ARGUMENT;
+
+    const Sapphire::EngineParameter& p = engine->render->parameters()[paramId];
+    info->name = p.name;
+    info->description = p.description;
+    info->minValue = p.minValue;
+    info->maxValue = p.maxValue;
+    info->defaultValue = p.defaultValue;
+    return SAPPHIRE_OK;
+}
+
+
+int sapphire_find_param(const SapphireEngine *engine, const char *name)
+{
+    if (engine == nullptr || name == nullptr)
+        return -1;
+
+    // Compare C strings directly: building a std::string here could allocate.
+    const std::vector<Sapphire::EngineParameter>& plist = engine->render->parameters();
+    for (size_t i = 0; i < plist.size(); ++i)
+        if (!strcmp(name, plist[i].name))
+            return static_cast<int>(i);
+    return -1;
+}
+
+
+int sapphire_set_param(SapphireEngine *engine, int paramId, float value)
+{
+    if (engine == nullptr || !std::isfinite(value))
+        return SAPPHIRE_ERROR_ARGUMENT;
+
+    return engine->render->setParameter(paramId, value) ? SAPPHIRE_OK : SAPPHIRE_ERROR_ARGUMENT;
+}
+
+
+float sapphire_get_param(const SapphireEngine *engine, int paramId)
+{
+    return (engine != nullptr) ? engine->render->getParameter(paramId) : 0.0f;
+}
+
+
+int sapphire_process_block(
+    SapphireEngine *engine,
+    const float * const *inputs,
+    float * const *outputs,
+    size_t nframes)
+{
+    if (engine == nullptr || inputs == nullptr || outputs == nullptr)
+        return SAPPHIRE_ERROR_ARGUMENT;
+
+    for (int c = 0; c < SAPPHIRE_CHANNELS; ++c)
+        if (inputs[c] == nullptr || outputs[c] == nullptr)
+            return SAPPHIRE_ERROR_ARGUMENT;
+
+    try
+    {
+        engine->render->process(nframes, inputs[0], inputs[1], outputs[0], outputs[1]);
+        return SAPPHIRE_OK;
+    }
+    catch (const std::exception&)
+    {
+        // The engines throw only when their internal state has gone bad,
+        // which a C caller cannot catch; report it instead.
+        return SAPPHIRE_ERROR_ENGINE;
+    }
+}
@@ -1,8 +1,17 @@
 #include <cstdio>
 #include <cstring>
+#include <malloc.h>
 #include <random>
+#include <thread>
 #include "sapphire_engine.hpp"
-#include "wavefile.hpp"
+#include "sapphire_handoff.hpp"
+#include "elastika_engine.hpp"
+#include "tubeunit_engine.hpp"
+#include "async_wavefile.hpp"
+#include "realtime_guard.hpp"
+#include "session_replay.hpp"
+#include "render_engine.hpp"
+#include "sapphire.h"
 
 static int Fail(const std::string name, const std::string message)
 {
@@ -24,27 +33,52 @@ struct UnitTest
     UnitTestFunction func;
 };
 
+static int AnchorTest();
 static int AutoGainControl();
+static int AsyncWriteTest();
+static int CaptureTest();
+static int CApiTest();
 static int ReadWave();
+static int RealtimeGuardTest();
 static int AutoScale();
 static int DelayLineTest();
+static int FilterBankTest();
+static int FixedMeshTest();
+static int HandoffTest();
 static int InterpolatorTest();
+static int LatticeTest();
 static int TaperTest();
 static int QuadraticTest();
+static int SlewTest();
+static int StateTest();
+static int WaveFormatTest();
 
 static const UnitTest CommandTable[] =
 {
     { "agc",        AutoGainControl },
+    { "anchors",    AnchorTest },
+    { "async",      AsyncWriteTest },
+    { "capi",       CApiTest },
+    { "capture",    CaptureTest },
     { "delay",      DelayLineTest },
+    { "filterbank", FilterBankTest },
+    { "fixedmesh",  FixedMeshTest },
+    { "handoff",    HandoffTest },
     { "interp",     InterpolatorTest },
+    { "lattice",    LatticeTest },
     { "quad",       QuadraticTest },
     { "readwave",   ReadWave },
+    { "rtguard",    RealtimeGuardTest },
     { "scale",      AutoScale },
+    { "slew",       SlewTest },
+    { "state",      StateTest },
     { "taper",      TaperTest },
+    { "wavefmt",    WaveFormatTest },
     { nullptr,  nullptr }
 };
 
 
+
 int main(int argc, const char *argv[])
 {
     if (argc == 2)
@@ -121,8 +155,8 @@ static int AgcTestCase(
     Sapphire::AutomaticGainLimiter agc;
     agc.setCeiling(ceiling);
 
-    string harshFileName = string("output/agc_input_")  + name + ".wav";
-    string mildFileName  = string("output/agc_output_") + name + ".wav";
+    std::string harshFileName = std::string("output/agc_input_")  + name + ".wav";
+    std::string mildFileName  = std::string("output/agc_output_") + name + ".wav";
 
     WaveFileWriter harsh;
     if (!harsh.Open(harshFileName.c_str(), sampleRate, 2))
@@ -309,9 +343,8 @@ static int ReadWave()
 static int AutoScale()
 {
     // Verify that class ScaledWaveFileWriter can automatically adjust the level
-    // of an output signal by a two-pass approach: write floating point data and
-    // remember maximum amplitude, then go back and use maximum amplitude to scale
-    // to 16-bit integer audio.
+    // of an output signal: write floating point data and remember maximum amplitude,
+    // then go back and divide the samples in place by the maximum amplitude.
 
     const char *outFileName = "output/scale.wav";
     const int sampleRate = 44100;
@@ -347,6 +380,29 @@ static int AutoScale()
         outwave.WriteSamples(buffer.data(), bufsize);
     }
 
+    outwave.Close();
+
+    // Verify the output really is normalized to a peak magnitude of 1.
+    WaveFileReader inwave;
+    if (!inwave.Open(outFileName))
+        return Fail("AutoScale", std::string("Could not read back file: ") + outFileName);
+
+    if (inwave.Format() != WaveSampleFormat::Float32 || inwave.TotalSamples() != durationBuffers * bufsize)
+        return Fail("AutoScale", "Incorrect format or length read back.");
+
+    float peak = 0.0f;
+    for(;;)
+    {
+        size_t received = inwave.Read(buffer.data(), bufsize);
+        for (size_t i = 0; i < received; ++i)
+            peak = std::max(peak, std::abs(buffer[i]));
+        if (received < bufsize)
+            break;
+    }
+
+    if (peak != 1.0f)
+        return Fail("AutoScale", std::string("Expected peak = 1, but found ") + std::to_string(peak));
+
     return Pass("AutoScale");
 }
 
@@ -433,6 +489,51 @@ static int DelayLineTest()
 }
 
 
+static int FilterBankTest()
+{
+    using namespace Sapphire;
+
+    // Each lane of a filter bank must match a scalar filter exactly,
+    // including after the cutoff frequency and sample rate change.
+    const int LAYERS = 3;
+    const size_t nframes = 30000;
+    StagedFilter<float, LAYERS> scalar[4];
+    StagedFilterBank<LAYERS> bank;
+    StagedFilterBank<LAYERS> blockBank;
+    std::vector<float> block(4 * nframes);
+
+    std::mt19937 rand(777);
+    std::uniform_real_distribution<float> noise(-1.0f, +1.0f);
+    for (size_t i = 0; i < 4*nframes; ++i)
+        block[i] = noise(rand);
+
+    for (size_t i = 0; i < nframes; ++i)
+    {
+        const float sampleRate = (i < nframes/2) ? 44100.0f : 48000.0f;
+        if (i % 10000 == 0)
+        {
+            const float cutoff = 20.0f + i/100.0f;
+            for (int k = 0; k < 4; ++k)
+                scalar[k].SetCutoffFrequency(cutoff);
+            bank.SetCutoffFrequency(cutoff);
+            blockBank.SetCutoffFrequency(cutoff);
+        }
+
+        PhysicsVector x(block[4*i], block[4*i+1], block[4*i+2], block[4*i+3]);
+        PhysicsVector y = bank.UpdateHiPass(x, sampleRate);
+        blockBank.ProcessHiPass(&block[4*i], 1, sampleRate);
+        for (int k = 0; k < 4; ++k)
+        {
+            float expected = scalar[k].UpdateHiPass(x[k], sampleRate);
+            if (y[k] != expected || block[4*i+k] != expected)
+                return Fail("FilterBankTest", "Lane " + std::to_string(k) + " differs from scalar filter at sample " + std::to_string(i));
+        }
+    }
+
+    return Pass("FilterBankTest");
+}
+
+
 static int InterpolatorTest()
 {
     using namespace Sapphire;
@@ -570,3 +671,1455 @@ static int QuadraticTest()
 
     return Pass("QuadraticTest");
 }
+
+
+static int SlewTest()
+{
+    using namespace Sapphire;
+
+    // Verify the Slewer ramps linearly upward and downward,
+    // and that it scales every channel, including a partial final group of 4.
+    const int rampLength = 10;
+    const int channels = 7;
+
+    Slewer slewer;
+    slewer.setRampLength(rampLength);
+    slewer.enable(false);
+
+    float volts[channels];
+    for (int step = 0; step <= rampLength; ++step)
+    {
+        if (!slewer.update(true))
+            return Fail("SlewTest", "Slewer turned off while ramping upward.");
+
+        if (!slewer.isRamping())
+            return Fail("SlewTest", std::string("Expected ramping at step ") + std::to_string(step));
+
+        for (int c = 0; c < channels; ++c)
+            volts[c] = static_cast<float>(c + 1);
+
+        slewer.process(volts, channels);
+
+        // The gain must be exactly count/rampLength, as Moots and Elastika have always used.
+        const float expectedGain = static_cast<float>(step) / rampLength;
+        if (slewer.getGain() != expectedGain)
+            return Fail("SlewTest", std::string("Incorrect gain at step ") + std::to_string(step));
+
+        for (int c = 0; c < channels; ++c)
+        {
+            float diff = std::abs(volts[c] - expectedGain*(c + 1));
+            if (diff > 1.0e-6f)
+            {
+                fprintf(stderr, "SlewTest: step=%d, c=%d: excessive error %e\n", step, c, diff);
+                return 1;
+            }
+        }
+    }
+
+    // One more update should finish the ramp and pass audio through unchanged.
+    slewer.update(true);
+    if (slewer.isRamping() || slewer.getGain() != 1.0f)
+        return Fail("SlewTest", "Slewer did not settle in the On state.");
+
+    // Once settled, process() must leave every channel of a full polyphonic port alone.
+    float poly[16];
+    for (int c = 0; c < 16; ++c)
+        poly[c] = static_cast<float>(c) - 7.5f;
+    slewer.process(poly, 16);
+    for (int c = 0; c < 16; ++c)
+        if (poly[c] != static_cast<float>(c) - 7.5f)
+            return Fail("SlewTest", "Settled slewer changed its input.");
+
+    // Ramp back down to silence.
+    int count = 0;
+    while (slewer.update(false))
+    {
+        if (++count > rampLength)
+            return Fail("SlewTest", "Downward ramp took too long.");
+    }
+
+    if (count != rampLength)
+        return Fail("SlewTest", std::string("Downward ramp had incorrect length ") + std::to_string(count));
+
+    return Pass("SlewTest");
+}
+
+
+static int RealtimeGuardSelfTest()
+{
+    // Make sure the guard notices allocations and throws inside a real-time scope,
+    // and ignores them outside of one. Count violations instead of aborting.
+    RealtimeGuard::SetFatal(false);
+    const long before = RealtimeGuard::Violations();
+
+    std::vector<int> outside(100);
+    if (RealtimeGuard::Violations() != before)
+        return Fail("RealtimeGuardTest", "Allocation outside a real-time scope was reported.");
+
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        std::vector<int> inside(100);
+    }
+    long afterAlloc = RealtimeGuard::Violations();
+    if (afterAlloc < before + 2)    // at least one allocation and one free
+        return Fail("RealtimeGuardTest", "Allocation inside a real-time scope was not reported.");
+
+    // Aligned allocations must be reported too. Store each pointer through
+    // a volatile variable so the compiler cannot leave the allocation out.
+    void * volatile aligned = nullptr;
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        void *p = nullptr;
+        if (posix_memalign(&p, 64, 100) == 0)
+            aligned = p;
+    }
+    free(aligned);
+    if (RealtimeGuard::Violations() != afterAlloc + 1)
+        return Fail("RealtimeGuardTest", "posix_memalign inside a real-time scope was not reported.");
+
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        aligned = aligned_alloc(64, 128);
+    }
+    free(aligned);
+    if (RealtimeGuard::Violations() != afterAlloc + 2)
+        return Fail("RealtimeGuardTest", "aligned_alloc inside a real-time scope was not reported.");
+
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        aligned = memalign(64, 100);
+    }
+    free(aligned);
+    if (RealtimeGuard::Violations() != afterAlloc + 3)
+        return Fail("RealtimeGuardTest", "memalign inside a real-time scope was not reported.");
+    afterAlloc = RealtimeGuard::Violations();
+
+    try
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        throw std::runtime_error("deliberate");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    if (RealtimeGuard::Violations() <= afterAlloc)
+        return Fail("RealtimeGuardTest", "Exception inside a real-time scope was not reported.");
+
+    RealtimeGuard::SetFatal(true);
+    return 0;
+}
+
+
+static int RealtimeGuardTest()
+{
+    using namespace Sapphire;
+
+    if (!RealtimeGuard::IsActive())
+    {
+        printf("RealtimeGuardTest: allocator hooks are not supported on this platform; skipping.\n");
+        return Pass("RealtimeGuardTest");
+    }
+
+    if (RealtimeGuardSelfTest())
+        return 1;
+
+    // From here on, any violation aborts the program with a stack trace.
+    // Drive the engines the way the VCV Rack modules do: every setter that the module's
+    // process() function calls runs inside the real-time scope too, with knobs sweeping
+    // over their full ranges, and at several sample rates.
+    std::mt19937 rand(4321);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const float sampleRates[] = { 11025.0f, 44100.0f, 192000.0f };
+
+    std::unique_ptr<ElastikaEngine> elastika(new ElastikaEngine);
+    std::unique_ptr<TubeUnitEngine[]> tubeunit(new TubeUnitEngine[16]);
+    Slewer slewer;
+    slewer.setRampLength(100);
+
+    for (float sampleRate : sampleRates)
+    {
+        for (int c = 0; c < 16; ++c)
+            tubeunit[c].setSampleRate(sampleRate);
+
+        for (int i = 0; i < 20000; ++i)
+        {
+            SAPPHIRE_REALTIME_SCOPE();
+
+            const float knob = unit(rand);
+            const float in = 2.0f*unit(rand) - 1.0f;
+            float sample[2];
+
+            elastika->setFriction(knob);
+            elastika->setStiffness(knob);
+            elastika->setSpan(knob);
+            elastika->setCurl(2.0f*knob - 1.0f);
+            elastika->setMass(2.0f*knob - 1.0f);
+            elastika->setDrive(2.0f*knob);
+            elastika->setGain(2.0f*knob);
+            elastika->setInputTilt(knob);
+            elastika->setOutputTilt(knob);
+            elastika->process(sampleRate, in, -in, sample[0], sample[1]);
+            slewer.update((i / 3000) % 2 == 0);
+            slewer.process(sample, 2);
+            if (i % 5000 == 4999)
+                elastika->quiet();
+
+            for (int c = 0; c < 16; ++c)
+            {
+                tubeunit[c].setQuiet(i % 7000 > 6500);
+                tubeunit[c].setGain(2.0f*knob);
+                tubeunit[c].setAirflow(5.0f*knob);
+                tubeunit[c].setRootFrequency(4 * std::pow(2.0f, 8.0f*knob));
+                tubeunit[c].setReflectionDecay(knob);
+                tubeunit[c].setReflectionAngle(M_PI * knob);
+                tubeunit[c].setSpringConstant(0.005f * std::pow(10.0f, 4.0f*knob));
+                tubeunit[c].setBypassWidth(0.5f + 19.5f*knob);
+                tubeunit[c].setBypassCenter(20.0f*knob - 10.0f);
+                tubeunit[c].setVortex(knob);
+                tubeunit[c].setInterpolation(static_cast<TubeInterpolation>(c % static_cast<int>(TubeInterpolation::Count)));
+                tubeunit[c].process(sample[0], sample[1], in, -in);
+            }
+        }
+    }
+
+    return Pass("RealtimeGuardTest");
+}
+
+
+class ElastikaStateHarness
+{
+public:
+    Sapphire::ElastikaEngine engine;
+
+    void step(float leftIn, float rightIn, float& leftOut, float& rightOut)
+    {
+        engine.process(44100.0f, leftIn, rightIn, leftOut, rightOut);
+    }
+};
+
+
+class TubeUnitStateHarness
+{
+public:
+    Sapphire::TubeUnitEngine engine;
+
+    TubeUnitStateHarness()
+    {
+        engine.setSampleRate(44100.0f);
+        engine.setAirflow(1.0f);
+        engine.setRootFrequency(110.0f);
+    }
+
+    void step(float leftIn, float rightIn, float& leftOut, float& rightOut)
+    {
+        engine.process(leftOut, rightOut, leftIn, rightIn);
+    }
+};
+
+
+template <typename harness_t>
+static int StateCase(const char *name)
+{
+    // Warm up one engine, snapshot it, and keep it running.
+    // A second, cold engine restored from the snapshot must then produce bit-identical output.
+    const int warmupSamples = 20000;
+    const int compareSamples = 20000;
+    std::mt19937 rand(12345);
+    std::uniform_real_distribution<float> noise(-1.0f, +1.0f);
+
+    harness_t warm;
+    float leftOut, rightOut;
+    for (int i = 0; i < warmupSamples; ++i)
+        warm.step(noise(rand), noise(rand), leftOut, rightOut);
+
+    std::vector<uint8_t> state;
+    warm.engine.saveState(state);
+
+    harness_t cold;
+    cold.engine.loadState(state);
+
+    for (int i = 0; i < compareSamples; ++i)
+    {
+        const float leftIn = noise(rand);
+        const float rightIn = noise(rand);
+        float leftCold, rightCold;
+        warm.step(leftIn, rightIn, leftOut, rightOut);
+        cold.step(leftIn, rightIn, leftCold, rightCold);
+        if (leftOut != leftCold || rightOut != rightCold)
+            return Fail("StateTest", std::string(name) + ": restored engine diverged at sample " + std::to_string(i));
+    }
+
+    // Saving the restored engine must reproduce the same bytes as saving the original.
+    std::vector<uint8_t> check;
+    warm.engine.saveState(state);
+    cold.engine.saveState(check);
+    if (state != check)
+        return Fail("StateTest", std::string(name) + ": re-saved state does not match.");
+
+    // A damaged blob must be rejected.
+    check.pop_back();
+    try
+    {
+        cold.engine.loadState(check);
+        return Fail("StateTest", std::string(name) + ": truncated state was accepted.");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+
+    // A blob whose header is intact but whose payload runs short must be rejected
+    // before any of it is loaded, leaving the engine exactly as it was.
+    // Use a fresh engine's state, so a partial load would show up in the re-saved bytes.
+    harness_t fresh;
+    fresh.engine.saveState(check);
+    check.pop_back();
+    const uint32_t shortLength = static_cast<uint32_t>(check.size() - 16);
+    memcpy(check.data() + 12, &shortLength, sizeof(shortLength));
+    try
+    {
+        cold.engine.loadState(check);
+        return Fail("StateTest", std::string(name) + ": short payload was accepted.");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    cold.engine.saveState(check);
+    if (state != check)
+        return Fail("StateTest", std::string(name) + ": rejected state was partially loaded.");
+
+    printf("StateTest: %s state is %u bytes.\n", name, static_cast<unsigned>(state.size()));
+    return 0;
+}
+
+
+static int StateTest()
+{
+    if (StateCase<ElastikaStateHarness>("elastika")) return 1;
+    if (StateCase<TubeUnitStateHarness>("tubeunit")) return 1;
+
+    // A state saved by one kind of engine must not load into another.
+    std::vector<uint8_t> state;
+    Sapphire::ElastikaEngine elastika;
+    elastika.saveState(state);
+    Sapphire::TubeUnitEngine tubeunit;
+    try
+    {
+        tubeunit.loadState(state);
+        return Fail("StateTest", "Tube Unit accepted an Elastika state.");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+
+    return Pass("StateTest");
+}
+
+
+static long FileSize(const std::string& filename)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == nullptr)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+
+static int ReplayCaptureFile(const std::string& filename, long& frames, long& mismatches, bool& complete)
+{
+    try
+    {
+        SessionReplay replay(filename);
+        while (replay.step())
+            ;
+        frames = replay.frames();
+        mismatches = replay.mismatches();
+        complete = replay.isComplete();
+        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        return Fail("CaptureTest", filename + ": " + e.what());
+    }
+}
+
+
+static int CaptureCase(const char *slug, const char *knobName, const char *gateName)
+{
+    using namespace Sapphire;
+    const std::string traceFileName = std::string("output/capture_") + slug + ".sapc";
+    const std::string truncatedFileName = std::string("output/capture_") + slug + "_truncated.sapc";
+    const int warmupSamples = 5000;
+    const int captureSamples = 20000;
+
+    std::unique_ptr<rack::engine::Module> module(HeadlessSapphirePlugin().getModel(slug)->createModule());
+    CaptureTarget& target = dynamic_cast<CaptureTarget&>(*module);
+
+    rack::engine::Module::ProcessArgs args {};
+    args.sampleRate = 44100.0f;
+    args.sampleTime = 1.0f / args.sampleRate;
+    module->onSampleRateChange({args.sampleRate, args.sampleTime});
+
+    const int knob = module->findParam(knobName);
+    const int limiter = module->findParam("Output limiter");
+    const int knobCv = module->findInput(std::string(knobName) + " CV");
+    const int gate = module->findInput(gateName);
+    const int leftIn = module->findInput("Left audio");
+    const int rightIn = module->findInput("Right audio");
+    if (knob < 0 || limiter < 0 || knobCv < 0 || gate < 0 || leftIn < 0 || rightIn < 0)
+        return Fail("CaptureTest", std::string(slug) + ": missing a control or port.");
+
+    module->inputs[leftIn].channels = 2;
+    module->inputs[rightIn].channels = 1;
+    module->inputs[knobCv].channels = 1;
+    module->params[module->findParam(std::string(knobName) + " attenuverter")].setValue(0.3f);
+    for (rack::engine::Output& output : module->outputs)
+        output.channels = 1;
+
+    if (!strcmp(slug, "TubeUnit"))
+    {
+        // Interpolation is a menu setting whose engine state (the allpass memory) must go into the snapshot.
+        target.replaySetting(2, static_cast<float>(static_cast<int>(TubeInterpolation::Thiran)));
+    }
+
+    std::mt19937 rand(8491);
+    std::uniform_real_distribution<float> noise(-5.0f, +5.0f);
+    for (int i = 0; i < warmupSamples + captureSamples; ++i)
+    {
+        const int t = i - warmupSamples;
+        if (t == 0)
+            target.capture.start(traceFileName, slug, module->params.size(), module->inputs.size(), module->outputs.size());
+
+        // Script a session: knob turns, menu changes, a power/vent gate, a sample rate change, and a reset.
+        if (t == 2000)
+            module->params[knob].setValue(0.8f);
+        if (t == 3000)
+            module->paramQuantities[limiter]->setValue(7.5f);
+        if (t == 4000 && !strcmp(slug, "TubeUnit"))
+        {
+            target.replaySetting(2, static_cast<float>(static_cast<int>(TubeInterpolation::Hermite)));
+            target.replaySetting(1, 1.0f);
+        }
+        if (t == 5000)
+            module->inputs[gate].channels = 1;
+        if (t == 5000 || t == 7000)
+            module->inputs[gate].voltages[0] = (t == 5000) ? 0.0f : 10.0f;
+        if (t == 9000)
+        {
+            args.sampleRate = 48000.0f;
+            args.sampleTime = 1.0f / args.sampleRate;
+            module->onSampleRateChange({args.sampleRate, args.sampleTime});
+        }
+        if (t == 15000)
+            module->onReset(rack::engine::Module::ResetEvent());
+
+        // Leave stretches of constant input, so the trace has idle frames to merge.
+        if (t < 10000 || t >= 12000)
+        {
+            module->inputs[leftIn].voltages[0] = noise(rand);
+            module->inputs[leftIn].voltages[1] = noise(rand);
+            module->inputs[rightIn].voltages[0] = noise(rand);
+            module->inputs[knobCv].voltages[0] = 5.0f * std::sin(i * 0.001f);
+        }
+
+        module->process(args);
+        ++args.frame;
+    }
+
+    if (!target.capture.stop())
+        return Fail("CaptureTest", std::string(slug) + ": capture did not finish cleanly.");
+
+    long frames, mismatches;
+    bool complete;
+    if (ReplayCaptureFile(traceFileName, frames, mismatches, complete)) return 1;
+    printf("CaptureTest: %s replayed %ld frames with %ld mismatches.\n", slug, frames, mismatches);
+    if (frames != captureSamples)
+        return Fail("CaptureTest", std::string(slug) + ": replay has the wrong number of frames.");
+    if (mismatches != 0)
+        return Fail("CaptureTest", std::string(slug) + ": replay does not match the capture.");
+    if (!complete)
+        return Fail("CaptureTest", std::string(slug) + ": trace is not marked complete.");
+
+    // The trace must be much smaller than the raw frames it encodes.
+    const long traceBytes = FileSize(traceFileName);
+    const long rawBytes = 4L * captureSamples * (module->params.size() + 17*(module->inputs.size() + module->outputs.size()));
+    printf("CaptureTest: %s trace is %ld bytes; raw frames would be %ld bytes.\n", slug, traceBytes, rawBytes);
+    if (traceBytes <= 0 || traceBytes * 4 > rawBytes)
+        return Fail("CaptureTest", std::string(slug) + ": trace is not compact enough.");
+
+    // A trace whose writer never finished must still replay, as far as it goes.
+    std::vector<char> data(traceBytes);
+    FILE *infile = fopen(traceFileName.c_str(), "rb");
+    const size_t nread = fread(data.data(), 1, data.size(), infile);
+    fclose(infile);
+    FILE *outfile = fopen(truncatedFileName.c_str(), "wb");
+    if (outfile == nullptr)
+        return Fail("CaptureTest", "Cannot open output file: " + truncatedFileName);
+    fwrite(data.data(), 1, nread * 2 / 3, outfile);
+    fclose(outfile);
+
+    if (ReplayCaptureFile(truncatedFileName, frames, mismatches, complete)) return 1;
+    printf("CaptureTest: %s truncated trace replayed %ld frames.\n", slug, frames);
+    if (complete || frames <= 0 || frames >= captureSamples || mismatches != 0)
+        return Fail("CaptureTest", std::string(slug) + ": truncated trace did not replay its first part correctly.");
+
+    return 0;
+}
+
+
+static int CaptureTest()
+{
+    if (CaptureCase("Elastika", "Friction", "Power gate")) return 1;
+    if (CaptureCase("TubeUnit", "Airflow", "Vent gate")) return 1;
+    return Pass("CaptureTest");
+}
+
+
+static int CApiCase(SapphireEngineKind kind, const char *name, int paramCount)
+{
+    using namespace Sapphire;
+    const std::string caseName = std::string("CApiTest(") + name + ")";
+    const size_t nframes = 256;
+    const int nblocks = 200;
+
+    if (sapphire_create(kind, 0.0f) != nullptr)
+        return Fail(caseName, "created an engine with a zero sample rate.");
+
+    SapphireEngine *engine = sapphire_create(kind, 44100.0f);
+    if (engine == nullptr)
+        return Fail(caseName, "sapphire_create failed.");
+    std::unique_ptr<SapphireEngine, void(*)(SapphireEngine *)> owner(engine, sapphire_destroy);
+
+    // The library must behave exactly like the RenderEngine the command-line tools use.
+    std::unique_ptr<RenderEngine> reference = CreateRenderEngine(name);
+    reference->setSampleRate(44100.0f);
+
+    // The parameter ids in sapphire.h must agree with the engine's parameter table.
+    if (sapphire_param_count(engine) != paramCount || reference->numParameters() != paramCount)
+        return Fail(caseName, "sapphire.h has the wrong parameter count.");
+
+    std::vector<SapphireParamInfo> info(paramCount);
+    for (int id = 0; id < paramCount; ++id)
+    {
+        if (sapphire_param_info(engine, id, &info[id]) != SAPPHIRE_OK)
+            return Fail(caseName, "sapphire_param_info failed.");
+        if (sapphire_find_param(engine, info[id].name) != id)
+            return Fail(caseName, std::string("sapphire_find_param cannot find ") + info[id].name);
+    }
+
+    std::mt19937 rand(2718);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<float> inLeft(nframes), inRight(nframes);
+    std::vector<float> outLeft(nframes), outRight(nframes);
+    std::vector<float> refLeft(nframes), refRight(nframes);
+    int status = SAPPHIRE_OK;
+    int errors = 0;
+    for (int block = 0; block < nblocks; ++block)
+    {
+        for (size_t i = 0; i < nframes; ++i)
+        {
+            inLeft[i] = 10.0f*unit(rand) - 5.0f;
+            inRight[i] = 10.0f*unit(rand) - 5.0f;
+        }
+
+        // Odd blocks are processed in place.
+        const bool inPlace = (block % 2 == 1);
+        if (inPlace)
+        {
+            outLeft = inLeft;
+            outRight = inRight;
+        }
+
+        const int id = block % paramCount;
+        const float value = info[id].minValue + unit(rand)*(info[id].maxValue - info[id].minValue);
+
+        {
+            // After sapphire_create(), nothing may allocate memory.
+            SAPPHIRE_REALTIME_SCOPE();
+
+            status |= sapphire_set_param(engine, id, value);
+            reference->setParameter(id, value);
+
+            if (block == nblocks/2)
+            {
+                status |= sapphire_set_sample_rate(engine, 48000.0f);
+                reference->setSampleRate(48000.0f);
+            }
+
+            if (block == 3*nblocks/4)
+            {
+                status |= sapphire_reset(engine);
+                reference->initialize();
+            }
+
+            const float *inputs[SAPPHIRE_CHANNELS] = { inLeft.data(), inRight.data() };
+            if (inPlace)
+            {
+                inputs[0] = outLeft.data();
+                inputs[1] = outRight.data();
+            }
+            float *outputs[SAPPHIRE_CHANNELS] = { outLeft.data(), outRight.data() };
+            status |= sapphire_process_block(engine, inputs, outputs, nframes);
+            reference->process(nframes, inLeft.data(), inRight.data(), refLeft.data(), refRight.data());
+
+            // Bad arguments must be rejected without side effects.
+            errors += (sapphire_set_param(engine, -1, 0.0f) == SAPPHIRE_ERROR_ARGUMENT);
+            errors += (sapphire_set_param(engine, paramCount, 0.0f) == SAPPHIRE_ERROR_ARGUMENT);
+            errors += (sapphire_set_param(engine, id, std::nanf("")) == SAPPHIRE_ERROR_ARGUMENT);
+            errors += (sapphire_set_sample_rate(engine, -1.0f) == SAPPHIRE_ERROR_ARGUMENT);
+            errors += (sapphire_find_param(engine, "nonexistent") == -1);
+            outputs[1] = nullptr;
+            errors += (sapphire_process_block(engine, inputs, outputs, nframes) == SAPPHIRE_ERROR_ARGUMENT);
+        }
+
+        if (memcmp(outLeft.data(), refLeft.data(), nframes * sizeof(float)) || memcmp(outRight.data(), refRight.data(), nframes * sizeof(float)))
+            return Fail(caseName, "output differs from RenderEngine in block " + std::to_string(block));
+    }
+
+    if (status != SAPPHIRE_OK)
+        return Fail(caseName, "an engine call failed.");
+
+    if (errors != 6 * nblocks)
+        return Fail(caseName, "bad arguments were not rejected.");
+
+    if (sapphire_get_param(engine, paramCount-1) != reference->getParameter(paramCount-1))
+        return Fail(caseName, "sapphire_get_param does not match.");
+
+    return 0;
+}
+
+
+static int CApiTest()
+{
+    if (CApiCase(SAPPHIRE_ELASTIKA, "elastika", SAPPHIRE_ELASTIKA_PARAM_COUNT)) return 1;
+    if (CApiCase(SAPPHIRE_TUBEUNIT, "tubeunit", SAPPHIRE_TUBEUNIT_PARAM_COUNT)) return 1;
+    return Pass("CApiTest");
+}
+
+
+static int FixedMeshTest()
+{
+    using namespace Sapphire;
+
+    // The compile-time layout must still describe the mesh HexBuilder makes.
+    if (!FixedHexMesh::Matches(HexTopology()))
+        return Fail("FixedMeshTest", "HexLayout does not match HexTopology().");
+
+    // Both kinds of Elastika engine must produce the same output,
+    // while the settings change underneath them.
+    const int nsamples = 40000;
+    std::mt19937 rand(7321);
+    std::uniform_real_distribution<float> noise(-1.0f, +1.0f);
+    ElastikaEngine fixed;
+    DynamicElastikaEngine dynamic;
+    float maxDiff = 0.0f;
+    for (int i = 0; i < nsamples; ++i)
+    {
+        if (i % 5000 == 0)
+        {
+            const float slider = (noise(rand) + 1.0f) / 2.0f;
+            fixed.setFriction(slider);      dynamic.setFriction(slider);
+            fixed.setStiffness(slider);     dynamic.setStiffness(slider);
+            fixed.setSpan(1.0f - slider);   dynamic.setSpan(1.0f - slider);
+            fixed.setCurl(slider - 0.5f);   dynamic.setCurl(slider - 0.5f);
+            fixed.setMass(0.5f - slider);   dynamic.setMass(0.5f - slider);
+        }
+
+        const float leftIn = noise(rand);
+        const float rightIn = noise(rand);
+        float fixedLeft, fixedRight, dynamicLeft, dynamicRight;
+        fixed.process(44100.0f, leftIn, rightIn, fixedLeft, fixedRight);
+        dynamic.process(44100.0f, leftIn, rightIn, dynamicLeft, dynamicRight);
+        maxDiff = std::max(maxDiff, std::max(std::abs(fixedLeft - dynamicLeft), std::abs(fixedRight - dynamicRight)));
+    }
+
+    printf("FixedMeshTest: maxDiff = %g\n", maxDiff);
+    if (maxDiff != 0.0f)
+        return Fail("FixedMeshTest", "Fixed and dynamic Elastika engines disagree.");
+
+    // The two engines save their state in the same format, so each can resume the other.
+    std::vector<uint8_t> state;
+    dynamic.saveState(state);
+    fixed.quiet();
+    fixed.loadState(state);
+    std::vector<uint8_t> check;
+    fixed.saveState(check);
+    if (state != check)
+        return Fail("FixedMeshTest", "Fixed engine did not restore the dynamic engine's state.");
+
+    return Pass("FixedMeshTest");
+}
+
+
+// A small mesh with every kind of spring: anchor first, anchor last,
+// mobile to mobile, and one between two fixed anchors.
+// Balls 0 and 5 are fixed anchors, ball 3 is a driven anchor, and the rest are mobile.
+const Sapphire::Spring AnchorTestSprings[] =
+{
+    {0, 1}, {1, 2}, {2, 3}, {3, 4}, {4, 0}, {0, 5},
+};
+
+// The same mesh compiled for FixedPhysicsMesh: the spring between the two fixed anchors is gone.
+struct AnchorTestLayout
+{
+    static constexpr int NumBalls = 6;
+    static constexpr int NumLiveBalls = 4;
+    static constexpr int NumLinks = 5;
+    static constexpr int LiveBalls[NumLiveBalls] = { 1, 2, 3, 4 };
+    static constexpr int Slots[NumBalls] = { -1, 0, 1, 2, 3, -1 };
+    static constexpr Sapphire::FixedLink Links[NumLinks] =
+    {
+        {0, 0.0f, 0.0f, 0.0f}, {0, 1}, {1, 2}, {2, 3}, {3, 0.0f, 0.0f, 0.0f},
+    };
+};
+
+constexpr int AnchorTestLayout::LiveBalls[];
+constexpr int AnchorTestLayout::Slots[];
+constexpr Sapphire::FixedLink AnchorTestLayout::Links[];
+
+
+// Simulates every ball in a topology, fixed anchors included,
+// so it shows what folding the fixed anchors into constants must not change.
+class FullMeshReference
+{
+private:
+    const Sapphire::MeshTopology& topology;
+    Sapphire::BallList currBallList;
+    Sapphire::BallList nextBallList;
+    Sapphire::PhysicsVectorList forceList;
+    Sapphire::PhysicsVector magnet;
+
+    void CalcForces(const Sapphire::BallList& blist)
+    {
+        using namespace Sapphire;
+
+        for (size_t i = 0; i < blist.size(); ++i)
+            if (blist[i].IsMobile())
+                forceList[i] = PhysicsVector::zero();
+
+        for (const Spring& spring : topology.GetSprings())
+        {
+            const Ball& b1 = blist[spring.ballIndex1];
+            const Ball& b2 = blist[spring.ballIndex2];
+            PhysicsVector force = SpringForce(b1.pos, b2.pos, MESH_DEFAULT_STIFFNESS, MESH_DEFAULT_REST_LENGTH);
+            if (b1.IsMobile())
+            {
+                forceList[spring.ballIndex1] += force;
+                forceList[spring.ballIndex1] += Cross(b1.vel, magnet);
+            }
+            if (b2.IsMobile())
+            {
+                forceList[spring.ballIndex2] -= force;
+                forceList[spring.ballIndex2] += Cross(b2.vel, magnet);
+            }
+        }
+    }
+
+public:
+    FullMeshReference(const Sapphire::MeshTopology& _topology, Sapphire::PhysicsVector _magnet)
+        : topology(_topology)
+        , currBallList(_topology.GetInitialBalls())
+        , nextBallList(_topology.GetInitialBalls())
+        , forceList(_topology.NumBalls())
+        , magnet(_magnet)
+        {}
+
+    Sapphire::Ball& GetBallAt(int index) { return currBallList.at(index); }
+
+    void Update(float dt, float halflife)
+    {
+        using namespace Sapphire;
+
+        const float damp = MeshDampingFactor(dt, halflife);
+        for (Ball& b : currBallList)
+            b.vel *= damp;
+
+        CalcForces(currBallList);
+        for (size_t i = 0; i < currBallList.size(); ++i)
+            ExtrapolateBall(dt / 2.0, MESH_DEFAULT_SPEED_LIMIT, forceList[i], currBallList[i], nextBallList[i]);
+        CalcForces(nextBallList);
+        for (size_t i = 0; i < currBallList.size(); ++i)
+            ExtrapolateBall(dt, MESH_DEFAULT_SPEED_LIMIT, forceList[i], currBallList[i], nextBallList[i]);
+        currBallList = nextBallList;
+    }
+};
+
+
+static int AnchorTest()
+{
+    using namespace Sapphire;
+
+    // Both exact meshes leave fixed anchors out of their simulation state.
+    PhysicsMesh hex;
+    CreateHex(hex);
+    if (hex.NumBalls() != 34 || hex.NumLiveBalls() != 24)
+        return Fail("AnchorTest", "Hex mesh has " + std::to_string(hex.NumLiveBalls()) + " live balls out of " + std::to_string(hex.NumBalls()));
+
+    if (FixedHexMesh::NumBalls() != 34 || FixedHexMesh::NumLiveBalls() != 24)
+        return Fail("AnchorTest", "Fixed hex mesh has " + std::to_string(FixedHexMesh::NumLiveBalls()) + " live balls out of " + std::to_string(FixedHexMesh::NumBalls()));
+
+    MeshTopology topology;
+    topology.Add(Ball::Anchor(0.0f, 0.0f, 0.0f));
+    topology.Add(Ball(1.0e-6f, 0.001f, 0.0f, 0.0f));
+    topology.Add(Ball(1.0e-6f, 0.002f, 0.001f, 0.0f));
+    topology.Add(Ball::Anchor(0.003f, 0.0f, 0.0f));     // driven
+    topology.Add(Ball(2.0e-6f, 0.0015f, -0.001f, 0.0f));
+    topology.Add(Ball::Anchor(-0.001f, 0.0f, 0.0f));
+    for (const Spring& spring : AnchorTestSprings)
+        if (!topology.Add(spring))
+            return Fail("AnchorTest", "Could not add spring.");
+
+    // The compiled layout depends on which anchors are driven.
+    if (FixedPhysicsMesh<AnchorTestLayout>::Matches(topology))
+        return Fail("AnchorTest", "Layout matched before ball 3 was marked driven.");
+    topology.MarkDriven(3);
+    if (!FixedPhysicsMesh<AnchorTestLayout>::Matches(topology))
+        return Fail("AnchorTest", "AnchorTestLayout does not match its topology.");
+
+    PhysicsMesh mesh;
+    FixedPhysicsMesh<AnchorTestLayout> fixed;
+    mesh.Attach(topology);
+    fixed.Attach(topology);
+    if (mesh.NumLiveBalls() != 4)
+        return Fail("AnchorTest", "Expected 4 live balls, found " + std::to_string(mesh.NumLiveBalls()));
+
+    const PhysicsVector magnet(0.002f, 0.0f, 0.001f, 0.0f);
+    FullMeshReference reference(topology, magnet);
+    mesh.SetMagneticField(magnet);
+    fixed.SetMagneticField(magnet);
+    std::mt19937 rand(2468);
+    std::uniform_real_distribution<float> noise(-1.0f, +1.0f);
+    for (int i = 0; i < 20000; ++i)
+    {
+        // Now and then, put the driven anchor right on top of a ball, where the spring between them
+        // has no direction and needs SpringForce's special case.
+        PhysicsVector drive = topology.GetBallOrigin(3) + PhysicsVector(0.0f, 0.0f, 1.0e-4f * noise(rand), 0.0f);
+        if (i % 1000 == 999)
+            drive = reference.GetBallAt(2).pos;
+        mesh.GetBallAt(3).pos = drive;
+        fixed.GetBallAt(3).pos = drive;
+        reference.GetBallAt(3).pos = drive;
+        mesh.Update(1.0f / 44100.0f, 0.5f);
+        fixed.Update(1.0f / 44100.0f, 0.5f);
+        reference.Update(1.0f / 44100.0f, 0.5f);
+        const PhysicsMesh& view = mesh;
+        const FixedPhysicsMesh<AnchorTestLayout>& fixedView = fixed;
+        for (int b = 0; b < AnchorTestLayout::NumBalls; ++b)
+        {
+            const PhysicsVector diff = view.GetBallAt(b).pos - reference.GetBallAt(b).pos;
+            const PhysicsVector fixedDiff = fixedView.GetBallAt(b).pos - reference.GetBallAt(b).pos;
+            if (Dot(diff, diff) != 0.0f || Dot(fixedDiff, fixedDiff) != 0.0f)
+                return Fail("AnchorTest", "Ball " + std::to_string(b) + " diverged at sample " + std::to_string(i));
+        }
+    }
+
+    // A fixed anchor can be looked at, but not moved.
+    if (Dot(mesh.GetBallDisplacement(5), mesh.GetBallDisplacement(5)) != 0.0f)
+        return Fail("AnchorTest", "Fixed anchor moved.");
+
+    if (Dot(fixed.GetBallDisplacement(0), fixed.GetBallDisplacement(0)) != 0.0f)
+        return Fail("AnchorTest", "Fixed anchor moved in the fixed mesh.");
+
+    try
+    {
+        mesh.GetBallAt(0).pos = PhysicsVector::zero();
+        return Fail("AnchorTest", "Fixed anchor was writable.");
+    }
+    catch (const std::out_of_range&)
+    {
+    }
+
+    // Fixed anchors are still part of the saved state, so it does not depend on which balls are live.
+    std::vector<uint8_t> state, check;
+    StateWriter writer(state, StateTag('T', 'E', 'S', 'T'), 1);
+    mesh.SaveState(writer);
+    writer.finish();
+    StateWriter checkWriter(check, StateTag('T', 'E', 'S', 'T'), 1);
+    fixed.SaveState(checkWriter);
+    checkWriter.finish();
+    if (state != check)
+        return Fail("AnchorTest", "Saved states do not match.");
+
+    return Pass("AnchorTest");
+}
+
+static int LatticeTest()
+{
+    using namespace Sapphire;
+
+    // The lattice engine adds up forces in a different order than the exact engine,
+    // so its output cannot match bit for bit. With noise going in, Elastika is chaotic:
+    // even a rounding difference in one input sample grows until the outputs no longer
+    // match sample by sample. So compare samples closely at first, then compare loudness
+    // over a run long enough that the chaotic wandering averages out.
+    const int closeSamples = 2000;
+    const int nsamples = 200000;
+    std::mt19937 rand(9876);
+    std::uniform_real_distribution<float> noise(-1.0f, +1.0f);
+    ElastikaEngine exact;
+    LatticeElastikaEngine lattice;
+    exact.setStiffness(0.7f);   lattice.setStiffness(0.7f);
+    exact.setCurl(0.3f);        lattice.setCurl(0.3f);
+    exact.setMass(0.3f);        lattice.setMass(0.3f);
+    float maxDiff = 0.0f;
+    float maxOut = 0.0f;
+    double exactPower = 0.0;
+    double latticePower = 0.0;
+    for (int i = 0; i < nsamples; ++i)
+    {
+        const float leftIn = 0.5f * noise(rand);
+        const float rightIn = 0.5f * noise(rand);
+        float exactLeft, exactRight, latticeLeft, latticeRight;
+        exact.process(44100.0f, leftIn, rightIn, exactLeft, exactRight);
+        lattice.process(44100.0f, leftIn, rightIn, latticeLeft, latticeRight);
+        if (i < closeSamples)
+        {
+            maxDiff = std::max(maxDiff, std::max(std::abs(exactLeft - latticeLeft), std::abs(exactRight - latticeRight)));
+            maxOut = std::max(maxOut, std::max(std::abs(exactLeft), std::abs(exactRight)));
+        }
+        exactPower += exactLeft*exactLeft + exactRight*exactRight;
+        latticePower += latticeLeft*latticeLeft + latticeRight*latticeRight;
+    }
+
+    const double loudness = std::sqrt(latticePower / exactPower);
+    printf("LatticeTest: engine maxDiff = %g, maxOut = %g, loudness ratio = %0.4lf\n", maxDiff, maxOut, loudness);
+    if (maxDiff > 1.0e-3f * maxOut)
+        return Fail("LatticeTest", "Lattice engine output is too different from the exact engine.");
+
+    if (std::abs(loudness - 1.0) > 0.05)
+        return Fail("LatticeTest", "Lattice engine loudness is too different from the exact engine.");
+
+    // A much larger plate, plucked and left to ring for a moment.
+    // Like the engine, the plate magnifies tiny differences over time;
+    // even PhysicsMesh disagrees with itself this much after a perturbation of 1.0e-11.
+    MeshTopology plate;
+    CreateHexPlate(plate, 12, 10);
+    PhysicsMesh mesh;
+    LatticeMesh grid;
+    mesh.Attach(plate);
+    grid.Attach(plate);
+    printf("LatticeTest: %d x %d hex plate has %d balls, %d springs, %d grid sites.\n", 12, 10, grid.NumBalls(), grid.NumSprings(), grid.GridSites());
+
+    const int pluck = plate.NumBalls() / 3;
+    const PhysicsVector pluckPos = plate.GetBallOrigin(pluck) + PhysicsVector(0.0f, 0.0f, 2.0e-4f, 0.0f);
+    mesh.SetBallPosition(pluck, pluckPos);
+    grid.SetBallPosition(pluck, pluckPos);
+    mesh.SetMagneticField(PhysicsVector(0.002f, 0.0f, 0.0f, 0.0f));
+    grid.SetMagneticField(PhysicsVector(0.002f, 0.0f, 0.0f, 0.0f));
+    float maxMove = 0.0f;
+    float maxError = 0.0f;
+    for (int i = 0; i < 500; ++i)
+    {
+        mesh.Update(1.0f / 44100.0f, 0.1f);
+        grid.Update(1.0f / 44100.0f, 0.1f);
+    }
+    for (int b = 0; b < plate.NumBalls(); ++b)
+    {
+        const PhysicsVector move = mesh.GetBallDisplacement(b);
+        const PhysicsVector error = grid.GetBallDisplacement(b) - move;
+        maxMove = std::max(maxMove, Magnitude(move));
+        maxError = std::max(maxError, Magnitude(error));
+    }
+    printf("LatticeTest: plate maxMove = %g, maxError = %g\n", maxMove, maxError);
+    if (!(maxMove > 0.0f) || maxError > 1.0e-3f * maxMove)
+        return Fail("LatticeTest", "Lattice plate does not match PhysicsMesh.");
+
+    if (std::abs(grid.KineticEnergy() - mesh.KineticEnergy()) > 1.0e-3f * mesh.KineticEnergy())
+        return Fail("LatticeTest", "Kinetic energies do not match.");
+
+    // Balls that are not on a lattice must be rejected.
+    MeshTopology bent;
+    bent.Add(Ball::Anchor(0.0f, 0.0f, 0.0f));
+    bent.Add(Ball(1.0e-6f, 0.001f, 0.0f, 0.0f));
+    bent.Add(Ball(1.0e-6f, 0.0017f, 0.0004f, 0.0f));
+    bent.Add(Spring(0, 1));
+    bent.Add(Spring(1, 2));
+    try
+    {
+        grid.Attach(bent);
+        return Fail("LatticeTest", "Irregular topology was accepted.");
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+
+    return Pass("LatticeTest");
+}
+
+
+static int WaveFormatCase(const char *outFileName, WaveSampleFormat format, bool rf64, long expectedHeaderBytes)
+{
+    const int sampleRate = 44100;
+    const int channels = 2;
+    const size_t nsamples = 3 * 1024 * 1024 + 7;    // more than one internal buffer, with an odd tail
+
+    std::vector<float> buffer;
+    buffer.resize(nsamples);
+    for (size_t i = 0; i < nsamples; ++i)
+        buffer[i] = std::sin(0.001f * static_cast<float>(i));
+
+    WaveFileWriter outwave;
+    if (!outwave.Open(outFileName, sampleRate, channels, format, rf64))
+        return Fail("WaveFormatTest", std::string("Could not open output file: ") + outFileName);
+
+    outwave.WriteSamples(buffer.data(), nsamples);
+    if (static_cast<long>(outwave.HeaderBytes()) != expectedHeaderBytes)
+    {
+        fprintf(stderr, "WaveFormatTest: %s has header size %d, expected %ld\n", outFileName, static_cast<int>(outwave.HeaderBytes()), expectedHeaderBytes);
+        return 1;
+    }
+    outwave.Close();
+
+    FILE *infile = fopen(outFileName, "rb");
+    if (infile == nullptr)
+        return Fail("WaveFormatTest", std::string("Could not re-open file: ") + outFileName);
+    fseek(infile, 0, SEEK_END);
+    long fileSize = ftell(infile);
+    fclose(infile);
+
+    long expectedSize = expectedHeaderBytes + static_cast<long>(nsamples) * WaveBytesPerSample(format);
+    if (fileSize != expectedSize)
+    {
+        fprintf(stderr, "WaveFormatTest: %s has size %ld, expected %ld\n", outFileName, fileSize, expectedSize);
+        return 1;
+    }
+
+    // Read the file back and verify we get the same audio, to within the format's precision.
+    WaveFileReader inwave;
+    if (!inwave.Open(outFileName))
+        return Fail("WaveFormatTest", std::string("Could not read back file: ") + outFileName);
+
+    if (inwave.Format() != format || inwave.SampleRate() != sampleRate || inwave.Channels() != channels || inwave.TotalSamples() != nsamples)
+        return Fail("WaveFormatTest", std::string("Incorrect format read back from file: ") + outFileName);
+
+    float tolerance = 0.0f;
+    if (format == WaveSampleFormat::Int16)
+        tolerance = 1.0f / IntSampleScale;
+    else if (format == WaveSampleFormat::Int24)
+        tolerance = 1.0f / Int24SampleScale;
+
+    std::vector<float> readback;
+    readback.resize(1000);
+    size_t position = 0;
+    for(;;)
+    {
+        size_t received = inwave.Read(readback.data(), readback.size());
+        for (size_t i = 0; i < received; ++i)
+        {
+            float diff = std::abs(readback[i] - buffer[position + i]);
+            if (diff > tolerance)
+            {
+                fprintf(stderr, "WaveFormatTest: %s sample %d has excessive error %e\n", outFileName, static_cast<int>(position + i), diff);
+                return 1;
+            }
+        }
+        position += received;
+        if (received < readback.size())
+            break;
+    }
+
+    if (position != nsamples)
+        return Fail("WaveFormatTest", std::string("Did not read back all samples from: ") + outFileName);
+
+    return 0;
+}
+
+
+static int WaveExtensibleCase()
+{
+    // Hand-craft a tiny WAVE_FORMAT_EXTENSIBLE file holding 24-bit PCM,
+    // preceded by an odd-length chunk we must skip (including its pad byte).
+    const char *outFileName = "output/format_extensible.wav";
+    const uint8_t header[] = {
+        'R', 'I', 'F', 'F', 78, 0, 0, 0, 'W', 'A', 'V', 'E',
+        'L', 'I', 'S', 'T', 3, 0, 0, 0, 'a', 'b', 'c', 0,
+        'f', 'm', 't', ' ', 40, 0, 0, 0,
+        0xfe, 0xff,             // WAVE_FORMAT_EXTENSIBLE
+        1, 0,                   // mono
+        0x44, 0xac, 0, 0,       // 44100 Hz
+        0xcc, 0x04, 2, 0,       // byte rate
+        3, 0,                   // block alignment
+        24, 0,                  // bits per sample
+        22, 0,                  // extension size
+        24, 0,                  // valid bits per sample
+        4, 0, 0, 0,             // channel mask = front center
+        1, 0, 0, 0, 0, 0, 0x10, 0, 0x80, 0, 0, 0xaa, 0, 0x38, 0x9b, 0x71,     // KSDATAFORMAT_SUBTYPE_PCM
+        'd', 'a', 't', 'a', 6, 0, 0, 0,
+        0x00, 0x00, 0x40,       // +0x400000
+        0x00, 0x00, 0xc0,       // -0x400000
+    };
+
+    FILE *outfile = fopen(outFileName, "wb");
+    if (outfile == nullptr)
+        return Fail("WaveFormatTest", std::string("Cannot create file: ") + outFileName);
+    fwrite(header, sizeof(header), 1, outfile);
+    fclose(outfile);
+
+    WaveFileReader inwave;
+    if (!inwave.Open(outFileName))
+        return Fail("WaveFormatTest", "Could not parse WAVE_FORMAT_EXTENSIBLE file.");
+
+    if (inwave.Format() != WaveSampleFormat::Int24 || inwave.Channels() != 1 || inwave.SampleRate() != 44100 || inwave.TotalSamples() != 2)
+        return Fail("WaveFormatTest", "Incorrect format decoded from WAVE_FORMAT_EXTENSIBLE file.");
+
+    float data[2];
+    if (inwave.Read(data, 2) != 2)
+        return Fail("WaveFormatTest", "Could not read samples from WAVE_FORMAT_EXTENSIBLE file.");
+
+    const float expected = static_cast<float>(0x400000) / Int24SampleScale;
+    if (data[0] != expected || data[1] != -expected)
+        return Fail("WaveFormatTest", "Incorrect 24-bit sample values.");
+
+    return 0;
+}
+
+
+static int Int24ConversionCase()
+{
+    // The vectorized 24-bit conversion must match the scalar formula exactly,
+    // for every length (so every way the SIMD loop can hand off to the scalar tail),
+    // and must never write past the end of its output.
+    std::mt19937 rand(6802);
+    std::uniform_real_distribution<float> unit(-1.0f, +1.0f);
+    const size_t maxLength = 37;
+    std::vector<float> data(maxLength);
+    std::vector<uint8_t> out(3*maxLength + 8);
+    for (size_t length = 0; length <= maxLength; ++length)
+    {
+        for (size_t i = 0; i < length; ++i)
+            data[i] = unit(rand);
+        if (length > 3)
+        {
+            data[0] = +1.0f;
+            data[1] = -1.0f;
+            data[2] = -0.0f;
+            data[3] = -1.0f / Int24SampleScale;
+        }
+
+        std::fill(out.begin(), out.end(), 0xa5);
+        ConvertFloatToInt24(data.data(), out.data(), length);
+
+        for (size_t i = 0; i < length; ++i)
+        {
+            const int32_t s = static_cast<int32_t>(static_cast<float>(Int24SampleScale) * data[i]);
+            if (out[3*i+0] != static_cast<uint8_t>(s) || out[3*i+1] != static_cast<uint8_t>(s >> 8) || out[3*i+2] != static_cast<uint8_t>(s >> 16))
+                return Fail("WaveFormatTest", "24-bit conversion differs at length " + std::to_string(length) + ", sample " + std::to_string(i));
+        }
+
+        for (size_t b = 3*length; b < out.size(); ++b)
+            if (out[b] != 0xa5)
+                return Fail("WaveFormatTest", "24-bit conversion wrote past the end at length " + std::to_string(length));
+    }
+    return 0;
+}
+
+
+static int Rf64HeaderCase()
+{
+    // Files over 4 GB take too long to write in a unit test, so build the header
+    // for one directly. It must switch from RIFF to RF64, turning the reserved JUNK chunk
+    // into a ds64 chunk that holds the real sizes.
+    const char *outFileName = "output/format_rf64_large.wav";
+    const int channels = 2;
+    const uint64_t frames = 0x28000001;         // 5 GB of stereo float data, plus one frame
+    const uint64_t dataBytes = frames * channels * sizeof(float);
+    std::vector<uint8_t> header;
+    WaveFileWriter::BuildHeader(header, WaveSampleFormat::Float32, channels, 48000, dataBytes, true);
+
+    if (header.size() != 94 || memcmp(&header[0], "RF64", 4) || memcmp(&header[12], "ds64", 4))
+        return Fail("WaveFormatTest", "Large header was not converted to RF64.");
+
+    // A header that does not need RF64 must keep its JUNK chunk.
+    std::vector<uint8_t> small;
+    WaveFileWriter::BuildHeader(small, WaveSampleFormat::Float32, channels, 48000, 1000 * channels * sizeof(float), true);
+    if (small.size() != 94 || memcmp(&small[0], "RIFF", 4) || memcmp(&small[12], "JUNK", 4))
+        return Fail("WaveFormatTest", "Small header was converted to RF64.");
+
+    // Write the header followed by a sparse hole as long as the data it describes,
+    // then make sure the reader finds all the data through the ds64 chunk.
+    FILE *outfile = fopen(outFileName, "wb");
+    if (outfile == nullptr)
+        return Fail("WaveFormatTest", std::string("Could not open output file: ") + outFileName);
+    const bool written = (fwrite(header.data(), 1, header.size(), outfile) == header.size());
+    fclose(outfile);
+    if (!written)
+        return Fail("WaveFormatTest", std::string("Could not write header to: ") + outFileName);
+
+    if (truncate(outFileName, static_cast<off_t>(header.size() + dataBytes)))
+    {
+        printf("WaveFormatTest: cannot make a %llu-byte sparse file here; skipping RF64 read test.\n", static_cast<unsigned long long>(dataBytes));
+        remove(outFileName);
+        return 0;
+    }
+
+    WaveFileReader reader;
+    const bool opened = reader.Open(outFileName);
+    const size_t samples = reader.TotalSamples();
+    const int readChannels = reader.Channels();
+    const int sampleRate = reader.SampleRate();
+    const WaveSampleFormat format = reader.Format();
+    reader.Close();
+    remove(outFileName);
+
+    if (!opened)
+        return Fail("WaveFormatTest", "Could not read the RF64 file.");
+
+    if (samples != frames * channels || readChannels != channels || sampleRate != 48000 || format != WaveSampleFormat::Float32)
+        return Fail("WaveFormatTest", "RF64 sizes did not read back correctly: " + std::to_string(samples) + " samples.");
+
+    return 0;
+}
+
+
+static int WaveFormatTest()
+{
+    // Verify the classic 44-byte header, plus the larger headers needed
+    // for floating point data and for reserving space for RF64.
+    if (WaveFormatCase("output/format_int16.wav",   WaveSampleFormat::Int16,   false, 44)) return 1;
+    if (WaveFormatCase("output/format_int24.wav",   WaveSampleFormat::Int24,   false, 44)) return 1;
+    if (WaveFormatCase("output/format_float32.wav", WaveSampleFormat::Float32, false, 58)) return 1;
+    if (WaveFormatCase("output/format_rf64.wav",    WaveSampleFormat::Float32, true,  94)) return 1;
+    if (WaveExtensibleCase()) return 1;
+    if (Rf64HeaderCase()) return 1;
+    if (Int24ConversionCase()) return 1;
+
+    // Out-of-range integer samples must still be rejected.
+    WaveFileWriter outwave;
+    if (!outwave.Open("output/format_range.wav", 44100, 1))
+        return Fail("WaveFormatTest", "Could not open range test file.");
+
+    float bad[9] = { 0.0f, 0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 1.5f };
+    try
+    {
+        outwave.WriteSamples(bad, 9);
+        return Fail("WaveFormatTest", "Out-of-range sample was not detected.");
+    }
+    catch (const std::range_error&)
+    {
+    }
+
+    return Pass("WaveFormatTest");
+}
+
+
+static bool FilesAreIdentical(const char *fn1, const char *fn2)
+{
+    MemoryMappedFile f1, f2;
+    if (!f1.Open(fn1) || !f2.Open(fn2))
+        return false;
+    return (f1.Length() == f2.Length()) && !memcmp(f1.Data(), f2.Data(), f1.Length());
+}
+
+
+static int AsyncWriteTest()
+{
+    // Verify that writing through the background thread produces exactly
+    // the same file as writing directly. Use tiny blocks and a short ring
+    // so the producer is forced to wait for the writer thread many times.
+    const char *syncFileName = "output/async_sync.wav";
+    const char *asyncFileName = "output/async_async.wav";
+    const int sampleRate = 44100;
+    const int channels = 2;
+
+    WaveFileWriter syncWave;
+    if (!syncWave.Open(syncFileName, sampleRate, channels))
+        return Fail("AsyncWriteTest", std::string("Could not open output file: ") + syncFileName);
+
+    AsyncWaveWriter<WaveFileWriter> asyncWave(100, 2);
+    if (!asyncWave.Open(asyncFileName, sampleRate, channels))
+        return Fail("AsyncWriteTest", std::string("Could not open output file: ") + asyncFileName);
+
+    float sample[channels];
+    for (int i = 0; i < 3 * sampleRate; ++i)
+    {
+        sample[0] = std::sin(0.01f * i);
+        sample[1] = std::cos(0.013f * i);
+        syncWave.WriteSamples(sample, channels);
+        asyncWave.WriteSamples(sample, channels);
+    }
+
+    syncWave.Close();
+    asyncWave.Close();
+
+    if (!FilesAreIdentical(syncFileName, asyncFileName))
+        return Fail("AsyncWriteTest", "Asynchronous output does not match synchronous output.");
+
+    // Errors on the writer thread must come back to the caller.
+    AsyncWaveWriter<WaveFileWriter> badWave(4, 2);
+    if (!badWave.Open("output/async_bad.wav", sampleRate, 1))
+        return Fail("AsyncWriteTest", "Could not open output file for error test.");
+
+    try
+    {
+        float bad[1] = { 2.0f };
+        for (int i = 0; i < 1000; ++i)
+            badWave.WriteSamples(bad, 1);
+        badWave.Close();
+        return Fail("AsyncWriteTest", "Writer thread error was not reported.");
+    }
+    catch (const std::range_error&)
+    {
+    }
+
+    // A disk error must be reported once by Close(). Closing the inner writer fails too,
+    // and destroying the writer afterward must neither throw nor terminate the program.
+    if (FILE *probe = fopen("/dev/full", "wb"))
+    {
+        fclose(probe);
+        std::unique_ptr<AsyncWaveWriter<WaveFileWriter>> fullWave(new AsyncWaveWriter<WaveFileWriter>(100, 2));
+        if (!fullWave->Open("/dev/full", sampleRate, channels))
+            return Fail("AsyncWriteTest", "Could not open /dev/full.");
+
+        bool reported = false;
+        try
+        {
+            for (int i = 0; i < sampleRate; ++i)
+            {
+                sample[0] = sample[1] = 0.5f;
+                fullWave->WriteSamples(sample, channels);
+            }
+            fullWave->Close();
+        }
+        catch (const std::runtime_error&)
+        {
+            reported = true;
+        }
+        fullWave.reset();
+
+        if (!reported)
+            return Fail("AsyncWriteTest", "Disk full error was not reported.");
+    }
+    else
+    {
+        printf("AsyncWriteTest: /dev/full is not available; skipping disk error test.\n");
+    }
+
+    return Pass("AsyncWriteTest");
+}
+
+
+static int HandoffTest()
+{
+    // A reader that has never polled must receive the initial value,
+    // then see nothing new until the setting is written again.
+    Sapphire::SettingSlot<float> slot {8.5f};
+    uint32_t seen = 0;
+    float value = 0.0f;
+    if (!slot.poll(seen, value) || value != 8.5f)
+        return Fail("HandoffTest", "First poll did not report the initial value.");
+    if (slot.poll(seen, value))
+        return Fail("HandoffTest", "Second poll reported a change that did not happen.");
+    slot.set(7.0f);
+    if (!slot.poll(seen, value) || value != 7.0f)
+        return Fail("HandoffTest", "Poll did not report a written value.");
+
+    // One thread writes a rising sequence of values while this thread
+    // polls the way a module does on the audio thread.
+    // Values may be skipped, but must never go backward, and the final value must arrive.
+    const int finalValue = 200000;
+    Sapphire::SettingSlot<int> counter {0};
+    std::thread writer([&counter, finalValue]()
+    {
+        for (int i = 1; i <= finalValue; ++i)
+        {
+            counter.set(i);
+            if (i % 16 == 0)
+                std::this_thread::yield();      // let the reader interleave with writing
+        }
+    });
+
+    long changes = 0;
+    int latest = 0;
+    bool backward = false;
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        uint32_t counterSeen = 0;
+        int received;
+        while (latest != finalValue)
+        {
+            if (counter.poll(counterSeen, received))
+            {
+                ++changes;
+                if (received < latest || received > finalValue)
+                    backward = true;
+                latest = received;
+            }
+        }
+    }
+    writer.join();
+
+    if (backward)
+        return Fail("HandoffTest", "Reader received values out of order.");
+
+    printf("HandoffTest: reader saw %ld of %d writes.\n", changes, finalValue);
+
+    // Publish telemetry-sized frames from another thread, with every field of frame #n set to n.
+    // Each frame the reader gets must be complete: all fields from the same publish,
+    // and frames must never go back in time.
+    const uint32_t finalFrame = 100000;
+    Sapphire::TripleBuffer<Sapphire::EngineTelemetry> frames;
+    std::thread publisher([&frames, finalFrame]()
+    {
+        for (uint32_t n = 1; n <= finalFrame; ++n)
+        {
+            Sapphire::EngineTelemetry& frame = frames.writeBuffer();
+            frame.sequence = n;
+            frame.peakLeft = frame.peakRight = frame.agcFollower = frame.meshEnergy = frame.cpuLoad = static_cast<float>(n);
+            frames.publish();
+            if (n % 16 == 0)
+                std::this_thread::yield();      // let the reader interleave with publishing
+        }
+    });
+
+    uint32_t prevSequence = 0;
+    long torn = 0;
+    long distinct = 0;
+    {
+        SAPPHIRE_REALTIME_SCOPE();
+        while (prevSequence != finalFrame)
+        {
+            const Sapphire::EngineTelemetry& frame = frames.read();
+            if (frame.sequence == 0)
+                continue;   // nothing published yet
+            const float expected = static_cast<float>(frame.sequence);
+            if (frame.peakLeft != expected || frame.peakRight != expected || frame.agcFollower != expected ||
+                frame.meshEnergy != expected || frame.cpuLoad != expected || frame.sequence < prevSequence)
+                ++torn;
+            if (frame.sequence != prevSequence)
+                ++distinct;
+            prevSequence = frame.sequence;
+        }
+    }
+    publisher.join();
+
+    if (torn > 0)
+        return Fail("HandoffTest", "Reader received " + std::to_string(torn) + " torn or out-of-order telemetry frames.");
+
+    printf("HandoffTest: reader saw %ld of %u telemetry frames.\n", distinct, finalFrame);
+
+    // An engine reports its output peaks and mesh energy, then restarts the peak measurement.
+    Sapphire::ElastikaEngine elastika;
+    const float sampleRate = 44100.0f;
+    for (int i = 0; i < 4410; ++i)
+    {
+        float left, right;
+        const float x = (i < 100) ? 0.5f : 0.0f;
+        elastika.process(sampleRate, x, -x, left, right);
+    }
+
+    Sapphire::EngineTelemetry report;
+    elastika.readTelemetry(report);
+    if (report.peakLeft <= 0.0f || report.peakRight <= 0.0f || report.meshEnergy <= 0.0f)
+        return Fail("HandoffTest", "Elastika telemetry did not report any activity.");
+    if (report.agcDistortion() < 0.0f)
+        return Fail("HandoffTest", "Elastika telemetry reported negative limiter distortion.");
+
+    Sapphire::EngineTelemetry second;
+    elastika.readTelemetry(second);
+    if (second.peakLeft != 0.0f || second.peakRight != 0.0f)
+        return Fail("HandoffTest", "Reading telemetry did not restart the peak measurement.");
+
+    return Pass("HandoffTest");
+}